@@ -30,6 +30,11 @@
 #include "qemu-common.h"
 #include "aes.h"
 
+#ifdef CONFIG_AES_NI
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
 #ifndef NDEBUG
 #define NDEBUG
 #endif
@@ -1262,6 +1267,104 @@ void AES_decrypt(const unsigned char *in, unsigned char *out,
 
 #endif /* AES_ASM */
 
+#ifdef CONFIG_AES_NI
+/*
+ * CBC with the AES-NI instructions, for CPUs that have them. The round keys
+ * of the table implementation are used as they are: AES_set_decrypt_key()
+ * builds the schedule of the equivalent inverse cipher, which is also what
+ * AESDEC expects. Decryption has no chaining dependency, so four blocks are
+ * kept in flight to hide the latency of the instructions.
+ */
+#define AESNI_FN __attribute__((target("aes,sse2")))
+
+static int aesni_available(void)
+{
+	static int available = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (available < 0) {
+		available = __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+			(ecx & bit_AES);
+	}
+	return available;
+}
+
+static AESNI_FN void aesni_load_keys(const AES_KEY *key, __m128i *rk)
+{
+	const u32 *k = key->rd_key;
+	int i;
+
+	for (i = 0; i <= key->rounds; i++, k += 4) {
+		rk[i] = _mm_set_epi32(bswap32(k[3]), bswap32(k[2]),
+				      bswap32(k[1]), bswap32(k[0]));
+	}
+}
+
+static AESNI_FN void aesni_cbc_encrypt(const unsigned char *in,
+		     unsigned char *out, unsigned long len, const AES_KEY *key,
+		     unsigned char *ivec, const int enc)
+{
+	__m128i rk[AES_MAXNR + 1];
+	__m128i iv, b0, b1, b2, b3, c0, c1, c2, c3;
+	int nr = key->rounds;
+	int i;
+
+	aesni_load_keys(key, rk);
+	iv = _mm_loadu_si128((const __m128i *)ivec);
+
+	if (enc) {
+		for (; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE,
+		     in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+			b0 = _mm_loadu_si128((const __m128i *)in);
+			b0 = _mm_xor_si128(_mm_xor_si128(b0, iv), rk[0]);
+			for (i = 1; i < nr; i++)
+				b0 = _mm_aesenc_si128(b0, rk[i]);
+			iv = _mm_aesenclast_si128(b0, rk[nr]);
+			_mm_storeu_si128((__m128i *)out, iv);
+		}
+	} else {
+		for (; len >= 4 * AES_BLOCK_SIZE; len -= 4 * AES_BLOCK_SIZE,
+		     in += 4 * AES_BLOCK_SIZE, out += 4 * AES_BLOCK_SIZE) {
+			c0 = _mm_loadu_si128((const __m128i *)in);
+			c1 = _mm_loadu_si128((const __m128i *)in + 1);
+			c2 = _mm_loadu_si128((const __m128i *)in + 2);
+			c3 = _mm_loadu_si128((const __m128i *)in + 3);
+			b0 = _mm_xor_si128(c0, rk[0]);
+			b1 = _mm_xor_si128(c1, rk[0]);
+			b2 = _mm_xor_si128(c2, rk[0]);
+			b3 = _mm_xor_si128(c3, rk[0]);
+			for (i = 1; i < nr; i++) {
+				b0 = _mm_aesdec_si128(b0, rk[i]);
+				b1 = _mm_aesdec_si128(b1, rk[i]);
+				b2 = _mm_aesdec_si128(b2, rk[i]);
+				b3 = _mm_aesdec_si128(b3, rk[i]);
+			}
+			b0 = _mm_xor_si128(_mm_aesdeclast_si128(b0, rk[nr]), iv);
+			b1 = _mm_xor_si128(_mm_aesdeclast_si128(b1, rk[nr]), c0);
+			b2 = _mm_xor_si128(_mm_aesdeclast_si128(b2, rk[nr]), c1);
+			b3 = _mm_xor_si128(_mm_aesdeclast_si128(b3, rk[nr]), c2);
+			_mm_storeu_si128((__m128i *)out, b0);
+			_mm_storeu_si128((__m128i *)out + 1, b1);
+			_mm_storeu_si128((__m128i *)out + 2, b2);
+			_mm_storeu_si128((__m128i *)out + 3, b3);
+			iv = c3;
+		}
+		for (; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE,
+		     in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+			c0 = _mm_loadu_si128((const __m128i *)in);
+			b0 = _mm_xor_si128(c0, rk[0]);
+			for (i = 1; i < nr; i++)
+				b0 = _mm_aesdec_si128(b0, rk[i]);
+			b0 = _mm_xor_si128(_mm_aesdeclast_si128(b0, rk[nr]), iv);
+			_mm_storeu_si128((__m128i *)out, b0);
+			iv = c0;
+		}
+	}
+
+	_mm_storeu_si128((__m128i *)ivec, iv);
+}
+#endif
+
 void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		     const unsigned long length, const AES_KEY *key,
 		     unsigned char *ivec, const int enc)
@@ -1273,6 +1376,18 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 
 	assert(in && out && key && ivec);
 
+#ifdef CONFIG_AES_NI
+	/* a partial last block is left to the table code below */
+	if (aesni_available()) {
+		aesni_cbc_encrypt(in, out, len & ~(AES_BLOCK_SIZE - 1UL), key,
+				  ivec, enc);
+		n = len & ~(AES_BLOCK_SIZE - 1UL);
+		in += n;
+		out += n;
+		len -= n;
+	}
+#endif
+
 	if (enc) {
 		while (len >= AES_BLOCK_SIZE) {
 			for(n=0; n < AES_BLOCK_SIZE; ++n)
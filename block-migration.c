@@ -51,6 +51,7 @@ typedef struct BlkMigDevState {
     int64_t dirty;
     QSIMPLEQ_ENTRY(BlkMigDevState) entry;
     unsigned long *aio_bitmap;
+    BdrvDirtyBitmap *dirty_bitmap;
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
@@ -256,7 +257,7 @@ static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
     }
     block_mig_state.submitted++;
 
-    bdrv_reset_dirty(bs, cur_sector, nr_sectors);
+    bdrv_reset_dirty(bs, bmds->dirty_bitmap, cur_sector, nr_sectors);
     bmds->cur_sector = cur_sector + nr_sectors;
 
     return (bmds->cur_sector >= total_sectors);
@@ -269,13 +270,23 @@ error:
     return 0;
 }
 
-static void set_dirty_tracking(int enable)
+static int set_dirty_tracking(int enable)
 {
     BlkMigDevState *bmds;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        bdrv_set_dirty_tracking(bmds->bs, enable);
+        if (enable) {
+            bmds->dirty_bitmap = bdrv_create_dirty_bitmap(bmds->bs,
+                                    BDRV_SECTORS_PER_DIRTY_CHUNK, NULL);
+            if (!bmds->dirty_bitmap) {
+                return -EIO;
+            }
+        } else if (bmds->dirty_bitmap) {
+            bdrv_release_dirty_bitmap(bmds->bs, bmds->dirty_bitmap);
+            bmds->dirty_bitmap = NULL;
+        }
     }
+    return 0;
 }
 
 static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
@@ -384,58 +395,58 @@ static int mig_save_device_dirty(Monitor *mon, QEMUFile *f,
     int64_t sector;
     int nr_sectors;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        if (bmds_aio_inflight(bmds, sector)) {
-            qemu_aio_flush();
-        }
-        if (bdrv_get_dirty(bmds->bs, sector)) {
+    /* Skip straight to the next dirty chunk instead of testing each one */
+    sector = bdrv_get_next_dirty(bmds->bs, bmds->dirty_bitmap, bmds->cur_dirty);
+    if (sector < 0 || sector >= total_sectors) {
+        bmds->cur_dirty = total_sectors;
+        return 1;
+    }
+    bmds->cur_dirty = sector;
 
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = qemu_malloc(sizeof(BlkMigBlock));
-            blk->buf = qemu_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                if (block_mig_state.submitted == 0) {
-                    block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
-                }
+    if (bmds_aio_inflight(bmds, sector)) {
+        bdrv_drain_all();
+    }
 
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-                if (!blk->aiocb) {
-                    goto error;
-                }
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-            } else {
-                if (bdrv_read(bmds->bs, sector, blk->buf,
-                              nr_sectors) < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        nr_sectors = total_sectors - sector;
+    } else {
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+    blk = qemu_malloc(sizeof(BlkMigBlock));
+    blk->buf = qemu_malloc(BLOCK_SIZE);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
 
-                qemu_free(blk->buf);
-                qemu_free(blk);
-            }
+    if (is_async) {
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
 
-            bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
-            break;
+        if (block_mig_state.submitted == 0) {
+            block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
+        }
+
+        blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+        if (!blk->aiocb) {
+            goto error;
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+        block_mig_state.submitted++;
+        bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+    } else {
+        if (bdrv_read(bmds->bs, sector, blk->buf,
+                      nr_sectors) < 0) {
+            goto error;
+        }
+        blk_send(f, blk);
+
+        qemu_free(blk->buf);
+        qemu_free(blk);
     }
 
-    return (bmds->cur_dirty >= bmds->total_sectors);
+    bdrv_reset_dirty(bmds->bs, bmds->dirty_bitmap, sector, nr_sectors);
+    return 0;
 
 error:
     monitor_printf(mon, "Error reading sector %" PRId64 "\n", sector);
@@ -498,10 +509,10 @@ static int64_t get_remaining_dirty(void)
     int64_t dirty = 0;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        dirty += bdrv_get_dirty_count(bmds->bs);
+        dirty += bdrv_get_dirty_count(bmds->bs, bmds->dirty_bitmap);
     }
 
-    return dirty * BLOCK_SIZE;
+    return dirty << BDRV_SECTOR_BITS;
 }
 
 static int is_stage2_completed(void)
@@ -574,7 +585,18 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         init_blk_migration(mon, f);
 
         /* start track dirty blocks */
-        set_dirty_tracking(1);
+        if (set_dirty_tracking(1) < 0) {
+            monitor_printf(mon, "Error starting dirty tracking\n");
+            qemu_file_set_error(f);
+            blk_mig_cleanup(mon);
+            return 0;
+        }
+    }
+
+    if (stage == 3) {
+        /* vm_stop() doesn't wait for our reads if the VM was already stopped,
+           and throttled ones may not even have been submitted yet */
+        bdrv_drain_all();
     }
 
     flush_blks(f);
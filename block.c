@@ -26,8 +26,11 @@
 #include "trace.h"
 #include "monitor.h"
 #include "block_int.h"
+#include "blockjob.h"
 #include "module.h"
 #include "qemu-objects.h"
+#include "qemu-timer.h"
+#include "host-utils.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -43,6 +46,24 @@
 #include <windows.h>
 #endif
 
+static BlockDriverAIOCB *bdrv_aio_submit(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write);
+static int bdrv_io_queue_active(BlockDriverState *bs);
+static void bdrv_io_queue_flush(BlockDriverState *bs);
+static BlockDriverAIOCB *bdrv_aio_rw_throttled(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write);
+static BlockDriverAIOCB *bdrv_aio_tracked_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+static void bdrv_tracked_overwrite(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors);
+static int bdrv_io_throttle_pending(BlockDriverState *bs);
+static void bdrv_io_throttle_dispatch(BlockDriverState *bs, int force);
+static BlockDriverAIOCB *bdrv_io_queue_add(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -192,6 +213,13 @@ BlockDriverState *bdrv_new(const char *device_name)
 
     bs = qemu_mallocz(sizeof(BlockDriverState));
     pstrcpy(bs->device_name, sizeof(bs->device_name), device_name);
+    bs->io_merge_max = BDRV_MERGE_MAX_DEFAULT;
+    QTAILQ_INIT(&bs->io_queue);
+    QTAILQ_INIT(&bs->io_throttled[0]);
+    QTAILQ_INIT(&bs->io_throttled[1]);
+    QLIST_INIT(&bs->tracked_requests);
+    QLIST_INIT(&bs->dirty_bitmaps);
+    QTAILQ_INIT(&bs->tracked_waiters);
     if (device_name[0] != '\0') {
         QTAILQ_INSERT_TAIL(&bdrv_states, bs, list);
     }
@@ -476,6 +504,15 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
         goto free_and_fail;
     }
 
+    /* Losing the bitmaps is no reason to fail, the next backup is full */
+    if (drv->bdrv_load_dirty_bitmaps) {
+        ret = drv->bdrv_load_dirty_bitmaps(bs);
+        if (ret < 0) {
+            error_report("Could not load the dirty bitmaps of '%s': %s",
+                         filename, strerror(-ret));
+        }
+    }
+
 #ifndef _WIN32
     if (bs->is_temporary) {
         unlink(filename);
@@ -651,8 +688,34 @@ unlink_and_fail:
     return ret;
 }
 
+/* Named bitmaps belong to the image, and the image is going away */
+static void bdrv_close_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap, *next;
+    int ret;
+
+    if (bs->drv->bdrv_store_dirty_bitmaps && !bs->read_only) {
+        ret = bs->drv->bdrv_store_dirty_bitmaps(bs);
+        if (ret < 0) {
+            error_report("Could not store the dirty bitmaps of '%s': %s",
+                         bs->filename, strerror(-ret));
+        }
+    }
+
+    QLIST_FOREACH_SAFE(bitmap, &bs->dirty_bitmaps, list, next) {
+        if (bitmap->name) {
+            bdrv_release_dirty_bitmap(bs, bitmap);
+        }
+    }
+}
+
 void bdrv_close(BlockDriverState *bs)
 {
+    if (bdrv_io_throttle_pending(bs)) {
+        bdrv_io_throttle_dispatch(bs, 1);
+        qemu_aio_flush();
+    }
+
     if (bs->drv) {
         if (bs == bs_snapshots) {
             bs_snapshots = NULL;
@@ -661,6 +724,7 @@ void bdrv_close(BlockDriverState *bs)
             bdrv_delete(bs->backing_hd);
             bs->backing_hd = NULL;
         }
+        bdrv_close_dirty_bitmaps(bs);
         bs->drv->bdrv_close(bs);
         qemu_free(bs->opaque);
 #ifdef _WIN32
@@ -670,6 +734,8 @@ void bdrv_close(BlockDriverState *bs)
 #endif
         bs->opaque = NULL;
         bs->drv = NULL;
+        bs->backing_file[0] = '\0';
+        bs->backing_format[0] = '\0';
 
         if (bs->file != NULL) {
             bdrv_close(bs->file);
@@ -687,6 +753,9 @@ void bdrv_close_all(void)
     BlockDriverState *bs;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bs->job) {
+            block_job_cancel_sync(bs->job);
+        }
         bdrv_close(bs);
     }
 }
@@ -705,6 +774,11 @@ void bdrv_delete(BlockDriverState *bs)
 {
     assert(!bs->peer);
 
+    /* A job can't outlive its image, e.g. when the guest unplugs the disk */
+    if (bs->job) {
+        block_job_cancel_sync(bs->job);
+    }
+
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
 
@@ -714,6 +788,10 @@ void bdrv_delete(BlockDriverState *bs)
     }
 
     assert(bs != bs_snapshots);
+    if (bs->io_throttle_timer) {
+        qemu_del_timer(bs->io_throttle_timer);
+        qemu_free_timer(bs->io_throttle_timer);
+    }
     qemu_free(bs);
 }
 
@@ -934,31 +1012,64 @@ int bdrv_read(BlockDriverState *bs, int64_t sector_num,
     return drv->bdrv_read(bs, sector_num, buf, nb_sectors);
 }
 
-static void set_dirty_bitmap(BlockDriverState *bs, int64_t sector_num,
+static void set_dirty_bitmap(BdrvDirtyBitmap *bitmap, int64_t sector_num,
                              int nb_sectors, int dirty)
 {
-    int64_t start, end;
-    unsigned long val, idx, bit;
+    if (sector_num < 0 || nb_sectors <= 0) {
+        return;
+    }
 
-    start = sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
-    end = (sector_num + nb_sectors - 1) / BDRV_SECTORS_PER_DIRTY_CHUNK;
+    if (dirty) {
+        hbitmap_set(bitmap->bitmap, sector_num, nb_sectors);
+    } else {
+        hbitmap_reset(bitmap->bitmap, sector_num, nb_sectors);
+    }
+}
 
-    for (; start <= end; start++) {
-        idx = start / (sizeof(unsigned long) * 8);
-        bit = start % (sizeof(unsigned long) * 8);
-        val = bs->dirty_bitmap[idx];
-        if (dirty) {
-            if (!(val & (1UL << bit))) {
-                bs->dirty_count++;
-                val |= 1UL << bit;
-            }
-        } else {
-            if (val & (1UL << bit)) {
-                bs->dirty_count--;
-                val &= ~(1UL << bit);
-            }
+static void bdrv_set_dirty(BlockDriverState *bs, int64_t sector_num,
+                           int nb_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        set_dirty_bitmap(bitmap, sector_num, nb_sectors, 1);
+    }
+}
+
+/* For changes of the contents that aren't writes, like reverting snapshots */
+static void bdrv_set_dirty_all(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        hbitmap_set(bitmap->bitmap, 0, bs->total_sectors);
+    }
+}
+
+/*
+ * Resizes the bitmaps to the new size of the image. Sectors that were added
+ * count as dirty, as they weren't in any backup yet.
+ */
+static void bdrv_resize_dirty_bitmaps(BlockDriverState *bs,
+                                      int64_t old_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+    HBitmap *old;
+    int64_t sector;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        old = bitmap->bitmap;
+        bitmap->bitmap = hbitmap_alloc(bs->total_sectors,
+                                       ctz32(bitmap->granularity));
+        for (sector = hbitmap_next(old, 0); sector >= 0;
+             sector = hbitmap_next(old, sector + bitmap->granularity)) {
+            hbitmap_set(bitmap->bitmap, sector, bitmap->granularity);
         }
-        bs->dirty_bitmap[idx] = val;
+        if (bs->total_sectors > old_sectors) {
+            hbitmap_set(bitmap->bitmap, old_sectors,
+                        bs->total_sectors - old_sectors);
+        }
+        hbitmap_free(old);
     }
 }
 
@@ -979,14 +1090,17 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
-    if (bs->dirty_bitmap) {
-        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
-    }
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
     }
 
+    /* A native synchronous write isn't tracked, see copy on read */
+    if (bs->copy_on_read) {
+        bdrv_tracked_overwrite(bs, sector_num, nb_sectors);
+    }
+
     return drv->bdrv_write(bs, sector_num, buf, nb_sectors);
 }
 
@@ -1127,6 +1241,7 @@ int bdrv_write_sync(BlockDriverState *bs, int64_t sector_num,
 int bdrv_truncate(BlockDriverState *bs, int64_t offset)
 {
     BlockDriver *drv = bs->drv;
+    int64_t old_sectors = bs->total_sectors;
     int ret;
     if (!drv)
         return -ENOMEDIUM;
@@ -1139,6 +1254,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
+        bdrv_resize_dirty_bitmaps(bs, old_sectors);
         if (bs->change_cb) {
             bs->change_cb(bs->change_opaque, CHANGE_SIZE);
         }
@@ -1568,6 +1684,8 @@ const char *bdrv_get_device_name(BlockDriverState *bs)
 
 int bdrv_flush(BlockDriverState *bs)
 {
+    bdrv_io_queue_flush(bs);
+
     if (bs->open_flags & BDRV_O_NO_FLUSH) {
         return 0;
     }
@@ -1620,6 +1738,9 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
     if (!bs->drv->bdrv_discard) {
         return 0;
     }
+
+    /* Discarded sectors may read differently afterwards */
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
     return bs->drv->bdrv_discard(bs, sector_num, nb_sectors);
 }
 
@@ -1650,6 +1771,34 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
 }
 
+/*
+ * Returns whether any image from top down to (excluding) base has data for
+ * the first sectors of the range. *pnum is set to the number of sectors that
+ * are in the same state.
+ */
+int bdrv_is_allocated_above(BlockDriverState *top, BlockDriverState *base,
+                            int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BlockDriverState *intermediate;
+    int n;
+
+    for (intermediate = top; intermediate != base;
+         intermediate = intermediate->backing_hd) {
+        if (bdrv_is_allocated(intermediate, sector_num, nb_sectors, &n)) {
+            *pnum = n;
+            return 1;
+        }
+
+        /* n is 0 beyond the end of a backing file that is too short */
+        if (n > 0 && n < nb_sectors) {
+            nb_sectors = n;
+        }
+    }
+
+    *pnum = nb_sectors;
+    return 0;
+}
+
 void bdrv_mon_event(const BlockDriverState *bdrv,
                     BlockMonEventAction action, int is_read)
 {
@@ -1679,6 +1828,19 @@ void bdrv_mon_event(const BlockDriverState *bdrv,
     qobject_decref(data);
 }
 
+static void bdrv_print_dirty_bitmap(QObject *obj, void *opaque)
+{
+    QDict *qdict = qobject_to_qdict(obj);
+    Monitor *mon = opaque;
+
+    monitor_printf(mon, "    Dirty bitmap %s: %" PRId64 " bytes dirty,"
+                        " granularity %" PRId64 "%s\n",
+                   qdict_get_str(qdict, "name"),
+                   qdict_get_int(qdict, "count"),
+                   qdict_get_int(qdict, "granularity"),
+                   qdict_get_bool(qdict, "persistent") ? ", persistent" : "");
+}
+
 static void bdrv_print_dict(QObject *obj, void *opaque)
 {
     QDict *bs_dict;
@@ -1712,6 +1874,15 @@ static void bdrv_print_dict(QObject *obj, void *opaque)
     }
 
     monitor_printf(mon, "\n");
+
+    if (qdict_haskey(bs_dict, "inserted")) {
+        QDict *qdict = qobject_to_qdict(qdict_get(bs_dict, "inserted"));
+
+        if (qdict_haskey(qdict, "dirty-bitmaps")) {
+            qlist_iter(qdict_get_qlist(qdict, "dirty-bitmaps"),
+                       bdrv_print_dirty_bitmap, mon);
+        }
+    }
 }
 
 void bdrv_info_print(Monitor *mon, const QObject *data)
@@ -1719,6 +1890,38 @@ void bdrv_info_print(Monitor *mon, const QObject *data)
     qlist_iter(qobject_to_qlist(data), bdrv_print_dict, mon);
 }
 
+static int bdrv_has_named_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (bitmap->name) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static QObject *bdrv_dirty_bitmaps_info(BlockDriverState *bs)
+{
+    QList *list = qlist_new();
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!bitmap->name) {
+            continue;
+        }
+        qlist_append_obj(list, qobject_from_jsonf(
+            "{ 'name': %s, 'granularity': %" PRId64 ", "
+            "'count': %" PRId64 ", 'persistent': %i }",
+            bitmap->name,
+            (int64_t) bitmap->granularity << BDRV_SECTOR_BITS,
+            bdrv_get_dirty_count(bs, bitmap) << BDRV_SECTOR_BITS,
+            bitmap->persistent));
+    }
+    return QOBJECT(list);
+}
+
 void bdrv_info(Monitor *mon, QObject **ret_data)
 {
     QList *bs_list;
@@ -1748,6 +1951,11 @@ void bdrv_info(Monitor *mon, QObject **ret_data)
                 qdict_put(qdict, "backing_file",
                           qstring_from_str(bs->backing_file));
             }
+            if (bdrv_has_named_dirty_bitmaps(bs)) {
+                QDict *qdict = qobject_to_qdict(obj);
+                qdict_put_obj(qdict, "dirty-bitmaps",
+                              bdrv_dirty_bitmaps_info(bs));
+            }
 
             qdict_put_obj(bs_dict, "inserted", obj);
         }
@@ -1769,12 +1977,30 @@ static void bdrv_stats_iter(QObject *data, void *opaque)
     monitor_printf(mon, " rd_bytes=%" PRId64
                         " wr_bytes=%" PRId64
                         " rd_operations=%" PRId64
-                        " wr_operations=%" PRId64
-                        "\n",
+                        " wr_operations=%" PRId64,
                         qdict_get_int(qdict, "rd_bytes"),
                         qdict_get_int(qdict, "wr_bytes"),
                         qdict_get_int(qdict, "rd_operations"),
                         qdict_get_int(qdict, "wr_operations"));
+    if (qdict_haskey(qdict, "l2_cache_hits")) {
+        monitor_printf(mon, " l2_cache_hits=%" PRId64
+                            " l2_cache_misses=%" PRId64
+                            " refcount_cache_hits=%" PRId64
+                            " refcount_cache_misses=%" PRId64,
+                            qdict_get_int(qdict, "l2_cache_hits"),
+                            qdict_get_int(qdict, "l2_cache_misses"),
+                            qdict_get_int(qdict, "refcount_cache_hits"),
+                            qdict_get_int(qdict, "refcount_cache_misses"));
+    }
+    if (qdict_haskey(qdict, "throttled_rd_operations")) {
+        monitor_printf(mon, " throttled_rd_operations=%" PRId64
+                            " throttled_wr_operations=%" PRId64
+                            " throttled_total_time_ns=%" PRId64,
+                            qdict_get_int(qdict, "throttled_rd_operations"),
+                            qdict_get_int(qdict, "throttled_wr_operations"),
+                            qdict_get_int(qdict, "throttled_total_time_ns"));
+    }
+    monitor_printf(mon, "\n");
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -1800,6 +2026,22 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
                              (uint64_t)BDRV_SECTOR_SIZE);
     dict  = qobject_to_qdict(res);
 
+    if (bs->drv && bs->drv->bdrv_info_stats) {
+        bs->drv->bdrv_info_stats(bs,
+            qobject_to_qdict(qdict_get(dict, "stats")));
+    }
+
+    if (bs->io_limits_enabled || bs->throttled_ops[0] || bs->throttled_ops[1]) {
+        QDict *stats = qobject_to_qdict(qdict_get(dict, "stats"));
+
+        qdict_put(stats, "throttled_rd_operations",
+                  qint_from_int(bs->throttled_ops[0]));
+        qdict_put(stats, "throttled_wr_operations",
+                  qint_from_int(bs->throttled_ops[1]));
+        qdict_put(stats, "throttled_total_time_ns",
+                  qint_from_int(bs->throttled_ns));
+    }
+
     if (*bs->device_name) {
         qdict_put(dict, "device", qstring_from_str(bs->device_name));
     }
@@ -1859,13 +2101,33 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
-    if (bs->dirty_bitmap) {
-        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
-    }
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
 
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
+/*
+ * Like bdrv_write_compressed(), but the driver may compress in the background.
+ * buf must stay valid until cb is called. Returns NULL if the driver has no
+ * asynchronous compressed writes, callers fall back to bdrv_write_compressed().
+ */
+BlockDriverAIOCB *bdrv_aio_write_compressed(BlockDriverState *bs,
+    int64_t sector_num, const uint8_t *buf, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv || !drv->bdrv_aio_write_compressed)
+        return NULL;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return NULL;
+
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
+
+    return drv->bdrv_aio_write_compressed(bs, sector_num, buf, nb_sectors,
+                                          cb, opaque);
+}
+
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BlockDriver *drv = bs->drv;
@@ -1979,6 +2241,10 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (!drv)
         return -ENOMEDIUM;
+
+    /* Whatever the outcome, the contents may have changed */
+    bdrv_set_dirty_all(bs);
+
     if (drv->bdrv_snapshot_goto)
         return drv->bdrv_snapshot_goto(bs, snapshot_id);
 
@@ -2113,165 +2379,971 @@ char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
 
 
 /**************************************************************/
-/* async I/Os */
-
-BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
-                                 QEMUIOVector *qiov, int nb_sectors,
-                                 BlockDriverCompletionFunc *cb, void *opaque)
-{
-    BlockDriver *drv = bs->drv;
-    BlockDriverAIOCB *ret;
-
-    trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
-
-    if (!drv)
-        return NULL;
-    if (bdrv_check_request(bs, sector_num, nb_sectors))
-        return NULL;
-
-    ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
-                              cb, opaque);
-
-    if (ret) {
-	/* Update stats even though technically transfer has not happened. */
-	bs->rd_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-	bs->rd_ops ++;
-    }
+/* I/O throttling */
 
-    return ret;
-}
+/*
+ * Every limit of a drive is a leaky bucket that drains at the configured
+ * rate. A request may pass while all buckets it is charged to (the total one
+ * and the one of its direction) are below their burst size, and then adds
+ * its bytes and one operation to them. Requests that have to wait are kept
+ * in a FIFO per direction and dispatched from a timer.
+ *
+ * Throttled requests are invisible to qemu_aio_flush(), so code that needs
+ * all guest I/O to be finished must use bdrv_drain_all(). Only requests from
+ * the main async context are delayed. Synchronous I/O emulated in a nested
+ * context (bdrv_read_em() and friends) is charged but never queued, not even
+ * behind waiting requests: the timer can't run there, so it would never
+ * complete.
+ */
 
-typedef struct BlockCompleteData {
-    BlockDriverCompletionFunc *cb;
-    void *opaque;
-    BlockDriverState *bs;
+typedef struct BlockThrottleAIOCB {
+    BlockDriverAIOCB common;
     int64_t sector_num;
+    QEMUIOVector *qiov;
     int nb_sectors;
-} BlockCompleteData;
+    int is_write;
+    int64_t queued;
+    int cancelled;
+    BlockDriverAIOCB *aiocb;
+    QTAILQ_ENTRY(BlockThrottleAIOCB) entry;
+} BlockThrottleAIOCB;
 
-static void block_complete_cb(void *opaque, int ret)
+static void bdrv_io_throttle_cancel(BlockDriverAIOCB *blockacb)
 {
-    BlockCompleteData *b = opaque;
+    BlockThrottleAIOCB *acb = container_of(blockacb, BlockThrottleAIOCB,
+                                           common);
 
-    if (b->bs->dirty_bitmap) {
-        set_dirty_bitmap(b->bs, b->sector_num, b->nb_sectors, 1);
+    if (acb->aiocb) {
+        /* Drivers that complete a cancelled request leave the acb to us */
+        acb->cancelled = 1;
+        bdrv_aio_cancel(acb->aiocb);
+    } else {
+        QTAILQ_REMOVE(&acb->common.bs->io_throttled[acb->is_write], acb,
+                      entry);
     }
-    b->cb(b->opaque, ret);
-    qemu_free(b);
+    qemu_aio_release(acb);
 }
 
-static BlockCompleteData *blk_dirty_cb_alloc(BlockDriverState *bs,
-                                             int64_t sector_num,
-                                             int nb_sectors,
-                                             BlockDriverCompletionFunc *cb,
-                                             void *opaque)
-{
-    BlockCompleteData *blkdata = qemu_mallocz(sizeof(BlockCompleteData));
-
-    blkdata->bs = bs;
-    blkdata->cb = cb;
-    blkdata->opaque = opaque;
-    blkdata->sector_num = sector_num;
-    blkdata->nb_sectors = nb_sectors;
+static AIOPool bdrv_io_throttle_pool = {
+    .aiocb_size         = sizeof(BlockThrottleAIOCB),
+    .cancel             = bdrv_io_throttle_cancel,
+};
 
-    return blkdata;
+static double bdrv_io_bucket_size(uint64_t rate, uint64_t burst)
+{
+    return burst ? burst : rate / 10.0;
 }
 
-BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
-                                  QEMUIOVector *qiov, int nb_sectors,
-                                  BlockDriverCompletionFunc *cb, void *opaque)
+static void bdrv_io_limits_leak(BlockDriverState *bs, int64_t now)
 {
-    BlockDriver *drv = bs->drv;
-    BlockDriverAIOCB *ret;
-    BlockCompleteData *blk_cb_data;
-
-    trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
-
-    if (!drv)
-        return NULL;
-    if (bs->read_only)
-        return NULL;
-    if (bdrv_check_request(bs, sector_num, nb_sectors))
-        return NULL;
+    double elapsed = (double)(now - bs->io_bucket_stamp) / get_ticks_per_sec();
+    int i;
 
-    if (bs->dirty_bitmap) {
-        blk_cb_data = blk_dirty_cb_alloc(bs, sector_num, nb_sectors, cb,
-                                         opaque);
-        cb = &block_complete_cb;
-        opaque = blk_cb_data;
+    for (i = 0; i < BLOCK_IO_LIMIT_MAX; i++) {
+        bs->io_bucket_bytes[i] -= bs->io_limits.bps[i] * elapsed;
+        bs->io_bucket_bytes[i] = MAX(bs->io_bucket_bytes[i], 0);
+        bs->io_bucket_ops[i] -= bs->io_limits.iops[i] * elapsed;
+        bs->io_bucket_ops[i] = MAX(bs->io_bucket_ops[i], 0);
     }
+    bs->io_bucket_stamp = now;
+}
 
-    ret = drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
-                               cb, opaque);
-
-    if (ret) {
-        /* Update stats even though technically transfer has not happened. */
-        bs->wr_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-        bs->wr_ops ++;
-        if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
-            bs->wr_highest_sector = sector_num + nb_sectors - 1;
+/* Returns the time in ns until a request may pass, 0 if it may pass now */
+static int64_t bdrv_io_limits_wait(BlockDriverState *bs, int is_write)
+{
+    BlockIOLimit *l = &bs->io_limits;
+    int types[2] = {
+        BLOCK_IO_LIMIT_TOTAL,
+        is_write ? BLOCK_IO_LIMIT_WRITE : BLOCK_IO_LIMIT_READ,
+    };
+    double over, wait = 0;
+    int i, full = 0;
+
+    for (i = 0; i < 2; i++) {
+        int t = types[i];
+
+        if (l->bps[t]) {
+            over = bs->io_bucket_bytes[t] - bdrv_io_bucket_size(l->bps[t],
+                                                                l->bps_max);
+            if (over >= 0) {
+                wait = MAX(wait, over / l->bps[t]);
+                full = 1;
+            }
+        }
+        if (l->iops[t]) {
+            over = bs->io_bucket_ops[t] - bdrv_io_bucket_size(l->iops[t],
+                                                              l->iops_max);
+            if (over >= 0) {
+                wait = MAX(wait, over / l->iops[t]);
+                full = 1;
+            }
         }
     }
 
-    return ret;
+    /* A full bucket must make the request wait, however little */
+    return full ? (int64_t)(wait * get_ticks_per_sec()) + 1 : 0;
 }
 
+static void bdrv_io_limits_account(BlockDriverState *bs, int nb_sectors,
+                                   int is_write)
+{
+    BlockIOLimit *l = &bs->io_limits;
+    int t = is_write ? BLOCK_IO_LIMIT_WRITE : BLOCK_IO_LIMIT_READ;
+    double bytes = (double) nb_sectors * BDRV_SECTOR_SIZE;
 
-typedef struct MultiwriteCB {
-    int error;
-    int num_requests;
-    int num_callbacks;
-    struct {
-        BlockDriverCompletionFunc *cb;
-        void *opaque;
-        QEMUIOVector *free_qiov;
-        void *free_buf;
-    } callbacks[];
-} MultiwriteCB;
+    /* Buckets without a limit never drain, so don't fill them either */
+    if (l->bps[BLOCK_IO_LIMIT_TOTAL]) {
+        bs->io_bucket_bytes[BLOCK_IO_LIMIT_TOTAL] += bytes;
+    }
+    if (l->bps[t]) {
+        bs->io_bucket_bytes[t] += bytes;
+    }
+    if (l->iops[BLOCK_IO_LIMIT_TOTAL]) {
+        bs->io_bucket_ops[BLOCK_IO_LIMIT_TOTAL]++;
+    }
+    if (l->iops[t]) {
+        bs->io_bucket_ops[t]++;
+    }
+}
 
-static void multiwrite_user_cb(MultiwriteCB *mcb)
+static void bdrv_io_throttle_schedule(BlockDriverState *bs)
 {
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    int64_t wait = INT64_MAX;
     int i;
 
-    for (i = 0; i < mcb->num_callbacks; i++) {
-        mcb->callbacks[i].cb(mcb->callbacks[i].opaque, mcb->error);
-        if (mcb->callbacks[i].free_qiov) {
-            qemu_iovec_destroy(mcb->callbacks[i].free_qiov);
+    bdrv_io_limits_leak(bs, now);
+    for (i = 0; i < 2; i++) {
+        if (!QTAILQ_EMPTY(&bs->io_throttled[i])) {
+            wait = MIN(wait, bdrv_io_limits_wait(bs, i));
         }
-        qemu_free(mcb->callbacks[i].free_qiov);
-        qemu_vfree(mcb->callbacks[i].free_buf);
+    }
+    if (wait != INT64_MAX) {
+        qemu_mod_timer(bs->io_throttle_timer, now + wait);
     }
 }
 
-static void multiwrite_cb(void *opaque, int ret)
+static void bdrv_io_throttle_cb(void *opaque, int ret)
 {
-    MultiwriteCB *mcb = opaque;
+    BlockThrottleAIOCB *acb = opaque;
 
-    trace_multiwrite_cb(mcb, ret);
-
-    if (ret < 0 && !mcb->error) {
-        mcb->error = ret;
-    }
-
-    mcb->num_requests--;
-    if (mcb->num_requests == 0) {
-        multiwrite_user_cb(mcb);
-        qemu_free(mcb);
+    if (acb->cancelled) {
+        return;
     }
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
 }
 
-static int multiwrite_req_compare(const void *a, const void *b)
+/*
+ * Hands the throttled requests to the driver as the limits allow, or all of
+ * them if force is set. Reads and writes take turns.
+ */
+static void bdrv_io_throttle_dispatch(BlockDriverState *bs, int force)
 {
-    const BlockRequest *req1 = a, *req2 = b;
+    BlockThrottleAIOCB *acb;
+    int64_t now;
+    int i, progress;
 
-    /*
-     * Note that we can't simply subtract req2->sector from req1->sector
-     * here as that could overflow the return value.
-     */
-    if (req1->sector > req2->sector) {
-        return 1;
-    } else if (req1->sector < req2->sector) {
-        return -1;
+    do {
+        progress = 0;
+        for (i = 0; i < 2; i++) {
+            acb = QTAILQ_FIRST(&bs->io_throttled[i]);
+            if (acb == NULL) {
+                continue;
+            }
+            now = qemu_get_clock_ns(rt_clock);
+            bdrv_io_limits_leak(bs, now);
+            if (!force && bdrv_io_limits_wait(bs, i)) {
+                continue;
+            }
+
+            QTAILQ_REMOVE(&bs->io_throttled[i], acb, entry);
+            bdrv_io_limits_account(bs, acb->nb_sectors, i);
+            bs->throttled_ns += now - acb->queued;
+
+            acb->aiocb = bdrv_aio_submit(bs, acb->sector_num, acb->qiov,
+                                         acb->nb_sectors, bdrv_io_throttle_cb,
+                                         acb, i);
+            if (acb->aiocb == NULL) {
+                acb->common.cb(acb->common.opaque, -EIO);
+                qemu_aio_release(acb);
+            }
+            progress = 1;
+        }
+    } while (progress);
+
+    bdrv_io_throttle_schedule(bs);
+}
+
+static void bdrv_io_throttle_timer(void *opaque)
+{
+    bdrv_io_throttle_dispatch(opaque, 0);
+}
+
+/*
+ * Returns 1 if the request must wait. Otherwise it is charged to the
+ * buckets and may be submitted right away.
+ */
+static int bdrv_io_limits_exceeded(BlockDriverState *bs, int nb_sectors,
+                                   int is_write)
+{
+    if (!bs->io_limits_enabled) {
+        return 0;
+    }
+
+    /* Keep the order of requests that are already waiting. Nested contexts
+     * are never delayed, see above. */
+    bdrv_io_limits_leak(bs, qemu_get_clock_ns(rt_clock));
+    if (get_async_context_id() == 0 &&
+        (!QTAILQ_EMPTY(&bs->io_throttled[is_write]) ||
+         bdrv_io_limits_wait(bs, is_write))) {
+        return 1;
+    }
+
+    bdrv_io_limits_account(bs, nb_sectors, is_write);
+    return 0;
+}
+
+static BlockDriverAIOCB *bdrv_io_throttle_add(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    BlockThrottleAIOCB *acb;
+
+    acb = qemu_aio_get(&bdrv_io_throttle_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->is_write = is_write;
+    acb->queued = qemu_get_clock_ns(rt_clock);
+    acb->cancelled = 0;
+    acb->aiocb = NULL;
+    QTAILQ_INSERT_TAIL(&bs->io_throttled[is_write], acb, entry);
+    bs->throttled_ops[is_write]++;
+
+    bdrv_io_throttle_schedule(bs);
+    return &acb->common;
+}
+
+static int bdrv_io_throttle_pending(BlockDriverState *bs)
+{
+    return !QTAILQ_EMPTY(&bs->io_throttled[0]) ||
+           !QTAILQ_EMPTY(&bs->io_throttled[1]);
+}
+
+int bdrv_io_limits_valid(const BlockIOLimit *limits)
+{
+    if (limits->bps[BLOCK_IO_LIMIT_TOTAL] &&
+        (limits->bps[BLOCK_IO_LIMIT_READ] ||
+         limits->bps[BLOCK_IO_LIMIT_WRITE])) {
+        return 0;
+    }
+    if (limits->iops[BLOCK_IO_LIMIT_TOTAL] &&
+        (limits->iops[BLOCK_IO_LIMIT_READ] ||
+         limits->iops[BLOCK_IO_LIMIT_WRITE])) {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Replaces the I/O limits of the drive. The buckets start out empty, and
+ * requests that are waiting are rescheduled for the new limits, or all
+ * submitted if there are none.
+ */
+void bdrv_set_io_limits(BlockDriverState *bs, const BlockIOLimit *limits)
+{
+    int i;
+
+    bs->io_limits = *limits;
+    bs->io_limits_enabled = 0;
+    for (i = 0; i < BLOCK_IO_LIMIT_MAX; i++) {
+        if (limits->bps[i] || limits->iops[i]) {
+            bs->io_limits_enabled = 1;
+        }
+        bs->io_bucket_bytes[i] = 0;
+        bs->io_bucket_ops[i] = 0;
+    }
+    bs->io_bucket_stamp = qemu_get_clock_ns(rt_clock);
+
+    if (bs->io_limits_enabled && bs->io_throttle_timer == NULL) {
+        bs->io_throttle_timer = qemu_new_timer_ns(rt_clock,
+                                                  bdrv_io_throttle_timer, bs);
+    }
+    bdrv_io_throttle_dispatch(bs, !bs->io_limits_enabled);
+
+    /* Nothing is waiting any more without limits, so the timer can go */
+    if (!bs->io_limits_enabled && bs->io_throttle_timer) {
+        qemu_del_timer(bs->io_throttle_timer);
+        qemu_free_timer(bs->io_throttle_timer);
+        bs->io_throttle_timer = NULL;
+    }
+}
+
+/*
+ * Waits for all guest requests to complete, including those that are still
+ * held back by I/O throttling.
+ */
+void bdrv_drain_all(void)
+{
+    BlockDriverState *bs;
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bdrv_io_throttle_pending(bs)) {
+            bdrv_io_throttle_dispatch(bs, 1);
+        }
+    }
+    qemu_aio_flush();
+}
+
+
+static BlockDriverAIOCB *bdrv_aio_rw_throttled(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    if (bdrv_io_limits_exceeded(bs, nb_sectors, is_write)) {
+        return bdrv_io_throttle_add(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque, is_write);
+    }
+    return bdrv_aio_submit(bs, sector_num, qiov, nb_sectors,
+                           cb, opaque, is_write);
+}
+
+
+/**************************************************************/
+/* copy on read */
+
+/*
+ * With copy on read enabled, a read that touches clusters the image doesn't
+ * have yet reads the whole clusters, which fetches them from the backing
+ * file, and writes them into the image before it completes. The write back
+ * must not overtake or be overtaken by a guest write to the same clusters,
+ * so while copy on read is enabled writes are tracked too: a copy on read
+ * request waits for all overlapping requests, and a write waits for the
+ * overlapping copy on read requests.
+ *
+ * As with throttling, only the main async context can wait. Reads from a
+ * nested context don't copy, and writes from there don't wait but keep a
+ * copy on read request that hasn't written back yet from doing so. A nested
+ * write that comes in while the write back is already in flight can't be
+ * ordered against it, so devices that mix synchronous and asynchronous
+ * writes on the same clusters can still lose one of theirs.
+ */
+
+/* the copy granularity for formats that don't report a cluster size */
+#define COR_DEFAULT_CLUSTER_SECTORS 128
+
+typedef struct BdrvTrackedRequest {
+    int64_t sector_num;
+    int nb_sectors;
+    int is_cor;
+    int overwritten;
+    QLIST_ENTRY(BdrvTrackedRequest) list;
+} BdrvTrackedRequest;
+
+typedef struct BdrvWaiter {
+    int64_t sector_num;
+    int nb_sectors;
+    int is_cor;
+    void (*resume)(void *opaque);
+    void *opaque;
+    QTAILQ_ENTRY(BdrvWaiter) entry;
+} BdrvWaiter;
+
+static BdrvTrackedRequest *bdrv_tracked_find(BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors, int cor_only)
+{
+    BdrvTrackedRequest *req;
+
+    QLIST_FOREACH(req, &bs->tracked_requests, list) {
+        if ((req->is_cor || !cor_only) &&
+            sector_num < req->sector_num + req->nb_sectors &&
+            req->sector_num < sector_num + nb_sectors) {
+            return req;
+        }
+    }
+    return NULL;
+}
+
+/* Keeps the overlapping copy on read requests from writing back */
+static void bdrv_tracked_overwrite(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors)
+{
+    BdrvTrackedRequest *req;
+
+    QLIST_FOREACH(req, &bs->tracked_requests, list) {
+        if (req->is_cor && sector_num < req->sector_num + req->nb_sectors &&
+            req->sector_num < sector_num + nb_sectors) {
+            req->overwritten = 1;
+        }
+    }
+}
+
+/* Returns a write other than req that overlaps it */
+static BdrvTrackedRequest *bdrv_tracked_find_write(BlockDriverState *bs,
+                                                   BdrvTrackedRequest *req)
+{
+    BdrvTrackedRequest *other;
+
+    QLIST_FOREACH(other, &bs->tracked_requests, list) {
+        if (other != req && !other->is_cor &&
+            req->sector_num < other->sector_num + other->nb_sectors &&
+            other->sector_num < req->sector_num + req->nb_sectors) {
+            return other;
+        }
+    }
+    return NULL;
+}
+
+static void bdrv_tracked_add(BlockDriverState *bs, BdrvTrackedRequest *req,
+                             int64_t sector_num, int nb_sectors, int is_cor)
+{
+    req->sector_num = sector_num;
+    req->nb_sectors = nb_sectors;
+    req->is_cor = is_cor;
+    req->overwritten = 0;
+    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+}
+
+static void bdrv_tracked_remove(BlockDriverState *bs, BdrvTrackedRequest *req)
+{
+    BdrvWaiter *w;
+
+    QLIST_REMOVE(req, list);
+
+    /* Resuming a waiter changes both lists, so start over after each one */
+restart:
+    QTAILQ_FOREACH(w, &bs->tracked_waiters, entry) {
+        if (!bdrv_tracked_find(bs, w->sector_num, w->nb_sectors, !w->is_cor)) {
+            QTAILQ_REMOVE(&bs->tracked_waiters, w, entry);
+            w->resume(w->opaque);
+            goto restart;
+        }
+    }
+}
+
+static void bdrv_tracked_wait(BlockDriverState *bs, BdrvWaiter *w,
+                              int64_t sector_num, int nb_sectors, int is_cor,
+                              void (*resume)(void *opaque), void *opaque)
+{
+    w->sector_num = sector_num;
+    w->nb_sectors = nb_sectors;
+    w->is_cor = is_cor;
+    w->resume = resume;
+    w->opaque = opaque;
+    QTAILQ_INSERT_TAIL(&bs->tracked_waiters, w, entry);
+}
+
+typedef struct BlockTrackedAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    BdrvTrackedRequest req;
+    BdrvWaiter waiter;
+    int waiting;
+    int cancelled;
+    BlockDriverAIOCB *aiocb;
+} BlockTrackedAIOCB;
+
+static void bdrv_tracked_write_cancel(BlockDriverAIOCB *blockacb)
+{
+    BlockTrackedAIOCB *acb = container_of(blockacb, BlockTrackedAIOCB, common);
+    BlockDriverState *bs = acb->common.bs;
+
+    if (acb->waiting) {
+        QTAILQ_REMOVE(&bs->tracked_waiters, &acb->waiter, entry);
+    } else {
+        /* Drivers that complete a cancelled request leave the acb to us */
+        acb->cancelled = 1;
+        bdrv_aio_cancel(acb->aiocb);
+        bdrv_tracked_remove(bs, &acb->req);
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_tracked_write_pool = {
+    .aiocb_size         = sizeof(BlockTrackedAIOCB),
+    .cancel             = bdrv_tracked_write_cancel,
+};
+
+static void bdrv_tracked_write_cb(void *opaque, int ret)
+{
+    BlockTrackedAIOCB *acb = opaque;
+
+    if (acb->cancelled) {
+        return;
+    }
+    bdrv_tracked_remove(acb->common.bs, &acb->req);
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+static int bdrv_tracked_write_start(BlockTrackedAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+
+    bdrv_tracked_add(bs, &acb->req, acb->sector_num, acb->nb_sectors, 0);
+    acb->waiting = 0;
+    acb->aiocb = bdrv_aio_rw_throttled(bs, acb->sector_num, acb->qiov,
+                                       acb->nb_sectors, bdrv_tracked_write_cb,
+                                       acb, 1);
+    if (acb->aiocb == NULL) {
+        bdrv_tracked_remove(bs, &acb->req);
+        return -EIO;
+    }
+    return 0;
+}
+
+static void bdrv_tracked_write_resume(void *opaque)
+{
+    BlockTrackedAIOCB *acb = opaque;
+
+    if (bdrv_tracked_write_start(acb) < 0) {
+        acb->common.cb(acb->common.opaque, -EIO);
+        qemu_aio_release(acb);
+    }
+}
+
+static BlockDriverAIOCB *bdrv_aio_tracked_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockTrackedAIOCB *acb;
+
+    acb = qemu_aio_get(&bdrv_tracked_write_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->cancelled = 0;
+
+    if (get_async_context_id() != 0) {
+        bdrv_tracked_overwrite(bs, sector_num, nb_sectors);
+    } else if (bdrv_tracked_find(bs, sector_num, nb_sectors, 1)) {
+        acb->waiting = 1;
+        bdrv_tracked_wait(bs, &acb->waiter, sector_num, nb_sectors, 0,
+                          bdrv_tracked_write_resume, acb);
+        return &acb->common;
+    }
+
+    if (bdrv_tracked_write_start(acb) < 0) {
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
+
+typedef struct BlockCopyOnReadAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    int64_t cluster_sector_num;
+    int cluster_nb_sectors;
+    BdrvTrackedRequest req;
+    BdrvWaiter waiter;
+    int waiting;
+    int cancelled;
+    QEMUBH *bh;
+    BlockDriverAIOCB *aiocb;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    void *bounce;
+} BlockCopyOnReadAIOCB;
+
+static void bdrv_cor_cancel(BlockDriverAIOCB *blockacb)
+{
+    BlockCopyOnReadAIOCB *acb = container_of(blockacb, BlockCopyOnReadAIOCB,
+                                             common);
+    BlockDriverState *bs = acb->common.bs;
+
+    if (acb->waiting) {
+        QTAILQ_REMOVE(&bs->tracked_waiters, &acb->waiter, entry);
+    } else {
+        if (acb->bh) {
+            qemu_bh_delete(acb->bh);
+        }
+        if (acb->aiocb) {
+            /* Drivers that complete a cancelled request leave the acb to us */
+            acb->cancelled = 1;
+            bdrv_aio_cancel(acb->aiocb);
+        }
+        bdrv_tracked_remove(bs, &acb->req);
+    }
+    qemu_vfree(acb->bounce);
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_cor_pool = {
+    .aiocb_size         = sizeof(BlockCopyOnReadAIOCB),
+    .cancel             = bdrv_cor_cancel,
+};
+
+static void bdrv_cor_complete(BlockCopyOnReadAIOCB *acb, int ret)
+{
+    bdrv_tracked_remove(acb->common.bs, &acb->req);
+    qemu_vfree(acb->bounce);
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+static void bdrv_cor_plain_cb(void *opaque, int ret)
+{
+    BlockCopyOnReadAIOCB *acb = opaque;
+
+    acb->aiocb = NULL;
+    if (acb->cancelled) {
+        return;
+    }
+    bdrv_cor_complete(acb, ret);
+}
+
+/* Hands the requested part of the clusters to the caller */
+static void bdrv_cor_read_done(BlockCopyOnReadAIOCB *acb, int ret)
+{
+    size_t offset;
+
+    if (ret == 0) {
+        offset = (acb->sector_num - acb->cluster_sector_num) *
+                 BDRV_SECTOR_SIZE;
+        qemu_iovec_from_buffer(acb->qiov, (uint8_t *) acb->bounce + offset,
+                               acb->nb_sectors * BDRV_SECTOR_SIZE);
+    }
+    bdrv_cor_complete(acb, ret);
+}
+
+static void bdrv_cor_write_cb(void *opaque, int ret)
+{
+    BlockCopyOnReadAIOCB *acb = opaque;
+
+    acb->aiocb = NULL;
+    if (acb->cancelled) {
+        return;
+    }
+    bdrv_cor_read_done(acb, ret);
+}
+
+static void bdrv_cor_read_cb(void *opaque, int ret)
+{
+    BlockCopyOnReadAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    acb->aiocb = NULL;
+    if (acb->cancelled) {
+        return;
+    }
+
+    /*
+     * Skip the write back if a nested write got there first or is still
+     * in flight, its data must not be overwritten. Otherwise the request
+     * stays tracked until the write back is done, so that guest writes to
+     * the clusters wait for it.
+     */
+    if (ret < 0 || acb->req.overwritten ||
+        bdrv_tracked_find_write(bs, &acb->req)) {
+        bdrv_cor_read_done(acb, ret);
+        return;
+    }
+
+    acb->aiocb = bdrv_aio_submit(bs, acb->cluster_sector_num,
+                                 &acb->bounce_qiov, acb->cluster_nb_sectors,
+                                 bdrv_cor_write_cb, acb, 1);
+    if (acb->aiocb == NULL) {
+        bdrv_cor_complete(acb, -EIO);
+    }
+}
+
+static void bdrv_cor_bh(void *opaque)
+{
+    BlockCopyOnReadAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    int64_t sector_num = acb->cluster_sector_num;
+    int64_t end = sector_num + acb->cluster_nb_sectors;
+    int n, copy = 0;
+
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+
+    while (sector_num < end) {
+        if (!bdrv_is_allocated(bs, sector_num, end - sector_num, &n)) {
+            copy = 1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        sector_num += n;
+    }
+
+    if (!copy) {
+        acb->aiocb = bdrv_aio_rw_throttled(bs, acb->sector_num, acb->qiov,
+                                           acb->nb_sectors, bdrv_cor_plain_cb,
+                                           acb, 0);
+    } else {
+        acb->bounce = qemu_blockalign(bs, acb->cluster_nb_sectors *
+                                          BDRV_SECTOR_SIZE);
+        acb->iov.iov_base = acb->bounce;
+        acb->iov.iov_len = acb->cluster_nb_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&acb->bounce_qiov, &acb->iov, 1);
+        acb->aiocb = bdrv_aio_rw_throttled(bs, acb->cluster_sector_num,
+                                           &acb->bounce_qiov,
+                                           acb->cluster_nb_sectors,
+                                           bdrv_cor_read_cb, acb, 0);
+    }
+    if (acb->aiocb == NULL) {
+        bdrv_cor_complete(acb, -EIO);
+    }
+}
+
+static void bdrv_cor_start(void *opaque)
+{
+    BlockCopyOnReadAIOCB *acb = opaque;
+
+    acb->waiting = 0;
+    bdrv_tracked_add(acb->common.bs, &acb->req, acb->cluster_sector_num,
+                     acb->cluster_nb_sectors, 1);
+
+    /*
+     * Checking the allocation may have to wait for metadata I/O, don't do
+     * it in the middle of the caller's request submission.
+     */
+    acb->bh = qemu_bh_new(bdrv_cor_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+/*
+ * Reads from the image and writes the clusters that came from the backing
+ * file into the image. Copy on read must be enabled for the image.
+ */
+BlockDriverAIOCB *bdrv_aio_copy_on_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockCopyOnReadAIOCB *acb;
+    BlockDriverInfo bdi;
+    int cluster_sectors = COR_DEFAULT_CLUSTER_SECTORS;
+    int64_t end;
+
+    assert(bs->copy_on_read);
+
+    if (bdrv_get_info(bs, &bdi) == 0 && bdi.cluster_size > 0) {
+        cluster_sectors = bdi.cluster_size >> BDRV_SECTOR_BITS;
+    }
+
+    acb = qemu_aio_get(&bdrv_cor_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->bh = NULL;
+    acb->aiocb = NULL;
+    acb->bounce = NULL;
+    acb->cancelled = 0;
+
+    acb->cluster_sector_num = sector_num - sector_num % cluster_sectors;
+    end = sector_num + nb_sectors + cluster_sectors - 1;
+    end -= end % cluster_sectors;
+    end = MIN(end, bs->total_sectors);
+    acb->cluster_nb_sectors = end - acb->cluster_sector_num;
+
+    if (bdrv_tracked_find(bs, acb->cluster_sector_num,
+                          acb->cluster_nb_sectors, 0)) {
+        acb->waiting = 1;
+        bdrv_tracked_wait(bs, &acb->waiter, acb->cluster_sector_num,
+                          acb->cluster_nb_sectors, 1, bdrv_cor_start, acb);
+    } else {
+        bdrv_cor_start(acb);
+    }
+    return &acb->common;
+}
+
+/*
+ * Copy on read can be enabled several times, e.g. by the user and by an
+ * image streaming job, and stays on until disabled as often.
+ */
+void bdrv_enable_copy_on_read(BlockDriverState *bs)
+{
+    /* Writes already in flight aren't tracked, let them finish first */
+    if (bs->copy_on_read++ == 0) {
+        bdrv_drain_all();
+    }
+}
+
+void bdrv_disable_copy_on_read(BlockDriverState *bs)
+{
+    assert(bs->copy_on_read > 0);
+    bs->copy_on_read--;
+}
+
+
+/**************************************************************/
+/* async I/Os */
+
+BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
+                                 QEMUIOVector *qiov, int nb_sectors,
+                                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+
+    trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
+
+    if (!drv)
+        return NULL;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return NULL;
+
+    if (bs->copy_on_read && bs->backing_hd && get_async_context_id() == 0) {
+        ret = bdrv_aio_copy_on_readv(bs, sector_num, qiov, nb_sectors,
+                                     cb, opaque);
+    } else {
+        ret = bdrv_aio_rw_throttled(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque, 0);
+    }
+
+    if (ret) {
+	/* Update stats even though technically transfer has not happened. */
+	bs->rd_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+	bs->rd_ops ++;
+    }
+
+    return ret;
+}
+
+typedef struct BlockCompleteData {
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+} BlockCompleteData;
+
+static void block_complete_cb(void *opaque, int ret)
+{
+    BlockCompleteData *b = opaque;
+
+    bdrv_set_dirty(b->bs, b->sector_num, b->nb_sectors);
+    b->cb(b->opaque, ret);
+    qemu_free(b);
+}
+
+static BlockCompleteData *blk_dirty_cb_alloc(BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors,
+                                             BlockDriverCompletionFunc *cb,
+                                             void *opaque)
+{
+    BlockCompleteData *blkdata = qemu_mallocz(sizeof(BlockCompleteData));
+
+    blkdata->bs = bs;
+    blkdata->cb = cb;
+    blkdata->opaque = opaque;
+    blkdata->sector_num = sector_num;
+    blkdata->nb_sectors = nb_sectors;
+
+    return blkdata;
+}
+
+BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
+                                  QEMUIOVector *qiov, int nb_sectors,
+                                  BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+    BlockCompleteData *blk_cb_data;
+
+    trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
+
+    if (!drv)
+        return NULL;
+    if (bs->read_only)
+        return NULL;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return NULL;
+
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        blk_cb_data = blk_dirty_cb_alloc(bs, sector_num, nb_sectors, cb,
+                                         opaque);
+        cb = &block_complete_cb;
+        opaque = blk_cb_data;
+    }
+
+    if (bs->copy_on_read) {
+        ret = bdrv_aio_tracked_writev(bs, sector_num, qiov, nb_sectors,
+                                      cb, opaque);
+    } else {
+        ret = bdrv_aio_rw_throttled(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque, 1);
+    }
+
+    if (ret) {
+        /* Update stats even though technically transfer has not happened. */
+        bs->wr_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+        bs->wr_ops ++;
+        if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
+            bs->wr_highest_sector = sector_num + nb_sectors - 1;
+        }
+    }
+
+    return ret;
+}
+
+
+typedef struct MultiwriteCB {
+    int error;
+    int num_requests;
+    int num_callbacks;
+    struct {
+        BlockDriverCompletionFunc *cb;
+        void *opaque;
+        QEMUIOVector *free_qiov;
+        void *free_buf;
+    } callbacks[];
+} MultiwriteCB;
+
+static void multiwrite_user_cb(MultiwriteCB *mcb)
+{
+    int i;
+
+    for (i = 0; i < mcb->num_callbacks; i++) {
+        mcb->callbacks[i].cb(mcb->callbacks[i].opaque, mcb->error);
+        if (mcb->callbacks[i].free_qiov) {
+            qemu_iovec_destroy(mcb->callbacks[i].free_qiov);
+        }
+        qemu_free(mcb->callbacks[i].free_qiov);
+        qemu_vfree(mcb->callbacks[i].free_buf);
+    }
+}
+
+static void multiwrite_cb(void *opaque, int ret)
+{
+    MultiwriteCB *mcb = opaque;
+
+    trace_multiwrite_cb(mcb, ret);
+
+    if (ret < 0 && !mcb->error) {
+        mcb->error = ret;
+    }
+
+    mcb->num_requests--;
+    if (mcb->num_requests == 0) {
+        multiwrite_user_cb(mcb);
+        qemu_free(mcb);
+    }
+}
+
+static int multiwrite_req_compare(const void *a, const void *b)
+{
+    const BlockRequest *req1 = a, *req2 = b;
+
+    /*
+     * Note that we can't simply subtract req2->sector from req1->sector
+     * here as that could overflow the return value.
+     */
+    if (req1->sector > req2->sector) {
+        return 1;
+    } else if (req1->sector < req2->sector) {
+        return -1;
     } else {
         return 0;
     }
@@ -2461,6 +3533,8 @@ BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
 
     trace_bdrv_aio_flush(bs, opaque);
 
+    bdrv_io_queue_flush(bs);
+
     if (bs->open_flags & BDRV_O_NO_FLUSH) {
         return bdrv_aio_noop_em(bs, cb, opaque);
     }
@@ -2475,6 +3549,372 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->pool->cancel(acb);
 }
 
+/*
+ * Request queue
+ *
+ * While a device model has the drive plugged, reads and writes that it
+ * submits are not passed to the driver but kept in bs->io_queue. The final
+ * bdrv_io_unplug() sorts them by start sector and, like multiwrite_merge(),
+ * combines requests of the same direction that are exactly adjacent into a
+ * single request of at most bs->io_merge_max sectors. The device keeps one
+ * AIOCB per original request and each gets its own completion.
+ *
+ * Only requests from the async context that plugged the drive are queued,
+ * synchronous I/O emulated in a nested context goes straight to the driver
+ * and cannot wait for requests that are held back.
+ */
+
+typedef struct BlockQueueRequest BlockQueueRequest;
+
+typedef struct BlockQueueAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    int is_write;
+    int cancelled;
+    BlockQueueRequest *req;
+    QTAILQ_ENTRY(BlockQueueAIOCB) entry;
+} BlockQueueAIOCB;
+
+struct BlockQueueRequest {
+    BlockDriverState *bs;
+    BlockDriverAIOCB *aiocb;
+    QEMUIOVector qiov;
+    int nb_sectors;
+    int merged;
+    int completing;
+    QEMUBH *bh;
+    int ret;
+    QTAILQ_HEAD(, BlockQueueAIOCB) acbs;
+};
+
+static void bdrv_io_queue_cancel(BlockDriverAIOCB *blockacb);
+
+static AIOPool bdrv_io_queue_pool = {
+    .aiocb_size         = sizeof(BlockQueueAIOCB),
+    .cancel             = bdrv_io_queue_cancel,
+};
+
+static int bdrv_io_queue_active(BlockDriverState *bs)
+{
+    return bs->io_plugged && bs->io_plug_context == get_async_context_id();
+}
+
+static BlockDriverAIOCB *bdrv_io_queue_add(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    BlockQueueAIOCB *acb;
+
+    acb = qemu_aio_get(&bdrv_io_queue_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->nb_sectors = nb_sectors;
+    acb->qiov = qiov;
+    acb->is_write = is_write;
+    acb->cancelled = 0;
+    acb->req = NULL;
+    QTAILQ_INSERT_TAIL(&bs->io_queue, acb, entry);
+
+    return &acb->common;
+}
+
+static void bdrv_io_queue_complete(BlockQueueRequest *req)
+{
+    BlockQueueAIOCB *acb;
+
+    req->completing = 1;
+    while ((acb = QTAILQ_FIRST(&req->acbs))) {
+        QTAILQ_REMOVE(&req->acbs, acb, entry);
+        if (acb->cancelled) {
+            /* bdrv_io_queue_cancel() is waiting for us and releases it */
+            acb->req = NULL;
+            continue;
+        }
+        acb->common.cb(acb->common.opaque, req->ret);
+        qemu_aio_release(acb);
+    }
+
+    if (req->merged) {
+        qemu_iovec_destroy(&req->qiov);
+    }
+    if (req->bh) {
+        qemu_bh_delete(req->bh);
+    }
+    qemu_free(req);
+}
+
+static void bdrv_io_queue_cb(void *opaque, int ret)
+{
+    BlockQueueRequest *req = opaque;
+
+    req->ret = ret;
+    bdrv_io_queue_complete(req);
+}
+
+static void bdrv_io_queue_bh(void *opaque)
+{
+    BlockQueueRequest *req = opaque;
+
+    bdrv_io_queue_complete(req);
+}
+
+static void bdrv_io_queue_cancel(BlockDriverAIOCB *blockacb)
+{
+    BlockQueueAIOCB *acb = container_of(blockacb, BlockQueueAIOCB, common);
+    BlockQueueRequest *req = acb->req;
+
+    if (req == NULL) {
+        /* Still queued, the driver has never seen it */
+        QTAILQ_REMOVE(&acb->common.bs->io_queue, acb, entry);
+        qemu_aio_release(acb);
+        return;
+    }
+
+    if (req->completing) {
+        /* Cancelled from the callback of another part of the same request */
+        QTAILQ_REMOVE(&req->acbs, acb, entry);
+        qemu_aio_release(acb);
+        return;
+    }
+
+    acb->cancelled = 1;
+
+    if (!req->merged && req->aiocb) {
+        /*
+         * The request is this one alone. Some drivers complete a cancelled
+         * request, bdrv_io_queue_complete() then detaches the acb and frees
+         * req. Otherwise req is left to us.
+         */
+        bdrv_aio_cancel(req->aiocb);
+        if (acb->req) {
+            QTAILQ_REMOVE(&req->acbs, acb, entry);
+            qemu_free(req);
+        }
+        qemu_aio_release(acb);
+        return;
+    }
+
+    /*
+     * The request shares its buffer list with others and can't be cancelled
+     * on its own. Wait for it to complete without calling back, so that the
+     * caller may free its buffers when we return.
+     */
+    while (acb->req) {
+        qemu_aio_wait();
+    }
+    qemu_aio_release(acb);
+}
+
+static int bdrv_io_queue_compare(const void *a, const void *b)
+{
+    const BlockQueueAIOCB *acb1 = *(BlockQueueAIOCB * const *) a;
+    const BlockQueueAIOCB *acb2 = *(BlockQueueAIOCB * const *) b;
+
+    if (acb1->is_write != acb2->is_write) {
+        return acb1->is_write - acb2->is_write;
+    }
+    if (acb1->sector_num > acb2->sector_num) {
+        return 1;
+    } else if (acb1->sector_num < acb2->sector_num) {
+        return -1;
+    }
+
+    /* Keep the submission order of requests starting at the same sector */
+    return acb1 < acb2 ? -1 : (acb1 > acb2);
+}
+
+static void bdrv_io_queue_submit_one(BlockDriverState *bs,
+                                     BlockQueueRequest *req)
+{
+    BlockDriver *drv = bs->drv;
+    BlockQueueAIOCB *first = QTAILQ_FIRST(&req->acbs);
+    QEMUIOVector *qiov = req->merged ? &req->qiov : first->qiov;
+    int nb_sectors = req->nb_sectors;
+
+    if (drv == NULL) {
+        req->aiocb = NULL;
+    } else if (first->is_write) {
+        req->aiocb = drv->bdrv_aio_writev(bs, first->sector_num, qiov,
+                                          nb_sectors, bdrv_io_queue_cb, req);
+    } else {
+        req->aiocb = drv->bdrv_aio_readv(bs, first->sector_num, qiov,
+                                         nb_sectors, bdrv_io_queue_cb, req);
+    }
+
+    if (req->aiocb == NULL) {
+        /* The device already has its AIOCBs, so fail them asynchronously */
+        req->ret = -EIO;
+        req->bh = qemu_bh_new(bdrv_io_queue_bh, req);
+        qemu_bh_schedule(req->bh);
+    }
+}
+
+static void bdrv_io_queue_submit(BlockDriverState *bs)
+{
+    BlockQueueAIOCB **acbs, *acb, *prev = NULL;
+    BlockQueueRequest *req = NULL;
+    int64_t req_start = 0;
+    int i, n = 0;
+
+    QTAILQ_FOREACH(acb, &bs->io_queue, entry) {
+        n++;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    acbs = qemu_malloc(n * sizeof(*acbs));
+    i = 0;
+    while ((acb = QTAILQ_FIRST(&bs->io_queue))) {
+        QTAILQ_REMOVE(&bs->io_queue, acb, entry);
+        acbs[i++] = acb;
+    }
+    qsort(acbs, n, sizeof(*acbs), bdrv_io_queue_compare);
+
+    for (i = 0; i < n; i++) {
+        int merge = 0;
+
+        acb = acbs[i];
+
+        /*
+         * Only exactly sequential requests are merged: overlapping writes
+         * can't be combined without deciding which one wins, and filling
+         * gaps with zeros is only possible for writes to unused space.
+         */
+        if (prev && prev->is_write == acb->is_write &&
+            acb->sector_num == prev->sector_num + prev->nb_sectors &&
+            acb->sector_num + acb->nb_sectors - req_start <=
+                bs->io_merge_max) {
+            int niov = req->merged ? req->qiov.niov : prev->qiov->niov;
+            merge = niov + acb->qiov->niov <= IOV_MAX;
+        }
+
+        if (merge) {
+            if (!req->merged) {
+                qemu_iovec_init(&req->qiov, prev->qiov->niov + acb->qiov->niov);
+                qemu_iovec_concat(&req->qiov, prev->qiov,
+                                  prev->nb_sectors << BDRV_SECTOR_BITS);
+                req->merged = 1;
+            }
+            qemu_iovec_concat(&req->qiov, acb->qiov,
+                              acb->nb_sectors << BDRV_SECTOR_BITS);
+        } else {
+            if (req) {
+                bdrv_io_queue_submit_one(bs, req);
+            }
+            req = qemu_mallocz(sizeof(*req));
+            req->bs = bs;
+            QTAILQ_INIT(&req->acbs);
+            req_start = acb->sector_num;
+        }
+
+        acb->req = req;
+        req->nb_sectors += acb->nb_sectors;
+        QTAILQ_INSERT_TAIL(&req->acbs, acb, entry);
+        prev = acb;
+    }
+    bdrv_io_queue_submit_one(bs, req);
+
+    qemu_free(acbs);
+}
+
+/*
+ * Hands the queued requests to the driver ahead of a flush, which must not
+ * overtake them. Requests submitted later are queued again until the drive
+ * is unplugged.
+ */
+static void bdrv_io_queue_flush(BlockDriverState *bs)
+{
+    if (bdrv_io_queue_active(bs)) {
+        bdrv_io_queue_submit(bs);
+    }
+}
+
+/*
+ * Passes a read or write to the driver, or to the request queue while the
+ * drive is plugged.
+ */
+static BlockDriverAIOCB *bdrv_aio_submit(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv == NULL) {
+        return NULL;
+    }
+    if (bdrv_io_queue_active(bs)) {
+        return bdrv_io_queue_add(bs, sector_num, qiov, nb_sectors,
+                                 cb, opaque, is_write);
+    }
+    if (is_write) {
+        return drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque);
+    } else {
+        return drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                                   cb, opaque);
+    }
+}
+
+/*
+ * Sets the size limit for requests merged by the request queue, a value of
+ * 0 only sorts requests.
+ */
+void bdrv_set_merge_max(BlockDriverState *bs, int max_sectors)
+{
+    bs->io_merge_max = max_sectors;
+}
+
+/*
+ * Tells the driver that a batch of requests is about to be submitted. The
+ * driver may hold them back until the matching bdrv_io_unplug() and then
+ * hand them to the host in one go. Calls can be nested. Drivers without
+ * support pass the hint on to their protocol layer.
+ */
+static void bdrv_io_plug_driver(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug_driver(bs->file);
+    }
+}
+
+static void bdrv_io_unplug_driver(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug_driver(bs->file);
+    }
+}
+
+/*
+ * Starts a batch of requests from a device model. Reads and writes are held
+ * in the request queue until the outermost bdrv_io_unplug(), which merges
+ * them and hands them to the driver.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    if (bs->io_plugged++ == 0) {
+        bs->io_plug_context = get_async_context_id();
+    }
+    bdrv_io_plug_driver(bs);
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    assert(bs->io_plugged > 0);
+    if (--bs->io_plugged == 0) {
+        bdrv_io_queue_submit(bs);
+    }
+    bdrv_io_unplug_driver(bs);
+}
 
 /**************************************************************/
 /* async block device emulation */
@@ -2820,49 +4260,122 @@ void *qemu_blockalign(BlockDriverState *bs, size_t size)
     return qemu_memalign((bs && bs->buffer_alignment) ? bs->buffer_alignment : 512, size);
 }
 
-void bdrv_set_dirty_tracking(BlockDriverState *bs, int enable)
+/*
+ * Creates a bitmap that records which chunks of granularity sectors were
+ * written from now on. Several users can track the same device, each with
+ * its own bitmap. Bitmaps with a name belong to the image rather than to a
+ * user; they are released when the image is closed.
+ */
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          int granularity, const char *name)
 {
-    int64_t bitmap_size;
+    BdrvDirtyBitmap *bitmap;
+    int64_t sectors;
 
-    bs->dirty_count = 0;
-    if (enable) {
-        if (!bs->dirty_bitmap) {
-            bitmap_size = (bdrv_getlength(bs) >> BDRV_SECTOR_BITS) +
-                    BDRV_SECTORS_PER_DIRTY_CHUNK * 8 - 1;
-            bitmap_size /= BDRV_SECTORS_PER_DIRTY_CHUNK * 8;
+    /* granularity must be a power of two */
+    assert(granularity > 0 && (granularity & (granularity - 1)) == 0);
 
-            bs->dirty_bitmap = qemu_mallocz(bitmap_size);
-        }
-    } else {
-        if (bs->dirty_bitmap) {
-            qemu_free(bs->dirty_bitmap);
-            bs->dirty_bitmap = NULL;
+    sectors = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
+    if (sectors < 0) {
+        return NULL;
+    }
+
+    bitmap = qemu_mallocz(sizeof(*bitmap));
+    bitmap->bitmap = hbitmap_alloc(sectors, ctz32(granularity));
+    bitmap->granularity = granularity;
+    bitmap->name = name ? qemu_strdup(name) : NULL;
+
+    QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+    return bitmap;
+}
+
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    QLIST_REMOVE(bitmap, list);
+    hbitmap_free(bitmap->bitmap);
+    qemu_free(bitmap->name);
+    qemu_free(bitmap);
+}
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (bitmap->name && !strcmp(bitmap->name, name)) {
+            return bitmap;
         }
     }
+    return NULL;
 }
 
-int bdrv_get_dirty(BlockDriverState *bs, int64_t sector)
+/* Returns 1 if persistent bitmaps can be stored in the image */
+int bdrv_can_store_dirty_bitmaps(BlockDriverState *bs)
 {
-    int64_t chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
+    BlockDriver *drv = bs->drv;
 
-    if (bs->dirty_bitmap &&
-        (sector << BDRV_SECTOR_BITS) < bdrv_getlength(bs)) {
-        return !!(bs->dirty_bitmap[chunk / (sizeof(unsigned long) * 8)] &
-            (1UL << (chunk % (sizeof(unsigned long) * 8))));
-    } else {
+    if (!drv || !drv->bdrv_store_dirty_bitmaps) {
+        return 0;
+    }
+    return !drv->bdrv_can_store_dirty_bitmaps ||
+           drv->bdrv_can_store_dirty_bitmaps(bs);
+}
+
+/*
+ * Makes a named bitmap persistent, i.e. the image format driver stores it
+ * in the image when it is closed. Returns -ENOTSUP if the image can't.
+ */
+int bdrv_dirty_bitmap_set_persistent(BlockDriverState *bs,
+                                     BdrvDirtyBitmap *bitmap, int persistent)
+{
+    if (persistent && !bdrv_can_store_dirty_bitmaps(bs)) {
+        return -ENOTSUP;
+    }
+    bitmap->persistent = persistent;
+    return 0;
+}
+
+int bdrv_get_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                   int64_t sector)
+{
+    if (sector < 0) {
         return 0;
     }
+    return hbitmap_get(bitmap->bitmap, sector);
+}
+
+/*
+ * Returns the first sector of the first dirty chunk at or after sector, or
+ * -1 if everything from there on is clean.
+ */
+int64_t bdrv_get_next_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                            int64_t sector)
+{
+    return hbitmap_next(bitmap->bitmap, MAX(sector, 0));
+}
+
+void bdrv_set_dirty_range(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                          int64_t cur_sector, int nr_sectors)
+{
+    set_dirty_bitmap(bitmap, cur_sector, nr_sectors, 1);
+}
+
+void bdrv_reset_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                      int64_t cur_sector, int nr_sectors)
+{
+    set_dirty_bitmap(bitmap, cur_sector, nr_sectors, 0);
 }
 
-void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
-                      int nr_sectors)
+void bdrv_clear_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
-    set_dirty_bitmap(bs, cur_sector, nr_sectors, 0);
+    hbitmap_reset_all(bitmap->bitmap);
 }
 
-int64_t bdrv_get_dirty_count(BlockDriverState *bs)
+/* Returns the number of dirty sectors, rounded up to whole chunks */
+int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
-    return bs->dirty_count;
+    return hbitmap_count(bitmap->bitmap);
 }
 
 void bdrv_set_in_use(BlockDriverState *bs, int in_use)
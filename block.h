@@ -120,6 +120,27 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
 BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
                                  BlockDriverCompletionFunc *cb, void *opaque);
 void bdrv_aio_cancel(BlockDriverAIOCB *acb);
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
+void bdrv_set_merge_max(BlockDriverState *bs, int max_sectors);
+
+/* I/O throttling, all limits are per second and 0 means unlimited */
+enum {
+    BLOCK_IO_LIMIT_TOTAL,
+    BLOCK_IO_LIMIT_READ,
+    BLOCK_IO_LIMIT_WRITE,
+    BLOCK_IO_LIMIT_MAX,
+};
+
+typedef struct BlockIOLimit {
+    uint64_t bps[BLOCK_IO_LIMIT_MAX];
+    uint64_t iops[BLOCK_IO_LIMIT_MAX];
+    uint64_t bps_max;   /* burst in bytes, 0 for a tenth of a second */
+    uint64_t iops_max;  /* burst in requests, 0 for a tenth of a second */
+} BlockIOLimit;
+
+void bdrv_set_io_limits(BlockDriverState *bs, const BlockIOLimit *limits);
+int bdrv_io_limits_valid(const BlockIOLimit *limits);
 
 typedef struct BlockRequest {
     /* Fields to be filled by multiwrite caller */
@@ -145,12 +166,17 @@ BlockDriverAIOCB *bdrv_aio_ioctl(BlockDriverState *bs,
 /* Ensure contents are flushed to disk.  */
 int bdrv_flush(BlockDriverState *bs);
 void bdrv_flush_all(void);
+void bdrv_enable_copy_on_read(BlockDriverState *bs);
+void bdrv_disable_copy_on_read(BlockDriverState *bs);
+void bdrv_drain_all(void);
 void bdrv_close_all(void);
 
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors);
 int bdrv_has_zero_init(BlockDriverState *bs);
 int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
                       int *pnum);
+int bdrv_is_allocated_above(BlockDriverState *top, BlockDriverState *base,
+                            int64_t sector_num, int nb_sectors, int *pnum);
 
 #define BIOS_ATA_TRANSLATION_AUTO   0
 #define BIOS_ATA_TRANSLATION_NONE   1
@@ -204,6 +230,9 @@ void bdrv_iterate_format(void (*it)(void *opaque, const char *name),
 const char *bdrv_get_device_name(BlockDriverState *bs);
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
+BlockDriverAIOCB *bdrv_aio_write_compressed(BlockDriverState *bs,
+    int64_t sector_num, const uint8_t *buf, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 
 const char *bdrv_get_encrypted_filename(BlockDriverState *bs);
@@ -241,11 +270,26 @@ int bdrv_img_create(const char *filename, const char *fmt,
 
 #define BDRV_SECTORS_PER_DIRTY_CHUNK 2048
 
-void bdrv_set_dirty_tracking(BlockDriverState *bs, int enable);
-int bdrv_get_dirty(BlockDriverState *bs, int64_t sector);
-void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
-                      int nr_sectors);
-int64_t bdrv_get_dirty_count(BlockDriverState *bs);
+typedef struct BdrvDirtyBitmap BdrvDirtyBitmap;
+
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          int granularity, const char *name);
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap);
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name);
+int bdrv_can_store_dirty_bitmaps(BlockDriverState *bs);
+int bdrv_dirty_bitmap_set_persistent(BlockDriverState *bs,
+                                     BdrvDirtyBitmap *bitmap, int persistent);
+int bdrv_get_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                   int64_t sector);
+int64_t bdrv_get_next_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                            int64_t sector);
+void bdrv_set_dirty_range(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                          int64_t cur_sector, int nr_sectors);
+void bdrv_reset_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                      int64_t cur_sector, int nr_sectors);
+void bdrv_clear_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap);
+int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap);
 
 void bdrv_set_in_use(BlockDriverState *bs, int in_use);
 int bdrv_in_use(BlockDriverState *bs);
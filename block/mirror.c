@@ -0,0 +1,626 @@
+/*
+ * Live block mirroring
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Mirroring copies a running image to a target image. All data to copy is
+ * marked in a dirty bitmap, which the guest's writes keep adding to, and the
+ * job copies dirty chunks with a bounded number of requests in flight until
+ * the bitmap is clean. From then on the job is ready: it keeps the target in
+ * sync until it is completed, which copies what is left with the guest's I/O
+ * stopped and switches the device over to the target.
+ *
+ * A backup is the same copy, except that it completes by itself once it has
+ * caught up and the device stays on its image. The target then holds the
+ * contents of the device at that point. An incremental backup only copies
+ * what is dirty in a named bitmap, which is cleared at that same point, so
+ * that the bitmap goes on with exactly what changed since the backup.
+ */
+
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "block_int.h"
+#include "blockjob.h"
+
+#define MIRROR_GRANULARITY      128     /* sectors per dirty bit, 64 KB */
+#define MIRROR_MAX_SECTORS      2048    /* largest copy request, 1 MB */
+#define MIRROR_MAX_IN_FLIGHT    16
+
+/* how often a ready job looks for new dirty chunks */
+#define MIRROR_POLL_NS          100000000LL
+
+typedef struct MirrorBlockJob {
+    BlockJob common;
+    BlockDriverState *target;
+    BdrvDirtyBitmap *bitmap;
+
+    /* chunks that are being copied must not be copied again meanwhile */
+    unsigned long *busy_bitmap;
+    int64_t nb_chunks;
+    int64_t cursor;
+
+    int in_flight;
+    int64_t in_flight_sectors;
+    int ret;
+    int should_complete;
+
+    /* a backup ends without switching over and clears sync_bitmap, if any */
+    int is_backup;
+    BdrvDirtyBitmap *sync_bitmap;
+} MirrorBlockJob;
+
+typedef struct MirrorOp {
+    MirrorBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    void *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} MirrorOp;
+
+static void mirror_iterate(MirrorBlockJob *s);
+
+static int mirror_chunk_busy(MirrorBlockJob *s, int64_t chunk)
+{
+    return !!(s->busy_bitmap[chunk / (sizeof(unsigned long) * 8)] &
+              (1UL << (chunk % (sizeof(unsigned long) * 8))));
+}
+
+static void mirror_set_busy(MirrorBlockJob *s, int64_t sector_num,
+                            int nb_sectors, int busy)
+{
+    int64_t chunk = sector_num / MIRROR_GRANULARITY;
+    int64_t end = (sector_num + nb_sectors - 1) / MIRROR_GRANULARITY;
+
+    for (; chunk <= end; chunk++) {
+        unsigned long bit = 1UL << (chunk % (sizeof(unsigned long) * 8));
+        if (busy) {
+            s->busy_bitmap[chunk / (sizeof(unsigned long) * 8)] |= bit;
+        } else {
+            s->busy_bitmap[chunk / (sizeof(unsigned long) * 8)] &= ~bit;
+        }
+    }
+}
+
+static int mirror_chunk_ready(MirrorBlockJob *s, int64_t chunk)
+{
+    return bdrv_get_dirty(s->common.bs, s->bitmap,
+                          chunk * MIRROR_GRANULARITY) &&
+           !mirror_chunk_busy(s, chunk);
+}
+
+static void mirror_update_progress(MirrorBlockJob *s)
+{
+    int64_t remaining;
+
+    remaining = bdrv_get_dirty_count(s->common.bs, s->bitmap) +
+                s->in_flight_sectors;
+    s->common.offset = MAX(s->common.len - remaining * BDRV_SECTOR_SIZE, 0);
+}
+
+/*
+ * Returns the first dirty chunk in [chunk, end) that isn't being copied yet,
+ * or -1 if there is none. Clean ranges are skipped by the bitmap; only busy
+ * chunks, of which there are few, are stepped over one by one.
+ */
+static int64_t mirror_find_ready(MirrorBlockJob *s, int64_t chunk,
+                                 int64_t end)
+{
+    int64_t sector_num;
+
+    while (chunk < end) {
+        sector_num = bdrv_get_next_dirty(s->common.bs, s->bitmap,
+                                         chunk * MIRROR_GRANULARITY);
+        if (sector_num < 0) {
+            return -1;
+        }
+        chunk = sector_num / MIRROR_GRANULARITY;
+        if (chunk >= end) {
+            return -1;
+        }
+        if (!mirror_chunk_busy(s, chunk)) {
+            return chunk;
+        }
+        chunk++;
+    }
+    return -1;
+}
+
+/*
+ * Finds the next run of dirty chunks that aren't being copied yet, starting
+ * at the cursor and wrapping around at the end of the image. Returns 0 if
+ * there is none.
+ */
+static int mirror_next_dirty(MirrorBlockJob *s, int64_t *sector_num,
+                             int *nb_sectors)
+{
+    int64_t total = s->common.len >> BDRV_SECTOR_BITS;
+    int64_t chunk, end;
+
+    if (bdrv_get_dirty_count(s->common.bs, s->bitmap) == 0) {
+        return 0;
+    }
+
+    chunk = mirror_find_ready(s, s->cursor, s->nb_chunks);
+    if (chunk < 0) {
+        chunk = mirror_find_ready(s, 0, s->cursor);
+    }
+    if (chunk < 0) {
+        return 0;
+    }
+
+    end = chunk + 1;
+    while (end < s->nb_chunks &&
+           end - chunk < MIRROR_MAX_SECTORS / MIRROR_GRANULARITY &&
+           mirror_chunk_ready(s, end)) {
+        end++;
+    }
+
+    s->cursor = end % s->nb_chunks;
+    *sector_num = chunk * MIRROR_GRANULARITY;
+    *nb_sectors = MIN(end * MIRROR_GRANULARITY, total) - *sector_num;
+    return 1;
+}
+
+static void mirror_op_done(MirrorOp *op, int ret)
+{
+    MirrorBlockJob *s = op->s;
+
+    if (ret < 0) {
+        bdrv_set_dirty_range(s->common.bs, s->bitmap, op->sector_num,
+                             op->nb_sectors);
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    }
+
+    mirror_set_busy(s, op->sector_num, op->nb_sectors, 0);
+    s->in_flight--;
+    s->in_flight_sectors -= op->nb_sectors;
+    mirror_update_progress(s);
+
+    qemu_vfree(op->buf);
+    qemu_free(op);
+
+    mirror_iterate(s);
+}
+
+static void mirror_write_cb(void *opaque, int ret)
+{
+    mirror_op_done(opaque, ret);
+}
+
+static void mirror_read_cb(void *opaque, int ret)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    BlockDriverAIOCB *acb;
+
+    if (ret < 0) {
+        mirror_op_done(op, ret);
+        return;
+    }
+
+    acb = bdrv_aio_writev(s->target, op->sector_num, &op->qiov,
+                          op->nb_sectors, mirror_write_cb, op);
+    if (acb == NULL) {
+        mirror_op_done(op, -EIO);
+    }
+}
+
+static int mirror_start_op(MirrorBlockJob *s, int64_t sector_num,
+                           int nb_sectors)
+{
+    BlockDriverState *bs = s->common.bs;
+    BlockDriverAIOCB *acb;
+    MirrorOp *op;
+
+    op = qemu_mallocz(sizeof(*op));
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->buf = qemu_blockalign(bs, nb_sectors * BDRV_SECTOR_SIZE);
+    op->iov.iov_base = op->buf;
+    op->iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&op->qiov, &op->iov, 1);
+
+    /* Guest writes from now on dirty the chunks again */
+    bdrv_reset_dirty(bs, s->bitmap, sector_num, nb_sectors);
+    mirror_set_busy(s, sector_num, nb_sectors, 1);
+    s->in_flight++;
+    s->in_flight_sectors += nb_sectors;
+
+    acb = bdrv_aio_readv(bs, sector_num, &op->qiov, nb_sectors,
+                         mirror_read_cb, op);
+    if (acb == NULL) {
+        bdrv_set_dirty_range(bs, s->bitmap, sector_num, nb_sectors);
+        mirror_set_busy(s, sector_num, nb_sectors, 0);
+        s->in_flight--;
+        s->in_flight_sectors -= nb_sectors;
+        qemu_vfree(op->buf);
+        qemu_free(op);
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Copies what is still dirty synchronously. Nothing else submits I/O to
+ * the image while this runs, so afterwards the target is an exact copy.
+ */
+static int mirror_sync_remaining(MirrorBlockJob *s)
+{
+    BlockDriverState *bs = s->common.bs;
+    int64_t total = s->common.len >> BDRV_SECTOR_BITS;
+    int64_t sector_num;
+    uint8_t *buf;
+    int n, ret = 0;
+
+    /* Guest writes mark the bitmap when they complete */
+    bdrv_drain_all();
+
+    buf = qemu_blockalign(bs, MIRROR_GRANULARITY * BDRV_SECTOR_SIZE);
+    for (sector_num = bdrv_get_next_dirty(bs, s->bitmap, 0);
+         sector_num >= 0 && sector_num < total;
+         sector_num = bdrv_get_next_dirty(bs, s->bitmap,
+                                          sector_num + MIRROR_GRANULARITY)) {
+        n = MIN(total - sector_num, MIRROR_GRANULARITY);
+        ret = bdrv_read(bs, sector_num, buf, n);
+        if (ret < 0) {
+            break;
+        }
+        ret = bdrv_write(s->target, sector_num, buf, n);
+        if (ret < 0) {
+            break;
+        }
+        bdrv_reset_dirty(bs, s->bitmap, sector_num, n);
+    }
+    qemu_vfree(buf);
+
+    if (ret == 0) {
+        ret = bdrv_flush(s->target);
+    }
+    return ret;
+}
+
+/*
+ * Reopens the device on the target image, which must be closed already. If
+ * that fails, the device goes back to the source, which is still up to
+ * date. If the source can't be reopened either, the device is left without
+ * medium and -ENOMEDIUM is returned.
+ *
+ * Named bitmaps stay with the device instead of being stored into the
+ * source. They replace bitmaps of the same name that the new image brings,
+ * and stop being persistent if it can't store them.
+ */
+static int mirror_pivot(BlockDriverState *bs, const char *filename,
+                        BlockDriver *drv)
+{
+    QLIST_HEAD(, BdrvDirtyBitmap) bitmaps = QLIST_HEAD_INITIALIZER(bitmaps);
+    BdrvDirtyBitmap *bitmap, *next, *old;
+    BlockDriver *old_drv = bs->drv;
+    char old_filename[1024];
+    int flags = bs->open_flags;
+    int ret, ret2;
+
+    pstrcpy(old_filename, sizeof(old_filename), bs->filename);
+
+    QLIST_FOREACH_SAFE(bitmap, &bs->dirty_bitmaps, list, next) {
+        if (bitmap->name) {
+            QLIST_REMOVE(bitmap, list);
+            QLIST_INSERT_HEAD(&bitmaps, bitmap, list);
+        }
+    }
+
+    bdrv_flush(bs);
+    bdrv_close(bs);
+    ret = bdrv_open(bs, filename, flags, drv);
+    if (ret < 0) {
+        error_report("Could not switch '%s' over to '%s': %s",
+                     bs->device_name, filename, strerror(-ret));
+        ret2 = bdrv_open(bs, old_filename, flags, old_drv);
+        if (ret2 < 0) {
+            error_report("Could not reopen '%s' on '%s' either: %s",
+                         bs->device_name, old_filename, strerror(-ret2));
+            ret = -ENOMEDIUM;
+        }
+    }
+
+    QLIST_FOREACH_SAFE(bitmap, &bitmaps, list, next) {
+        if (!bs->drv) {
+            bdrv_release_dirty_bitmap(bs, bitmap);
+            continue;
+        }
+
+        old = bdrv_find_dirty_bitmap(bs, bitmap->name);
+        if (old) {
+            bdrv_release_dirty_bitmap(bs, old);
+        }
+        QLIST_REMOVE(bitmap, list);
+        QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+
+        if (bitmap->persistent &&
+            bdrv_dirty_bitmap_set_persistent(bs, bitmap, 1) < 0) {
+            error_report("'%s' can't store dirty bitmap '%s', it is no "
+                         "longer persistent", bs->filename, bitmap->name);
+            bitmap->persistent = 0;
+        }
+    }
+    return ret;
+}
+
+static void mirror_finish(MirrorBlockJob *s)
+{
+    BlockDriverState *bs = s->common.bs;
+    int ret = s->ret;
+
+    if (block_job_is_cancelled(&s->common)) {
+        ret = -ECANCELED;
+    } else if (ret == 0 && s->should_complete) {
+        ret = mirror_sync_remaining(s);
+
+        /* The guest hasn't written since the target was brought in sync */
+        if (ret == 0 && s->sync_bitmap) {
+            bdrv_clear_dirty_bitmap(bs, s->sync_bitmap);
+        }
+    }
+
+    bdrv_release_dirty_bitmap(bs, s->bitmap);
+    qemu_free(s->busy_bitmap);
+
+    if (ret == 0 && s->should_complete && !s->is_backup) {
+        char filename[1024];
+        BlockDriver *drv = s->target->drv;
+
+        /* Close the target first, the device is about to open it */
+        pstrcpy(filename, sizeof(filename), s->target->filename);
+        bdrv_delete(s->target);
+        ret = mirror_pivot(bs, filename, drv);
+    } else {
+        bdrv_delete(s->target);
+    }
+
+    block_job_completed(&s->common, ret);
+}
+
+static void mirror_resume(BlockJob *job)
+{
+    mirror_iterate(DO_UPCAST(MirrorBlockJob, common, job));
+}
+
+static void mirror_finish_resume(BlockJob *job)
+{
+    mirror_finish(DO_UPCAST(MirrorBlockJob, common, job));
+}
+
+static void mirror_iterate(MirrorBlockJob *s)
+{
+    int64_t sector_num, delay;
+    int nb_sectors;
+
+    while (s->ret == 0 && !block_job_is_cancelled(&s->common) &&
+           s->in_flight < MIRROR_MAX_IN_FLIGHT &&
+           mirror_next_dirty(s, &sector_num, &nb_sectors)) {
+
+        delay = block_job_ratelimit(&s->common,
+                                    nb_sectors * BDRV_SECTOR_SIZE);
+        if (delay > 0) {
+            /* Put the chunk back in line, completions call us again */
+            s->cursor = sector_num / MIRROR_GRANULARITY;
+            if (s->in_flight == 0) {
+                block_job_sleep(&s->common, delay, mirror_resume);
+            }
+            return;
+        }
+
+        if (mirror_start_op(s, sector_num, nb_sectors) < 0) {
+            s->ret = -EIO;
+        }
+    }
+
+    if (s->in_flight > 0) {
+        return;
+    }
+
+    /*
+     * Nothing in flight and, unless we stop, nothing dirty either. We may
+     * be in the completion of the last copy, and finishing drains all
+     * requests and closes the target, so it runs from the main loop.
+     */
+    if (s->ret < 0 || block_job_is_cancelled(&s->common)) {
+        block_job_sleep(&s->common, 0, mirror_finish_resume);
+        return;
+    }
+
+    if (s->is_backup) {
+        s->should_complete = 1;
+    } else if (!s->common.ready) {
+        block_job_ready(&s->common);
+    }
+    if (s->should_complete) {
+        block_job_sleep(&s->common, 0, mirror_finish_resume);
+        return;
+    }
+    block_job_sleep(&s->common, MIRROR_POLL_NS, mirror_resume);
+}
+
+static int mirror_complete(BlockJob *job)
+{
+    MirrorBlockJob *s = DO_UPCAST(MirrorBlockJob, common, job);
+
+    s->should_complete = 1;
+    return 0;
+}
+
+static const BlockJobType mirror_job_type = {
+    .instance_size = sizeof(MirrorBlockJob),
+    .job_type      = "mirror",
+    .complete      = mirror_complete,
+};
+
+static const BlockJobType backup_job_type = {
+    .instance_size = sizeof(MirrorBlockJob),
+    .job_type      = "backup",
+};
+
+/* Marks everything the target doesn't have yet in the bitmap */
+static void mirror_mark_initial(MirrorBlockJob *s, MirrorSyncMode mode,
+                                int target_zeroed)
+{
+    BlockDriverState *bs = s->common.bs;
+    int64_t total = s->common.len >> BDRV_SECTOR_BITS;
+    int64_t sector_num;
+    int n, allocated;
+
+    for (sector_num = 0; sector_num < total; sector_num += n) {
+        n = MIN(total - sector_num, INT_MAX / BDRV_SECTOR_SIZE);
+        if (mode == MIRROR_SYNC_TOP) {
+            allocated = bdrv_is_allocated(bs, sector_num, n, &n);
+        } else if (target_zeroed) {
+            allocated = bdrv_is_allocated_above(bs, NULL, sector_num, n, &n);
+        } else {
+            allocated = 1;
+        }
+
+        if (n <= 0) {
+            break;
+        }
+        if (allocated) {
+            bdrv_set_dirty_range(bs, s->bitmap, sector_num, n);
+        }
+    }
+}
+
+static int mirror_create(const BlockJobType *job_type, BlockDriverState *bs,
+                         BlockDriverState *target, int64_t len, int64_t speed,
+                         BlockDriverCompletionFunc *cb, void *opaque,
+                         MirrorBlockJob **ps)
+{
+    MirrorBlockJob *s;
+    BdrvDirtyBitmap *bitmap;
+    int64_t bitmap_size;
+
+    /* A job can't be dropped without completing it, so this comes first */
+    bitmap = bdrv_create_dirty_bitmap(bs, MIRROR_GRANULARITY, NULL);
+    if (bitmap == NULL) {
+        return -EIO;
+    }
+
+    s = block_job_create(job_type, bs, cb, opaque);
+    if (s == NULL) {
+        bdrv_release_dirty_bitmap(bs, bitmap);
+        return -EBUSY;
+    }
+
+    s->target = target;
+    s->common.len = len;
+    s->common.speed = speed;
+
+    s->bitmap = bitmap;
+    s->nb_chunks = ((len >> BDRV_SECTOR_BITS) + MIRROR_GRANULARITY - 1) /
+                   MIRROR_GRANULARITY;
+    bitmap_size = (s->nb_chunks + sizeof(unsigned long) * 8 - 1) /
+                  (sizeof(unsigned long) * 8);
+    s->busy_bitmap = qemu_mallocz(MAX(bitmap_size, 1) * sizeof(unsigned long));
+    *ps = s;
+    return 0;
+}
+
+/*
+ * Starts mirroring bs to target, which the job takes over. With
+ * MIRROR_SYNC_TOP, only the data of bs itself is copied and target must
+ * have the same backing file. target_zeroed tells that target reads as
+ * zeroes, so that unallocated ranges needn't be copied. Returns -EBUSY if
+ * bs is in use.
+ */
+int mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                 MirrorSyncMode mode, int target_zeroed, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    MirrorBlockJob *s;
+    int64_t len;
+    int ret;
+
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        return len;
+    }
+
+    ret = mirror_create(&mirror_job_type, bs, target, len, speed, cb, opaque,
+                        &s);
+    if (ret < 0) {
+        return ret;
+    }
+
+    mirror_mark_initial(s, mode, target_zeroed);
+    mirror_update_progress(s);
+
+    /* Run from the main loop, so that cb is never called before we return */
+    block_job_sleep(&s->common, 0, mirror_resume);
+    return 0;
+}
+
+/*
+ * Starts backing bs up to target, which the job takes over. With
+ * BACKUP_SYNC_INCREMENTAL, only the chunks that are dirty in bitmap are
+ * copied. If a bitmap is given, it is cleared when the backup succeeds.
+ * target_zeroed is as for mirror_start(). Returns -EBUSY if bs is in use.
+ */
+int backup_start(BlockDriverState *bs, BlockDriverState *target,
+                 BackupSyncMode mode, BdrvDirtyBitmap *bitmap,
+                 int target_zeroed, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    MirrorBlockJob *s;
+    int64_t len, sector_num;
+    int ret;
+
+    assert(bitmap || mode != BACKUP_SYNC_INCREMENTAL);
+
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        return len;
+    }
+
+    ret = mirror_create(&backup_job_type, bs, target, len, speed, cb, opaque,
+                        &s);
+    if (ret < 0) {
+        return ret;
+    }
+    s->is_backup = 1;
+    s->sync_bitmap = bitmap;
+
+    if (mode == BACKUP_SYNC_INCREMENTAL) {
+        for (sector_num = bdrv_get_next_dirty(bs, bitmap, 0);
+             sector_num >= 0;
+             sector_num = bdrv_get_next_dirty(bs, bitmap, sector_num +
+                                              bitmap->granularity)) {
+            bdrv_set_dirty_range(bs, s->bitmap, sector_num,
+                                 bitmap->granularity);
+        }
+    } else {
+        mirror_mark_initial(s, MIRROR_SYNC_FULL, target_zeroed);
+    }
+    mirror_update_progress(s);
+
+    block_job_sleep(&s->common, 0, mirror_resume);
+    return 0;
+}
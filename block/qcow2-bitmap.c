@@ -0,0 +1,394 @@
+/*
+ * Dirty bitmaps stored in QCOW version 2 images
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * Persistent dirty bitmaps are listed in a header extension, which gives
+ * the name, granularity and image size of each bitmap and points to its
+ * data in clusters of its own. While the image is open read-write, the
+ * bitmaps only live in memory and the extension is removed from the header:
+ * they are written back on close, so that after a crash no bitmap claims
+ * that data is clean which was written after it was stored.
+ *
+ * The extension is only valid with the bitmaps auto-clear feature bit set.
+ * Writers that don't know about the bitmaps clear the bit when they open
+ * the image, which invalidates bitmaps that miss their writes. The bit needs
+ * a version 3 header.
+ */
+
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+typedef struct __attribute__((packed)) QCowDirtyBitmapHeader {
+    /* header is 8 byte aligned */
+    uint64_t data_offset;
+    uint64_t nb_sectors;
+    uint32_t granularity;
+    uint16_t name_size;
+    uint16_t reserved;
+    /* name follows */
+} QCowDirtyBitmapHeader;
+
+/* in sectors, the same limit of 1 GB as for block_dirty_bitmap_add */
+#define QCOW2_MAX_BITMAP_GRANULARITY    (1 << (30 - BDRV_SECTOR_BITS))
+
+static void qcow2_free_dirty_bitmap_list(QCowDirtyBitmap *list, int nb)
+{
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        qemu_free(list[i].name);
+    }
+    qemu_free(list);
+}
+
+void qcow2_free_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    qcow2_free_dirty_bitmap_list(s->dirty_bitmaps, s->nb_dirty_bitmaps);
+    s->dirty_bitmaps = NULL;
+    s->nb_dirty_bitmaps = 0;
+}
+
+/* Size of the data of a bitmap: one bit per chunk, in 64 bit words */
+uint64_t qcow2_dirty_bitmap_data_size(QCowDirtyBitmap *bm)
+{
+    uint64_t bits;
+
+    bits = (bm->nb_sectors + bm->granularity - 1) / bm->granularity;
+    return (bits + 63) / 64 * sizeof(uint64_t);
+}
+
+/* Reads the bitmap directory from the header extension at offset */
+int qcow2_read_dirty_bitmap_ext(BlockDriverState *bs, uint64_t offset,
+                                uint32_t len)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowDirtyBitmapHeader h;
+    QCowDirtyBitmap *bm;
+    uint8_t *buf;
+    size_t pos, name_size;
+    int ret;
+
+    buf = qemu_malloc(len);
+    ret = bdrv_pread(bs->file, offset, buf, len);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    qcow2_free_dirty_bitmaps(bs);
+    for (pos = 0; pos < len; pos = align_offset(pos + name_size, 8)) {
+        if (len - pos < sizeof(h)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        memcpy(&h, buf + pos, sizeof(h));
+        pos += sizeof(h);
+
+        name_size = be16_to_cpu(h.name_size);
+        if (len - pos < name_size) {
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        s->dirty_bitmaps = qemu_realloc(s->dirty_bitmaps,
+            (s->nb_dirty_bitmaps + 1) * sizeof(QCowDirtyBitmap));
+        bm = &s->dirty_bitmaps[s->nb_dirty_bitmaps++];
+        bm->data_offset = be64_to_cpu(h.data_offset);
+        bm->nb_sectors = be64_to_cpu(h.nb_sectors);
+        bm->granularity = be32_to_cpu(h.granularity);
+        bm->name = qemu_malloc(name_size + 1);
+        memcpy(bm->name, buf + pos, name_size);
+        bm->name[name_size] = '\0';
+    }
+
+    qemu_free(buf);
+    return 0;
+
+fail:
+    qcow2_free_dirty_bitmaps(bs);
+    qemu_free(buf);
+    return ret;
+}
+
+/* Size of the header extension data for the current bitmap directory */
+size_t qcow2_dirty_bitmap_ext_size(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < s->nb_dirty_bitmaps; i++) {
+        size = align_offset(size + sizeof(QCowDirtyBitmapHeader) +
+                            strlen(s->dirty_bitmaps[i].name), 8);
+    }
+    return size;
+}
+
+void qcow2_write_dirty_bitmap_ext(BlockDriverState *bs, uint8_t *buf)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowDirtyBitmapHeader h;
+    QCowDirtyBitmap *bm;
+    size_t pos = 0, name_size;
+    int i;
+
+    for (i = 0; i < s->nb_dirty_bitmaps; i++) {
+        bm = &s->dirty_bitmaps[i];
+        name_size = strlen(bm->name);
+
+        memset(&h, 0, sizeof(h));
+        h.data_offset = cpu_to_be64(bm->data_offset);
+        h.nb_sectors = cpu_to_be64(bm->nb_sectors);
+        h.granularity = cpu_to_be32(bm->granularity);
+        h.name_size = cpu_to_be16(name_size);
+
+        memcpy(buf + pos, &h, sizeof(h));
+        pos += sizeof(h);
+        memcpy(buf + pos, bm->name, name_size);
+        pos += name_size;
+
+        memset(buf + pos, 0, align_offset(pos, 8) - pos);
+        pos = align_offset(pos, 8);
+    }
+}
+
+static void qcow2_free_dirty_bitmap_data(BlockDriverState *bs,
+                                         QCowDirtyBitmap *list, int nb)
+{
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        if (list[i].data_offset) {
+            qcow2_free_clusters(bs, list[i].data_offset,
+                                qcow2_dirty_bitmap_data_size(&list[i]));
+        }
+    }
+}
+
+static int qcow2_load_dirty_bitmap(BlockDriverState *bs, QCowDirtyBitmap *bm)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    int64_t file_size;
+    uint64_t size;
+    uint8_t *buf;
+    int ret;
+
+    if (bm->nb_sectors != bs->total_sectors || bm->granularity == 0 ||
+        bm->granularity > QCOW2_MAX_BITMAP_GRANULARITY ||
+        (bm->granularity & (bm->granularity - 1)) ||
+        (bm->data_offset & (s->cluster_size - 1))) {
+        return -EINVAL;
+    }
+    if (strlen(bm->name) == 0 || bdrv_find_dirty_bitmap(bs, bm->name)) {
+        return -EINVAL;
+    }
+
+    /* The data must be in the image, its clusters are freed after loading */
+    if (bm->data_offset) {
+        file_size = bdrv_getlength(bs->file);
+        if (file_size < 0) {
+            return file_size;
+        }
+        size = qcow2_dirty_bitmap_data_size(bm);
+        if (bm->data_offset > file_size || size > file_size - bm->data_offset) {
+            return -EINVAL;
+        }
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, bm->granularity, bm->name);
+    if (bitmap == NULL) {
+        return -EIO;
+    }
+    bitmap->persistent = 1;
+
+    if (bm->data_offset == 0) {
+        return 0;
+    }
+
+    size = qcow2_dirty_bitmap_data_size(bm);
+    assert(size == hbitmap_serialized_size(bitmap->bitmap));
+    buf = qemu_malloc(size);
+    ret = bdrv_pread(bs->file, bm->data_offset, buf, size);
+    if (ret < 0) {
+        bdrv_release_dirty_bitmap(bs, bitmap);
+        qemu_free(buf);
+        return ret;
+    }
+    hbitmap_deserialize(bitmap->bitmap, buf);
+    qemu_free(buf);
+    return 0;
+}
+
+/*
+ * Creates the bitmaps listed in the header. On a writable image, they are
+ * then removed from the header until the image is closed, and the clusters
+ * of the bitmaps that were loaded are freed. Those of a broken entry may
+ * not be the bitmap's, so they are leaked rather than freed.
+ */
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowDirtyBitmap *list;
+    int i, nb, ret;
+
+    for (i = 0; i < s->nb_dirty_bitmaps; i++) {
+        ret = qcow2_load_dirty_bitmap(bs, &s->dirty_bitmaps[i]);
+        if (ret < 0) {
+            error_report("Dropping dirty bitmap '%s' of '%s': %s",
+                         s->dirty_bitmaps[i].name, bs->filename,
+                         strerror(-ret));
+            s->dirty_bitmaps[i].data_offset = 0;
+        }
+    }
+
+    if (bs->read_only || s->nb_dirty_bitmaps == 0) {
+        return 0;
+    }
+
+    list = s->dirty_bitmaps;
+    nb = s->nb_dirty_bitmaps;
+    s->dirty_bitmaps = NULL;
+    s->nb_dirty_bitmaps = 0;
+
+    ret = qcow2_update_ext_header(bs,
+        bs->backing_file[0] ? bs->backing_file : NULL,
+        bs->backing_format[0] ? bs->backing_format : NULL);
+    if (ret < 0) {
+        s->dirty_bitmaps = list;
+        s->nb_dirty_bitmaps = nb;
+        return ret;
+    }
+
+    qcow2_free_dirty_bitmap_data(bs, list, nb);
+    qcow2_free_dirty_bitmap_list(list, nb);
+    return 0;
+}
+
+int qcow2_can_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return s->qcow_version >= QCOW_VERSION_FEATURES;
+}
+
+/*
+ * Writes the persistent bitmaps to new clusters and lists them in the
+ * header. The data has to be on disk before the header points to it.
+ */
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    QCowDirtyBitmap *list, *old_list, *bm;
+    int64_t offset;
+    uint64_t size;
+    uint8_t *buf;
+    int i, nb = 0, old_nb, ret;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (bitmap->persistent) {
+            nb++;
+        }
+    }
+    if (nb == 0 && s->nb_dirty_bitmaps == 0) {
+        return 0;
+    }
+    if (!qcow2_can_store_dirty_bitmaps(bs)) {
+        return -ENOTSUP;
+    }
+
+    list = qemu_mallocz(MAX(nb, 1) * sizeof(QCowDirtyBitmap));
+    i = 0;
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!bitmap->persistent) {
+            continue;
+        }
+        bm = &list[i++];
+        bm->name = qemu_strdup(bitmap->name);
+        bm->nb_sectors = bs->total_sectors;
+        bm->granularity = bitmap->granularity;
+
+        /* A clean bitmap needs no data */
+        if (hbitmap_count(bitmap->bitmap) == 0) {
+            continue;
+        }
+
+        size = hbitmap_serialized_size(bitmap->bitmap);
+        offset = qcow2_alloc_clusters(bs, size);
+        if (offset < 0) {
+            ret = offset;
+            goto fail;
+        }
+        bm->data_offset = offset;
+
+        buf = qemu_malloc(size);
+        hbitmap_serialize(bitmap->bitmap, buf);
+        ret = bdrv_pwrite(bs->file, offset, buf, size);
+        qemu_free(buf);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    old_list = s->dirty_bitmaps;
+    old_nb = s->nb_dirty_bitmaps;
+    s->dirty_bitmaps = list;
+    s->nb_dirty_bitmaps = nb;
+
+    ret = qcow2_update_ext_header(bs,
+        bs->backing_file[0] ? bs->backing_file : NULL,
+        bs->backing_format[0] ? bs->backing_format : NULL);
+    if (ret < 0) {
+        s->dirty_bitmaps = old_list;
+        s->nb_dirty_bitmaps = old_nb;
+        goto fail;
+    }
+
+    qcow2_free_dirty_bitmap_data(bs, old_list, old_nb);
+    qcow2_free_dirty_bitmap_list(old_list, old_nb);
+
+    /* Only now the extension is valid, a crash before just leaks clusters */
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+        return qcow2_write_autoclear_features(bs,
+            s->autoclear_features | QCOW2_AUTOCLEAR_BITMAPS);
+    }
+    return 0;
+
+fail:
+    qcow2_free_dirty_bitmap_data(bs, list, nb);
+    qcow2_free_dirty_bitmap_list(list, nb);
+    return ret;
+}
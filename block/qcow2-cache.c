@@ -26,12 +26,63 @@
 #include "qemu-common.h"
 #include "qcow2.h"
 
+/*
+ * Besides the synchronous qcow2_cache_get(), tables can be brought into
+ * the cache with qcow2_cache_load_async(), which does not block: the
+ * caller's callback runs once the table is there, and the request goes on
+ * with a synchronous get that then hits.
+ *
+ * Loads read into a bounce buffer and hold a reference on their entry
+ * until they complete. A synchronous get finding the entry still loading
+ * reads the table itself, the bounce buffer is then dropped.
+ *
+ * The synchronous functions are called from AIO callbacks and must never
+ * wait for other requests. Loads leave a quarter of the cache to them, and
+ * if they still find every entry taken, they take over one that only a load
+ * holds. That load then completes without filling the cache.
+ *
+ * Dirty tables are written back synchronously when evicted or flushed.
+ *
+ * Cached tables are found through a hash over their offsets, chained
+ * through the entries, and all live in one buffer so that the entry of a
+ * table handed out is found from its address. Victims are picked with the
+ * CLOCK algorithm: a hit sets the referenced bit of an entry, the hand
+ * clears it when passing by and evicts the first unreferenced entry that
+ * no one holds.
+ */
+
+typedef struct Qcow2CacheWaiter {
+    BlockDriverCompletionFunc       *cb;
+    void                            *opaque;
+    QLIST_ENTRY(Qcow2CacheWaiter)   next;
+} Qcow2CacheWaiter;
+
+typedef struct Qcow2CacheAIO {
+    BlockDriverState                *bs;
+    Qcow2Cache                      *c;
+    int                             index; /* entry being loaded, or -1 */
+    int64_t                         offset;
+    void                            *buf;
+    struct iovec                    iov;
+    QEMUIOVector                    qiov;
+    QLIST_HEAD(, Qcow2CacheWaiter)  waiters;
+    QLIST_ENTRY(Qcow2CacheAIO)      next;
+} Qcow2CacheAIO;
+
+typedef struct Qcow2CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+} Qcow2CacheStats;
+
 typedef struct Qcow2CachedTable {
     void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    loading;
+    bool    prefetched;     /* loaded for the next lookup, counted already */
+    bool    referenced;
     int     ref;
+    int     hash_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,6 +91,15 @@ struct Qcow2Cache {
     int                     size;
     bool                    depends_on_flush;
     bool                    writethrough;
+    QLIST_HEAD(, Qcow2CacheAIO) loads;
+    int                     nb_loads;
+
+    void*                   table_array;
+    int                     table_bits;
+    int*                    buckets;
+    int                     nb_buckets;
+    int                     clock_hand;
+    Qcow2CacheStats*        stats;  /* from the first qcow2_cache_get_stats() */
 };
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
@@ -53,29 +113,156 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c->size = num_tables;
     c->entries = qemu_mallocz(sizeof(*c->entries) * num_tables);
     c->writethrough = writethrough;
+    QLIST_INIT(&c->loads);
+
+    c->table_bits = s->cluster_bits;
+    c->table_array = qemu_blockalign(bs,
+        (size_t) num_tables << c->table_bits);
+
+    c->nb_buckets = 1;
+    while (c->nb_buckets < num_tables) {
+        c->nb_buckets <<= 1;
+    }
+    c->buckets = qemu_malloc(sizeof(*c->buckets) * c->nb_buckets);
+    for (i = 0; i < c->nb_buckets; i++) {
+        c->buckets[i] = -1;
+    }
 
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].table = (uint8_t *) c->table_array +
+            ((size_t) i << c->table_bits);
+        c->entries[i].hash_next = -1;
     }
 
     return c;
 }
 
+static int qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset >> c->table_bits) & (c->nb_buckets - 1);
+}
+
+/* Returns the index of the entry caching offset, or -1 */
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_bucket(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Moves entry i to another offset, 0 leaves the entry unused */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, int64_t offset)
+{
+    int *p;
+
+    if (c->entries[i].offset) {
+        p = &c->buckets[qcow2_cache_bucket(c, c->entries[i].offset)];
+        while (*p != i) {
+            p = &c->entries[*p].hash_next;
+        }
+        *p = c->entries[i].hash_next;
+        c->entries[i].hash_next = -1;
+    }
+
+    c->entries[i].offset = offset;
+    if (offset) {
+        p = &c->buckets[qcow2_cache_bucket(c, offset)];
+        c->entries[i].hash_next = *p;
+        *p = i;
+    }
+}
+
+/* Returns the index of the entry holding table */
+static int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t diff = (uint8_t *) table - (uint8_t *) c->table_array;
+
+    assert(diff >= 0 && (diff >> c->table_bits) < c->size);
+    assert((diff & ((1 << c->table_bits) - 1)) == 0);
+    return diff >> c->table_bits;
+}
+
+/*
+ * Lookups are only counted once someone asked for the counters, the first
+ * call returns zeroes.
+ */
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    if (!c->stats) {
+        c->stats = qemu_mallocz(sizeof(*c->stats));
+    }
+    *hits = c->stats->hits;
+    *misses = c->stats->misses;
+}
+
+static void qcow2_cache_count(Qcow2Cache *c, bool hit)
+{
+    if (c->stats) {
+        if (hit) {
+            c->stats->hits++;
+        } else {
+            c->stats->misses++;
+        }
+    }
+}
+
+static void qcow2_cache_wait_loads(Qcow2Cache *c)
+{
+    while (!QLIST_EMPTY(&c->loads)) {
+        qemu_aio_wait();
+    }
+}
+
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 {
     int i;
 
+    qcow2_cache_wait_loads(c);
+
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    qemu_free(c->buckets);
     qemu_free(c->entries);
+    qemu_free(c->stats);
     qemu_free(c);
 
     return 0;
 }
 
+static Qcow2CacheAIO *qcow2_cache_aio_new(BlockDriverState *bs,
+    Qcow2Cache *c, int64_t offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CacheAIO *aio;
+
+    aio = qemu_mallocz(sizeof(*aio));
+    aio->bs = bs;
+    aio->c = c;
+    aio->index = -1;
+    aio->offset = offset;
+    aio->buf = qemu_blockalign(bs, s->cluster_size);
+    aio->iov.iov_base = aio->buf;
+    aio->iov.iov_len = s->cluster_size;
+    qemu_iovec_init_external(&aio->qiov, &aio->iov, 1);
+    QLIST_INIT(&aio->waiters);
+    return aio;
+}
+
+static void qcow2_cache_aio_free(Qcow2CacheAIO *aio)
+{
+    qemu_vfree(aio->buf);
+    qemu_free(aio);
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -130,7 +317,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     return 0;
 }
 
-int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+/* Writes all dirty tables back, without flushing bs->file */
+int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c)
 {
     int result = 0;
     int ret;
@@ -143,6 +331,16 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
         }
     }
 
+    return result;
+}
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int result;
+    int ret;
+
+    result = qcow2_cache_write(bs, c);
+
     if (result == 0) {
         ret = bdrv_flush(bs->file);
         if (ret < 0) {
@@ -181,34 +379,64 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
+/*
+ * Switches writethrough mode, returning the previous setting. Tables dirtied
+ * while it is off stay in the cache until qcow2_cache_write() or a flush.
+ */
+bool qcow2_cache_set_writethrough(Qcow2Cache *c, bool enable)
+{
+    bool old = c->writethrough;
+
+    c->writethrough = enable;
+    return old;
+}
+
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    Qcow2CachedTable *e;
+    int n, i;
 
+    /* Two rounds: the first may only clear referenced bits */
+    for (n = 0; n < 2 * c->size; n++) {
+        i = c->clock_hand;
+        c->clock_hand = (i + 1) % c->size;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
+        e = &c->entries[i];
+        if (e->ref) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+        if (e->offset && e->referenced) {
+            e->referenced = false;
+            continue;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+        return i;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    /* -1 if every entry is in use, asynchronous loads may run into this */
+    return -1;
+}
+
+/* Takes an entry over from a load that is the only one holding it */
+static int qcow2_cache_steal_load(Qcow2Cache *c)
+{
+    Qcow2CacheAIO *aio;
+
+    QLIST_FOREACH(aio, &c->loads, next) {
+        if (aio->index >= 0 && c->entries[aio->index].loading &&
+            c->entries[aio->index].ref == 1) {
+            int i = aio->index;
+
+            aio->index = -1;
+            c->nb_loads--;
+            c->entries[i].loading = false;
+            c->entries[i].prefetched = false;
+            c->entries[i].ref--;
+            qcow2_cache_set_offset(c, i, 0);
+            return i;
+        }
     }
-    return min_index;
+
+    return -1;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -219,24 +447,36 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     int ret;
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        if (c->entries[i].loading && read_from_disk) {
+            /* Don't wait for the load, its data is dropped */
+            ret = bdrv_pread(bs->file, offset, c->entries[i].table,
+                s->cluster_size);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (!c->entries[i].prefetched) {
+            qcow2_cache_count(c, true);
         }
+        c->entries[i].loading = false;
+        c->entries[i].prefetched = false;
+        goto found;
     }
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
     if (i < 0) {
-        return i;
+        i = qcow2_cache_steal_load(c);
     }
+    assert(i >= 0);
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
         return ret;
     }
 
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -246,16 +486,15 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         if (ret < 0) {
             return ret;
         }
+        qcow2_cache_count(c, false);
     }
+    c->entries[i].prefetched = false;
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    c->entries[i].referenced = true;
     c->entries[i].ref++;
     *table = c->entries[i].table;
     return 0;
@@ -273,18 +512,122 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
-int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+static void qcow2_cache_load_cb(void *opaque, int ret)
+{
+    Qcow2CacheAIO *aio = opaque;
+    Qcow2Cache *c = aio->c;
+    BDRVQcowState *s = aio->bs->opaque;
+    Qcow2CacheWaiter *w, *next;
+
+    /* The waiters look the table up again if the entry was taken over */
+    if (aio->index >= 0) {
+        Qcow2CachedTable *e = &c->entries[aio->index];
+
+        if (e->loading) {
+            if (ret < 0) {
+                qcow2_cache_set_offset(c, aio->index, 0);
+            } else {
+                memcpy(e->table, aio->buf, s->cluster_size);
+            }
+            e->loading = false;
+        }
+        e->ref--;
+        c->nb_loads--;
+    }
+    QLIST_REMOVE(aio, next);
+
+    QLIST_FOREACH_SAFE(w, &aio->waiters, next, next) {
+        w->cb(w->opaque, ret < 0 ? ret : 0);
+        qemu_free(w);
+    }
+    qcow2_cache_aio_free(aio);
+}
+
+static void qcow2_cache_add_waiter(Qcow2CacheAIO *aio,
+    BlockDriverCompletionFunc *cb, void *opaque)
 {
+    Qcow2CacheWaiter *w = qemu_mallocz(sizeof(*w));
+
+    w->cb = cb;
+    w->opaque = opaque;
+    QLIST_INSERT_HEAD(&aio->waiters, w, next);
+}
+
+/*
+ * Starts loading the table at offset into the cache without blocking.
+ *
+ * Returns 0 if the table is cached already, or is to be fetched by the
+ * synchronous path because too many loads are in flight. Returns
+ * -EINPROGRESS if cb will be called once the load completed, with the
+ * load's status.
+ */
+int qcow2_cache_load_async(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CacheAIO *aio;
+    BlockDriverAIOCB *acb;
     int i;
+    int ret;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        if (!c->entries[i].loading) {
+            return 0;
+        }
+        QLIST_FOREACH(aio, &c->loads, next) {
+            if (aio->index == i) {
+                qcow2_cache_add_waiter(aio, cb, opaque);
+                return -EINPROGRESS;
+            }
         }
+        abort();
     }
-    return -ENOENT;
 
-found:
+    if (c->nb_loads >= c->size - MAX(c->size / 4, 1)) {
+        return 0;
+    }
+
+    i = qcow2_cache_find_entry_to_replace(c);
+    assert(i >= 0);
+
+    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qcow2_cache_set_offset(c, i, 0);
+
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    }
+
+    aio = qcow2_cache_aio_new(bs, c, offset);
+    aio->index = i;
+    acb = bdrv_aio_readv(bs->file, offset >> BDRV_SECTOR_BITS, &aio->qiov,
+        s->cluster_sectors, qcow2_cache_load_cb, aio);
+    if (acb == NULL) {
+        qcow2_cache_aio_free(aio);
+        return -EIO;
+    }
+
+    qcow2_cache_count(c, false);
+    qcow2_cache_set_offset(c, i, offset);
+    c->entries[i].referenced = true;
+    c->entries[i].loading = true;
+    c->entries[i].prefetched = true;
+    c->entries[i].ref++;
+    qcow2_cache_add_waiter(aio, cb, opaque);
+    QLIST_INSERT_HEAD(&c->loads, aio, next);
+    c->nb_loads++;
+
+    return -EINPROGRESS;
+}
+
+int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+{
+    int i = qcow2_cache_table_index(c, *table);
+
     c->entries[i].ref--;
     *table = NULL;
 
@@ -299,16 +642,5 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
-    c->entries[i].dirty = true;
+    c->entries[qcow2_cache_table_index(c, table)].dirty = true;
 }
-
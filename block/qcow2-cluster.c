@@ -22,7 +22,6 @@
  * THE SOFTWARE.
  */
 
-#include <zlib.h>
 
 #include "qemu-common.h"
 #include "block_int.h"
@@ -123,6 +122,33 @@ static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
     return ret;
 }
 
+/*
+ * Starts loading the L2 table that maps offset into the cache, without
+ * waiting for it. Returns 0 if there is nothing to load (the table is cached
+ * or not allocated), -EINPROGRESS if cb will be called once it is loaded,
+ * or -errno.
+ */
+int qcow2_prefetch_l2(BlockDriverState *bs, uint64_t offset,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    unsigned int l1_index;
+    uint64_t l2_offset;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index] & ~QCOW_OFLAG_COPIED;
+    if (!l2_offset) {
+        return 0;
+    }
+
+    return qcow2_cache_load_async(bs, s->l2_table_cache, l2_offset, cb,
+        opaque);
+}
+
 /*
  * Writes one sector of the L1 table to the disk (can't update single entries
  * and we really don't want bdrv_pread to perform a read-modify-write)
@@ -614,22 +640,27 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 
     old_cluster = qemu_malloc(m->nb_clusters * sizeof(uint64_t));
 
-    /* copy content of unmodified sectors */
+    /* copy content of unmodified sectors, unless the AIO path did */
     start_sect = (m->offset & ~(s->cluster_size - 1)) >> 9;
     if (m->n_start) {
         cow = true;
-        ret = copy_sectors(bs, start_sect, cluster_offset, 0, m->n_start);
-        if (ret < 0)
-            goto err;
+        if (!m->cow_done) {
+            ret = copy_sectors(bs, start_sect, cluster_offset, 0, m->n_start);
+            if (ret < 0)
+                goto err;
+        }
     }
 
     if (m->nb_available & (s->cluster_sectors - 1)) {
         uint64_t end = m->nb_available & ~(uint64_t)(s->cluster_sectors - 1);
         cow = true;
-        ret = copy_sectors(bs, start_sect + end, cluster_offset + (end << 9),
-                m->nb_available - end, s->cluster_sectors);
-        if (ret < 0)
-            goto err;
+        if (!m->cow_done) {
+            ret = copy_sectors(bs, start_sect + end,
+                cluster_offset + (end << 9), m->nb_available - end,
+                s->cluster_sectors);
+            if (ret < 0)
+                goto err;
+        }
     }
 
     /*
@@ -637,13 +668,17 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      *
      * Before we update the L2 table to actually point to the new cluster, we
      * need to be sure that the refcounts have been increased and COW was
-     * handled.
+     * handled. With lazy refcounts the image is dirty and the refcounts are
+     * rebuilt after a crash instead.
      */
     if (cow) {
         qcow2_cache_depends_on_flush(s->l2_table_cache);
     }
 
-    qcow2_cache_set_dependency(bs, s->l2_table_cache, s->refcount_block_cache);
+    if (!s->use_lazy_refcounts) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+            s->refcount_block_cache);
+    }
     ret = get_cluster_table(bs, m->offset, &l2_table, &l2_offset, &l2_index);
     if (ret < 0) {
         goto err;
@@ -772,21 +807,22 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /*
      * Check if there already is an AIO write request in flight which allocates
      * the same cluster. In this case we need to wait until the previous
-     * request has completed and updated the L2 table accordingly.
+     * request has completed and updated the L2 table accordingly. Requests
+     * allocating neighbouring clusters go on in parallel.
      */
     QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
 
-        uint64_t end_offset = offset + nb_clusters * s->cluster_size;
-        uint64_t old_offset = old_alloc->offset;
-        uint64_t old_end_offset = old_alloc->offset +
-            old_alloc->nb_clusters * s->cluster_size;
+        uint64_t start = offset >> s->cluster_bits;
+        uint64_t end = start + nb_clusters;
+        uint64_t old_start = old_alloc->offset >> s->cluster_bits;
+        uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end_offset < old_offset || offset > old_end_offset) {
+        if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
-            if (offset < old_offset) {
+            if (start < old_start) {
                 /* Stop at the start of a running allocation */
-                nb_clusters = (old_offset - offset) >> s->cluster_bits;
+                nb_clusters = old_start - start;
             } else {
                 nb_clusters = 0;
             }
@@ -820,6 +856,7 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     m->offset = offset;
     m->n_start = n_start;
     m->nb_clusters = nb_clusters;
+    m->cow_done = false;
 
 out:
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
@@ -844,33 +881,6 @@ fail_put:
     return ret;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
 int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
 {
     BDRVQcowState *s = bs->opaque;
@@ -887,9 +897,10 @@ int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
         if (ret < 0) {
             return ret;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+        ret = qcow2_decompress_buffer(s->cluster_cache, s->cluster_size,
+                                      s->cluster_data + sector_offset, csize);
+        if (ret < 0) {
+            return ret;
         }
         s->cluster_cache_offset = coffset;
     }
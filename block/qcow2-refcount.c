@@ -117,6 +117,33 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     return refcount;
 }
 
+/*
+ * Starts loading the refcount block that the next cluster allocation will
+ * look at into the cache, without waiting for it. Returns 0 if there is
+ * nothing to load, -EINPROGRESS if cb will be called once it is loaded, or
+ * -errno.
+ */
+int qcow2_prefetch_refcount_block(BlockDriverState *bs,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    int refcount_table_index;
+    int64_t refcount_block_offset;
+
+    refcount_table_index = s->free_cluster_index >>
+        (s->cluster_bits - REFCOUNT_SHIFT);
+    if (refcount_table_index >= s->refcount_table_size) {
+        return 0;
+    }
+    refcount_block_offset = s->refcount_table[refcount_table_index];
+    if (!refcount_block_offset) {
+        return 0;
+    }
+
+    return qcow2_cache_load_async(bs, s->refcount_block_cache,
+        refcount_block_offset, cb, opaque);
+}
+
 /*
  * Rounds the refcount table size up to avoid growing the table for each single
  * refcount block that is allocated.
@@ -431,6 +458,13 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         return 0;
     }
 
+    if (s->use_lazy_refcounts) {
+        ret = qcow2_mark_dirty(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     if (addend < 0) {
         qcow2_cache_set_dependency(bs, s->refcount_block_cache,
             s->l2_table_cache);
@@ -1060,12 +1094,15 @@ fail:
 }
 
 /*
- * Checks an image for refcount consistency.
+ * Checks an image for refcount consistency. If repair is true, refcounts that
+ * don't match the references found are rewritten; the refcounts on disk can't
+ * be trusted then, so QCOW_OFLAG_COPIED is not checked.
  *
  * Returns 0 if no errors are found, the number of errors in case the image is
  * detected as corrupted, and -errno when an internal error occurred.
  */
-int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
+static int check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                           bool repair)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t size;
@@ -1084,7 +1121,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
 
     /* current L1 table */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                       s->l1_table_offset, s->l1_size, 1);
+                       s->l1_table_offset, s->l1_size, !repair);
     if (ret < 0) {
         goto fail;
     }
@@ -1101,6 +1138,16 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
+    /* dirty bitmaps */
+    for (i = 0; i < s->nb_dirty_bitmaps; i++) {
+        QCowDirtyBitmap *bm = &s->dirty_bitmaps[i];
+
+        if (bm->data_offset) {
+            inc_refcounts(bs, res, refcount_table, nb_clusters,
+                bm->data_offset, qcow2_dirty_bitmap_data_size(bm));
+        }
+    }
+
     /* refcount data */
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->refcount_table_offset,
@@ -1136,6 +1183,14 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
         }
     }
 
+    /*
+     * Refcount blocks allocated while repairing must not take clusters that
+     * are in use but not accounted for yet, so allocate behind the image.
+     */
+    if (repair) {
+        s->free_cluster_index = nb_clusters;
+    }
+
     /* compare ref counts */
     for(i = 0; i < nb_clusters; i++) {
         refcount1 = get_refcount(bs, i);
@@ -1148,6 +1203,18 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
 
         refcount2 = refcount_table[i];
         if (refcount1 != refcount2) {
+            if (repair) {
+                ret = update_refcount(bs, (int64_t) i << s->cluster_bits,
+                    s->cluster_size, refcount2 - refcount1);
+                if (ret >= 0) {
+                    fprintf(stderr, "Repaired cluster %d refcount=%d "
+                        "reference=%d\n", i, refcount1, refcount2);
+                    continue;
+                }
+                fprintf(stderr, "Can't repair refcount for cluster %d: %s\n",
+                    i, strerror(-ret));
+            }
+
             fprintf(stderr, "%s cluster %d refcount=%d reference=%d\n",
                    refcount1 < refcount2 ? "ERROR" : "Leaked",
                    i, refcount1, refcount2);
@@ -1159,6 +1226,10 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
         }
     }
 
+    if (repair) {
+        s->free_cluster_index = 0;
+    }
+
     ret = 0;
 
 fail:
@@ -1167,3 +1238,30 @@ fail:
     return ret;
 }
 
+/*
+ * Checks an image for refcount consistency. If fix is true, the refcounts are
+ * rebuilt from the references in the image first, which is needed after an
+ * unclean shutdown with lazy refcounts.
+ */
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                          bool fix)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (fix) {
+        BdrvCheckResult repair_res = {0};
+
+        ret = check_refcounts(bs, &repair_res, true);
+        if (ret < 0) {
+            return ret;
+        }
+
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return check_refcounts(bs, res, false);
+}
@@ -0,0 +1,445 @@
+/*
+ * Worker threads for qcow2 cluster compression and decompression
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * zlib runs at a few dozen MB/s per core, so compressed clusters are
+ * (de)compressed by a pool of worker threads, one per online CPU at most.
+ * The same pool encrypts and decrypts the data of encrypted images.
+ * The workers only ever touch the buffers of their job; everything else,
+ * including the completion callbacks, runs in the I/O thread. Like in
+ * posix-aio-compat.c, completions are signalled through a pipe that is
+ * registered with qemu_aio_set_fd_handler(), so qemu_aio_wait() and
+ * qemu_aio_flush() wait for outstanding jobs.
+ */
+
+#include <zlib.h>
+#include "qemu-common.h"
+#include "qemu-aio.h"
+#include "qemu-queue.h"
+#include "qemu-thread.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+/* Sectors that one job encrypts, larger requests are split across workers */
+#define QCOW2_CRYPT_JOB_SECTORS 128
+
+enum {
+    QCOW2_JOB_COMPRESS,
+    QCOW2_JOB_DECOMPRESS,
+    QCOW2_JOB_CRYPT,
+};
+
+typedef struct Qcow2ThreadJob {
+    int type;
+    uint8_t *dest;
+    size_t dest_size;
+    const uint8_t *src;
+    size_t src_size;
+
+    /* QCOW2_JOB_CRYPT, in place on dest */
+    BDRVQcowState *s;
+    int64_t sector_num;
+    int nb_sectors;
+    int enc;
+    const AES_KEY *key;
+
+    int ret;
+    bool done;
+
+    Qcow2ThreadFunc *cb;
+    void *opaque;
+    int async_context_id;
+    QEMUBH *bh;
+
+    QTAILQ_ENTRY(Qcow2ThreadJob) node;  /* waiting for a worker */
+    QLIST_ENTRY(Qcow2ThreadJob) next;   /* submitted, not completed */
+} Qcow2ThreadJob;
+
+static QemuMutex lock;
+static QemuCond cond;
+static QTAILQ_HEAD(, Qcow2ThreadJob) request_list;
+static QLIST_HEAD(, Qcow2ThreadJob) pending_jobs;
+static int max_threads;
+static int cur_threads;
+static int idle_threads;
+static int rfd = -1, wfd = -1;
+static bool pool_initialized;
+
+/*
+ * Compresses src into dest with the raw deflate format qcow2 uses.
+ *
+ * Returns the compressed size, -ENOSPC if the data doesn't compress into
+ * dest_size bytes and -EIO on zlib errors.
+ */
+int qcow2_compress_buffer(uint8_t *dest, size_t dest_size,
+                          const uint8_t *src, size_t src_size)
+{
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = strm.next_out - dest;
+    } else {
+        ret = (ret == Z_OK || ret == Z_BUF_ERROR) ? -ENOSPC : -EIO;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+/*
+ * Decompresses src, which must hold exactly dest_size bytes of data once
+ * inflated.
+ *
+ * Returns 0 on success and -EIO if the data is corrupted.
+ */
+int qcow2_decompress_buffer(uint8_t *dest, size_t dest_size,
+                            const uint8_t *src, size_t src_size)
+{
+    z_stream strm;
+    int ret, out_len;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = (uint8_t *)src;
+    strm.avail_in = src_size;
+    strm.next_out = dest;
+    strm.avail_out = dest_size;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    out_len = strm.next_out - dest;
+    inflateEnd(&strm);
+
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+        out_len != dest_size) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static void qcow2_thread_job_run(Qcow2ThreadJob *job)
+{
+    switch (job->type) {
+    case QCOW2_JOB_COMPRESS:
+        job->ret = qcow2_compress_buffer(job->dest, job->dest_size,
+                                         job->src, job->src_size);
+        break;
+    case QCOW2_JOB_DECOMPRESS:
+        job->ret = qcow2_decompress_buffer(job->dest, job->dest_size,
+                                           job->src, job->src_size);
+        break;
+    case QCOW2_JOB_CRYPT:
+        qcow2_encrypt_sectors(job->s, job->sector_num, job->dest, job->dest,
+                              job->nb_sectors, job->enc, job->key);
+        job->ret = 0;
+        break;
+    default:
+        abort();
+    }
+}
+
+static void *qcow2_worker_thread(void *unused)
+{
+    Qcow2ThreadJob *job;
+    char byte = 0;
+    ssize_t len;
+
+    qemu_mutex_lock(&lock);
+    for (;;) {
+        while (QTAILQ_EMPTY(&request_list)) {
+            idle_threads++;
+            qemu_cond_wait(&cond, &lock);
+            idle_threads--;
+        }
+
+        job = QTAILQ_FIRST(&request_list);
+        QTAILQ_REMOVE(&request_list, job, node);
+        qemu_mutex_unlock(&lock);
+
+        qcow2_thread_job_run(job);
+
+        qemu_mutex_lock(&lock);
+        job->done = true;
+
+        do {
+            len = write(wfd, &byte, sizeof(byte));
+        } while (len == -1 && errno == EINTR);
+    }
+
+    return NULL;
+}
+
+static void qcow2_spawn_thread(void)
+{
+    QemuThread thread;
+#ifndef _WIN32
+    sigset_t set, oldset;
+
+    /* The workers must not take any of the signals the I/O thread expects */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+#endif
+
+    cur_threads++;
+    qemu_thread_create(&thread, qcow2_worker_thread, NULL);
+
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#endif
+}
+
+/*
+ * Calls the callbacks of the finished jobs that were submitted in the
+ * current AIO context. Returns 1 if any callback was called.
+ */
+static int qcow2_threads_process_queue(void *opaque)
+{
+    Qcow2ThreadJob *job;
+    int async_context_id = get_async_context_id();
+    int result = 0;
+
+    /* A callback may submit new jobs, so start over after each one */
+    for (;;) {
+        qemu_mutex_lock(&lock);
+        QLIST_FOREACH(job, &pending_jobs, next) {
+            if (job->done && job->async_context_id == async_context_id) {
+                QLIST_REMOVE(job, next);
+                break;
+            }
+        }
+        qemu_mutex_unlock(&lock);
+
+        if (job == NULL) {
+            return result;
+        }
+
+        job->cb(job->opaque, job->ret);
+        qemu_free(job);
+        result = 1;
+    }
+}
+
+static void qcow2_threads_read(void *opaque)
+{
+    char bytes[16];
+    ssize_t len;
+
+    /* read all bytes from the notification pipe */
+    do {
+        len = read(rfd, bytes, sizeof(bytes));
+    } while (len == sizeof(bytes) || (len == -1 && errno == EINTR));
+
+    qcow2_threads_process_queue(opaque);
+}
+
+static int qcow2_threads_flush(void *opaque)
+{
+    return !QLIST_EMPTY(&pending_jobs);
+}
+
+static void qcow2_threads_init(void)
+{
+#ifndef _WIN32
+    int fds[2];
+#endif
+
+    pool_initialized = true;
+
+#ifndef _WIN32
+    if (qemu_pipe(fds) == -1) {
+        fprintf(stderr, "qcow2: failed to create pipe, (de)compressing "
+                "in the I/O thread\n");
+        return;
+    }
+    rfd = fds[0];
+    wfd = fds[1];
+    fcntl(rfd, F_SETFL, O_NONBLOCK);
+    fcntl(wfd, F_SETFL, O_NONBLOCK);
+
+    max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+
+    qemu_mutex_init(&lock);
+    qemu_cond_init(&cond);
+    QTAILQ_INIT(&request_list);
+    QLIST_INIT(&pending_jobs);
+
+    qemu_aio_set_fd_handler(rfd, qcow2_threads_read, NULL, qcow2_threads_flush,
+        qcow2_threads_process_queue, NULL);
+#endif
+}
+
+static void qcow2_inline_job_bh(void *opaque)
+{
+    Qcow2ThreadJob *job = opaque;
+
+    qemu_bh_delete(job->bh);
+    job->cb(job->opaque, job->ret);
+    qemu_free(job);
+}
+
+static Qcow2ThreadJob *qcow2_thread_job_new(int type, uint8_t *dest,
+    size_t dest_size, const uint8_t *src, size_t src_size,
+    Qcow2ThreadFunc *cb, void *opaque)
+{
+    Qcow2ThreadJob *job;
+
+    job = qemu_mallocz(sizeof(*job));
+    job->type = type;
+    job->dest = dest;
+    job->dest_size = dest_size;
+    job->src = src;
+    job->src_size = src_size;
+    job->cb = cb;
+    job->opaque = opaque;
+    job->async_context_id = get_async_context_id();
+
+    return job;
+}
+
+/*
+ * Queues a job for the worker threads. Without a pool the job runs right
+ * away and its callback is called from a bottom half.
+ */
+static void qcow2_threads_submit(Qcow2ThreadJob *job)
+{
+    if (!pool_initialized) {
+        qcow2_threads_init();
+    }
+
+    if (rfd == -1) {
+        qcow2_thread_job_run(job);
+        job->bh = qemu_bh_new(qcow2_inline_job_bh, job);
+        qemu_bh_schedule(job->bh);
+        return;
+    }
+
+    qemu_mutex_lock(&lock);
+    if (idle_threads == 0 && cur_threads < max_threads) {
+        qcow2_spawn_thread();
+    }
+    QTAILQ_INSERT_TAIL(&request_list, job, node);
+    QLIST_INSERT_HEAD(&pending_jobs, job, next);
+    qemu_cond_signal(&cond);
+    qemu_mutex_unlock(&lock);
+}
+
+/*
+ * Compresses src_size bytes at src into dest in a worker thread. The buffers
+ * must stay valid until cb is called with the result of
+ * qcow2_compress_buffer().
+ */
+void qcow2_compress_async(uint8_t *dest, size_t dest_size,
+    const uint8_t *src, size_t src_size, Qcow2ThreadFunc *cb, void *opaque)
+{
+    qcow2_threads_submit(qcow2_thread_job_new(QCOW2_JOB_COMPRESS, dest,
+        dest_size, src, src_size, cb, opaque));
+}
+
+/*
+ * Decompresses src into dest in a worker thread, cb is called with the
+ * result of qcow2_decompress_buffer().
+ */
+void qcow2_decompress_async(uint8_t *dest, size_t dest_size,
+    const uint8_t *src, size_t src_size, Qcow2ThreadFunc *cb, void *opaque)
+{
+    qcow2_threads_submit(qcow2_thread_job_new(QCOW2_JOB_DECOMPRESS, dest,
+        dest_size, src, src_size, cb, opaque));
+}
+
+typedef struct Qcow2CryptRequest {
+    int pending;
+    int ret;
+    Qcow2ThreadFunc *cb;
+    void *opaque;
+} Qcow2CryptRequest;
+
+static void qcow2_crypt_job_cb(void *opaque, int ret)
+{
+    Qcow2CryptRequest *req = opaque;
+
+    if (ret < 0 && req->ret == 0) {
+        req->ret = ret;
+    }
+    if (--req->pending == 0) {
+        req->cb(req->opaque, req->ret);
+        qemu_free(req);
+    }
+}
+
+/*
+ * Encrypts (enc = 1) or decrypts nb_sectors sectors at buf in place with
+ * qcow2_encrypt_sectors(). The buffer is split into chunks that the workers
+ * process in parallel; cb is called once all of them are done.
+ */
+void qcow2_crypt_async(BDRVQcowState *s, int64_t sector_num, uint8_t *buf,
+    int nb_sectors, int enc, const AES_KEY *key,
+    Qcow2ThreadFunc *cb, void *opaque)
+{
+    Qcow2CryptRequest *req;
+    Qcow2ThreadJob *job;
+    int n;
+
+    req = qemu_mallocz(sizeof(*req));
+    req->cb = cb;
+    req->opaque = opaque;
+    req->pending = (nb_sectors + QCOW2_CRYPT_JOB_SECTORS - 1) /
+        QCOW2_CRYPT_JOB_SECTORS;
+
+    while (nb_sectors > 0) {
+        n = MIN(nb_sectors, QCOW2_CRYPT_JOB_SECTORS);
+
+        job = qcow2_thread_job_new(QCOW2_JOB_CRYPT, buf, n * 512, NULL, 0,
+            qcow2_crypt_job_cb, req);
+        job->s = s;
+        job->sector_num = sector_num;
+        job->nb_sectors = n;
+        job->enc = enc;
+        job->key = key;
+        qcow2_threads_submit(job);
+
+        sector_num += n;
+        buf += n * 512;
+        nb_sectors -= n;
+    }
+}
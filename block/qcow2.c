@@ -24,11 +24,11 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "module.h"
-#include <zlib.h>
 #include "aes.h"
 #include "block/qcow2.h"
 #include "qemu-error.h"
 #include "qerror.h"
+#include "qint.h"
 
 /*
   Differences with QCOW:
@@ -53,12 +53,13 @@ typedef struct {
 } QCowExtension;
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
+#define  QCOW2_EXT_MAGIC_DIRTY_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     const QCowHeader *cow_header = (const void *)buf;
 
-    if (buf_size >= sizeof(QCowHeader) &&
+    if (buf_size >= QCOW_V2_HEADER_LENGTH &&
         be32_to_cpu(cow_header->magic) == QCOW_MAGIC &&
         be32_to_cpu(cow_header->version) >= QCOW_VERSION)
         return 100;
@@ -77,6 +78,7 @@ static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
                                  uint64_t end_offset)
 {
+    BDRVQcowState *s = bs->opaque;
     QCowExtension ext;
     uint64_t offset;
 
@@ -127,6 +129,16 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             offset = ((offset + ext.len + 7) & ~7);
             break;
 
+        case QCOW2_EXT_MAGIC_DIRTY_BITMAPS:
+            /* Without the auto-clear bit, an older writer may have changed
+             * the image after the bitmaps were stored */
+            if ((s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS) &&
+                qcow2_read_dirty_bitmap_ext(bs, offset, ext.len) < 0) {
+                return 4;
+            }
+            offset = ((offset + ext.len + 7) & ~7);
+            break;
+
         default:
             /* unknown magic -- just skip it */
             offset = ((offset + ext.len + 7) & ~7);
@@ -138,6 +150,120 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 }
 
 
+/*
+ * Returns the number of tables for the L2 and refcount block caches, taken
+ * from the drive options (in bytes) when given. By default the L2 cache
+ * maps the whole image up to DEFAULT_L2_CACHE_BYTES, and there is one
+ * refcount block for every four L2 tables.
+ */
+static void qcow2_cache_sizes(BlockDriverState *bs, int *l2_cache_size,
+    int *refcount_cache_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_tables, refcount_tables;
+
+    if (bs->l2_cache_size) {
+        l2_tables = bs->l2_cache_size >> s->cluster_bits;
+    } else {
+        /* One L2 entry of 8 bytes per cluster */
+        l2_tables = ((bs->total_sectors * BDRV_SECTOR_SIZE) >>
+                     s->cluster_bits) * sizeof(uint64_t);
+        l2_tables = MIN(l2_tables, DEFAULT_L2_CACHE_BYTES);
+        l2_tables = MAX((l2_tables + s->cluster_size - 1) >> s->cluster_bits,
+            DEFAULT_L2_CACHE_SIZE);
+    }
+    l2_tables = MAX(l2_tables, MIN_L2_CACHE_SIZE);
+
+    if (bs->refcount_cache_size) {
+        refcount_tables = bs->refcount_cache_size >> s->cluster_bits;
+    } else {
+        refcount_tables = l2_tables / 4;
+    }
+    refcount_tables = MAX(refcount_tables, MIN_REFCOUNT_CACHE_SIZE);
+
+    /* Keep the cache buffers addressable with an int */
+    *l2_cache_size = MIN(l2_tables, INT_MAX >> s->cluster_bits);
+    *refcount_cache_size = MIN(refcount_tables, INT_MAX >> s->cluster_bits);
+}
+
+static int qcow2_write_incompatible_features(BlockDriverState *bs,
+                                             uint64_t features)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t val = cpu_to_be64(features);
+    int ret;
+
+    assert(s->qcow_version >= QCOW_VERSION_FEATURES);
+
+    ret = bdrv_pwrite_sync(bs->file,
+        offsetof(QCowHeader, incompatible_features), &val, sizeof(val));
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->incompatible_features = features;
+    return 0;
+}
+
+int qcow2_write_autoclear_features(BlockDriverState *bs, uint64_t features)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t val = cpu_to_be64(features);
+    int ret;
+
+    assert(s->qcow_version >= QCOW_VERSION_FEATURES);
+
+    ret = bdrv_pwrite_sync(bs->file,
+        offsetof(QCowHeader, autoclear_features), &val, sizeof(val));
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->autoclear_features = features;
+    return 0;
+}
+
+/*
+ * Sets the dirty bit before the first refcount update that is only kept in
+ * the cache. An image with the bit set gets its refcounts rebuilt on the
+ * next open.
+ */
+int qcow2_mark_dirty(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
+        return 0;
+    }
+
+    return qcow2_write_incompatible_features(bs,
+        s->incompatible_features | QCOW2_INCOMPAT_DIRTY);
+}
+
+/* Writes all refcounts back and clears the dirty bit */
+static int qcow2_mark_clean(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        return 0;
+    }
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return qcow2_write_incompatible_features(bs,
+        s->incompatible_features & ~QCOW2_INCOMPAT_DIRTY);
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
@@ -145,6 +271,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     QCowHeader header;
     uint64_t ext_end;
     bool writethrough;
+    int l2_cache_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -168,7 +295,8 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         ret = -EINVAL;
         goto fail;
     }
-    if (header.version != QCOW_VERSION) {
+    if (header.version != QCOW_VERSION &&
+        header.version != QCOW_VERSION_FEATURES) {
         char version[64];
         snprintf(version, sizeof(version), "QCOW version %d", header.version);
         qerror_report(QERR_UNKNOWN_BLOCK_FORMAT_FEATURE,
@@ -176,6 +304,64 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         ret = -ENOTSUP;
         goto fail;
     }
+
+    if (header.version == QCOW_VERSION) {
+        header.incompatible_features = 0;
+        header.compatible_features = 0;
+        header.autoclear_features = 0;
+        header.refcount_order = REFCOUNT_ORDER;
+        header.header_length = QCOW_V2_HEADER_LENGTH;
+    } else {
+        be64_to_cpus(&header.incompatible_features);
+        be64_to_cpus(&header.compatible_features);
+        be64_to_cpus(&header.autoclear_features);
+        be32_to_cpus(&header.refcount_order);
+        be32_to_cpus(&header.header_length);
+        if (header.header_length < sizeof(header)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    if (header.incompatible_features & ~QCOW2_INCOMPAT_MASK) {
+        char feature[64];
+        snprintf(feature, sizeof(feature), "incompatible features %" PRIx64,
+            header.incompatible_features & ~(uint64_t) QCOW2_INCOMPAT_MASK);
+        qerror_report(QERR_UNKNOWN_BLOCK_FORMAT_FEATURE,
+            bs->device_name, "qcow2", feature);
+        ret = -ENOTSUP;
+        goto fail;
+    }
+    if (header.refcount_order != REFCOUNT_ORDER) {
+        char feature[64];
+        snprintf(feature, sizeof(feature), "%d bit refcounts",
+            1 << header.refcount_order);
+        qerror_report(QERR_UNKNOWN_BLOCK_FORMAT_FEATURE,
+            bs->device_name, "qcow2", feature);
+        ret = -ENOTSUP;
+        goto fail;
+    }
+    /* Clear the auto-clear features we don't know before writing */
+    if ((header.autoclear_features & ~QCOW2_AUTOCLEAR_MASK) &&
+        (flags & BDRV_O_RDWR)) {
+        uint64_t val;
+
+        header.autoclear_features &= QCOW2_AUTOCLEAR_MASK;
+        val = cpu_to_be64(header.autoclear_features);
+        ret = bdrv_pwrite_sync(bs->file,
+            offsetof(QCowHeader, autoclear_features), &val, sizeof(val));
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+    s->qcow_version = header.version;
+    s->header_length = header.header_length;
+    s->incompatible_features = header.incompatible_features;
+    s->compatible_features = header.compatible_features;
+    s->autoclear_features = header.autoclear_features;
+    s->use_lazy_refcounts =
+        (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS) != 0;
+
     if (header.cluster_bits < MIN_CLUSTER_BITS ||
         header.cluster_bits > MAX_CLUSTER_BITS) {
         ret = -EINVAL;
@@ -230,9 +416,10 @@ static int qcow2_open(BlockDriverState *bs, int flags)
 
     /* alloc L2 table/refcount block cache */
     writethrough = ((flags & BDRV_O_CACHE_WB) == 0);
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE, writethrough);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE,
-        writethrough);
+    qcow2_cache_sizes(bs, &l2_cache_size, &refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size, writethrough);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+        writethrough && !s->use_lazy_refcounts);
 
     s->cluster_cache = qemu_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -246,6 +433,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     QLIST_INIT(&s->cluster_allocs);
+    QSIMPLEQ_INIT(&s->l2_link_queue);
 
     /* read qcow2 extensions */
     if (header.backing_file_offset) {
@@ -253,7 +441,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     } else {
         ext_end = s->cluster_size;
     }
-    if (qcow2_read_extensions(bs, sizeof(header), ext_end)) {
+    if (qcow2_read_extensions(bs, s->header_length, ext_end)) {
         ret = -EINVAL;
         goto fail;
     }
@@ -276,13 +464,37 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         goto fail;
     }
 
+    /*
+     * Refcounts may be stale after an unclean shutdown with lazy refcounts.
+     * Like QED, read-only images are opened as they are to allow recovery.
+     */
+    if ((s->incompatible_features & QCOW2_INCOMPAT_DIRTY) &&
+        (flags & BDRV_O_RDWR)) {
+        BdrvCheckResult result = {0};
+
+        ret = qcow2_check_refcounts(bs, &result, true);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (!result.corruptions && !result.check_errors) {
+            ret = qcow2_mark_clean(bs);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+    }
+
 #ifdef DEBUG_ALLOC
-    qcow2_check_refcounts(bs);
+    {
+        BdrvCheckResult result = {0};
+        qcow2_check_refcounts(bs, &result, false);
+    }
 #endif
     return ret;
 
  fail:
     qcow2_free_snapshots(bs);
+    qcow2_free_dirty_bitmaps(bs);
     qcow2_refcount_close(bs);
     qemu_free(s->l1_table);
     if (s->l2_table_cache) {
@@ -310,6 +522,9 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
     }
     s->crypt_method = s->crypt_method_header;
 
+    /* Crypt jobs in the thread pool use the keys in place */
+    qemu_aio_flush();
+
     if (AES_set_encrypt_key(keybuf, 128, &s->aes_encrypt_key) != 0)
         return -1;
     if (AES_set_decrypt_key(keybuf, 128, &s->aes_decrypt_key) != 0)
@@ -384,13 +599,59 @@ typedef struct QCowAIOCB {
     QEMUBH *bh;
     QCowL2Meta l2meta;
     QLIST_ENTRY(QCowAIOCB) next_depend;
+
+    /* data and COW writes of an allocation, or cluster decompressions of a
+     * read, still running, and their first error */
+    int pending;
+    int pending_ret;
+    QSIMPLEQ_ENTRY(QCowAIOCB) next_link;
+
+    bool cancelled;     /* qcow2_aio_cancel() waits for the request */
+    bool finished;      /* signal for cancel completion */
 } QCowAIOCB;
 
+typedef struct QCowCOWRequest {
+    QCowAIOCB *acb;
+    int64_t sector_num;     /* guest sector the copy starts at */
+    int64_t file_sector;    /* where it goes in bs->file */
+    int nb_sectors;
+    uint8_t *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} QCowCOWRequest;
+
+/* At most this many compressed clusters of a read are decompressed at once */
+#define QCOW2_MAX_DECOMPRESS_CLUSTERS 32
+
+typedef struct QCowDecompressRequest {
+    QCowAIOCB *acb;
+    uint64_t coffset;       /* host offset of the compressed data */
+    int sector_offset;      /* offset of the data in the first sector */
+    int csize;              /* size of the compressed data */
+    int index_in_cluster;
+    int nb_sectors;
+    uint64_t qiov_offset;   /* where the sectors go in acb->qiov */
+    unsigned int cache_generation;
+    uint8_t *in_buf;
+    uint8_t *out_buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} QCowDecompressRequest;
+
 static void qcow2_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     QCowAIOCB *acb = container_of(blockacb, QCowAIOCB, common);
-    if (acb->hd_aiocb)
-        bdrv_aio_cancel(acb->hd_aiocb);
+
+    /*
+     * The request may be queued on a cache entry, waiting for a cluster
+     * allocation it depends on or for a job of the thread pool, and it can
+     * hold metadata state of its own. Let it run to completion instead of
+     * pulling the acb from under it.
+     */
+    acb->cancelled = true;
+    while (!acb->finished) {
+        qemu_aio_wait();
+    }
     qemu_aio_release(acb);
 }
 
@@ -401,6 +662,8 @@ static AIOPool qcow2_aio_pool = {
 
 static void qcow2_aio_read_cb(void *opaque, int ret);
 static void qcow2_aio_write_cb(void *opaque, int ret);
+static void qcow2_aio_read_metadata(QCowAIOCB *acb);
+static void qcow2_aio_write_metadata(QCowAIOCB *acb);
 
 static void qcow2_aio_rw_bh(void *opaque)
 {
@@ -429,12 +692,46 @@ static int qcow2_schedule_bh(QEMUBHFunc *cb, QCowAIOCB *acb)
     return 0;
 }
 
+static void qcow2_aio_complete(QCowAIOCB *acb, int ret)
+{
+    qemu_iovec_destroy(&acb->hd_qiov);
+
+    /* qcow2_aio_cancel() releases the acb */
+    if (acb->cancelled) {
+        acb->finished = true;
+        return;
+    }
+
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+/*
+ * Metadata needed by the next part of a request is loaded into the caches
+ * asynchronously first, the request goes on from this callback once it is
+ * there. The synchronous cache lookups that follow then hit, so a cache
+ * miss doesn't stall other requests.
+ */
+static void qcow2_aio_metadata_cb(void *opaque, int ret)
+{
+    QCowAIOCB *acb = opaque;
+
+    if (ret < 0) {
+        qcow2_aio_complete(acb, ret);
+    } else if (acb->is_write) {
+        qcow2_aio_write_metadata(acb);
+    } else {
+        qcow2_aio_read_metadata(acb);
+    }
+}
+
+static void qcow2_aio_read_decrypt_cb(void *opaque, int ret);
+
 static void qcow2_aio_read_cb(void *opaque, int ret)
 {
     QCowAIOCB *acb = opaque;
     BlockDriverState *bs = acb->common.bs;
     BDRVQcowState *s = bs->opaque;
-    int index_in_cluster, n1;
 
     acb->hd_aiocb = NULL;
     if (ret < 0)
@@ -447,13 +744,10 @@ static void qcow2_aio_read_cb(void *opaque, int ret)
         /* nothing to do */
     } else {
         if (s->crypt_method) {
-            qcow2_encrypt_sectors(s, acb->sector_num,  acb->cluster_data,
-                acb->cluster_data, acb->cur_nr_sectors, 0, &s->aes_decrypt_key);
-            qemu_iovec_reset(&acb->hd_qiov);
-            qemu_iovec_copy(&acb->hd_qiov, acb->qiov, acb->bytes_done,
-                acb->cur_nr_sectors * 512);
-            qemu_iovec_from_buffer(&acb->hd_qiov, acb->cluster_data,
-                512 * acb->cur_nr_sectors);
+            qcow2_crypt_async(s, acb->sector_num, acb->cluster_data,
+                acb->cur_nr_sectors, 0, &s->aes_decrypt_key,
+                qcow2_aio_read_decrypt_cb, acb);
+            return;
         }
     }
 
@@ -474,6 +768,196 @@ static void qcow2_aio_read_cb(void *opaque, int ret)
             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors);
     }
 
+    qcow2_aio_read_metadata(acb);
+    return;
+done:
+    qcow2_aio_complete(acb, ret);
+}
+
+static void qcow2_aio_read_decrypt_cb(void *opaque, int ret)
+{
+    QCowAIOCB *acb = opaque;
+
+    qemu_iovec_reset(&acb->hd_qiov);
+    qemu_iovec_copy(&acb->hd_qiov, acb->qiov, acb->bytes_done,
+        acb->cur_nr_sectors * 512);
+    qemu_iovec_from_buffer(&acb->hd_qiov, acb->cluster_data,
+        512 * acb->cur_nr_sectors);
+
+    /* The data is in place, only the bookkeeping of qcow2_aio_read_cb is
+     * left to do */
+    acb->cluster_offset = 0;
+    qcow2_aio_read_cb(acb, ret);
+}
+
+static void qcow2_aio_read_part_done(QCowAIOCB *acb, int ret)
+{
+    if (ret < 0 && acb->pending_ret == 0) {
+        acb->pending_ret = ret;
+    }
+    if (--acb->pending > 0) {
+        return;
+    }
+
+    qcow2_aio_read_cb(acb, acb->pending_ret);
+}
+
+static void qcow2_decompress_cb(void *opaque, int ret)
+{
+    QCowDecompressRequest *req = opaque;
+    QCowAIOCB *acb = req->acb;
+    BDRVQcowState *s = acb->common.bs->opaque;
+
+    if (ret >= 0) {
+        qemu_iovec_reset(&acb->hd_qiov);
+        qemu_iovec_copy(&acb->hd_qiov, acb->qiov, req->qiov_offset,
+            req->nb_sectors * 512);
+        qemu_iovec_from_buffer(&acb->hd_qiov,
+            req->out_buf + req->index_in_cluster * 512,
+            req->nb_sectors * 512);
+
+        /* Keep the cluster for the next small read, unless a write came in
+         * meanwhile */
+        if (req->cache_generation == s->cluster_cache_generation) {
+            uint8_t *old_cache = s->cluster_cache;
+
+            s->cluster_cache = req->out_buf;
+            s->cluster_cache_offset = req->coffset;
+            req->out_buf = old_cache;
+        }
+    }
+
+    qemu_vfree(req->in_buf);
+    qemu_free(req->out_buf);
+    qemu_free(req);
+    qcow2_aio_read_part_done(acb, ret);
+}
+
+static void qcow2_decompress_read_cb(void *opaque, int ret)
+{
+    QCowDecompressRequest *req = opaque;
+    BDRVQcowState *s = req->acb->common.bs->opaque;
+
+    if (ret < 0) {
+        qcow2_decompress_cb(req, ret);
+        return;
+    }
+
+    qcow2_decompress_async(req->out_buf, s->cluster_size,
+        req->in_buf + req->sector_offset, req->csize,
+        qcow2_decompress_cb, req);
+}
+
+/*
+ * Reads nb_sectors at sector_num of a compressed cluster into acb->qiov at
+ * qiov_offset. The cluster is read asynchronously and inflated by a worker
+ * thread unless it is the one in s->cluster_cache.
+ */
+static void qcow2_aio_read_compressed_cluster(QCowAIOCB *acb,
+    uint64_t cluster_offset, int64_t sector_num, int nb_sectors,
+    uint64_t qiov_offset)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    QCowDecompressRequest *req;
+    BlockDriverAIOCB *aiocb;
+    int index_in_cluster, nb_csectors;
+    uint64_t coffset;
+
+    coffset = cluster_offset & s->cluster_offset_mask;
+    index_in_cluster = sector_num & (s->cluster_sectors - 1);
+
+    if (coffset == s->cluster_cache_offset) {
+        qemu_iovec_reset(&acb->hd_qiov);
+        qemu_iovec_copy(&acb->hd_qiov, acb->qiov, qiov_offset,
+            nb_sectors * 512);
+        qemu_iovec_from_buffer(&acb->hd_qiov,
+            s->cluster_cache + index_in_cluster * 512, nb_sectors * 512);
+        return;
+    }
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+
+    req = qemu_mallocz(sizeof(*req));
+    req->acb = acb;
+    req->coffset = coffset;
+    req->sector_offset = coffset & 511;
+    req->csize = nb_csectors * 512 - req->sector_offset;
+    req->index_in_cluster = index_in_cluster;
+    req->nb_sectors = nb_sectors;
+    req->qiov_offset = qiov_offset;
+    req->cache_generation = s->cluster_cache_generation;
+    req->in_buf = qemu_blockalign(bs, nb_csectors * 512);
+    req->out_buf = qemu_malloc(s->cluster_size);
+    req->iov.iov_base = req->in_buf;
+    req->iov.iov_len = nb_csectors * 512;
+    qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+
+    acb->pending++;
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    aiocb = bdrv_aio_readv(bs->file, coffset >> 9, &req->qiov, nb_csectors,
+        qcow2_decompress_read_cb, req);
+    if (aiocb == NULL) {
+        qcow2_decompress_cb(req, -EIO);
+    }
+}
+
+/*
+ * Starts the current part of a read, which is in a compressed cluster. The
+ * compressed clusters that directly follow it are decompressed in parallel
+ * and become part of it, so that large reads of compressed images use all
+ * worker threads.
+ */
+static int qcow2_aio_read_compressed(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    uint64_t cluster_offset = acb->cluster_offset;
+    int64_t sector_num = acb->sector_num;
+    int nb_sectors = acb->cur_nr_sectors;
+    int total = 0;
+    int i, ret;
+
+    acb->pending = 1;
+    acb->pending_ret = 0;
+
+    for (i = 0; i < QCOW2_MAX_DECOMPRESS_CLUSTERS; i++) {
+        qcow2_aio_read_compressed_cluster(acb, cluster_offset, sector_num,
+            nb_sectors, acb->bytes_done + total * 512);
+        total += nb_sectors;
+        sector_num += nb_sectors;
+
+        if (total == acb->remaining_sectors) {
+            break;
+        }
+
+        /* A failed lookup is retried, and reported, by the next part */
+        nb_sectors = acb->remaining_sectors - total;
+        ret = qcow2_get_cluster_offset(bs, sector_num << 9, &nb_sectors,
+            &cluster_offset);
+        if (ret < 0 || !(cluster_offset & QCOW_OFLAG_COMPRESSED)) {
+            break;
+        }
+    }
+    acb->cur_nr_sectors = total;
+
+    if (--acb->pending > 0) {
+        return 0;
+    }
+
+    /* Everything came from the cache, don't recurse */
+    if (acb->pending_ret < 0) {
+        return acb->pending_ret;
+    }
+    return qcow2_schedule_bh(qcow2_aio_rw_bh, acb);
+}
+
+static void qcow2_aio_read_next(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    int index_in_cluster, n1;
+    int ret;
+
     ret = qcow2_get_cluster_offset(bs, acb->sector_num << 9,
         &acb->cur_nr_sectors, &acb->cluster_offset);
     if (ret < 0) {
@@ -513,19 +997,10 @@ static void qcow2_aio_read_cb(void *opaque, int ret)
                 goto done;
         }
     } else if (acb->cluster_offset & QCOW_OFLAG_COMPRESSED) {
-        /* add AIO support for compressed blocks ? */
-        ret = qcow2_decompress_cluster(bs, acb->cluster_offset);
+        ret = qcow2_aio_read_compressed(acb);
         if (ret < 0) {
             goto done;
         }
-
-        qemu_iovec_from_buffer(&acb->hd_qiov,
-            s->cluster_cache + index_in_cluster * 512,
-            512 * acb->cur_nr_sectors);
-
-        ret = qcow2_schedule_bh(qcow2_aio_rw_bh, acb);
-        if (ret < 0)
-            goto done;
     } else {
         if ((acb->cluster_offset & 511) != 0) {
             ret = -EIO;
@@ -560,109 +1035,358 @@ static void qcow2_aio_read_cb(void *opaque, int ret)
         }
     }
 
-    return;
-done:
-    acb->common.cb(acb->common.opaque, ret);
-    qemu_iovec_destroy(&acb->hd_qiov);
-    qemu_aio_release(acb);
+    return;
+done:
+    qcow2_aio_complete(acb, ret);
+}
+
+static void qcow2_aio_read_metadata(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    int ret;
+
+    ret = qcow2_prefetch_l2(bs, acb->sector_num << 9, qcow2_aio_metadata_cb,
+        acb);
+    if (ret == -EINPROGRESS) {
+        return;
+    } else if (ret < 0) {
+        qcow2_aio_complete(acb, ret);
+        return;
+    }
+
+    qcow2_aio_read_next(acb);
+}
+
+static QCowAIOCB *qcow2_aio_setup(BlockDriverState *bs, int64_t sector_num,
+                                  QEMUIOVector *qiov, int nb_sectors,
+                                  BlockDriverCompletionFunc *cb,
+                                  void *opaque, int is_write)
+{
+    QCowAIOCB *acb;
+
+    acb = qemu_aio_get(&qcow2_aio_pool, bs, cb, opaque);
+    if (!acb)
+        return NULL;
+    acb->hd_aiocb = NULL;
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->is_write = is_write;
+    acb->cancelled = false;
+    acb->finished = false;
+
+    qemu_iovec_init(&acb->hd_qiov, qiov->niov);
+
+    acb->bytes_done = 0;
+    acb->remaining_sectors = nb_sectors;
+    acb->cur_nr_sectors = 0;
+    acb->cluster_offset = 0;
+    acb->l2meta.nb_clusters = 0;
+    QLIST_INIT(&acb->l2meta.dependent_requests);
+    return acb;
+}
+
+static BlockDriverAIOCB *qcow2_aio_readv(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         QEMUIOVector *qiov, int nb_sectors,
+                                         BlockDriverCompletionFunc *cb,
+                                         void *opaque)
+{
+    QCowAIOCB *acb;
+    int ret;
+
+    acb = qcow2_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
+    if (!acb)
+        return NULL;
+
+    ret = qcow2_schedule_bh(qcow2_aio_rw_bh, acb);
+    if (ret < 0) {
+        qemu_iovec_destroy(&acb->hd_qiov);
+        qemu_aio_release(acb);
+        return NULL;
+    }
+
+    return &acb->common;
+}
+
+static void run_dependent_requests(QCowL2Meta *m)
+{
+    QCowAIOCB *req;
+    QCowAIOCB *next;
+
+    /* Take the request off the list of running requests */
+    if (m->nb_clusters != 0) {
+        QLIST_REMOVE(m, next_in_flight);
+    }
+
+    /* Restart all dependent requests */
+    QLIST_FOREACH_SAFE(req, &m->dependent_requests, next_depend, next) {
+        qcow2_aio_write_cb(req, 0);
+    }
+
+    /* Empty the list for the next part of the request */
+    QLIST_INIT(&m->dependent_requests);
+}
+
+static void qcow2_aio_write_continue(QCowAIOCB *acb, int ret)
+{
+    run_dependent_requests(&acb->l2meta);
+
+    if (ret < 0)
+        goto done;
+
+    acb->remaining_sectors -= acb->cur_nr_sectors;
+    acb->sector_num += acb->cur_nr_sectors;
+    acb->bytes_done += acb->cur_nr_sectors * 512;
+
+    if (acb->remaining_sectors == 0) {
+        /* request completed */
+        ret = 0;
+        goto done;
+    }
+
+    qcow2_aio_write_metadata(acb);
+    return;
+done:
+    qcow2_aio_complete(acb, ret);
+}
+
+static void qcow2_aio_write_cb(void *opaque, int ret)
+{
+    QCowAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    acb->hd_aiocb = NULL;
+
+    if (ret >= 0) {
+        ret = qcow2_alloc_cluster_link_l2(bs, &acb->l2meta);
+    }
+
+    qcow2_aio_write_continue(acb, ret);
+}
+
+/*
+ * Updates the L2 tables for all allocating writes that completed since the
+ * bottom half was scheduled. In writethrough mode each L2 table touched is
+ * written once for the whole batch instead of once per request.
+ */
+static void qcow2_link_l2_batch(BlockDriverState *bs,
+                                struct QCowLinkQueue *queue)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowAIOCB *acb;
+    bool writethrough;
+    int ret = 0;
+
+    writethrough = qcow2_cache_set_writethrough(s->l2_table_cache, false);
+    QSIMPLEQ_FOREACH(acb, queue, next_link) {
+        if (acb->pending_ret >= 0) {
+            acb->pending_ret = qcow2_alloc_cluster_link_l2(bs, &acb->l2meta);
+        }
+    }
+    qcow2_cache_set_writethrough(s->l2_table_cache, writethrough);
+    if (writethrough) {
+        ret = qcow2_cache_write(bs, s->l2_table_cache);
+    }
+
+    while ((acb = QSIMPLEQ_FIRST(queue)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(queue, next_link);
+        qcow2_aio_write_continue(acb,
+            acb->pending_ret < 0 ? acb->pending_ret : ret);
+    }
+}
+
+static void qcow2_link_l2_bh(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+    struct QCowLinkQueue queue = QSIMPLEQ_HEAD_INITIALIZER(queue);
+
+    qemu_bh_delete(s->l2_link_bh);
+    s->l2_link_bh = NULL;
+
+    QSIMPLEQ_CONCAT(&queue, &s->l2_link_queue);
+    qcow2_link_l2_batch(bs, &queue);
+}
+
+static void qcow2_aio_write_part_done(QCowAIOCB *acb, int ret)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+
+    if (ret < 0 && acb->pending_ret == 0) {
+        acb->pending_ret = ret;
+    }
+    if (--acb->pending > 0) {
+        return;
+    }
+
+    /*
+     * The bottom half only runs in the AIO context it was created in. A
+     * request of a nested context (e.g. bdrv_write emulation) can't wait
+     * for the batch of an outer one, so it is linked on its own.
+     */
+    if (s->l2_link_bh && s->l2_link_context != get_async_context_id()) {
+        struct QCowLinkQueue queue = QSIMPLEQ_HEAD_INITIALIZER(queue);
+
+        QSIMPLEQ_INSERT_TAIL(&queue, acb, next_link);
+        qcow2_link_l2_batch(bs, &queue);
+        return;
+    }
+
+    QSIMPLEQ_INSERT_TAIL(&s->l2_link_queue, acb, next_link);
+    if (!s->l2_link_bh) {
+        s->l2_link_bh = qemu_bh_new(qcow2_link_l2_bh, bs);
+        s->l2_link_context = get_async_context_id();
+        qemu_bh_schedule(s->l2_link_bh);
+    }
 }
 
-static QCowAIOCB *qcow2_aio_setup(BlockDriverState *bs, int64_t sector_num,
-                                  QEMUIOVector *qiov, int nb_sectors,
-                                  BlockDriverCompletionFunc *cb,
-                                  void *opaque, int is_write)
+static void qcow2_aio_write_data_cb(void *opaque, int ret)
 {
-    QCowAIOCB *acb;
+    QCowAIOCB *acb = opaque;
 
-    acb = qemu_aio_get(&qcow2_aio_pool, bs, cb, opaque);
-    if (!acb)
-        return NULL;
     acb->hd_aiocb = NULL;
-    acb->sector_num = sector_num;
-    acb->qiov = qiov;
-    acb->is_write = is_write;
+    qcow2_aio_write_part_done(acb, ret);
+}
 
-    qemu_iovec_init(&acb->hd_qiov, qiov->niov);
+static void qcow2_cow_write_cb(void *opaque, int ret)
+{
+    QCowCOWRequest *cow = opaque;
+    QCowAIOCB *acb = cow->acb;
 
-    acb->bytes_done = 0;
-    acb->remaining_sectors = nb_sectors;
-    acb->cur_nr_sectors = 0;
-    acb->cluster_offset = 0;
-    acb->l2meta.nb_clusters = 0;
-    QLIST_INIT(&acb->l2meta.dependent_requests);
-    return acb;
+    qemu_vfree(cow->buf);
+    qemu_free(cow);
+    qcow2_aio_write_part_done(acb, ret);
 }
 
-static BlockDriverAIOCB *qcow2_aio_readv(BlockDriverState *bs,
-                                         int64_t sector_num,
-                                         QEMUIOVector *qiov, int nb_sectors,
-                                         BlockDriverCompletionFunc *cb,
-                                         void *opaque)
+static void qcow2_cow_encrypt_cb(void *opaque, int ret)
 {
-    QCowAIOCB *acb;
-    int ret;
-
-    acb = qcow2_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
-    if (!acb)
-        return NULL;
+    QCowCOWRequest *cow = opaque;
+    BlockDriverState *bs = cow->acb->common.bs;
 
-    ret = qcow2_schedule_bh(qcow2_aio_rw_bh, acb);
-    if (ret < 0) {
-        qemu_iovec_destroy(&acb->hd_qiov);
-        qemu_aio_release(acb);
-        return NULL;
+    BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
+    if (bdrv_aio_writev(bs->file, cow->file_sector, &cow->qiov,
+                        cow->nb_sectors, qcow2_cow_write_cb, cow) == NULL) {
+        qcow2_cow_write_cb(cow, -EIO);
     }
-
-    return &acb->common;
 }
 
-static void run_dependent_requests(QCowL2Meta *m)
+static void qcow2_cow_read_cb(void *opaque, int ret)
 {
-    QCowAIOCB *req;
-    QCowAIOCB *next;
+    QCowCOWRequest *cow = opaque;
+    BlockDriverState *bs = cow->acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
 
-    /* Take the request off the list of running requests */
-    if (m->nb_clusters != 0) {
-        QLIST_REMOVE(m, next_in_flight);
+    if (ret < 0) {
+        qcow2_cow_write_cb(cow, ret);
+        return;
     }
 
-    /* Restart all dependent requests */
-    QLIST_FOREACH_SAFE(req, &m->dependent_requests, next_depend, next) {
-        qcow2_aio_write_cb(req, 0);
+    if (s->crypt_method) {
+        qcow2_crypt_async(s, cow->sector_num, cow->buf, cow->nb_sectors, 1,
+            &s->aes_encrypt_key, qcow2_cow_encrypt_cb, cow);
+        return;
     }
 
-    /* Empty the list for the next part of the request */
-    QLIST_INIT(&m->dependent_requests);
+    BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
+    if (bdrv_aio_writev(bs->file, cow->file_sector, &cow->qiov,
+                        cow->nb_sectors, qcow2_cow_write_cb, cow) == NULL) {
+        qcow2_cow_write_cb(cow, -EIO);
+    }
 }
 
-static void qcow2_aio_write_cb(void *opaque, int ret)
+/* Copies sectors of a cluster that is allocated by acb but not written by
+ * it, from the backing file or as zeros */
+static void qcow2_cow_start(QCowAIOCB *acb, int64_t sector_num,
+    uint64_t file_offset, int nb_sectors)
 {
-    QCowAIOCB *acb = opaque;
     BlockDriverState *bs = acb->common.bs;
-    BDRVQcowState *s = bs->opaque;
-    int index_in_cluster;
-    int n_end;
+    QCowCOWRequest *cow;
+    int n1;
 
-    acb->hd_aiocb = NULL;
+    cow = qemu_mallocz(sizeof(*cow));
+    cow->acb = acb;
+    cow->sector_num = sector_num;
+    cow->file_sector = file_offset >> 9;
+    cow->nb_sectors = nb_sectors;
+    cow->buf = qemu_blockalign(bs, nb_sectors * 512);
+    cow->iov.iov_base = cow->buf;
+    cow->iov.iov_len = nb_sectors * 512;
+    qemu_iovec_init_external(&cow->qiov, &cow->iov, 1);
+    acb->pending++;
+
+    n1 = 0;
+    if (bs->backing_hd) {
+        n1 = qcow2_backing_read1(bs->backing_hd, &cow->qiov, sector_num,
+            nb_sectors);
+    } else {
+        memset(cow->buf, 0, nb_sectors * 512);
+    }
 
-    if (ret >= 0) {
-        ret = qcow2_alloc_cluster_link_l2(bs, &acb->l2meta);
+    if (n1 > 0) {
+        BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
+        if (bdrv_aio_readv(bs->backing_hd, sector_num, &cow->qiov, n1,
+                           qcow2_cow_read_cb, cow) == NULL) {
+            qcow2_cow_write_cb(cow, -EIO);
+        }
+    } else {
+        qcow2_cow_read_cb(cow, 0);
     }
+}
 
-    run_dependent_requests(&acb->l2meta);
+/* Returns true if the guest cluster at offset is not allocated in the image
+ * itself, so that its old content can be read asynchronously */
+static bool qcow2_cow_unallocated(BlockDriverState *bs, uint64_t offset)
+{
+    uint64_t cluster_offset;
+    int n = 1;
+    int ret;
 
-    if (ret < 0)
-        goto done;
+    ret = qcow2_get_cluster_offset(bs, offset, &n, &cluster_offset);
+    return ret == 0 && cluster_offset == 0;
+}
 
-    acb->remaining_sectors -= acb->cur_nr_sectors;
-    acb->sector_num += acb->cur_nr_sectors;
-    acb->bytes_done += acb->cur_nr_sectors * 512;
+/*
+ * Issues the copies of the head and tail of a new allocation next to its
+ * data write. Allocations replacing clusters of the image itself (after a
+ * snapshot) are left to the synchronous copy in qcow2_alloc_cluster_link_l2.
+ */
+static void qcow2_aio_write_cow(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    QCowL2Meta *m = &acb->l2meta;
+    uint64_t start = m->offset & ~(s->cluster_size - 1);
+    int end = m->nb_available & ~(s->cluster_sectors - 1);
+    bool head = m->n_start != 0;
+    bool tail = (m->nb_available & (s->cluster_sectors - 1)) != 0;
+
+    if ((head && !qcow2_cow_unallocated(bs, start)) ||
+        (tail && !qcow2_cow_unallocated(bs, start + ((uint64_t) end << 9)))) {
+        return;
+    }
 
-    if (acb->remaining_sectors == 0) {
-        /* request completed */
-        ret = 0;
-        goto done;
+    m->cow_done = true;
+    if (head) {
+        qcow2_cow_start(acb, start >> 9, m->cluster_offset, m->n_start);
+    }
+    if (tail) {
+        qcow2_cow_start(acb, (start >> 9) + m->nb_available,
+            m->cluster_offset + ((uint64_t) m->nb_available << 9),
+            s->cluster_sectors - (m->nb_available - end));
     }
+}
+
+static void qcow2_aio_write_data(QCowAIOCB *acb);
+static void qcow2_aio_write_encrypt_cb(void *opaque, int ret);
+
+static void qcow2_aio_write_next(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    int index_in_cluster;
+    int n_end;
+    int ret;
 
     index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
     n_end = index_in_cluster + acb->remaining_sectors;
@@ -700,12 +1424,51 @@ static void qcow2_aio_write_cb(void *opaque, int ret)
         assert(acb->hd_qiov.size <= QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         qemu_iovec_to_buffer(&acb->hd_qiov, acb->cluster_data);
 
-        qcow2_encrypt_sectors(s, acb->sector_num, acb->cluster_data,
-            acb->cluster_data, acb->cur_nr_sectors, 1, &s->aes_encrypt_key);
-
         qemu_iovec_reset(&acb->hd_qiov);
         qemu_iovec_add(&acb->hd_qiov, acb->cluster_data,
             acb->cur_nr_sectors * 512);
+
+        qcow2_crypt_async(s, acb->sector_num, acb->cluster_data,
+            acb->cur_nr_sectors, 1, &s->aes_encrypt_key,
+            qcow2_aio_write_encrypt_cb, acb);
+        return;
+    }
+
+    qcow2_aio_write_data(acb);
+    return;
+
+done:
+    qcow2_aio_complete(acb, ret);
+}
+
+static void qcow2_aio_write_encrypt_cb(void *opaque, int ret)
+{
+    qcow2_aio_write_data(opaque);
+}
+
+/* Writes the guest data of the current part, which is in acb->hd_qiov */
+static void qcow2_aio_write_data(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    int index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
+
+    if (acb->l2meta.nb_clusters != 0) {
+        /* The data write and the COW complete in any order, the L2 table
+         * is updated once all of them did */
+        acb->pending = 1;
+        acb->pending_ret = 0;
+        qcow2_aio_write_cow(acb);
+
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+        acb->hd_aiocb = bdrv_aio_writev(bs->file,
+                                    (acb->cluster_offset >> 9) + index_in_cluster,
+                                    &acb->hd_qiov, acb->cur_nr_sectors,
+                                    qcow2_aio_write_data_cb, acb);
+        if (acb->hd_aiocb == NULL) {
+            qcow2_aio_write_part_done(acb, -EIO);
+        }
+        return;
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
@@ -714,20 +1477,30 @@ static void qcow2_aio_write_cb(void *opaque, int ret)
                                     &acb->hd_qiov, acb->cur_nr_sectors,
                                     qcow2_aio_write_cb, acb);
     if (acb->hd_aiocb == NULL) {
-        ret = -EIO;
-        goto fail;
+        qcow2_aio_complete(acb, -EIO);
     }
+}
 
-    return;
+/* Besides the L2 table, an allocating write needs the refcount block that
+ * the next free cluster is counted in */
+static void qcow2_aio_write_metadata(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    int ret;
 
-fail:
-    if (acb->l2meta.nb_clusters != 0) {
-        QLIST_REMOVE(&acb->l2meta, next_in_flight);
+    ret = qcow2_prefetch_l2(bs, acb->sector_num << 9, qcow2_aio_metadata_cb,
+        acb);
+    if (ret == 0) {
+        ret = qcow2_prefetch_refcount_block(bs, qcow2_aio_metadata_cb, acb);
     }
-done:
-    acb->common.cb(acb->common.opaque, ret);
-    qemu_iovec_destroy(&acb->hd_qiov);
-    qemu_aio_release(acb);
+    if (ret == -EINPROGRESS) {
+        return;
+    } else if (ret < 0) {
+        qcow2_aio_complete(acb, ret);
+        return;
+    }
+
+    qcow2_aio_write_next(acb);
 }
 
 static BlockDriverAIOCB *qcow2_aio_writev(BlockDriverState *bs,
@@ -741,6 +1514,7 @@ static BlockDriverAIOCB *qcow2_aio_writev(BlockDriverState *bs,
     int ret;
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
+    s->cluster_cache_generation++;
 
     acb = qcow2_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
     if (!acb)
@@ -764,11 +1538,17 @@ static void qcow2_close(BlockDriverState *bs)
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
+    /* Clean shutdown, the refcounts on disk are up to date again */
+    if (bs->open_flags & BDRV_O_RDWR) {
+        qcow2_mark_clean(bs);
+    }
+
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
 
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
+    qcow2_free_dirty_bitmaps(bs);
     qcow2_refcount_close(bs);
 }
 
@@ -780,13 +1560,16 @@ static void qcow2_close(BlockDriverState *bs)
  *
  * Returns 0 on success, -errno in error cases.
  */
-static int qcow2_update_ext_header(BlockDriverState *bs,
+int qcow2_update_ext_header(BlockDriverState *bs,
     const char *backing_file, const char *backing_fmt)
 {
     size_t backing_file_len = 0;
     size_t backing_fmt_len = 0;
+    size_t bitmaps_len = 0, bitmaps_size;
     BDRVQcowState *s = bs->opaque;
     QCowExtension ext_backing_fmt = {0, 0};
+    QCowExtension ext_bitmaps = {0, 0};
+    QCowExtension ext_end = {0, 0};
     int ret;
 
     /* Backing file format doesn't make sense without a backing file */
@@ -802,44 +1585,64 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
             + strlen(backing_fmt) + 7) & ~7);
     }
 
+    /* Prepare the dirty bitmap extension if needed */
+    bitmaps_size = qcow2_dirty_bitmap_ext_size(bs);
+    if (bitmaps_size) {
+        ext_bitmaps.len = cpu_to_be32(bitmaps_size);
+        ext_bitmaps.magic = cpu_to_be32(QCOW2_EXT_MAGIC_DIRTY_BITMAPS);
+        bitmaps_len = sizeof(ext_bitmaps) + bitmaps_size;
+    }
+
     /* Check if we can fit the new header into the first cluster */
     if (backing_file) {
         backing_file_len = strlen(backing_file);
     }
 
-    size_t header_size = sizeof(QCowHeader) + backing_file_len
-        + backing_fmt_len;
+    size_t header_size = s->header_length + backing_fmt_len + bitmaps_len
+        + sizeof(ext_end) + backing_file_len;
 
     if (header_size > s->cluster_size) {
         return -ENOSPC;
     }
 
     /* Rewrite backing file name and qcow2 extensions */
-    size_t ext_size = header_size - sizeof(QCowHeader);
+    size_t ext_size = header_size - s->header_length;
     uint8_t buf[ext_size];
     size_t offset = 0;
     size_t backing_file_offset = 0;
 
-    if (backing_file) {
-        if (backing_fmt) {
-            int padding = backing_fmt_len -
-                (sizeof(ext_backing_fmt) + strlen(backing_fmt));
+    if (backing_fmt) {
+        int padding = backing_fmt_len -
+            (sizeof(ext_backing_fmt) + strlen(backing_fmt));
 
-            memcpy(buf + offset, &ext_backing_fmt, sizeof(ext_backing_fmt));
-            offset += sizeof(ext_backing_fmt);
+        memcpy(buf + offset, &ext_backing_fmt, sizeof(ext_backing_fmt));
+        offset += sizeof(ext_backing_fmt);
 
-            memcpy(buf + offset, backing_fmt, strlen(backing_fmt));
-            offset += strlen(backing_fmt);
+        memcpy(buf + offset, backing_fmt, strlen(backing_fmt));
+        offset += strlen(backing_fmt);
 
-            memset(buf + offset, 0, padding);
-            offset += padding;
-        }
+        memset(buf + offset, 0, padding);
+        offset += padding;
+    }
+
+    if (bitmaps_size) {
+        memcpy(buf + offset, &ext_bitmaps, sizeof(ext_bitmaps));
+        offset += sizeof(ext_bitmaps);
+
+        qcow2_write_dirty_bitmap_ext(bs, buf + offset);
+        offset += bitmaps_size;
+    }
+
+    /* Without a backing file, the extensions would end at the cluster end */
+    memcpy(buf + offset, &ext_end, sizeof(ext_end));
+    offset += sizeof(ext_end);
 
+    if (backing_file) {
         memcpy(buf + offset, backing_file, backing_file_len);
-        backing_file_offset = sizeof(QCowHeader) + offset;
+        backing_file_offset = s->header_length + offset;
     }
 
-    ret = bdrv_pwrite_sync(bs->file, sizeof(QCowHeader), buf, ext_size);
+    ret = bdrv_pwrite_sync(bs->file, s->header_length, buf, ext_size);
     if (ret < 0) {
         goto fail;
     }
@@ -955,6 +1758,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
      */
     BlockDriverState* bs;
     QCowHeader header;
+    size_t header_length;
     uint8_t* refcount_table;
     int ret;
 
@@ -985,7 +1789,20 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         header.crypt_method = cpu_to_be32(QCOW_CRYPT_NONE);
     }
 
-    ret = bdrv_pwrite(bs, 0, &header, sizeof(header));
+    if (flags & (BLOCK_FLAG_LAZY_REFCOUNTS | BLOCK_FLAG_FEATURES)) {
+        header.version = cpu_to_be32(QCOW_VERSION_FEATURES);
+        if (flags & BLOCK_FLAG_LAZY_REFCOUNTS) {
+            header.compatible_features =
+                cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
+        }
+        header.refcount_order = cpu_to_be32(REFCOUNT_ORDER);
+        header.header_length = cpu_to_be32(sizeof(header));
+        header_length = sizeof(header);
+    } else {
+        header_length = QCOW_V2_HEADER_LENGTH;
+    }
+
+    ret = bdrv_pwrite(bs, 0, &header, header_length);
     if (ret < 0) {
         goto out;
     }
@@ -1059,6 +1876,7 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
     int flags = 0;
     size_t cluster_size = DEFAULT_CLUSTER_SIZE;
     int prealloc = 0;
+    int compat_features = -1;
 
     /* Read out options */
     while (options && options->name) {
@@ -1074,6 +1892,18 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
             if (options->value.n) {
                 cluster_size = options->value.n;
             }
+        } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
+            flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_COMPAT_LEVEL)) {
+            if (!options->value.s || !strcmp(options->value.s, "0.10")) {
+                compat_features = 0;
+            } else if (!strcmp(options->value.s, "1.1")) {
+                compat_features = 1;
+            } else {
+                fprintf(stderr, "Invalid compatibility level: '%s'\n",
+                    options->value.s);
+                return -EINVAL;
+            }
         } else if (!strcmp(options->name, BLOCK_OPT_PREALLOC)) {
             if (!options->value.s || !strcmp(options->value.s, "off")) {
                 prealloc = 0;
@@ -1094,6 +1924,15 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
         return -EINVAL;
     }
 
+    /* Lazy refcounts imply version 3, unless 0.10 was asked for */
+    if ((flags & BLOCK_FLAG_LAZY_REFCOUNTS) && compat_features == 0) {
+        fprintf(stderr, "Lazy refcounts need compatibility level 1.1\n");
+        return -EINVAL;
+    }
+    if (compat_features == 1) {
+        flags |= BLOCK_FLAG_FEATURES;
+    }
+
     return qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
                          cluster_size, prealloc, options);
 }
@@ -1162,13 +2001,40 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+/*
+ * Allocates room for a compressed cluster and writes its data. The data isn't
+ * sector aligned and may share a sector with the previous compressed cluster,
+ * so it is written synchronously, in allocation order.
+ */
+static int qcow2_write_compressed_data(BlockDriverState *bs,
+    int64_t sector_num, const uint8_t *buf, int len)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, len);
+    if (!cluster_offset) {
+        return -EIO;
+    }
+    cluster_offset &= s->cluster_offset_mask;
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file, cluster_offset, buf, len);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return 0;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
     int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
@@ -1185,51 +2051,121 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (nb_sectors != s->cluster_sectors)
         return -EINVAL;
 
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    out_buf = qemu_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        qemu_free(out_buf);
-        return -1;
+    /* The compressed cluster must be smaller than a normal one */
+    out_len = qcow2_compress_buffer(out_buf, s->cluster_size - 1,
+                                    buf, s->cluster_size);
+    if (out_len == -ENOSPC) {
+        /* could not compress: write normal cluster */
+        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+    } else if (out_len < 0) {
+        ret = out_len;
+    } else {
+        ret = qcow2_write_compressed_data(bs, sector_num, out_buf, out_len);
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    qemu_free(out_buf);
+    return ret;
+}
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
-        deflateEnd(&strm);
-        return -1;
+typedef struct QCowCompressAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    const uint8_t *buf;
+    uint8_t *out_buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    bool cancelled;     /* qcow2_aio_compress_cancel() waits for the request */
+    bool finished;      /* signal for cancel completion */
+} QCowCompressAIOCB;
+
+static void qcow2_aio_compress_cancel(BlockDriverAIOCB *blockacb)
+{
+    QCowCompressAIOCB *acb = container_of(blockacb, QCowCompressAIOCB, common);
+
+    /* Wait for the request to finish, the worker uses its buffers */
+    acb->cancelled = true;
+    while (!acb->finished) {
+        qemu_aio_wait();
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool qcow2_compress_aio_pool = {
+    .aiocb_size         = sizeof(QCowCompressAIOCB),
+    .cancel             = qcow2_aio_compress_cancel,
+};
+
+static void qcow2_aio_compress_complete(void *opaque, int ret)
+{
+    QCowCompressAIOCB *acb = opaque;
+
+    qemu_free(acb->out_buf);
+
+    /* qcow2_aio_compress_cancel() releases the acb */
+    if (acb->cancelled) {
+        acb->finished = true;
+        return;
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+static void qcow2_aio_compress_cb(void *opaque, int ret)
+{
+    QCowCompressAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (ret == -ENOSPC) {
         /* could not compress: write normal cluster */
-        bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset)
-            return -1;
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
+        acb->iov.iov_base = (void *) acb->buf;
+        acb->iov.iov_len = s->cluster_size;
+        qemu_iovec_init_external(&acb->qiov, &acb->iov, 1);
+        if (!bdrv_aio_writev(bs, acb->sector_num, &acb->qiov,
+                             s->cluster_sectors, qcow2_aio_compress_complete,
+                             acb)) {
+            qcow2_aio_compress_complete(acb, -EIO);
         }
+        return;
     }
 
-    qemu_free(out_buf);
-    return 0;
+    if (ret >= 0) {
+        ret = qcow2_write_compressed_data(bs, acb->sector_num, acb->out_buf,
+            ret);
+    }
+    qcow2_aio_compress_complete(acb, ret);
+}
+
+/*
+ * Compresses the cluster in a worker thread, so that callers keeping several
+ * clusters in flight (qemu-img convert -c) use all CPUs.
+ */
+static BlockDriverAIOCB *qcow2_aio_write_compressed(BlockDriverState *bs,
+    int64_t sector_num, const uint8_t *buf, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowCompressAIOCB *acb;
+
+    if (nb_sectors != s->cluster_sectors) {
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&qcow2_compress_aio_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->buf = buf;
+    acb->out_buf = qemu_malloc(s->cluster_size);
+    acb->cancelled = false;
+    acb->finished = false;
+
+    /* The compressed cluster must be smaller than a normal one */
+    qcow2_compress_async(acb->out_buf, s->cluster_size - 1,
+        buf, s->cluster_size, qcow2_aio_compress_cb, acb);
+
+    return &acb->common;
 }
 
 static int qcow2_flush(BlockDriverState *bs)
@@ -1284,9 +2220,23 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 }
 
 
+static void qcow2_info_stats(BlockDriverState *bs, QDict *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t hits, misses;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &hits, &misses);
+    qdict_put(stats, "l2_cache_hits", qint_from_int(hits));
+    qdict_put(stats, "l2_cache_misses", qint_from_int(misses));
+
+    qcow2_cache_get_stats(s->refcount_block_cache, &hits, &misses);
+    qdict_put(stats, "refcount_cache_hits", qint_from_int(hits));
+    qdict_put(stats, "refcount_cache_misses", qint_from_int(misses));
+}
+
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result)
 {
-    return qcow2_check_refcounts(bs, result);
+    return qcow2_check_refcounts(bs, result, false);
 }
 
 #if 0
@@ -1372,6 +2322,16 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_STRING,
         .help = "Preallocation mode (allowed values: off, metadata)"
     },
+    {
+        .name = BLOCK_OPT_LAZY_REFCOUNTS,
+        .type = OPT_FLAG,
+        .help = "Postpone refcount updates"
+    },
+    {
+        .name = BLOCK_OPT_COMPAT_LEVEL,
+        .type = OPT_STRING,
+        .help = "Compatibility level (0.10 or 1.1)"
+    },
     { NULL }
 };
 
@@ -1394,6 +2354,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_discard           = qcow2_discard,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_aio_write_compressed = qcow2_aio_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -1401,12 +2362,17 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_info_stats    = qcow2_info_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
 
     .bdrv_change_backing_file   = qcow2_change_backing_file,
 
+    .bdrv_load_dirty_bitmaps    = qcow2_load_dirty_bitmaps,
+    .bdrv_store_dirty_bitmaps   = qcow2_store_dirty_bitmaps,
+    .bdrv_can_store_dirty_bitmaps = qcow2_can_store_dirty_bitmaps,
+
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
 };
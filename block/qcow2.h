@@ -33,6 +33,20 @@
 
 #define QCOW_MAGIC (('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
 #define QCOW_VERSION 2
+/* Version 3 adds the feature bitmaps, it is only written when a feature
+ * needs it */
+#define QCOW_VERSION_FEATURES 3
+
+/* Incompatible feature bits */
+#define QCOW2_INCOMPAT_DIRTY        (1ULL << 0)
+#define QCOW2_INCOMPAT_MASK         QCOW2_INCOMPAT_DIRTY
+
+/* Compatible feature bits */
+#define QCOW2_COMPAT_LAZY_REFCOUNTS (1ULL << 0)
+
+/* Auto-clear feature bits, writers that don't know them clear them */
+#define QCOW2_AUTOCLEAR_BITMAPS     (1ULL << 0)
+#define QCOW2_AUTOCLEAR_MASK        QCOW2_AUTOCLEAR_BITMAPS
 
 #define QCOW_CRYPT_NONE 0
 #define QCOW_CRYPT_AES  1
@@ -45,14 +59,20 @@
 #define QCOW_OFLAG_COMPRESSED (1LL << 62)
 
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
+#define REFCOUNT_ORDER 4 /* log2 of the refcount width in bits */
 
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
-#define L2_CACHE_SIZE 16
+/* Cache sizes in tables, unless set by the l2-cache-size and
+ * refcount-cache-size drive options the L2 cache covers the whole image
+ * up to DEFAULT_L2_CACHE_BYTES */
+#define MIN_L2_CACHE_SIZE 2
+#define DEFAULT_L2_CACHE_SIZE 16
+#define DEFAULT_L2_CACHE_BYTES (32 * 1024 * 1024)
 
 /* Must be at least 4 to cover all cases of refcount table growth */
-#define REFCOUNT_CACHE_SIZE 4
+#define MIN_REFCOUNT_CACHE_SIZE 4
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
@@ -70,8 +90,17 @@ typedef struct QCowHeader {
     uint32_t refcount_table_clusters;
     uint32_t nb_snapshots;
     uint64_t snapshots_offset;
+
+    /* The following fields are only valid for version >= 3 */
+    uint64_t incompatible_features;
+    uint64_t compatible_features;
+    uint64_t autoclear_features;
+    uint32_t refcount_order;
+    uint32_t header_length;
 } QCowHeader;
 
+#define QCOW_V2_HEADER_LENGTH offsetof(QCowHeader, incompatible_features)
+
 typedef struct QCowSnapshot {
     uint64_t l1_table_offset;
     uint32_t l1_size;
@@ -83,6 +112,13 @@ typedef struct QCowSnapshot {
     uint64_t vm_clock_nsec;
 } QCowSnapshot;
 
+typedef struct QCowDirtyBitmap {
+    char *name;
+    uint64_t data_offset;       /* 0 if the bitmap is clean */
+    uint64_t nb_sectors;        /* image size the bitmap was stored for */
+    uint32_t granularity;       /* sectors per bit */
+} QCowDirtyBitmap;
+
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
@@ -106,7 +142,12 @@ typedef struct BDRVQcowState {
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
+    unsigned int cluster_cache_generation;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
+    /* allocating writes whose data is written, waiting for their L2 update */
+    QSIMPLEQ_HEAD(QCowLinkQueue, QCowAIOCB) l2_link_queue;
+    QEMUBH *l2_link_bh;
+    int l2_link_context;
 
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
@@ -122,6 +163,18 @@ typedef struct BDRVQcowState {
     int snapshots_size;
     int nb_snapshots;
     QCowSnapshot *snapshots;
+
+    /* the dirty bitmap directory in the header, see qcow2-bitmap.c */
+    int nb_dirty_bitmaps;
+    QCowDirtyBitmap *dirty_bitmaps;
+
+    int qcow_version;
+    int header_length;
+    uint64_t incompatible_features;
+    uint64_t compatible_features;
+    uint64_t autoclear_features;
+    /* refcount updates stay in the cache, the image is marked dirty */
+    bool use_lazy_refcounts;
 } BDRVQcowState;
 
 /* XXX: use std qcow open function ? */
@@ -145,6 +198,7 @@ typedef struct QCowL2Meta
     int n_start;
     int nb_available;
     int nb_clusters;
+    bool cow_done; /* head and tail were copied by the AIO write path */
     struct QCowL2Meta *depends_on;
     QLIST_HEAD(QCowAioDependencies, QCowAIOCB) dependent_requests;
 
@@ -174,6 +228,10 @@ static inline int64_t align_offset(int64_t offset, int n)
 /* qcow2.c functions */
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors);
+int qcow2_mark_dirty(BlockDriverState *bs);
+int qcow2_write_autoclear_features(BlockDriverState *bs, uint64_t features);
+int qcow2_update_ext_header(BlockDriverState *bs,
+    const char *backing_file, const char *backing_fmt);
 
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
@@ -191,7 +249,10 @@ void qcow2_create_refcount_update(QCowCreateState *s, int64_t offset,
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
 
-int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res);
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+    bool fix);
+int qcow2_prefetch_refcount_block(BlockDriverState *bs,
+    BlockDriverCompletionFunc *cb, void *opaque);
 
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size);
@@ -204,6 +265,8 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
+int qcow2_prefetch_l2(BlockDriverState *bs, uint64_t offset,
+    BlockDriverCompletionFunc *cb, void *opaque);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int n_start, int n_end, int *num, QCowL2Meta *m);
 uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
@@ -224,6 +287,32 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs, const char *snapshot_name);
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_dirty_bitmap_ext(BlockDriverState *bs, uint64_t offset,
+    uint32_t len);
+size_t qcow2_dirty_bitmap_ext_size(BlockDriverState *bs);
+void qcow2_write_dirty_bitmap_ext(BlockDriverState *bs, uint8_t *buf);
+uint64_t qcow2_dirty_bitmap_data_size(QCowDirtyBitmap *bm);
+void qcow2_free_dirty_bitmaps(BlockDriverState *bs);
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs);
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs);
+int qcow2_can_store_dirty_bitmaps(BlockDriverState *bs);
+
+/* qcow2-threads.c functions */
+typedef void Qcow2ThreadFunc(void *opaque, int ret);
+
+int qcow2_compress_buffer(uint8_t *dest, size_t dest_size,
+                          const uint8_t *src, size_t src_size);
+int qcow2_decompress_buffer(uint8_t *dest, size_t dest_size,
+                            const uint8_t *src, size_t src_size);
+void qcow2_compress_async(uint8_t *dest, size_t dest_size,
+    const uint8_t *src, size_t src_size, Qcow2ThreadFunc *cb, void *opaque);
+void qcow2_decompress_async(uint8_t *dest, size_t dest_size,
+    const uint8_t *src, size_t src_size, Qcow2ThreadFunc *cb, void *opaque);
+void qcow2_crypt_async(BDRVQcowState *s, int64_t sector_num, uint8_t *buf,
+    int nb_sectors, int enc, const AES_KEY *key,
+    Qcow2ThreadFunc *cb, void *opaque);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     bool writethrough);
@@ -234,11 +323,16 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
 void qcow2_cache_depends_on_flush(Qcow2Cache *c);
+bool qcow2_cache_set_writethrough(Qcow2Cache *c, bool enable);
+int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c);
 
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+int qcow2_cache_load_async(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, BlockDriverCompletionFunc *cb, void *opaque);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 
 #endif
@@ -27,6 +27,7 @@
 
 /* posix-aio-compat.c - thread pool based implementation */
 int paio_init(void);
+void paio_set_max_threads(int n);
 BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
@@ -39,5 +40,8 @@ void *laio_init(void);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(void *aio_ctx);
+void laio_io_unplug(void *aio_ctx);
+void laio_io_kick(void *aio_ctx);
 
 #endif /* QEMU_RAW_POSIX_AIO_H */
@@ -0,0 +1,229 @@
+/*
+ * Image streaming
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Streaming copies the data of an image's backing files into the image
+ * itself, while the guest keeps running. It walks the image and reads every
+ * range that isn't allocated yet with copy on read enabled, which writes the
+ * data back into the image. Once the whole image is populated, the backing
+ * file (or the chain down to the given base) is dropped.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "blockjob.h"
+
+#define STREAM_BUFFER_SIZE  (512 * 1024)
+#define STREAM_SECTORS      (STREAM_BUFFER_SIZE >> BDRV_SECTOR_BITS)
+
+/* allocated ranges to skip before giving the main loop a turn */
+#define STREAM_SKIP_BATCH   64
+
+typedef struct StreamBlockJob {
+    BlockJob common;
+    BlockDriverState *base;
+    int64_t sector_num;
+    int nb_sectors;
+    void *buf;
+    QEMUIOVector qiov;
+} StreamBlockJob;
+
+static const BlockJobType stream_job_type = {
+    .instance_size = sizeof(StreamBlockJob),
+    .job_type      = "stream",
+};
+
+static void stream_run(StreamBlockJob *s);
+
+/* Replaces the backing file by base, or removes it if base is NULL */
+static int stream_drop_backing_file(StreamBlockJob *s)
+{
+    BlockDriverState *bs = s->common.bs;
+    BlockDriverState *base = s->base;
+    BlockDriverState *intermediate;
+    const char *base_filename = base ? base->filename : NULL;
+    const char *base_fmt = base ? base->drv->format_name : NULL;
+    int ret;
+
+    ret = bdrv_change_backing_file(bs, base_filename, base_fmt);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Requests that still read from the old chain must be done with it */
+    bdrv_drain_all();
+
+    intermediate = bs->backing_hd;
+    while (intermediate != base) {
+        BlockDriverState *next = intermediate->backing_hd;
+
+        intermediate->backing_hd = NULL;
+        bdrv_delete(intermediate);
+        intermediate = next;
+    }
+
+    bs->backing_hd = base;
+    pstrcpy(bs->backing_file, sizeof(bs->backing_file),
+            base_filename ? base_filename : "");
+    pstrcpy(bs->backing_format, sizeof(bs->backing_format),
+            base_fmt ? base_fmt : "");
+    return 0;
+}
+
+static void stream_finish(StreamBlockJob *s, int ret)
+{
+    BlockDriverState *bs = s->common.bs;
+
+    if (block_job_is_cancelled(&s->common)) {
+        ret = -ECANCELED;
+    } else if (ret == 0) {
+        ret = stream_drop_backing_file(s);
+    }
+
+    qemu_iovec_destroy(&s->qiov);
+    qemu_vfree(s->buf);
+    bdrv_disable_copy_on_read(bs);
+    block_job_completed(&s->common, ret);
+}
+
+static void stream_complete(BlockJob *job)
+{
+    stream_finish(DO_UPCAST(StreamBlockJob, common, job), 0);
+}
+
+static void stream_cb(void *opaque, int ret)
+{
+    StreamBlockJob *s = opaque;
+
+    if (ret < 0) {
+        stream_finish(s, ret);
+        return;
+    }
+
+    s->sector_num += s->nb_sectors;
+    s->common.offset = s->sector_num * BDRV_SECTOR_SIZE;
+    stream_run(s);
+}
+
+static void stream_resume(BlockJob *job)
+{
+    stream_run(DO_UPCAST(StreamBlockJob, common, job));
+}
+
+static void stream_run(StreamBlockJob *s)
+{
+    BlockDriverState *bs = s->common.bs;
+    int64_t end = s->common.len >> BDRV_SECTOR_BITS;
+    BlockDriverAIOCB *acb;
+    int64_t delay;
+    int n, copy, skipped = 0;
+
+    while (s->sector_num < end) {
+        if (block_job_is_cancelled(&s->common)) {
+            break;
+        }
+
+        n = MIN(end - s->sector_num, STREAM_SECTORS);
+        if (bdrv_is_allocated(bs, s->sector_num, n, &n)) {
+            copy = 0;
+        } else {
+            /* Ranges that read as zeroes from the whole chain stay holes */
+            copy = bdrv_is_allocated_above(bs->backing_hd, s->base,
+                                           s->sector_num, n, &n);
+        }
+
+        if (n <= 0) {
+            /* Not expected, but don't loop forever on a broken driver */
+            stream_finish(s, -EIO);
+            return;
+        }
+
+        if (!copy) {
+            s->sector_num += n;
+            s->common.offset = s->sector_num * BDRV_SECTOR_SIZE;
+
+            /* Looking up the allocation may read metadata synchronously */
+            if (++skipped == STREAM_SKIP_BATCH) {
+                block_job_sleep(&s->common, 0, stream_resume);
+                return;
+            }
+            continue;
+        }
+
+        delay = block_job_ratelimit(&s->common, n * BDRV_SECTOR_SIZE);
+        if (delay > 0) {
+            block_job_sleep(&s->common, delay, stream_resume);
+            return;
+        }
+
+        s->nb_sectors = n;
+        qemu_iovec_reset(&s->qiov);
+        qemu_iovec_add(&s->qiov, s->buf, n * BDRV_SECTOR_SIZE);
+
+        acb = bdrv_aio_copy_on_readv(bs, s->sector_num, &s->qiov, n,
+                                     stream_cb, s);
+        if (acb == NULL) {
+            stream_finish(s, -EIO);
+        }
+        return;
+    }
+
+    /*
+     * We usually get here from the completion of the last copy, dropping
+     * the backing file drains all requests and must run from the main loop
+     */
+    block_job_sleep(&s->common, 0, stream_complete);
+}
+
+/*
+ * Starts streaming the backing chain of bs down to (excluding) base into bs.
+ * If base is NULL, the whole chain is streamed and bs ends up without a
+ * backing file. Returns -EBUSY if bs is in use.
+ */
+int stream_start(BlockDriverState *bs, BlockDriverState *base, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    StreamBlockJob *s;
+    int64_t len;
+
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        return len;
+    }
+
+    s = block_job_create(&stream_job_type, bs, cb, opaque);
+    if (s == NULL) {
+        return -EBUSY;
+    }
+
+    s->base = base;
+    s->common.len = len;
+    s->common.speed = speed;
+    s->buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+    qemu_iovec_init(&s->qiov, 1);
+
+    bdrv_enable_copy_on_read(bs);
+
+    /* Run from the main loop, so that cb is never called before we return */
+    block_job_sleep(&s->common, 0, stream_resume);
+    return 0;
+}
@@ -27,9 +27,13 @@
 #include "block.h"
 #include "qemu-option.h"
 #include "qemu-queue.h"
+#include "qdict.h"
+#include "hbitmap.h"
 
 #define BLOCK_FLAG_ENCRYPT	1
 #define BLOCK_FLAG_COMPAT6	4
+#define BLOCK_FLAG_LAZY_REFCOUNTS	8
+#define BLOCK_FLAG_FEATURES	16
 
 #define BLOCK_OPT_SIZE          "size"
 #define BLOCK_OPT_ENCRYPT       "encryption"
@@ -39,6 +43,8 @@
 #define BLOCK_OPT_CLUSTER_SIZE  "cluster_size"
 #define BLOCK_OPT_TABLE_SIZE    "table_size"
 #define BLOCK_OPT_PREALLOC      "preallocation"
+#define BLOCK_OPT_LAZY_REFCOUNTS "lazy_refcounts"
+#define BLOCK_OPT_COMPAT_LEVEL  "compat"
 
 typedef struct AIOPool {
     void (*cancel)(BlockDriverAIOCB *acb);
@@ -81,12 +87,19 @@ struct BlockDriver {
     int (*bdrv_merge_requests)(BlockDriverState *bs, BlockRequest* a,
         BlockRequest *b);
 
+    /* Requests submitted between plug and unplug may be batched */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
 
     const char *protocol_name;
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    BlockDriverAIOCB *(*bdrv_aio_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -98,6 +111,8 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /* adds driver specific counters to "info blockstats" */
+    void (*bdrv_info_stats)(BlockDriverState *bs, QDict *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, const uint8_t *buf,
                              int64_t pos, int size);
@@ -137,9 +152,27 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Persistent dirty bitmaps. Loading creates the bitmaps stored in the
+     * image after it has been opened; storing writes all persistent bitmaps
+     * of a writable image back before it is closed.
+     */
+    int (*bdrv_load_dirty_bitmaps)(BlockDriverState *bs);
+    int (*bdrv_store_dirty_bitmaps)(BlockDriverState *bs);
+    /* Returns 0 if the image can't store bitmaps although the format can */
+    int (*bdrv_can_store_dirty_bitmaps)(BlockDriverState *bs);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
+struct BdrvDirtyBitmap {
+    HBitmap *bitmap;
+    int granularity;            /* sectors per bit */
+    char *name;                 /* NULL for internal users like migration */
+    int persistent;             /* kept in the image across restarts */
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
+};
+
 struct BlockDriverState {
     int64_t total_sectors; /* if we are reading a disk image, give its
                               size in sectors */
@@ -175,12 +208,41 @@ struct BlockDriverState {
 
     void *sync_aiocb;
 
+    /* requests held back between bdrv_io_plug() and bdrv_io_unplug() */
+    int io_plugged;
+    int io_plug_context;
+    int io_merge_max; /* in sectors, 0 disables merging */
+    QTAILQ_HEAD(, BlockQueueAIOCB) io_queue;
+
+    /* I/O throttling, a leaky bucket for each limit */
+    BlockIOLimit io_limits;
+    int io_limits_enabled;
+    double io_bucket_bytes[BLOCK_IO_LIMIT_MAX];
+    double io_bucket_ops[BLOCK_IO_LIMIT_MAX];
+    int64_t io_bucket_stamp;
+    QEMUTimer *io_throttle_timer;
+    QTAILQ_HEAD(, BlockThrottleAIOCB) io_throttled[2];
+
+    /* if > 0, clusters read from the backing file are copied into the image */
+    int copy_on_read;
+    QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    QTAILQ_HEAD(, BdrvWaiter) tracked_waiters;
+
+    /* the block job running on the image, see blockjob.h */
+    struct BlockJob *job;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t rd_bytes;
     uint64_t wr_bytes;
     uint64_t rd_ops;
     uint64_t wr_ops;
     uint64_t wr_highest_sector;
+    uint64_t throttled_ops[2];
+    uint64_t throttled_ns;
+
+    /* metadata cache sizes in bytes, 0 for the driver's default */
+    uint64_t l2_cache_size;
+    uint64_t refcount_cache_size;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -196,13 +258,14 @@ struct BlockDriverState {
     int cyls, heads, secs, translation;
     BlockErrorAction on_read_error, on_write_error;
     char device_name[32];
-    unsigned long *dirty_bitmap;
-    int64_t dirty_count;
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
     void *private;
 };
 
+#define BDRV_MERGE_MAX_DEFAULT  2048
+
 #define CHANGE_MEDIA    0x01
 #define CHANGE_SIZE     0x02
 
@@ -222,6 +285,32 @@ void qemu_aio_release(void *p);
 
 void *qemu_blockalign(BlockDriverState *bs, size_t size);
 
+BlockDriverAIOCB *bdrv_aio_copy_on_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+
+int stream_start(BlockDriverState *bs, BlockDriverState *base, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque);
+
+typedef enum {
+    MIRROR_SYNC_FULL,   /* copy the whole backing chain */
+    MIRROR_SYNC_TOP,    /* copy only the topmost image */
+} MirrorSyncMode;
+
+int mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                 MirrorSyncMode mode, int target_zeroed, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque);
+
+typedef enum {
+    BACKUP_SYNC_FULL,           /* copy everything */
+    BACKUP_SYNC_INCREMENTAL,    /* copy what is dirty in a bitmap */
+} BackupSyncMode;
+
+int backup_start(BlockDriverState *bs, BlockDriverState *target,
+                 BackupSyncMode mode, BdrvDirtyBitmap *bitmap,
+                 int target_zeroed, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque);
+
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
 #endif
@@ -16,6 +16,7 @@
 #include "sysemu.h"
 #include "hw/qdev.h"
 #include "block_int.h"
+#include "blockjob.h"
 
 static QTAILQ_HEAD(drivelist, DriveInfo) drives = QTAILQ_HEAD_INITIALIZER(drives);
 
@@ -238,6 +239,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     DriveInfo *dinfo;
     int snapshot = 0;
     int ret;
+    BlockIOLimit io_limits;
 
     translation = BIOS_ATA_TRANSLATION_AUTO;
 
@@ -265,6 +267,24 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
 
+    /* I/O throttling */
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = qemu_opt_get_number(opts, "bps", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_READ] = qemu_opt_get_number(opts, "bps_rd", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = qemu_opt_get_number(opts, "bps_wr", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] = qemu_opt_get_number(opts, "iops", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_READ] =
+        qemu_opt_get_number(opts, "iops_rd", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
+        qemu_opt_get_number(opts, "iops_wr", 0);
+    io_limits.bps_max = qemu_opt_get_number(opts, "bps_max", 0);
+    io_limits.iops_max = qemu_opt_get_number(opts, "iops_max", 0);
+
+    if (!bdrv_io_limits_valid(&io_limits)) {
+        error_report("bps and iops can't be combined with their "
+                     "read or write counterpart");
+        return NULL;
+    }
+
     if ((buf = qemu_opt_get(opts, "if")) != NULL) {
         pstrcpy(devname, sizeof(devname), buf);
         for (type = 0; type < IF_COUNT && strcmp(buf, if_name[type]); type++)
@@ -533,6 +553,15 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 
     bdrv_flags |= ro ? 0 : BDRV_O_RDWR;
 
+    dinfo->bdrv->l2_cache_size = qemu_opt_get_size(opts, "l2-cache-size", 0);
+    dinfo->bdrv->refcount_cache_size =
+        qemu_opt_get_size(opts, "refcount-cache-size", 0);
+    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+    if (qemu_opt_get(opts, "merge-max-size")) {
+        bdrv_set_merge_max(dinfo->bdrv,
+            qemu_opt_get_size(opts, "merge-max-size", 0) >> BDRV_SECTOR_BITS);
+    }
+
     ret = bdrv_open(dinfo->bdrv, file, bdrv_flags, drv);
     if (ret < 0) {
         error_report("could not open disk image %s: %s",
@@ -540,6 +569,14 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         goto err;
     }
 
+    if (qemu_opt_get_bool(opts, "copy-on-read", 0)) {
+        if (ro) {
+            error_report("copy-on-read needs a writable image, ignored");
+        } else {
+            bdrv_enable_copy_on_read(dinfo->bdrv);
+        }
+    }
+
     if (bdrv_key_required(dinfo->bdrv))
         autostart = 0;
     return dinfo;
@@ -593,6 +630,12 @@ int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data)
         goto out;
     }
 
+    if (bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        ret = -1;
+        goto out;
+    }
+
     pstrcpy(old_filename, sizeof(old_filename), bs->filename);
 
     old_drv = bs->drv;
@@ -622,7 +665,7 @@ int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data)
         goto out;
     }
 
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
 
     bdrv_close(bs);
@@ -650,6 +693,10 @@ out:
 
 static int eject_device(Monitor *mon, BlockDriverState *bs, int force)
 {
+    if (bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, bdrv_get_device_name(bs));
+        return -1;
+    }
     if (!force) {
         if (!bdrv_is_removable(bs)) {
             qerror_report(QERR_DEVICE_NOT_REMOVABLE,
@@ -703,6 +750,504 @@ int do_block_set_passwd(Monitor *mon, const QDict *qdict,
     return 0;
 }
 
+static int io_limit_get(const QDict *qdict, const char *name, uint64_t *value)
+{
+    int64_t v = qdict_get_try_int(qdict, name, 0);
+
+    if (v < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, name,
+                      "a non-negative number");
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+int do_block_set_io_throttle(Monitor *mon, const QDict *qdict,
+                             QObject **ret_data)
+{
+    BlockIOLimit io_limits;
+    const char *devname = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+
+    bs = bdrv_find(devname);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, devname);
+        return -1;
+    }
+
+    if (io_limit_get(qdict, "bps", &io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) ||
+        io_limit_get(qdict, "bps_rd", &io_limits.bps[BLOCK_IO_LIMIT_READ]) ||
+        io_limit_get(qdict, "bps_wr", &io_limits.bps[BLOCK_IO_LIMIT_WRITE]) ||
+        io_limit_get(qdict, "iops", &io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) ||
+        io_limit_get(qdict, "iops_rd", &io_limits.iops[BLOCK_IO_LIMIT_READ]) ||
+        io_limit_get(qdict, "iops_wr",
+                     &io_limits.iops[BLOCK_IO_LIMIT_WRITE]) ||
+        io_limit_get(qdict, "bps_max", &io_limits.bps_max) ||
+        io_limit_get(qdict, "iops_max", &io_limits.iops_max)) {
+        return -1;
+    }
+
+    if (!bdrv_io_limits_valid(&io_limits)) {
+        qerror_report(QERR_INVALID_PARAMETER_COMBINATION);
+        return -1;
+    }
+
+    bdrv_set_io_limits(bs, &io_limits);
+    return 0;
+}
+
+static void block_job_cb(void *opaque, int ret)
+{
+    BlockDriverState *bs = opaque;
+    BlockJob *job = bs->job;
+    QObject *obj;
+    MonitorEvent event;
+
+    obj = block_job_info_obj(job);
+    if (ret < 0 && ret != -ECANCELED) {
+        QDict *dict = qobject_to_qdict(obj);
+        qdict_put(dict, "error", qstring_from_str(strerror(-ret)));
+    }
+
+    if (block_job_is_cancelled(job)) {
+        event = QEVENT_BLOCK_JOB_CANCELLED;
+    } else {
+        event = QEVENT_BLOCK_JOB_COMPLETED;
+    }
+
+    monitor_protocol_event(event, obj);
+    qobject_decref(obj);
+}
+
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *base = qdict_get_try_str(qdict, "base");
+    int64_t speed = qdict_get_try_int(qdict, "speed", 0);
+    BlockDriverState *bs;
+    BlockDriverState *base_bs = NULL;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    if (base) {
+        for (base_bs = bs->backing_hd; base_bs; base_bs = base_bs->backing_hd) {
+            if (!strcmp(base_bs->filename, base)) {
+                break;
+            }
+        }
+        if (!base_bs) {
+            qerror_report(QERR_BASE_NOT_FOUND, base);
+            return -1;
+        }
+    }
+
+    if (speed < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "speed",
+                      "a non-negative value");
+        return -1;
+    }
+
+    /* The backing file is dropped in the end, so the format must allow it */
+    if (!bs->drv || !bs->drv->bdrv_change_backing_file) {
+        qerror_report(QERR_UNSUPPORTED);
+        return -1;
+    }
+
+    ret = stream_start(bs, base_bs, speed, block_job_cb, bs);
+    if (ret == -EBUSY) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    } else if (ret < 0) {
+        qerror_report(QERR_UNDEFINED_ERROR);
+        return -1;
+    }
+    return 0;
+}
+
+int do_drive_mirror(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *target = qdict_get_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    const char *sync = qdict_get_try_str(qdict, "sync");
+    const char *mode = qdict_get_try_str(qdict, "mode");
+    int64_t speed = qdict_get_try_int(qdict, "speed", 0);
+    BlockDriverState *bs, *target_bs, *source;
+    BlockDriver *drv = NULL;
+    MirrorSyncMode sync_mode;
+    int existing, flags, ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (!bs->drv) {
+        qerror_report(QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return -1;
+    }
+    if (bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+
+    if (!sync || !strcmp(sync, "full")) {
+        sync_mode = MIRROR_SYNC_FULL;
+    } else if (!strcmp(sync, "top")) {
+        sync_mode = MIRROR_SYNC_TOP;
+    } else {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "sync", "full or top");
+        return -1;
+    }
+
+    if (!mode || !strcmp(mode, "absolute-paths")) {
+        existing = 0;
+    } else if (!strcmp(mode, "existing")) {
+        existing = 1;
+    } else {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "mode",
+                      "absolute-paths or existing");
+        return -1;
+    }
+
+    if (speed < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "speed",
+                      "a non-negative value");
+        return -1;
+    }
+
+    if (!format && !existing) {
+        format = bs->drv->format_name;
+    }
+    if (format) {
+        drv = bdrv_find_format(format);
+        if (!drv) {
+            qerror_report(QERR_INVALID_BLOCK_FORMAT, format);
+            return -1;
+        }
+    }
+
+    flags = bs->open_flags | BDRV_O_RDWR;
+
+    /* Only the top image is copied, the rest is shared via the backing file */
+    source = sync_mode == MIRROR_SYNC_TOP ? bs->backing_hd : NULL;
+
+    if (!existing) {
+        char backing_filename[PATH_MAX];
+
+        /* Protocols have no real path, they are used as they are */
+        if (source && !realpath(source->filename, backing_filename)) {
+            pstrcpy(backing_filename, sizeof(backing_filename),
+                    source->filename);
+        }
+        ret = bdrv_img_create(target, format,
+                              source ? backing_filename : NULL,
+                              source ? source->drv->format_name : NULL,
+                              NULL, bdrv_getlength(bs), flags);
+        if (ret) {
+            qerror_report(QERR_OPEN_FILE_FAILED, target);
+            return -1;
+        }
+    }
+
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, flags, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        qerror_report(QERR_OPEN_FILE_FAILED, target);
+        return -1;
+    }
+
+    ret = mirror_start(bs, target_bs, sync_mode,
+                       !existing && bdrv_has_zero_init(target_bs),
+                       speed, block_job_cb, bs);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        qerror_report(QERR_UNDEFINED_ERROR);
+        return -1;
+    }
+    return 0;
+}
+
+int do_block_dirty_bitmap_add(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *name = qdict_get_str(qdict, "name");
+    int64_t granularity = qdict_get_try_int(qdict, "granularity", 65536);
+    int persistent = qdict_get_try_bool(qdict, "persistent", 0);
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (!bs->drv) {
+        qerror_report(QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return -1;
+    }
+
+    if (!*name) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "name",
+                      "a non-empty string");
+        return -1;
+    }
+    if (granularity < BDRV_SECTOR_SIZE || granularity > (1LL << 30) ||
+        (granularity & (granularity - 1))) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "granularity",
+                      "a power of two between 512 and 1G");
+        return -1;
+    }
+    if (bdrv_find_dirty_bitmap(bs, name)) {
+        qerror_report(QERR_DUPLICATE_ID, name, "dirty bitmap");
+        return -1;
+    }
+
+    /* A persistent bitmap is written back to the image when it is closed */
+    if (persistent) {
+        if (!bdrv_can_store_dirty_bitmaps(bs)) {
+            qerror_report(QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
+                          bs->drv->format_name, device, "persistent bitmaps");
+            return -1;
+        }
+        if (bdrv_is_read_only(bs)) {
+            qerror_report(QERR_DEVICE_IS_READ_ONLY, device);
+            return -1;
+        }
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity >> BDRV_SECTOR_BITS,
+                                      name);
+    if (!bitmap) {
+        qerror_report(QERR_UNDEFINED_ERROR);
+        return -1;
+    }
+    bdrv_dirty_bitmap_set_persistent(bs, bitmap, persistent);
+    return 0;
+}
+
+int do_block_dirty_bitmap_remove(Monitor *mon, const QDict *qdict,
+                                 QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *name = qdict_get_str(qdict, "name");
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        qerror_report(QERR_DIRTY_BITMAP_NOT_FOUND, device, name);
+        return -1;
+    }
+
+    /* A running backup may be about to clear it */
+    if (bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+
+    bdrv_release_dirty_bitmap(bs, bitmap);
+    return 0;
+}
+
+int do_drive_backup(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *target = qdict_get_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    const char *sync = qdict_get_try_str(qdict, "sync");
+    const char *bitmap_name = qdict_get_try_str(qdict, "bitmap");
+    const char *mode = qdict_get_try_str(qdict, "mode");
+    int64_t speed = qdict_get_try_int(qdict, "speed", 0);
+    BlockDriverState *bs, *target_bs;
+    BlockDriver *drv = NULL;
+    BdrvDirtyBitmap *bitmap = NULL;
+    BackupSyncMode sync_mode;
+    int existing, flags, ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (!bs->drv) {
+        qerror_report(QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return -1;
+    }
+    if (bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+
+    if (!sync || !strcmp(sync, "full")) {
+        sync_mode = BACKUP_SYNC_FULL;
+    } else if (!strcmp(sync, "incremental")) {
+        sync_mode = BACKUP_SYNC_INCREMENTAL;
+    } else {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "sync",
+                      "full or incremental");
+        return -1;
+    }
+
+    if (bitmap_name) {
+        bitmap = bdrv_find_dirty_bitmap(bs, bitmap_name);
+        if (!bitmap) {
+            qerror_report(QERR_DIRTY_BITMAP_NOT_FOUND, device, bitmap_name);
+            return -1;
+        }
+    } else if (sync_mode == BACKUP_SYNC_INCREMENTAL) {
+        qerror_report(QERR_MISSING_PARAMETER, "bitmap");
+        return -1;
+    }
+
+    if (!mode || !strcmp(mode, "absolute-paths")) {
+        existing = 0;
+    } else if (!strcmp(mode, "existing")) {
+        existing = 1;
+    } else {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "mode",
+                      "absolute-paths or existing");
+        return -1;
+    }
+
+    if (speed < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "speed",
+                      "a non-negative value");
+        return -1;
+    }
+
+    if (!format && !existing) {
+        format = bs->drv->format_name;
+    }
+    if (format) {
+        drv = bdrv_find_format(format);
+        if (!drv) {
+            qerror_report(QERR_INVALID_BLOCK_FORMAT, format);
+            return -1;
+        }
+    }
+
+    flags = bs->open_flags | BDRV_O_RDWR;
+
+    /* A backup stands on its own, so a new target gets no backing file */
+    if (!existing) {
+        ret = bdrv_img_create(target, format, NULL, NULL, NULL,
+                              bdrv_getlength(bs), flags);
+        if (ret) {
+            qerror_report(QERR_OPEN_FILE_FAILED, target);
+            return -1;
+        }
+    }
+
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, flags, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        qerror_report(QERR_OPEN_FILE_FAILED, target);
+        return -1;
+    }
+
+    ret = backup_start(bs, target_bs, sync_mode, bitmap,
+                       !existing && bdrv_has_zero_init(target_bs),
+                       speed, block_job_cb, bs);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        qerror_report(QERR_UNDEFINED_ERROR);
+        return -1;
+    }
+    return 0;
+}
+
+static BlockJob *find_block_job(const char *device)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return NULL;
+    }
+    if (!bs->job) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return NULL;
+    }
+    return bs->job;
+}
+
+int do_block_job_set_speed(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    int64_t value = qdict_get_int(qdict, "value");
+    BlockJob *job;
+
+    job = find_block_job(device);
+    if (!job) {
+        return -1;
+    }
+    if (value < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a non-negative value");
+        return -1;
+    }
+
+    block_job_set_speed(job, value);
+    return 0;
+}
+
+int do_block_job_complete(Monitor *mon, const QDict *qdict,
+                          QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockJob *job;
+    int ret;
+
+    job = find_block_job(device);
+    if (!job) {
+        return -1;
+    }
+
+    ret = block_job_complete(job);
+    if (ret == -ENOTSUP) {
+        qerror_report(QERR_UNSUPPORTED);
+        return -1;
+    } else if (ret == -EBUSY) {
+        qerror_report(QERR_BLOCK_JOB_NOT_READY, device);
+        return -1;
+    } else if (ret < 0) {
+        qerror_report(QERR_UNDEFINED_ERROR);
+        return -1;
+    }
+    return 0;
+}
+
+int do_block_job_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    BlockJob *job;
+
+    job = find_block_job(qdict_get_str(qdict, "device"));
+    if (!job) {
+        return -1;
+    }
+
+    block_job_cancel(job);
+    return 0;
+}
+
 int do_change_block(Monitor *mon, const char *device,
                     const char *filename, const char *fmt)
 {
@@ -750,7 +1295,7 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
     }
 
     /* quiesce block driver; prevent further io */
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
     bdrv_close(bs);
 
@@ -60,6 +60,20 @@ DriveInfo *add_init_drive(const char *opts);
 void do_commit(Monitor *mon, const QDict *qdict);
 int do_eject(Monitor *mon, const QDict *qdict, QObject **ret_data);
 int do_block_set_passwd(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_block_set_io_throttle(Monitor *mon, const QDict *qdict,
+                             QObject **ret_data);
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_block_job_set_speed(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data);
+int do_drive_mirror(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_block_dirty_bitmap_add(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+int do_block_dirty_bitmap_remove(Monitor *mon, const QDict *qdict,
+                                 QObject **ret_data);
+int do_drive_backup(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_block_job_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_block_job_complete(Monitor *mon, const QDict *qdict,
+                          QObject **ret_data);
 int do_change_block(Monitor *mon, const char *device,
                     const char *filename, const char *fmt);
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data);
@@ -0,0 +1,267 @@
+/*
+ * Block jobs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * A block job is a long running background operation on an image, like
+ * streaming its backing file into it. At most one job runs per image and
+ * keeps the image in use while it runs. This file does the bookkeeping that
+ * all jobs share: creation, cancellation, rate limiting and the monitor
+ * interface; the jobs themselves live in block/.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "blockjob.h"
+#include "qemu-timer.h"
+#include "qemu-objects.h"
+#include "monitor.h"
+
+/* the interval over which the speed limit is enforced */
+#define BLOCK_JOB_SLICE_NS  100000000LL
+
+static void block_job_timer(void *opaque)
+{
+    BlockJob *job = opaque;
+    void (*resume)(BlockJob *job) = job->resume;
+
+    job->resume = NULL;
+    resume(job);
+}
+
+/*
+ * Creates a job of the given type on the image. Returns NULL if the image
+ * is already in use, by another job or e.g. by block migration. cb is
+ * called when the job ends, with -ECANCELED if it was cancelled.
+ */
+void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
+                       BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockJob *job;
+
+    if (bs->job || bdrv_in_use(bs)) {
+        return NULL;
+    }
+
+    job = qemu_mallocz(job_type->instance_size);
+    job->job_type = job_type;
+    job->bs = bs;
+    job->cb = cb;
+    job->opaque = opaque;
+    job->timer = qemu_new_timer_ns(rt_clock, block_job_timer, job);
+
+    bs->job = job;
+    bdrv_set_in_use(bs, 1);
+    return job;
+}
+
+/*
+ * Ends the job. The completion callback still sees the job in bs->job,
+ * which is freed afterwards.
+ */
+void block_job_completed(BlockJob *job, int ret)
+{
+    BlockDriverState *bs = job->bs;
+
+    assert(bs->job == job);
+    job->cb(job->opaque, ret);
+
+    bs->job = NULL;
+    bdrv_set_in_use(bs, 0);
+    qemu_del_timer(job->timer);
+    qemu_free_timer(job->timer);
+    qemu_free(job);
+}
+
+int block_job_is_cancelled(BlockJob *job)
+{
+    return job->cancelled;
+}
+
+void block_job_set_speed(BlockJob *job, int64_t speed)
+{
+    job->speed = speed;
+    job->slice_end = 0;
+
+    /* A sleeping job recalculates its delay with the new limit */
+    if (job->resume) {
+        qemu_mod_timer(job->timer, qemu_get_clock_ns(rt_clock));
+    }
+}
+
+/*
+ * Returns how long in ns the job has to sleep before it may transfer the
+ * given number of bytes, or 0 if it may do so now. The bytes are accounted
+ * only in the latter case.
+ */
+int64_t block_job_ratelimit(BlockJob *job, uint64_t bytes)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    uint64_t quota;
+
+    if (!job->speed) {
+        return 0;
+    }
+
+    if (now >= job->slice_end) {
+        job->slice_end = now + BLOCK_JOB_SLICE_NS;
+        job->slice_bytes = 0;
+    }
+
+    /* A chunk larger than the quota must still be able to go at some point */
+    quota = job->speed * BLOCK_JOB_SLICE_NS / get_ticks_per_sec();
+    if (job->slice_bytes && job->slice_bytes + bytes > quota) {
+        return job->slice_end - now;
+    }
+    job->slice_bytes += bytes;
+    return 0;
+}
+
+/*
+ * Calls resume after ns nanoseconds, or earlier when the job is cancelled
+ * or its speed changes. The job must not have I/O in flight meanwhile.
+ */
+void block_job_sleep(BlockJob *job, int64_t ns, void (*resume)(BlockJob *job))
+{
+    job->resume = resume;
+    qemu_mod_timer(job->timer, qemu_get_clock_ns(rt_clock) + ns);
+}
+
+/*
+ * Asks the job to stop. It ends as soon as its current I/O completes, and
+ * its completion callback gets -ECANCELED.
+ */
+void block_job_cancel(BlockJob *job)
+{
+    job->cancelled = 1;
+    if (job->resume) {
+        qemu_mod_timer(job->timer, qemu_get_clock_ns(rt_clock));
+    }
+}
+
+/*
+ * Cancels the job and waits for it to end. Timers don't run in
+ * qemu_aio_wait(), so a sleeping job is woken up directly, also when it
+ * goes to sleep again to finish from the main loop.
+ */
+void block_job_cancel_sync(BlockJob *job)
+{
+    BlockDriverState *bs = job->bs;
+
+    block_job_cancel(job);
+    while (bs->job) {
+        if (job->resume) {
+            qemu_del_timer(job->timer);
+            block_job_timer(job);
+        } else {
+            qemu_aio_wait();
+        }
+    }
+}
+
+/* Called by a job that runs until told so once it can be completed */
+void block_job_ready(BlockJob *job)
+{
+    QObject *data;
+
+    job->ready = 1;
+
+    data = block_job_info_obj(job);
+    monitor_protocol_event(QEVENT_BLOCK_JOB_READY, data);
+    qobject_decref(data);
+}
+
+/*
+ * Asks a job that runs until told so to finish successfully. Returns
+ * -ENOTSUP for jobs that end by themselves and -EBUSY if the job isn't
+ * ready yet.
+ */
+int block_job_complete(BlockJob *job)
+{
+    int ret;
+
+    if (!job->job_type->complete) {
+        return -ENOTSUP;
+    }
+    if (!job->ready) {
+        return -EBUSY;
+    }
+
+    ret = job->job_type->complete(job);
+    if (ret == 0 && job->resume) {
+        qemu_mod_timer(job->timer, qemu_get_clock_ns(rt_clock));
+    }
+    return ret;
+}
+
+QObject *block_job_info_obj(BlockJob *job)
+{
+    return qobject_from_jsonf("{ 'type': %s, 'device': %s, "
+                              "'len': %" PRId64 ", "
+                              "'offset': %" PRId64 ", "
+                              "'speed': %" PRId64 ", "
+                              "'ready': %i }",
+                              job->job_type->job_type,
+                              bdrv_get_device_name(job->bs),
+                              job->len, job->offset, job->speed,
+                              job->ready);
+}
+
+void block_job_info(Monitor *mon, QObject **ret_data)
+{
+    QList *jobs = qlist_new();
+    BlockDriverState *bs = NULL;
+
+    while ((bs = bdrv_next(bs))) {
+        if (bs->job) {
+            qlist_append_obj(jobs, block_job_info_obj(bs->job));
+        }
+    }
+
+    *ret_data = QOBJECT(jobs);
+}
+
+static void block_job_info_print_iter(QObject *data, void *opaque)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    Monitor *mon = opaque;
+
+    monitor_printf(mon, "Job %s on device %s: Completed %" PRId64
+                        " of %" PRId64 " bytes, speed limit %" PRId64
+                        " bytes/s%s\n",
+                   qdict_get_str(qdict, "type"),
+                   qdict_get_str(qdict, "device"),
+                   qdict_get_int(qdict, "offset"),
+                   qdict_get_int(qdict, "len"),
+                   qdict_get_int(qdict, "speed"),
+                   qdict_get_bool(qdict, "ready") ? ", ready" : "");
+}
+
+void block_job_info_print(Monitor *mon, const QObject *data)
+{
+    QList *list = qobject_to_qlist(data);
+
+    if (qlist_empty(list)) {
+        monitor_printf(mon, "No active jobs\n");
+        return;
+    }
+    qlist_iter(list, block_job_info_print_iter, mon);
+}
@@ -0,0 +1,88 @@
+/*
+ * Block jobs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef BLOCKJOB_H
+#define BLOCKJOB_H
+
+#include "block.h"
+#include "qobject.h"
+
+typedef struct BlockJob BlockJob;
+
+typedef struct BlockJobType {
+    /* size of the job's state, which starts with a BlockJob */
+    size_t instance_size;
+
+    /* the job type as shown by query-block-jobs */
+    const char *job_type;
+
+    /* asks the job to finish successfully, for jobs that run until told so */
+    int (*complete)(BlockJob *job);
+} BlockJobType;
+
+/*
+ * Jobs run in the I/O thread as a chain of AIO callbacks. They have to
+ * check block_job_is_cancelled() whenever their I/O completes and then
+ * finish by calling block_job_completed() once nothing is in flight.
+ */
+struct BlockJob {
+    const BlockJobType *job_type;
+    BlockDriverState *bs;
+    int cancelled;
+
+    /* progress in bytes, len is the amount of work to do in total */
+    int64_t offset;
+    int64_t len;
+
+    /* set once a job that runs until told so can be completed */
+    int ready;
+
+    /* limit in bytes per second, 0 for unlimited */
+    int64_t speed;
+    int64_t slice_end;
+    uint64_t slice_bytes;
+
+    /* set while the job sleeps */
+    QEMUTimer *timer;
+    void (*resume)(BlockJob *job);
+
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+};
+
+void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
+                       BlockDriverCompletionFunc *cb, void *opaque);
+void block_job_completed(BlockJob *job, int ret);
+int block_job_is_cancelled(BlockJob *job);
+void block_job_set_speed(BlockJob *job, int64_t speed);
+int64_t block_job_ratelimit(BlockJob *job, uint64_t bytes);
+void block_job_sleep(BlockJob *job, int64_t ns, void (*resume)(BlockJob *job));
+void block_job_cancel(BlockJob *job);
+void block_job_cancel_sync(BlockJob *job);
+void block_job_ready(BlockJob *job);
+int block_job_complete(BlockJob *job);
+
+QObject *block_job_info_obj(BlockJob *job);
+void block_job_info(Monitor *mon, QObject **ret_data);
+void block_job_info_print(Monitor *mon, const QObject *data);
+
+#endif
@@ -0,0 +1,753 @@
+/*
+ * Block layer unit-tests.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+#include <check.h>
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "blockjob.h"
+#include "block/qcow2.h"
+
+/*
+ * The tests run without a main loop: timers never fire, and the clock of
+ * qemu-tool stands still, so I/O limits never drain by themselves.
+ */
+
+static char test_image[32];
+static char backing_image[32];
+
+static void create_image(char *filename, const char *fmt,
+                         const char *backing, int64_t size)
+{
+    int fd;
+
+    pstrcpy(filename, 32, "/tmp/check-block.XXXXXX");
+    fd = mkstemp(filename);
+    fail_unless(fd >= 0);
+    close(fd);
+
+    /* qcow2 images need version 3 for persistent bitmaps */
+    fail_unless(bdrv_img_create(filename, fmt, backing, backing ? "raw" : NULL,
+                                !strcmp(fmt, "qcow2") ? (char *) "compat=1.1"
+                                                      : NULL,
+                                size, 0) == 0);
+}
+
+#define BACKING_PATTERN 0x55
+
+static void fill_backing_image(int64_t size)
+{
+    BlockDriverState *bs;
+    uint8_t buf[64 * BDRV_SECTOR_SIZE];
+    int64_t sector_num;
+
+    create_image(backing_image, "raw", NULL, size);
+    bs = bdrv_new("");
+    fail_unless(bdrv_open(bs, backing_image, BDRV_O_RDWR, NULL) == 0);
+
+    memset(buf, BACKING_PATTERN, sizeof(buf));
+    for (sector_num = 0; sector_num < size >> BDRV_SECTOR_BITS;
+         sector_num += 64) {
+        fail_unless(bdrv_write(bs, sector_num, buf, 64) == 0);
+    }
+    bdrv_delete(bs);
+}
+
+/*
+ * Creates and opens an image. If backing is set, it gets a raw backing file
+ * filled with BACKING_PATTERN.
+ */
+static BlockDriverState *open_test_image(const char *fmt, int64_t size,
+                                         int backing)
+{
+    BlockDriverState *bs;
+
+    bdrv_init();
+    backing_image[0] = '\0';
+    if (backing) {
+        fill_backing_image(size);
+    }
+    create_image(test_image, fmt, backing ? backing_image : NULL, size);
+
+    bs = bdrv_new("");
+    fail_unless(bdrv_open(bs, test_image, BDRV_O_RDWR,
+                          bdrv_find_format(fmt)) == 0);
+    return bs;
+}
+
+static void close_test_image(BlockDriverState *bs)
+{
+    bdrv_delete(bs);
+    unlink(test_image);
+    if (backing_image[0]) {
+        unlink(backing_image);
+    }
+}
+
+static void set_write_iops(BlockDriverState *bs, uint64_t iops)
+{
+    BlockIOLimit limits;
+
+    memset(&limits, 0, sizeof(limits));
+    limits.iops[BLOCK_IO_LIMIT_WRITE] = iops;
+    bdrv_set_io_limits(bs, &limits);
+}
+
+static void count_cb(void *opaque, int ret)
+{
+    int *count = opaque;
+
+    fail_unless(ret == 0);
+    (*count)++;
+}
+
+typedef struct TestRequest {
+    int cancelled;
+    int completed;
+} TestRequest;
+
+static void request_cb(void *opaque, int ret)
+{
+    TestRequest *req = opaque;
+
+    fail_if(req->cancelled, "cancelled request called back");
+    req->completed++;
+}
+
+static int bucket_writes;
+
+/* Fills the write bucket and queues nb writes behind it */
+static void queue_writes(BlockDriverState *bs, QEMUIOVector *qiov, int nb,
+                         BlockDriverAIOCB **acbs, TestRequest *reqs)
+{
+    int i;
+
+    fail_unless(bdrv_aio_writev(bs, 0, qiov, 1, count_cb,
+                                &bucket_writes) != NULL);
+    for (i = 0; i < nb; i++) {
+        memset(&reqs[i], 0, sizeof(reqs[i]));
+        acbs[i] = bdrv_aio_writev(bs, 8 + i, qiov, 1, request_cb, &reqs[i]);
+        fail_unless(acbs[i] != NULL);
+    }
+}
+
+static void cancel_request(BlockDriverAIOCB *acb, TestRequest *req)
+{
+    req->cancelled = 1;
+    bdrv_aio_cancel(acb);
+}
+
+/*
+ * Synchronous I/O of a format without native bdrv_read/bdrv_write is
+ * emulated through AIO in a nested async context. It must get through while
+ * throttled requests of the main context wait, the timer that would
+ * dispatch them can't run there.
+ */
+START_TEST(throttle_nested_sync_test)
+{
+    BlockDriverState *bs = open_test_image("qcow2", 1024 * 1024, 0);
+    uint8_t buf[BDRV_SECTOR_SIZE], data[BDRV_SECTOR_SIZE];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    QEMUIOVector qiov;
+    BlockDriverAIOCB *acbs[2];
+    TestRequest reqs[2];
+
+    memset(buf, 0x11, sizeof(buf));
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    set_write_iops(bs, 1);
+    queue_writes(bs, &qiov, 2, acbs, reqs);
+    qemu_aio_flush();
+    fail_unless(bucket_writes == 1 && !reqs[0].completed);
+
+    memset(data, 0x22, sizeof(data));
+    fail_unless(bdrv_write(bs, 100, data, 1) == 0);
+    memset(data, 0, sizeof(data));
+    fail_unless(bdrv_read(bs, 100, data, 1) == 0);
+    fail_unless(data[0] == 0x22 && data[BDRV_SECTOR_SIZE - 1] == 0x22);
+    fail_unless(!reqs[0].completed && !reqs[1].completed);
+
+    /* Lifting the limits submits the waiting writes */
+    set_write_iops(bs, 0);
+    bdrv_drain_all();
+    fail_unless(reqs[0].completed == 1 && reqs[1].completed == 1);
+
+    close_test_image(bs);
+}
+END_TEST
+
+/*
+ * Cancelling a throttled request, before and after it was handed to the
+ * driver. QED completes a request from its cancel function.
+ */
+static void throttle_cancel(const char *fmt)
+{
+    BlockDriverState *bs = open_test_image(fmt, 1024 * 1024, 0);
+    uint8_t buf[BDRV_SECTOR_SIZE];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    QEMUIOVector qiov;
+    BlockDriverAIOCB *acbs[3];
+    TestRequest reqs[3];
+
+    memset(buf, 0x33, sizeof(buf));
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    set_write_iops(bs, 1);
+    queue_writes(bs, &qiov, 3, acbs, reqs);
+    qemu_aio_flush();
+
+    cancel_request(acbs[0], &reqs[0]);
+    set_write_iops(bs, 0);
+    /* Waiting for a cancelled request may complete the other one */
+    cancel_request(acbs[1], &reqs[1]);
+    bdrv_drain_all();
+    fail_unless(reqs[2].completed == 1);
+
+    close_test_image(bs);
+}
+
+START_TEST(throttle_cancel_qcow2_test)
+{
+    throttle_cancel("qcow2");
+}
+END_TEST
+
+START_TEST(throttle_cancel_qed_test)
+{
+    throttle_cancel("qed");
+}
+END_TEST
+
+START_TEST(copy_on_read_test)
+{
+    BlockDriverState *bs = open_test_image("qcow2", 1024 * 1024, 1);
+    uint8_t buf[BDRV_SECTOR_SIZE];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    QEMUIOVector qiov;
+    int completed = 0;
+    int n;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    bdrv_enable_copy_on_read(bs);
+    fail_unless(bdrv_aio_readv(bs, 130, &qiov, 1, count_cb,
+                               &completed) != NULL);
+    bdrv_drain_all();
+    fail_unless(completed == 1);
+    fail_unless(buf[0] == BACKING_PATTERN &&
+                buf[BDRV_SECTOR_SIZE - 1] == BACKING_PATTERN);
+
+    /* The whole cluster was written back, and nothing else */
+    fail_unless(bdrv_is_allocated(bs, 128, 128, &n) && n == 128);
+    fail_unless(!bdrv_is_allocated(bs, 0, 128, &n));
+    fail_unless(!bdrv_is_allocated(bs, 256, 128, &n));
+
+    /* Synchronous reads come from a nested context and don't copy */
+    fail_unless(bdrv_read(bs, 0, buf, 1) == 0);
+    fail_unless(!bdrv_is_allocated(bs, 0, 128, &n));
+
+    bdrv_disable_copy_on_read(bs);
+    close_test_image(bs);
+}
+END_TEST
+
+/*
+ * Cancelling copy on read requests, before and while their read is in
+ * flight, and a write that waits for one of them.
+ */
+static void copy_on_read_cancel(const char *fmt)
+{
+    BlockDriverState *bs = open_test_image(fmt, 1024 * 1024, 1);
+    uint8_t buf[3][BDRV_SECTOR_SIZE];
+    struct iovec iov[3];
+    QEMUIOVector qiov[3];
+    BlockDriverAIOCB *acbs[3];
+    TestRequest reqs[3];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        memset(buf[i], 0x66, sizeof(buf[i]));
+        iov[i].iov_base = buf[i];
+        iov[i].iov_len = sizeof(buf[i]);
+        qemu_iovec_init_external(&qiov[i], &iov[i], 1);
+        memset(&reqs[i], 0, sizeof(reqs[i]));
+    }
+
+    bdrv_enable_copy_on_read(bs);
+
+    acbs[0] = bdrv_aio_readv(bs, 0, &qiov[0], 1, request_cb, &reqs[0]);
+    acbs[1] = bdrv_aio_readv(bs, 1000, &qiov[1], 1, request_cb, &reqs[1]);
+    acbs[2] = bdrv_aio_writev(bs, 1, &qiov[2], 1, request_cb, &reqs[2]);
+    fail_unless(acbs[0] && acbs[1] && acbs[2]);
+
+    /* The copy of acbs[0] hasn't started yet, the write waits for it */
+    cancel_request(acbs[0], &reqs[0]);
+    fail_unless(!reqs[2].completed);
+
+    /* Let the read of acbs[1] start */
+    qemu_aio_wait();
+    cancel_request(acbs[1], &reqs[1]);
+    bdrv_drain_all();
+    fail_unless(reqs[2].completed == 1);
+
+    bdrv_disable_copy_on_read(bs);
+    close_test_image(bs);
+}
+
+START_TEST(copy_on_read_cancel_qcow2_test)
+{
+    copy_on_read_cancel("qcow2");
+}
+END_TEST
+
+START_TEST(copy_on_read_cancel_qed_test)
+{
+    copy_on_read_cancel("qed");
+}
+END_TEST
+
+static char target_image[32];
+
+static BlockDriverState *open_target_image(const char *fmt, int64_t size)
+{
+    BlockDriverState *target;
+
+    create_image(target_image, fmt, NULL, size);
+    target = bdrv_new("");
+    fail_unless(bdrv_open(target, target_image, BDRV_O_RDWR,
+                          bdrv_find_format(fmt)) == 0);
+    return target;
+}
+
+static void fill_sectors(BlockDriverState *bs, int64_t sector_num,
+                         int nb_sectors, int pattern)
+{
+    uint8_t buf[BDRV_SECTOR_SIZE];
+    int i;
+
+    memset(buf, pattern, sizeof(buf));
+    for (i = 0; i < nb_sectors; i++) {
+        fail_unless(bdrv_write(bs, sector_num + i, buf, 1) == 0);
+    }
+}
+
+static void check_sectors(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors, int pattern)
+{
+    uint8_t buf[BDRV_SECTOR_SIZE];
+    int i, j;
+
+    for (i = 0; i < nb_sectors; i++) {
+        fail_unless(bdrv_read(bs, sector_num + i, buf, 1) == 0);
+        for (j = 0; j < BDRV_SECTOR_SIZE; j++) {
+            fail_unless(buf[j] == pattern);
+        }
+    }
+}
+
+static void job_cb(void *opaque, int ret)
+{
+    *(int *)opaque = ret;
+}
+
+/*
+ * Timers don't run here, so this plays the job's timer. Returns once the
+ * job has ended, or, if ready is set, when it is ready to be completed.
+ */
+static void run_job(BlockDriverState *bs, int ready)
+{
+    void (*resume)(BlockJob *job);
+
+    while (bs->job && !(ready && bs->job->ready)) {
+        if (bs->job->resume) {
+            resume = bs->job->resume;
+            bs->job->resume = NULL;
+            resume(bs->job);
+        } else {
+            qemu_aio_wait();
+        }
+    }
+}
+
+START_TEST(mirror_pivot_test)
+{
+    BlockDriverState *bs = open_test_image("qcow2", 4 * 1024 * 1024, 1);
+    BlockDriverState *target;
+    BdrvDirtyBitmap *bitmap;
+    int ret = -EINPROGRESS;
+
+    fill_sectors(bs, 0, 3, 0x11);
+    fill_sectors(bs, 5000, 1, 0x22);
+    bitmap = bdrv_create_dirty_bitmap(bs, 128, "backup");
+    fail_unless(bitmap != NULL);
+    fail_unless(bdrv_dirty_bitmap_set_persistent(bs, bitmap, 1) == 0);
+
+    target = open_target_image("qcow2", 4 * 1024 * 1024);
+    fail_unless(mirror_start(bs, target, MIRROR_SYNC_FULL, 1, 0, job_cb,
+                             &ret) == 0);
+    run_job(bs, 1);
+    fail_unless(bs->job != NULL && ret == -EINPROGRESS);
+
+    /* Writes after the job became ready are copied at completion */
+    fill_sectors(bs, 1000, 2, 0x33);
+    fail_unless(block_job_complete(bs->job) == 0);
+    run_job(bs, 0);
+    fail_unless(ret == 0);
+
+    /* The device is on the target now, with all of the data */
+    fail_unless(!strcmp(bs->filename, target_image));
+    fail_unless(bs->backing_hd == NULL);
+    check_sectors(bs, 0, 3, 0x11);
+    check_sectors(bs, 3, 1, BACKING_PATTERN);
+    check_sectors(bs, 1000, 2, 0x33);
+    check_sectors(bs, 5000, 1, 0x22);
+
+    /* Named bitmaps go along and are stored into the target on close */
+    bitmap = bdrv_find_dirty_bitmap(bs, "backup");
+    fail_unless(bitmap != NULL && bitmap->persistent);
+    fail_unless(bdrv_get_dirty_count(bs, bitmap) == 128);
+    fail_unless(bdrv_get_dirty(bs, bitmap, 1000));
+
+    bdrv_delete(bs);
+    bs = bdrv_new("");
+    fail_unless(bdrv_open(bs, target_image, BDRV_O_RDWR,
+                          bdrv_find_format("qcow2")) == 0);
+    bitmap = bdrv_find_dirty_bitmap(bs, "backup");
+    fail_unless(bitmap != NULL && bdrv_get_dirty(bs, bitmap, 1000));
+    bdrv_delete(bs);
+
+    bs = bdrv_new("");
+    fail_unless(bdrv_open(bs, test_image, BDRV_O_RDWR,
+                          bdrv_find_format("qcow2")) == 0);
+    fail_unless(bdrv_find_dirty_bitmap(bs, "backup") == NULL);
+
+    close_test_image(bs);
+    unlink(target_image);
+}
+END_TEST
+
+/* A cancelled mirror leaves the device where it was */
+START_TEST(mirror_cancel_test)
+{
+    BlockDriverState *bs = open_test_image("qcow2", 1024 * 1024, 0);
+    BlockDriverState *target;
+    char filename[32];
+    int ret = -EINPROGRESS;
+
+    pstrcpy(filename, sizeof(filename), bs->filename);
+    target = open_target_image("raw", 1024 * 1024);
+    fail_unless(mirror_start(bs, target, MIRROR_SYNC_FULL, 0, 0, job_cb,
+                             &ret) == 0);
+    run_job(bs, 1);
+    block_job_cancel_sync(bs->job);
+    fail_unless(ret == -ECANCELED && bs->job == NULL);
+    fail_unless(!strcmp(bs->filename, filename));
+
+    close_test_image(bs);
+    unlink(target_image);
+}
+END_TEST
+
+/* Deleting an image cancels its job */
+START_TEST(delete_with_job_test)
+{
+    BlockDriverState *bs = open_test_image("qcow2", 1024 * 1024, 0);
+    BlockDriverState *target;
+    int ret = -EINPROGRESS;
+
+    fill_sectors(bs, 0, 1, 0x44);
+    target = open_target_image("raw", 1024 * 1024);
+    fail_unless(mirror_start(bs, target, MIRROR_SYNC_FULL, 0, 0, job_cb,
+                             &ret) == 0);
+    close_test_image(bs);
+    fail_unless(ret == -ECANCELED);
+    unlink(target_image);
+}
+END_TEST
+
+static void backup(BackupSyncMode mode)
+{
+    BlockDriverState *bs = open_test_image("qcow2", 4 * 1024 * 1024, 0);
+    BlockDriverState *target;
+    BdrvDirtyBitmap *bitmap;
+    int ret = -EINPROGRESS;
+    int n;
+
+    fill_sectors(bs, 0, 1, 0x55);
+    bitmap = bdrv_create_dirty_bitmap(bs, 128, "backup");
+    fail_unless(bitmap != NULL);
+    fill_sectors(bs, 2000, 4, 0x66);
+
+    target = open_target_image("qcow2", 4 * 1024 * 1024);
+    fail_unless(backup_start(bs, target, mode, bitmap, 1, 0, job_cb,
+                             &ret) == 0);
+    run_job(bs, 0);
+    fail_unless(ret == 0);
+    fail_unless(bdrv_get_dirty_count(bs, bitmap) == 0);
+
+    /* The device stays on its image */
+    fail_unless(!strcmp(bs->filename, test_image));
+    close_test_image(bs);
+
+    target = bdrv_new("");
+    fail_unless(bdrv_open(target, target_image, 0, NULL) == 0);
+    check_sectors(target, 2000, 4, 0x66);
+    if (mode == BACKUP_SYNC_INCREMENTAL) {
+        fail_unless(!bdrv_is_allocated(target, 0, 128, &n));
+    } else {
+        check_sectors(target, 0, 1, 0x55);
+    }
+    bdrv_delete(target);
+    unlink(target_image);
+}
+
+START_TEST(backup_full_test)
+{
+    backup(BACKUP_SYNC_FULL);
+}
+END_TEST
+
+START_TEST(backup_incremental_test)
+{
+    backup(BACKUP_SYNC_INCREMENTAL);
+}
+END_TEST
+
+static BlockDriverState *reopen_test_image(BlockDriverState *bs, int flags)
+{
+    if (bs) {
+        bdrv_delete(bs);
+    }
+    bs = bdrv_new("");
+    fail_unless(bdrv_open(bs, test_image, flags,
+                          bdrv_find_format("qcow2")) == 0);
+    return bs;
+}
+
+static BdrvDirtyBitmap *add_persistent_bitmap(BlockDriverState *bs,
+                                              const char *name,
+                                              int granularity)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name);
+    fail_unless(bitmap != NULL);
+    fail_unless(bdrv_dirty_bitmap_set_persistent(bs, bitmap, 1) == 0);
+    return bitmap;
+}
+
+static void check_image_clean(BlockDriverState *bs, int leaks)
+{
+    BdrvCheckResult result;
+
+    memset(&result, 0, sizeof(result));
+    fail_unless(bdrv_check(bs, &result) == 0);
+    fail_unless(result.corruptions == 0 && result.check_errors == 0);
+    fail_unless(leaks ? result.leaks > 0 : result.leaks == 0);
+}
+
+START_TEST(persistent_bitmap_test)
+{
+    BlockDriverState *bs = open_test_image("qcow2", 4 * 1024 * 1024, 0);
+    BdrvDirtyBitmap *bitmap;
+    int64_t sector_num;
+    int i;
+
+    bitmap = add_persistent_bitmap(bs, "dirty", 128);
+    bdrv_set_dirty_range(bs, bitmap, 100, 10);
+    bdrv_set_dirty_range(bs, bitmap, 5000, 300);
+    add_persistent_bitmap(bs, "clean", 8);
+    fail_unless(bdrv_create_dirty_bitmap(bs, 128, "temporary") != NULL);
+
+    /* Stored on close, then loaded read-only and read-write */
+    for (i = 0; i < 3; i++) {
+        bs = reopen_test_image(bs, i == 1 ? 0 : BDRV_O_RDWR);
+
+        bitmap = bdrv_find_dirty_bitmap(bs, "dirty");
+        fail_unless(bitmap != NULL && bitmap->persistent);
+        fail_unless(bitmap->granularity == 128);
+        fail_unless(bdrv_get_dirty_count(bs, bitmap) == 128 + 3 * 128);
+        for (sector_num = 0; sector_num < bs->total_sectors;
+             sector_num += 128) {
+            fail_unless(bdrv_get_dirty(bs, bitmap, sector_num) ==
+                        (sector_num == 0 ||
+                         (sector_num >= 4992 && sector_num < 5376)));
+        }
+
+        bitmap = bdrv_find_dirty_bitmap(bs, "clean");
+        fail_unless(bitmap != NULL && bitmap->granularity == 8);
+        fail_unless(bdrv_get_dirty_count(bs, bitmap) == 0);
+        fail_unless(bdrv_find_dirty_bitmap(bs, "temporary") == NULL);
+
+        /* A read-write open frees the clusters of the loaded bitmaps */
+        if (i != 1) {
+            check_image_clean(bs, 0);
+        }
+    }
+
+    close_test_image(bs);
+}
+END_TEST
+
+/* Accesses the image file at offset without going through the format */
+static void rw_test_image_file(int64_t offset, void *buf, int len,
+                               int is_write)
+{
+    BlockDriverState *file;
+
+    file = bdrv_new("");
+    fail_unless(bdrv_open(file, test_image, BDRV_O_RDWR,
+                          bdrv_find_format("raw")) == 0);
+    if (is_write) {
+        fail_unless(bdrv_pwrite(file, offset, buf, len) == len);
+    } else {
+        fail_unless(bdrv_pread(file, offset, buf, len) == len);
+    }
+    bdrv_delete(file);
+}
+
+/* Writers that don't know the bitmaps invalidate them */
+START_TEST(persistent_bitmap_autoclear_test)
+{
+    BlockDriverState *bs = open_test_image("qcow2", 4 * 1024 * 1024, 0);
+    BdrvDirtyBitmap *bitmap;
+    uint64_t features;
+    int64_t offset = offsetof(QCowHeader, autoclear_features);
+
+    bitmap = add_persistent_bitmap(bs, "dirty", 128);
+    bdrv_set_dirty_range(bs, bitmap, 0, 1);
+    bdrv_delete(bs);
+
+    rw_test_image_file(offset, &features, sizeof(features), 0);
+    fail_unless(be64_to_cpu(features) == QCOW2_AUTOCLEAR_BITMAPS);
+
+    /* Unknown bits are cleared on open, the bitmaps bit is kept */
+    features = cpu_to_be64(QCOW2_AUTOCLEAR_BITMAPS | (1ULL << 63));
+    rw_test_image_file(offset, &features, sizeof(features), 1);
+    bs = reopen_test_image(NULL, BDRV_O_RDWR);
+    fail_unless(bdrv_find_dirty_bitmap(bs, "dirty") != NULL);
+    rw_test_image_file(offset, &features, sizeof(features), 0);
+    fail_unless(be64_to_cpu(features) == QCOW2_AUTOCLEAR_BITMAPS);
+    bdrv_delete(bs);
+
+    /* As an older writer would, clear the bit, which drops the bitmaps */
+    features = 0;
+    rw_test_image_file(offset, &features, sizeof(features), 1);
+    bs = reopen_test_image(NULL, BDRV_O_RDWR);
+    fail_unless(bdrv_find_dirty_bitmap(bs, "dirty") == NULL);
+    close_test_image(bs);
+
+    /* Version 2 images can't have the bit, so they can't store bitmaps */
+    create_image(test_image, "raw", NULL, 0);
+    fail_unless(bdrv_img_create(test_image, "qcow2", NULL, NULL, NULL,
+                                4 * 1024 * 1024, 0) == 0);
+    bs = reopen_test_image(NULL, BDRV_O_RDWR);
+    bitmap = bdrv_create_dirty_bitmap(bs, 128, "dirty");
+    fail_unless(bitmap != NULL);
+    fail_unless(bdrv_dirty_bitmap_set_persistent(bs, bitmap, 1) == -ENOTSUP);
+    close_test_image(bs);
+}
+END_TEST
+
+/* Overwrites a field of the header entry of the named bitmap */
+static void patch_bitmap_entry(const char *name, int offset, void *val,
+                               int len)
+{
+    uint8_t buf[4096];
+    uint8_t *p;
+
+    rw_test_image_file(0, buf, sizeof(buf), 0);
+    p = memmem(buf, sizeof(buf), name, strlen(name));
+    fail_unless(p != NULL);
+    rw_test_image_file(p - buf + offset, val, len, 1);
+}
+
+/* Broken entries are dropped, and clusters that may not be theirs kept */
+START_TEST(persistent_bitmap_broken_test)
+{
+    BlockDriverState *bs = open_test_image("qcow2", 4 * 1024 * 1024, 0);
+    BdrvDirtyBitmap *bitmap;
+    uint32_t granularity = cpu_to_be32(0x80000000);
+    uint64_t data_offset = cpu_to_be64(1ULL << 40);
+
+    bitmap = add_persistent_bitmap(bs, "granularity", 128);
+    bdrv_set_dirty_range(bs, bitmap, 0, 1);
+    bitmap = add_persistent_bitmap(bs, "offset", 128);
+    bdrv_set_dirty_range(bs, bitmap, 0, 1);
+    bitmap = add_persistent_bitmap(bs, "good", 128);
+    bdrv_set_dirty_range(bs, bitmap, 0, 1);
+    bdrv_delete(bs);
+
+    /* The name follows the granularity, size and data offset fields */
+    patch_bitmap_entry("granularity", -8, &granularity, sizeof(granularity));
+    patch_bitmap_entry("offset", -24, &data_offset, sizeof(data_offset));
+
+    bs = bdrv_new("");
+    fail_unless(bdrv_open(bs, test_image, BDRV_O_RDWR,
+                          bdrv_find_format("qcow2")) == 0);
+    fail_unless(bdrv_find_dirty_bitmap(bs, "granularity") == NULL);
+    fail_unless(bdrv_find_dirty_bitmap(bs, "offset") == NULL);
+    bitmap = bdrv_find_dirty_bitmap(bs, "good");
+    fail_unless(bitmap != NULL && bdrv_get_dirty(bs, bitmap, 0));
+
+    /* The clusters of the dropped entries are leaked, not freed */
+    check_image_clean(bs, 1);
+
+    close_test_image(bs);
+}
+END_TEST
+
+static Suite *block_suite(void)
+{
+    Suite *s;
+    TCase *throttle_tcase, *cor_tcase, *job_tcase, *bitmap_tcase;
+
+    s = suite_create("Block layer test-suite");
+
+    throttle_tcase = tcase_create("I/O throttling");
+    suite_add_tcase(s, throttle_tcase);
+    tcase_add_test(throttle_tcase, throttle_nested_sync_test);
+    tcase_add_test(throttle_tcase, throttle_cancel_qcow2_test);
+    tcase_add_test(throttle_tcase, throttle_cancel_qed_test);
+
+    cor_tcase = tcase_create("Copy on read");
+    suite_add_tcase(s, cor_tcase);
+    tcase_add_test(cor_tcase, copy_on_read_test);
+    tcase_add_test(cor_tcase, copy_on_read_cancel_qcow2_test);
+    tcase_add_test(cor_tcase, copy_on_read_cancel_qed_test);
+
+    job_tcase = tcase_create("Block jobs");
+    suite_add_tcase(s, job_tcase);
+    tcase_add_test(job_tcase, mirror_pivot_test);
+    tcase_add_test(job_tcase, mirror_cancel_test);
+    tcase_add_test(job_tcase, delete_with_job_test);
+    tcase_add_test(job_tcase, backup_full_test);
+    tcase_add_test(job_tcase, backup_incremental_test);
+
+    bitmap_tcase = tcase_create("Persistent dirty bitmaps");
+    suite_add_tcase(s, bitmap_tcase);
+    tcase_add_test(bitmap_tcase, persistent_bitmap_test);
+    tcase_add_test(bitmap_tcase, persistent_bitmap_broken_test);
+    tcase_add_test(bitmap_tcase, persistent_bitmap_autoclear_test);
+
+    return s;
+}
+
+int main(void)
+{
+	int nf;
+	Suite *s;
+	SRunner *sr;
+
+	s = block_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	nf = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (nf == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,274 @@
+/*
+ * Hierarchical bitmap unit-tests.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+#include <check.h>
+
+#include "qemu-common.h"
+#include "hbitmap.h"
+
+/*
+ * Every test runs the same operations on an HBitmap and on a naive bitmap
+ * with one byte per bit, and compares the two.
+ */
+
+typedef struct TestBitmap {
+    HBitmap *hb;
+    uint8_t *bits;
+    uint64_t size;              /* number of items */
+    uint64_t nb_bits;
+    int granularity;
+} TestBitmap;
+
+static void test_bitmap_init(TestBitmap *t, uint64_t size, int granularity)
+{
+    t->hb = hbitmap_alloc(size, granularity);
+    t->size = size;
+    t->granularity = granularity;
+    t->nb_bits = (size + (1ULL << granularity) - 1) >> granularity;
+    t->bits = qemu_mallocz(MAX(t->nb_bits, 1));
+}
+
+static void test_bitmap_free(TestBitmap *t)
+{
+    hbitmap_free(t->hb);
+    qemu_free(t->bits);
+}
+
+static void test_bitmap_update(TestBitmap *t, uint64_t start, uint64_t count,
+                               int set)
+{
+    uint64_t bit;
+
+    if (set) {
+        hbitmap_set(t->hb, start, count);
+    } else {
+        hbitmap_reset(t->hb, start, count);
+    }
+
+    if (count == 0) {
+        return;
+    }
+    for (bit = start >> t->granularity;
+         bit <= (start + count - 1) >> t->granularity && bit < t->nb_bits;
+         bit++) {
+        t->bits[bit] = set;
+    }
+}
+
+/* Compares get, count and a walk with next over the whole bitmap */
+static void test_bitmap_check(TestBitmap *t)
+{
+    uint64_t bit, count = 0;
+    int64_t next, expected;
+
+    for (bit = 0; bit < t->nb_bits; bit++) {
+        fail_unless(hbitmap_get(t->hb, bit << t->granularity) == t->bits[bit]);
+        count += t->bits[bit];
+    }
+    fail_unless(hbitmap_count(t->hb) == count << t->granularity);
+
+    next = hbitmap_next(t->hb, 0);
+    for (bit = 0; bit < t->nb_bits; bit++) {
+        if (!t->bits[bit]) {
+            continue;
+        }
+        expected = bit << t->granularity;
+        fail_unless(next == expected);
+        next = hbitmap_next(t->hb, expected + (1ULL << t->granularity));
+    }
+    fail_unless(next == -1);
+}
+
+/* Deterministic pseudo random numbers, so that failures can be reproduced */
+static uint64_t test_rand_state;
+
+static uint64_t test_rand(uint64_t limit)
+{
+    test_rand_state = test_rand_state * 6364136223846793005ULL +
+                      1442695040888963407ULL;
+    return limit ? (test_rand_state >> 16) % limit : 0;
+}
+
+START_TEST(hbitmap_empty_test)
+{
+    HBitmap *hb = hbitmap_alloc(1000, 3);
+
+    fail_unless(hbitmap_count(hb) == 0);
+    fail_unless(hbitmap_next(hb, 0) == -1);
+    fail_unless(hbitmap_get(hb, 0) == 0);
+    fail_unless(hbitmap_get(hb, 999) == 0);
+
+    /* Past the end */
+    fail_unless(hbitmap_get(hb, 1000000) == 0);
+    fail_unless(hbitmap_next(hb, 1000000) == -1);
+    hbitmap_free(hb);
+}
+END_TEST
+
+START_TEST(hbitmap_granularity_test)
+{
+    HBitmap *hb = hbitmap_alloc(1000, 3);
+
+    /* One item sets the whole bit that covers it */
+    hbitmap_set(hb, 17, 1);
+    fail_unless(hbitmap_count(hb) == 8);
+    fail_unless(hbitmap_get(hb, 16) && hbitmap_get(hb, 23));
+    fail_unless(!hbitmap_get(hb, 15) && !hbitmap_get(hb, 24));
+    fail_unless(hbitmap_next(hb, 0) == 16);
+    fail_unless(hbitmap_next(hb, 20) == 16);
+    fail_unless(hbitmap_next(hb, 24) == -1);
+
+    /* Resetting any item of a bit clears all of it */
+    hbitmap_reset(hb, 23, 1);
+    fail_unless(hbitmap_count(hb) == 0);
+    fail_unless(hbitmap_next(hb, 0) == -1);
+    hbitmap_free(hb);
+}
+END_TEST
+
+/* Ranges that go past the end are cut off there */
+START_TEST(hbitmap_end_test)
+{
+    TestBitmap t;
+
+    test_bitmap_init(&t, 130, 0);
+    test_bitmap_update(&t, 120, 100, 1);
+    test_bitmap_check(&t);
+    fail_unless(hbitmap_count(t.hb) == 10);
+
+    test_bitmap_update(&t, 200, 10, 1);
+    test_bitmap_check(&t);
+    test_bitmap_update(&t, 125, 1000, 0);
+    test_bitmap_check(&t);
+    test_bitmap_free(&t);
+}
+END_TEST
+
+/* Word boundaries of the leaf and the summary level */
+START_TEST(hbitmap_boundary_test)
+{
+    static const uint64_t starts[] = { 0, 1, 63, 64, 65, 127, 128, 4095,
+                                       4096, 4097, 8191 };
+    static const uint64_t counts[] = { 1, 2, 63, 64, 65, 4096, 4097 };
+    TestBitmap t;
+    int i, j;
+
+    test_bitmap_init(&t, 3 * 4096 + 5, 0);
+    for (i = 0; i < ARRAY_SIZE(starts); i++) {
+        for (j = 0; j < ARRAY_SIZE(counts); j++) {
+            test_bitmap_update(&t, starts[i], counts[j], 1);
+            test_bitmap_check(&t);
+            test_bitmap_update(&t, starts[i] + counts[j] / 2, counts[j], 0);
+            test_bitmap_check(&t);
+        }
+    }
+
+    hbitmap_reset_all(t.hb);
+    memset(t.bits, 0, t.nb_bits);
+    test_bitmap_check(&t);
+    test_bitmap_free(&t);
+}
+END_TEST
+
+/* Random ranges, mostly short ones, in bitmaps of various shapes */
+START_TEST(hbitmap_random_test)
+{
+    static const struct {
+        uint64_t size;
+        int granularity;
+    } shapes[] = {
+        { 1, 0 }, { 64, 0 }, { 65, 0 }, { 64 * 64, 0 }, { 64 * 64 + 1, 0 },
+        { 100000, 0 }, { 100000, 3 }, { 1000000, 7 }, { 333333, 9 },
+    };
+    TestBitmap t;
+    uint64_t start, count;
+    int i, j;
+
+    test_rand_state = 1;
+    for (i = 0; i < ARRAY_SIZE(shapes); i++) {
+        test_bitmap_init(&t, shapes[i].size, shapes[i].granularity);
+        for (j = 0; j < 200; j++) {
+            start = test_rand(t.size);
+            count = test_rand(j % 10 ? 300 : t.size);
+            test_bitmap_update(&t, start, count, test_rand(3) != 0);
+            if (j % 20 == 0) {
+                test_bitmap_check(&t);
+            }
+        }
+        test_bitmap_check(&t);
+        test_bitmap_free(&t);
+    }
+}
+END_TEST
+
+START_TEST(hbitmap_serialize_test)
+{
+    TestBitmap t;
+    HBitmap *copy;
+    uint8_t *buf;
+    uint64_t size;
+    int j;
+
+    test_rand_state = 2;
+    test_bitmap_init(&t, 10000, 1);
+    for (j = 0; j < 50; j++) {
+        test_bitmap_update(&t, test_rand(t.size), test_rand(200), 1);
+    }
+
+    size = hbitmap_serialized_size(t.hb);
+    fail_unless(size == (t.nb_bits + 63) / 64 * 8);
+    buf = qemu_malloc(size);
+    hbitmap_serialize(t.hb, buf);
+
+    /* Bits past the end in the buffer must not come back */
+    buf[size - 1] = 0xff;
+
+    copy = t.hb;
+    t.hb = hbitmap_alloc(t.size, t.granularity);
+    hbitmap_set(t.hb, 0, t.size);
+    hbitmap_deserialize(t.hb, buf);
+    hbitmap_free(copy);
+    test_bitmap_check(&t);
+
+    qemu_free(buf);
+    test_bitmap_free(&t);
+}
+END_TEST
+
+static Suite *hbitmap_suite(void)
+{
+    Suite *s;
+    TCase *hbitmap_tcase;
+
+    s = suite_create("HBitmap test-suite");
+
+    hbitmap_tcase = tcase_create("Public Interface");
+    suite_add_tcase(s, hbitmap_tcase);
+    tcase_add_test(hbitmap_tcase, hbitmap_empty_test);
+    tcase_add_test(hbitmap_tcase, hbitmap_granularity_test);
+    tcase_add_test(hbitmap_tcase, hbitmap_end_test);
+    tcase_add_test(hbitmap_tcase, hbitmap_boundary_test);
+    tcase_add_test(hbitmap_tcase, hbitmap_random_test);
+    tcase_add_test(hbitmap_tcase, hbitmap_serialize_test);
+
+    return s;
+}
+
+int main(void)
+{
+	int nf;
+	Suite *s;
+	SRunner *sr;
+
+	s = hbitmap_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	nf = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (nf == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,246 @@
+/*
+ * Hierarchical bitmap
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * A bitmap over a range of items (e.g. sectors) where each bit covers
+ * 2^granularity items. Besides the leaf bits, which are the bitmap proper,
+ * a summary level keeps one bit per leaf word that is set iff the word has
+ * any bit set. Ranges are set and cleared a word at a time, and looking for
+ * the next set bit skips 64 clean leaf words per summary word, so that
+ * walking a huge, mostly clean bitmap touches hardly any memory.
+ */
+
+#include "qemu-common.h"
+#include "host-utils.h"
+#include "hbitmap.h"
+
+#define HBITMAP_WORD_BITS   64
+
+struct HBitmap {
+    uint64_t size;              /* number of leaf bits */
+    int granularity;            /* log2 of the number of items per bit */
+    uint64_t count;             /* number of set leaf bits */
+    uint64_t nb_words;
+    uint64_t *leaf;
+    uint64_t *summary;          /* bit n is set iff leaf[n] != 0 */
+};
+
+/* Creates an empty bitmap for size items, with 2^granularity items per bit */
+HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+{
+    HBitmap *hb = qemu_mallocz(sizeof(*hb));
+    uint64_t nb_summary;
+
+    assert(granularity >= 0 && granularity < 64);
+
+    hb->granularity = granularity;
+    hb->size = (size + (1ULL << granularity) - 1) >> granularity;
+    hb->nb_words = (hb->size + HBITMAP_WORD_BITS - 1) / HBITMAP_WORD_BITS;
+    nb_summary = (hb->nb_words + HBITMAP_WORD_BITS - 1) / HBITMAP_WORD_BITS;
+
+    hb->leaf = qemu_mallocz(MAX(hb->nb_words, 1) * sizeof(uint64_t));
+    hb->summary = qemu_mallocz(MAX(nb_summary, 1) * sizeof(uint64_t));
+    return hb;
+}
+
+void hbitmap_free(HBitmap *hb)
+{
+    qemu_free(hb->summary);
+    qemu_free(hb->leaf);
+    qemu_free(hb);
+}
+
+/* Returns whether the bit covering item is set */
+int hbitmap_get(const HBitmap *hb, uint64_t item)
+{
+    uint64_t bit = item >> hb->granularity;
+
+    if (bit >= hb->size) {
+        return 0;
+    }
+    return !!(hb->leaf[bit / HBITMAP_WORD_BITS] &
+              (1ULL << (bit % HBITMAP_WORD_BITS)));
+}
+
+/*
+ * Sets or clears the bits covering the items [start, start + count), a leaf
+ * word at a time, and keeps the count and the summary level up to date.
+ */
+static void hbitmap_update(HBitmap *hb, uint64_t start, uint64_t count,
+                           int set)
+{
+    uint64_t first, last, word, mask, changed;
+
+    if (count == 0) {
+        return;
+    }
+
+    first = start >> hb->granularity;
+    last = (start + count - 1) >> hb->granularity;
+    if (first >= hb->size) {
+        return;
+    }
+    if (last >= hb->size) {
+        last = hb->size - 1;
+    }
+
+    for (word = first / HBITMAP_WORD_BITS;
+         word <= last / HBITMAP_WORD_BITS; word++) {
+        mask = ~0ULL;
+        if (word == first / HBITMAP_WORD_BITS) {
+            mask &= ~0ULL << (first % HBITMAP_WORD_BITS);
+        }
+        if (word == last / HBITMAP_WORD_BITS) {
+            mask &= ~0ULL >> (HBITMAP_WORD_BITS - 1 - last % HBITMAP_WORD_BITS);
+        }
+
+        if (set) {
+            changed = mask & ~hb->leaf[word];
+            hb->leaf[word] |= mask;
+            hb->count += ctpop64(changed);
+        } else {
+            changed = mask & hb->leaf[word];
+            hb->leaf[word] &= ~mask;
+            hb->count -= ctpop64(changed);
+        }
+
+        if (hb->leaf[word]) {
+            hb->summary[word / HBITMAP_WORD_BITS] |=
+                1ULL << (word % HBITMAP_WORD_BITS);
+        } else {
+            hb->summary[word / HBITMAP_WORD_BITS] &=
+                ~(1ULL << (word % HBITMAP_WORD_BITS));
+        }
+    }
+}
+
+/* Sets the bits covering the items [start, start + count) */
+void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
+{
+    hbitmap_update(hb, start, count, 1);
+}
+
+/* Clears the bits covering the items [start, start + count) */
+void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
+{
+    hbitmap_update(hb, start, count, 0);
+}
+
+void hbitmap_reset_all(HBitmap *hb)
+{
+    uint64_t nb_summary;
+
+    nb_summary = (hb->nb_words + HBITMAP_WORD_BITS - 1) / HBITMAP_WORD_BITS;
+    memset(hb->leaf, 0, hb->nb_words * sizeof(uint64_t));
+    memset(hb->summary, 0, nb_summary * sizeof(uint64_t));
+    hb->count = 0;
+}
+
+/* Returns the number of items covered by set bits */
+uint64_t hbitmap_count(const HBitmap *hb)
+{
+    return hb->count << hb->granularity;
+}
+
+/*
+ * Returns the first item of the first set bit that covers item or any item
+ * after it, or -1 if there is none. Iterating over the set bits is done by
+ * calling this again with the returned item plus 2^granularity.
+ */
+int64_t hbitmap_next(const HBitmap *hb, uint64_t item)
+{
+    uint64_t bit = item >> hb->granularity;
+    uint64_t word, sword, val;
+
+    if (bit >= hb->size) {
+        return -1;
+    }
+
+    word = bit / HBITMAP_WORD_BITS;
+    val = hb->leaf[word] & (~0ULL << (bit % HBITMAP_WORD_BITS));
+    if (!val) {
+        /* Find the next non-zero leaf word in the summary */
+        word++;
+        sword = word / HBITMAP_WORD_BITS;
+        if (word >= hb->nb_words) {
+            return -1;
+        }
+        val = hb->summary[sword] & (~0ULL << (word % HBITMAP_WORD_BITS));
+        while (!val) {
+            if (++sword * HBITMAP_WORD_BITS >= hb->nb_words) {
+                return -1;
+            }
+            val = hb->summary[sword];
+        }
+        word = sword * HBITMAP_WORD_BITS + ctz64(val);
+        val = hb->leaf[word];
+    }
+
+    bit = word * HBITMAP_WORD_BITS + ctz64(val);
+    return bit << hb->granularity;
+}
+
+/*
+ * The serialized form of a bitmap is its leaf level as a sequence of
+ * little endian 64 bit words, i.e. bit n is bit n % 8 of byte n / 8.
+ */
+uint64_t hbitmap_serialized_size(const HBitmap *hb)
+{
+    return hb->nb_words * sizeof(uint64_t);
+}
+
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf)
+{
+    uint64_t i, val;
+
+    for (i = 0; i < hb->nb_words; i++) {
+        val = cpu_to_le64(hb->leaf[i]);
+        memcpy(buf + i * sizeof(val), &val, sizeof(val));
+    }
+}
+
+/* Replaces the contents of the bitmap by the serialized bitmap in buf */
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf)
+{
+    uint64_t i, val;
+
+    hbitmap_reset_all(hb);
+    for (i = 0; i < hb->nb_words; i++) {
+        memcpy(&val, buf + i * sizeof(val), sizeof(val));
+        hb->leaf[i] = le64_to_cpu(val);
+    }
+
+    /* Bits past the end must stay clear */
+    if (hb->size % HBITMAP_WORD_BITS) {
+        hb->leaf[hb->nb_words - 1] &=
+            ~0ULL >> (HBITMAP_WORD_BITS - hb->size % HBITMAP_WORD_BITS);
+    }
+
+    for (i = 0; i < hb->nb_words; i++) {
+        if (hb->leaf[i]) {
+            hb->count += ctpop64(hb->leaf[i]);
+            hb->summary[i / HBITMAP_WORD_BITS] |=
+                1ULL << (i % HBITMAP_WORD_BITS);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * Hierarchical bitmap
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef HBITMAP_H
+#define HBITMAP_H
+
+#include "qemu-common.h"
+
+typedef struct HBitmap HBitmap;
+
+HBitmap *hbitmap_alloc(uint64_t size, int granularity);
+void hbitmap_free(HBitmap *hb);
+int hbitmap_get(const HBitmap *hb, uint64_t item);
+void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count);
+void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
+uint64_t hbitmap_count(const HBitmap *hb);
+int64_t hbitmap_next(const HBitmap *hb, uint64_t item);
+void hbitmap_reset_all(HBitmap *hb);
+
+uint64_t hbitmap_serialized_size(const HBitmap *hb);
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf);
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf);
+
+#endif
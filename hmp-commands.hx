@@ -1213,6 +1213,161 @@ STEXI
 @item block_passwd @var{device} @var{password}
 @findex block_passwd
 Set the encrypted device @var{device} password to @var{password}
+ETEXI
+
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,iops_max:l?",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr [bps_max] [iops_max]",
+        .help       = "change the I/O throttling limits of a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+STEXI
+@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr} [@var{bps_max}] [@var{iops_max}]
+@findex block_set_io_throttle
+Change the I/O throttling limits of block device @var{device} to the given
+bytes and requests per second, 0 meaning unlimited. @var{bps_max} and
+@var{iops_max} are the burst sizes in bytes and requests.
+ETEXI
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?,base:s?",
+        .params     = "device [speed [base]]",
+        .help       = "copy data from a backing file into a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+STEXI
+@item block_stream @var{device} [@var{speed} [@var{base}]]
+@findex block_stream
+Copy data from the backing file chain of @var{device} into @var{device}, down
+to the backing file @var{base} or the whole chain, at most @var{speed} bytes
+per second. When done, @var{device} uses @var{base} or no backing file at all.
+ETEXI
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .help       = "set maximum speed for a background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+STEXI
+@item block_job_set_speed @var{device} @var{value}
+@findex block_job_set_speed
+Set the maximum speed of the background operation on @var{device} to
+@var{value} bytes per second, 0 meaning unlimited.
+ETEXI
+
+    {
+        .name       = "drive_mirror",
+        .args_type  = "device:B,target:s,format:s?,sync:s?,mode:s?,speed:o?",
+        .params     = "device target [format [sync [mode [speed]]]]",
+        .help       = "start mirroring a block device to a new image",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_drive_mirror,
+    },
+
+STEXI
+@item drive_mirror @var{device} @var{target} [@var{format} [@var{sync} [@var{mode} [@var{speed}]]]]
+@findex drive_mirror
+Start copying @var{device} to the image @var{target} while the guest keeps
+running. @var{sync} is "full" to copy the whole backing chain, or "top" to
+copy only the topmost image. @var{mode} is "absolute-paths" to create
+@var{target}, or "existing" to use an existing image. Once the copy is done,
+@code{block_job_complete} switches @var{device} over to @var{target}.
+ETEXI
+
+    {
+        .name       = "drive_backup",
+        .args_type  = "device:B,target:s,format:s?,sync:s?,bitmap:s?,mode:s?,speed:o?",
+        .params     = "device target [format [sync [bitmap [mode [speed]]]]]",
+        .help       = "start backing a block device up to an image",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_drive_backup,
+    },
+
+STEXI
+@item drive_backup @var{device} @var{target} [@var{format} [@var{sync} [@var{bitmap} [@var{mode} [@var{speed}]]]]]
+@findex drive_backup
+Copy @var{device} to the image @var{target} while the guest keeps running.
+@var{sync} is "full" to copy everything, or "incremental" to copy only what
+is dirty in the dirty bitmap @var{bitmap}. The bitmap is cleared when the
+backup is done, which happens by itself once the target has caught up.
+@var{mode} is as for @code{drive_mirror}.
+ETEXI
+
+    {
+        .name       = "block_dirty_bitmap_add",
+        .args_type  = "persistent:-p,device:B,name:s,granularity:i?",
+        .params     = "[-p] device name [granularity]",
+        .help       = "track writes to a block device in a dirty bitmap "
+                      "(use -p to store it in the image)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_dirty_bitmap_add,
+    },
+
+STEXI
+@item block_dirty_bitmap_add [-p] @var{device} @var{name} [@var{granularity}]
+@findex block_dirty_bitmap_add
+Create the dirty bitmap @var{name} on @var{device}, which tracks the writes to
+@var{device} in chunks of @var{granularity} bytes (64k by default). With
+@code{-p}, the bitmap is stored in the image and comes back when it is opened
+again.
+ETEXI
+
+    {
+        .name       = "block_dirty_bitmap_remove",
+        .args_type  = "device:B,name:s",
+        .params     = "device name",
+        .help       = "remove a dirty bitmap from a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_dirty_bitmap_remove,
+    },
+
+STEXI
+@item block_dirty_bitmap_remove @var{device} @var{name}
+@findex block_dirty_bitmap_remove
+Remove the dirty bitmap @var{name} from @var{device}, and from its image if
+it is persistent.
+ETEXI
+
+    {
+        .name       = "block_job_complete",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "complete an active background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_complete,
+    },
+
+STEXI
+@item block_job_complete @var{device}
+@findex block_job_complete
+Complete the background operation on @var{device} once it is ready. For a
+mirror, the remaining data is copied and @var{device} switches over to the
+target image.
+ETEXI
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop an active background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+STEXI
+@item block_job_cancel @var{device}
+@findex block_job_cancel
+Stop the background operation on @var{device}. Data it copied so far stays.
 ETEXI
 
     {
@@ -1293,6 +1448,8 @@ show the character devices
 show the block devices
 @item info blockstats
 show block device statistics
+@item info block-jobs
+show progress of ongoing block device operations
 @item info registers
 show the cpu registers
 @item info cpus
@@ -0,0 +1,55 @@
+/*
+ * NVMe stubs for targets that don't build the nvme device.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "sysemu.h"
+#include "monitor.h"
+#include "qerror.h"
+
+static int nvme_unsupported(void)
+{
+    qerror_report(QERR_UNSUPPORTED);
+    return -ENOSYS;
+}
+
+int do_nvme_ns_create(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    return nvme_unsupported();
+}
+
+int do_nvme_ns_delete(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    return nvme_unsupported();
+}
+
+int do_nvme_ns_resize(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    return nvme_unsupported();
+}
+
+int do_nvme_ns_attach(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    return nvme_unsupported();
+}
+
+int do_nvme_ns_detach(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    return nvme_unsupported();
+}
+
+int do_nvme_set_qos(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    return nvme_unsupported();
+}
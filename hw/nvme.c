@@ -26,6 +26,8 @@
 #include "nvme.h"
 #include "nvme_debug.h"
 #include "range.h"
+#include "monitor.h"
+#include "qemu-objects.h"
 
 
 static const VMStateDescription vmstate_nvme = {
@@ -43,6 +45,7 @@ static inline uint8_t range_covers_reg(uint64_t, uint64_t, uint64_t,
 static void process_doorbell(NVMEState *, target_phys_addr_t, uint32_t);
 static void read_file(NVMEState *, uint8_t);
 static void sq_processing_timer_cb(void *);
+static void nvme_admin_bh(void *);
 static int nvme_irqcq_empty(NVMEState *, uint32_t);
 static void msix_clr_pending(PCIDevice *, uint32_t);
 
@@ -62,6 +65,48 @@ void enqueue_async_event(NVMEState *n, uint8_t event_type, uint8_t event_info,
             qemu_get_clock_ns(vm_clock) + 20000);
 }
 
+/*********************************************************************
+    Function     :    nvme_ns_changed
+    Description  :    Records a namespace in the Changed Namespace List
+                      and raises a Namespace Attribute Changed event
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t : Namespace id
+*********************************************************************/
+void nvme_ns_changed(NVMEState *n, uint32_t nsid)
+{
+    uint16_t i;
+
+    if (NVME_DP_ON(n)) {
+        nvme_dp_ns_changed(n, nsid);
+    }
+    if (n->num_changed_nsids == 0 || n->changed_nsids[0] != 0xffffffff) {
+        for (i = 0; i < n->num_changed_nsids; i++) {
+            if (n->changed_nsids[i] == nsid) {
+                break;
+            }
+        }
+        if (i == n->num_changed_nsids) {
+            if (n->num_changed_nsids < NVME_MAX_CHANGED_NAMESPACES) {
+                n->changed_nsids[n->num_changed_nsids++] = nsid;
+            } else {
+                /* Too many changes to report, host has to rescan all */
+                n->changed_nsids[0] = 0xffffffff;
+                n->num_changed_nsids = 1;
+            }
+        }
+    }
+
+    /* Further events are masked until the host reads the log page */
+    if (n->ns_change_aen_pending ||
+            !(n->feature.asynchronous_event_configuration & (1 << 8))) {
+        return;
+    }
+    n->ns_change_aen_pending = 1;
+    enqueue_async_event(n, event_type_notice,
+        event_info_notice_ns_attr_changed, NVME_LOG_CHANGED_NS_LIST);
+}
+
 void isr_notify(NVMEState *n, NVMEIOCQueue *cq)
 {
     if (cq->irq_enabled) {
@@ -111,13 +156,28 @@ static void process_doorbell(NVMEState *nvme_dev, target_phys_addr_t addr,
                 event_info_err_invalid_db, NVME_LOG_ERROR_INFORMATION);
             return;
         }
+        if (queue_id != ACQ_ID && NVME_DP_ON(nvme_dev)) {
+            /* I/O completions are posted by the dataplane */
+            nvme_dev->cq[queue_id].head = new_head;
+            nvme_dp_cq_doorbell(nvme_dev, queue_id, new_head);
+            return;
+        }
         if (is_cq_full(nvme_dev, queue_id)) {
             /* queue was previously full, schedule submission queue check
                in case there are commands that couldn't be processed */
-            nvme_dev->sq_processing_timer_target = qemu_get_clock_ns(vm_clock)
-                + 5000;
-            qemu_mod_timer(nvme_dev->sq_processing_timer,
-                nvme_dev->sq_processing_timer_target);
+            if (queue_id == ACQ_ID) {
+                qemu_bh_schedule(nvme_dev->admin_bh);
+                if (nvme_dev->outstanding_asyncs > 0 &&
+                    !QSIMPLEQ_EMPTY(&nvme_dev->async_queue)) {
+                    qemu_mod_timer(nvme_dev->async_event_timer,
+                        qemu_get_clock_ns(vm_clock));
+                }
+            } else {
+                nvme_dev->sq_processing_timer_target =
+                    qemu_get_clock_ns(vm_clock) + 5000;
+                qemu_mod_timer(nvme_dev->sq_processing_timer,
+                    nvme_dev->sq_processing_timer_target);
+            }
         }
         nvme_dev->cq[queue_id].head = new_head;
         /* Reset the P bit if head == tail for all Queues on
@@ -151,6 +211,14 @@ static void process_doorbell(NVMEState *nvme_dev, target_phys_addr_t addr,
             return;
         }
         nvme_dev->sq[queue_id].tail = new_tail;
+        if (queue_id == ASQ_ID) {
+            qemu_bh_schedule(nvme_dev->admin_bh);
+            return;
+        }
+        if (NVME_DP_ON(nvme_dev)) {
+            nvme_dp_sq_doorbell(nvme_dev, queue_id, new_tail);
+            return;
+        }
 
         /* Check if the SQ processing routine is scheduled for
          * execution within 5 uS.If it isn't, make it so
@@ -207,14 +275,39 @@ static int nvme_irqcq_empty(NVMEState *nvme_dev, uint32_t vector)
     return ret_val;
 }
 
+/*********************************************************************
+    Function     :    nvme_admin_bh
+    Description  :    Processes the admin SQ. It runs from a bottom
+                      half with its own budget, so admin commands
+                      never eat into the one of the I/O SQs.
+    Return Type  :    void
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_admin_bh(void *param)
+{
+    NVMEState *n = (NVMEState *) param;
+    int entries_to_process = ENTRIES_TO_PROCESS;
+
+    while (n->sq[ASQ_ID].head != n->sq[ASQ_ID].tail) {
+        if (process_sq(n, ASQ_ID)) {
+            /* ACQ full or an admin job running, both reschedule us */
+            return;
+        }
+        if (--entries_to_process == 0) {
+            qemu_bh_schedule(n->admin_bh);
+            return;
+        }
+    }
+}
+
 static void sq_processing_timer_cb(void *param)
 {
     NVMEState *n =  (NVMEState *) param;
     int sq_id;
     int entries_to_process = ENTRIES_TO_PROCESS;
 
-    /* Check SQs for work */
-    for (sq_id = 0; sq_id < NVME_MAX_QS_ALLOCATED; sq_id++) {
+    /* Check the I/O SQs for work, the admin SQ has nvme_admin_bh */
+    for (sq_id = ASQ_ID + 1; sq_id < NVME_MAX_QS_ALLOCATED; sq_id++) {
         while (n->sq[sq_id].head != n->sq[sq_id].tail) {
             /* Handle one SQ entry */
             if (process_sq(n, sq_id)) {
@@ -339,6 +432,9 @@ static void nvme_mmio_writel(void *opaque, target_phys_addr_t addr,
                     /* Update CSTS.RDY based on CC.EN and set the phase tag */
                     nvme_dev->cntrl_reg[NVME_CTST] |= CC_EN ;
                     nvme_dev->cq[ACQ_ID].phase_tag = 1;
+                    if (NVME_DP_ON(nvme_dev)) {
+                        nvme_dp_enable(nvme_dev);
+                    }
                 }
             } else if ((var & CC_EN) ^ (val & CC_EN)) {
                 /* For 1->0 transition for CC.EN */
@@ -347,8 +443,14 @@ static void nvme_mmio_writel(void *opaque, target_phys_addr_t addr,
                  */
                 LOG_NORM("Resetting the NVME device to idle state");
                 clear_nvme_device(nvme_dev);
-                /* Update CSTS.RDY based on CC.EN */
-                nvme_dev->cntrl_reg[NVME_CTST] &= ~(CC_EN);
+                /* Update CSTS.RDY based on CC.EN, it stays set until
+                 * the dataplane let go of the queues
+                 */
+                if (NVME_DP_ON(nvme_dev) && nvme_dp_reset_pending(nvme_dev)) {
+                    nvme_dev->cntrl_reg[NVME_CTST] |= CC_EN;
+                } else {
+                    nvme_dev->cntrl_reg[NVME_CTST] &= ~(CC_EN);
+                }
             } else {
                 /* Writes before/after CC.EN is set */
                 nvme_cntrl_write_config(nvme_dev, NVME_CC, val, DWORD);
@@ -668,6 +770,26 @@ static void nvme_mmio_map(PCIDevice *pci_dev, int reg_num, pcibus_t addr,
     msix_mmio_map(pci_dev, reg_num, addr, size, type);
 }
 
+/*********************************************************************
+    Function     :    nvme_cmb_map
+    Description  :    Function for mapping the Controller Memory Buffer
+                      BAR as plain RAM, so guest accesses to it do not
+                      trap into the device model
+    Return Type  :    void
+    Arguments    :    PCIDevice * : Pointer to PCI device state
+                      int : To specify the BAR's from BAR0-BAR5
+                      pcibus_t : Addr to be registered
+                      pcibus_t : size to be registered
+                      int : Type of the BAR
+*********************************************************************/
+static void nvme_cmb_map(PCIDevice *pci_dev, int reg_num, pcibus_t addr,
+                            pcibus_t size, int type)
+{
+    NVMEState *n = DO_UPCAST(NVMEState, dev, pci_dev);
+
+    cpu_register_physical_memory(addr, size, n->cmb_offset | IO_MEM_RAM);
+}
+
 /*********************************************************************
     Function     :    nvme_set_registry
     Description  :    Default initialization of NVME Registery
@@ -697,6 +819,48 @@ static void nvme_set_registry(NVMEState *n)
     }
 }
 
+/*********************************************************************
+    Function     :    nvme_cmb_set_registry
+    Description  :    Advertises the Controller Memory Buffer in the
+                      CMBLOC and CMBSZ registers. Both are read only
+                      so they are written directly into the registry.
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device state
+*********************************************************************/
+static void nvme_cmb_set_registry(NVMEState *n)
+{
+    uint32_t cmbloc = 0, cmbsz = 0;
+
+    if (n->cmb_size) {
+        /* The buffer starts at offset 0 of its own BAR */
+        cmbloc = NVME_CMB_BIR;
+        /* SQs, PRP lists and data buffers may live in the CMB. CQs are
+         * left in host memory as they are written by the controller. */
+        cmbsz = NVME_CMBSZ_SQS | NVME_CMBSZ_LISTS | NVME_CMBSZ_RDS |
+            NVME_CMBSZ_WDS | NVME_CMBSZ_SZU_1M |
+            (n->cmb_size << NVME_CMBSZ_SZ_SHIFT);
+    }
+    cmbloc = cpu_to_le32(cmbloc);
+    cmbsz = cpu_to_le32(cmbsz);
+    memcpy(&n->cntrl_reg[NVME_CMBLOC], &cmbloc, DWORD);
+    memcpy(&n->cntrl_reg[NVME_CMBSZ], &cmbsz, DWORD);
+}
+
+/*********************************************************************
+    Function     :    nvme_reset_complete
+    Description  :    Clears CSTS.RDY once the dataplane acknowledged
+                      a controller reset, unless the guest enabled
+                      the controller again meanwhile
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device state
+*********************************************************************/
+void nvme_reset_complete(NVMEState *n)
+{
+    if (!(nvme_cntrl_read_config(n, NVME_CC, DWORD) & CC_EN)) {
+        n->cntrl_reg[NVME_CTST] &= ~(CC_EN);
+    }
+}
+
 /*********************************************************************
     Function     :    clear_nvme_device
     Description  :    To reset Nvme Device (Controller Reset)
@@ -714,6 +878,13 @@ static void clear_nvme_device(NVMEState *n)
     /* Inflight Operations will not be processed */
     qemu_del_timer(n->sq_processing_timer);
     n->sq_processing_timer_target = 0;
+    qemu_bh_cancel(n->admin_bh);
+    nvme_adm_job_cancel(n);
+    nvme_nand_reset(n);
+    nvme_qos_reset(n);
+    if (NVME_DP_ON(n)) {
+        nvme_dp_reset(n);
+    }
 
     /* Saving the Admin Queue States before reset */
     n->aqstate.aqa = nvme_cntrl_read_config(n, NVME_AQA, DWORD);
@@ -725,6 +896,7 @@ static void clear_nvme_device(NVMEState *n)
         nvme_cntrl_read_config(n, NVME_ACQ, DWORD);
     /* Update NVME space registery from config file */
     read_file(n, NVME_SPACE);
+    nvme_cmb_set_registry(n);
     n->intr_vect = 0;
 
     for (i = 1; i < NVME_MAX_QS_ALLOCATED; i++) {
@@ -747,6 +919,7 @@ static void clear_nvme_device(NVMEState *n)
     n->outstanding_asyncs = 0;
     n->feature.temperature_threshold = NVME_TEMPERATURE + 10;
     n->temp_warn_issued = 0;
+    n->ns_change_aen_pending = 0;
 
     QSIMPLEQ_INIT(&n->async_queue);
 }
@@ -871,32 +1044,27 @@ static void read_file(NVMEState *n, uint8_t space)
 static void read_identify_cns(NVMEState *n)
 {
     struct power_state_description *power;
-    int index, i;
-    int ms_arr[4] = {0, 8, 64, 128};
+    uint64_t tnvmcap;
+    int index;
 
     LOG_NORM("%s(): called", __func__);
-    for (index = 0; index < n->num_namespaces; index++) {
-        n->disk[index].idtfy_ns.nsze = (n->ns_size * BYTES_PER_MB) /
-            BYTES_PER_BLOCK;
-        n->disk[index].idtfy_ns.ncap = (n->ns_size * BYTES_PER_MB) /
-            BYTES_PER_BLOCK;
-        n->disk[index].idtfy_ns.nuse = 0;
-        n->disk[index].idtfy_ns.nlbaf = NO_LBA_FORMATS;
-        n->disk[index].idtfy_ns.flbas = LBA_FORMAT_INUSE;
-
-        /* meta data capabilities */
-        n->disk[index].idtfy_ns.mc = 1 << 1 | 1 << 0;
-        n->disk[index].idtfy_ns.dpc = 1 << 4 | 1 << 3 | 1 << 0;
-        n->disk[index].idtfy_ns.dps = 0;
-
-        /* Filling in the LBA Format structure */
-        for (i = 0 ; i <= NO_LBA_FORMATS; i++) {
-            n->disk[index].idtfy_ns.lbafx[i].lbads = LBA_SIZE + (i / 4);
-            n->disk[index].idtfy_ns.lbafx[i].ms = ms_arr[i % 4];
-        }
+    /* The first controller of a subsystem creates its namespaces */
+    for (index = 0; n->subsys->nctrls == 1 && index < n->num_namespaces;
+            index++) {
+        nvme_init_ns_identify(&n->disk[index],
+            (n->ns_size * BYTES_PER_MB) >> (LBA_SIZE + n->lba_format / 4),
+            n->lba_format);
+        n->disk[index].idtfy_ns.nmic = n->subsys->name != NULL;
+        n->disk[index].allocated = 1;
         LOG_NORM("Capacity of namespace %d: %lu", index+1,
             n->disk[index].idtfy_ns.ncap);
     }
+    /* Existing namespaces start out attached to a new controller */
+    for (index = 0; index < NVME_MAX_NUM_NAMESPACES; index++) {
+        if (n->disk[index].allocated) {
+            n->disk[index].attached |= 1U << n->ctrl_idx;
+        }
+    }
 
     n->idtfy_ctrl = qemu_mallocz(sizeof(*(n->idtfy_ctrl)));
     if (!n->idtfy_ctrl) {
@@ -918,19 +1086,26 @@ static void read_identify_cns(NVMEState *n)
     n->idtfy_ctrl->sqes = 6 << 4 | 6;
     n->idtfy_ctrl->oacs = 0x2;  /* set due to adm_cmd_format_nvm() */
     n->idtfy_ctrl->oacs |= 0x4; /* set for adm_cmd_act_fw() & adm_cmd_act_dl()*/
+    n->idtfy_ctrl->oacs |= 0x8; /* namespace management and attachment */
     n->idtfy_ctrl->oncs = 0x4;  /* dataset mgmt cmd */
 
     n->idtfy_ctrl->vid = 0x8086;
     n->idtfy_ctrl->ssvid = 0x0111;
+    n->idtfy_ctrl->cntlid = n->instance;
+    if (n->subsys->name) {
+        n->idtfy_ctrl->mic |= 0x2; /* may be one of several controllers */
+    }
     /* number of supported name spaces bytes [516:519] */
-    n->idtfy_ctrl->nn = n->num_namespaces;
+    n->idtfy_ctrl->nn = NVME_MAX_NUM_NAMESPACES;
+    tnvmcap = cpu_to_le64(n->nvm_capacity * BYTES_PER_MB);
+    memcpy(n->idtfy_ctrl->tnvmcap, &tnvmcap, sizeof(tnvmcap));
     n->idtfy_ctrl->acl = NVME_ABORT_COMMAND_LIMIT;
     n->idtfy_ctrl->aerl = ASYNC_EVENT_REQ_LIMIT;
     n->idtfy_ctrl->frmw = 1 << 1 | 0;
     n->idtfy_ctrl->npss = NO_POWER_STATE_SUPPORT;
     n->idtfy_ctrl->awun = 0xff;
     n->idtfy_ctrl->lpa = 1 << 0;
-    n->idtfy_ctrl->mdts = 5; /* 128k max transfer */
+    n->idtfy_ctrl->mdts = n->mdts;
 
     power = (struct power_state_description *)&(n->idtfy_ctrl->psd0);
     power->mp = 1;
@@ -977,9 +1152,52 @@ static int pci_nvme_init(PCIDevice *pci_dev)
             n->ns_size, NVME_MAX_NAMESPACE_SIZE);
         return -1;
     }
+    if (n->nvm_capacity == 0) {
+        n->nvm_capacity = n->num_namespaces * n->ns_size;
+    } else if (n->nvm_capacity < n->num_namespaces * n->ns_size) {
+        LOG_ERR("bad capacity value:%u, must be at least %u", n->nvm_capacity,
+            n->num_namespaces * n->ns_size);
+        return -1;
+    }
+    if (n->lba_format > NO_LBA_FORMATS) {
+        LOG_ERR("bad lba format:%u, must be at most %d", n->lba_format,
+            NO_LBA_FORMATS);
+        return -1;
+    }
+    if (n->mem.host_node < -1 || n->mem.host_node >= NVME_MAX_HOST_NODES) {
+        LOG_ERR("bad host node:%d, must be below %d", n->mem.host_node,
+            NVME_MAX_HOST_NODES);
+        return -1;
+    }
+    if (n->mem.path == NULL && (n->mem.flags || n->mem.host_node != -1)) {
+        LOG_ERR("mem_prealloc, mem_lock and host_node need mem_path");
+        return -1;
+    }
+    if (n->mdts > NVME_MAX_MDTS) {
+        LOG_ERR("bad mdts:%u, must be at most %d", n->mdts, NVME_MAX_MDTS);
+        return -1;
+    }
+    if (n->cmb_size > NVME_MAX_CMB_SIZE) {
+        LOG_ERR("bad cmb size value:%u, must be at most %d", n->cmb_size,
+            NVME_MAX_CMB_SIZE);
+        return -1;
+    }
+    if (nvme_nand_init(n)) {
+        return -1;
+    }
+    if (nvme_dp_init(n)) {
+        nvme_nand_uninit(n);
+        return -1;
+    }
 
     n->instance = instance++;
-    n->disk = (DiskInfo *)qemu_malloc(sizeof(DiskInfo)*n->num_namespaces);
+    if (nvme_subsys_join(n)) {
+        nvme_dp_uninit(n);
+        nvme_nand_uninit(n);
+        return -1;
+    }
+    nvme_qos_init(n);
+    qemu_sglist_init(&n->sg, 16);
 
     /* Zero out the Queue Datastructures */
     memset(n->cq, 0, sizeof(NVMEIOCQueue) * NVME_MAX_QS_ALLOCATED);
@@ -1020,6 +1238,18 @@ static int pci_nvme_init(PCIDevice *pci_dev)
         PCI_BASE_ADDRESS_MEM_TYPE_64),
         nvme_mmio_map);
 
+    /* Register the Controller Memory Buffer as BAR 2 (and bar 3) */
+    if (n->cmb_size) {
+        n->cmb_offset = qemu_ram_alloc(&n->dev.qdev, "nvme.cmb",
+            n->cmb_size * 1024 * 1024);
+        n->cmb = qemu_get_ram_ptr(n->cmb_offset);
+        pci_register_bar((struct PCIDevice *)&n->dev, NVME_CMB_BIR,
+            n->cmb_size * 1024 * 1024, (PCI_BASE_ADDRESS_SPACE_MEMORY |
+            PCI_BASE_ADDRESS_MEM_TYPE_64 | PCI_BASE_ADDRESS_MEM_PREFETCH),
+            nvme_cmb_map);
+        LOG_NORM("%s(): CMB size %u MB", __func__, n->cmb_size);
+    }
+
     /* Allocating space for NVME regspace & masks except the doorbells */
     n->cntrl_reg = qemu_mallocz(NVME_CNTRL_SIZE);
     n->rw_mask = qemu_mallocz(NVME_CNTRL_SIZE);
@@ -1045,6 +1275,7 @@ static int pci_nvme_init(PCIDevice *pci_dev)
 
     /* Update NVME space registery from config file */
     read_file(n, NVME_SPACE);
+    nvme_cmb_set_registry(n);
 
     /* Defaulting the number of Queues */
     /* Indicates the number of I/O Q's allocated. This is 0's based value. */
@@ -1054,8 +1285,9 @@ static int pci_nvme_init(PCIDevice *pci_dev)
     /* Defaulting the temperature threshold, 60 C */
     n->feature.temperature_threshold = NVME_TEMPERATURE + 10;
 
-    /* Defaulting the async notification to all temperature and threshold */
-    n->feature.asynchronous_event_configuration = 0x3;
+    /* Defaulting the async notification to all temperature and threshold,
+     * and namespace attribute notices */
+    n->feature.asynchronous_event_configuration = 0x103;
 
     for (ret = 0; ret < n->nvectors; ret++) {
         msix_vector_use(&n->dev, ret);
@@ -1074,12 +1306,16 @@ static int pci_nvme_init(PCIDevice *pci_dev)
     n->page_size = (1 << (12 + mps));
     LOG_DBG("Page Size: %d", n->page_size);
 
-    /* Create the Storage Disk */
-    if (nvme_create_storage_disks(n)) {
+    /* Create the Storage Disk, unless the subsystem already has them */
+    if (n->subsys->nctrls == 1 && nvme_create_storage_disks(n)) {
         LOG_NORM("Errors while creating NVME disk");
     }
     n->sq_processing_timer = qemu_new_timer_ns(vm_clock,
         sq_processing_timer_cb, n);
+    n->admin_bh = qemu_bh_new(nvme_admin_bh, n);
+    if (nvme_adm_job_init(n)) {
+        LOG_NORM("Long admin commands will block the main loop");
+    }
 
     n->outstanding_asyncs = 0;
     n->async_event_timer = qemu_new_timer_ns(vm_clock,
@@ -1100,6 +1336,10 @@ static int pci_nvme_uninit(PCIDevice *pci_dev)
 {
     NVMEState *n = DO_UPCAST(NVMEState, dev, pci_dev);
 
+    /* A running admin job still uses the device state */
+    nvme_adm_job_uninit(n);
+    qemu_bh_delete(n->admin_bh);
+
     /* Freeing space allocated for NVME regspace masks except the doorbells */
     qemu_free(n->cntrl_reg);
     qemu_free(n->rw_mask);
@@ -1107,7 +1347,6 @@ static int pci_nvme_uninit(PCIDevice *pci_dev)
     qemu_free(n->rws_mask);
     qemu_free(n->used_mask);
     qemu_free(n->idtfy_ctrl);
-    qemu_free(n->disk);
 
     if (n->sq_processing_timer) {
         if (n->sq_processing_timer_target) {
@@ -1122,8 +1361,16 @@ static int pci_nvme_uninit(PCIDevice *pci_dev)
         qemu_free_timer(n->async_event_timer);
         n->async_event_timer = NULL;
     }
-
-    nvme_close_storage_disks(n);
+    nvme_nand_uninit(n);
+    nvme_qos_uninit(n);
+    qemu_sglist_destroy(&n->sg);
+    nvme_dp_uninit(n);
+
+    nvme_subsys_leave(n);
+    if (n->cmb) {
+        qemu_ram_free(n->cmb_offset);
+        n->cmb = NULL;
+    }
     LOG_NORM("Freed NVME device memory");
     return 0;
 }
@@ -1141,6 +1388,46 @@ static PCIDeviceInfo nvme_info = {
     .qdev.props = (Property[]) {
         DEFINE_PROP_UINT32("namespaces", NVMEState, num_namespaces, 1),
         DEFINE_PROP_UINT32("size", NVMEState, ns_size, 512),
+        DEFINE_PROP_UINT32("capacity", NVMEState, nvm_capacity, 0),
+        DEFINE_PROP_UINT32("lba_format", NVMEState, lba_format,
+            LBA_FORMAT_INUSE),
+        DEFINE_PROP_UINT32("mdts", NVMEState, mdts, NVME_DEFAULT_MDTS),
+        DEFINE_PROP_STRING("subsys", NVMEState, subsys_name),
+        DEFINE_PROP_STRING("mem_path", NVMEState, mem.path),
+        DEFINE_PROP_BIT("mem_prealloc", NVMEState, mem.flags,
+            NVME_MEM_PREALLOC, false),
+        DEFINE_PROP_BIT("mem_lock", NVMEState, mem.flags, NVME_MEM_LOCK,
+            false),
+        DEFINE_PROP_INT32("host_node", NVMEState, mem.host_node, -1),
+        DEFINE_PROP_UINT32("cmb_size", NVMEState, cmb_size, 0),
+        DEFINE_PROP_BIT("nand", NVMEState, nand.flags, NVME_NAND_ENABLED,
+            false),
+        DEFINE_PROP_UINT32("nand_channels", NVMEState, nand.channels, 8),
+        DEFINE_PROP_UINT32("nand_dies", NVMEState, nand.dies, 4),
+        DEFINE_PROP_UINT32("nand_planes", NVMEState, nand.planes, 2),
+        DEFINE_PROP_UINT32("nand_page_size", NVMEState, nand.page_size, 16),
+        DEFINE_PROP_UINT32("nand_pages_per_block", NVMEState,
+            nand.pages_per_block, 256),
+        DEFINE_PROP_UINT32("nand_read_lat", NVMEState, nand.read_lat, 50),
+        DEFINE_PROP_UINT32("nand_prog_lat", NVMEState, nand.prog_lat, 600),
+        DEFINE_PROP_UINT32("nand_erase_lat", NVMEState, nand.erase_lat,
+            3000),
+        DEFINE_PROP_UINT32("nand_chan_bw", NVMEState, nand.chan_bw, 400),
+        DEFINE_PROP_UINT32("nand_wbuf_size", NVMEState, nand.wbuf_size,
+            1024),
+        DEFINE_PROP_UINT64("ns_rd_iops", NVMEState, ns_qos.rd_iops, 0),
+        DEFINE_PROP_UINT64("ns_wr_iops", NVMEState, ns_qos.wr_iops, 0),
+        DEFINE_PROP_UINT64("ns_rd_bps", NVMEState, ns_qos.rd_bps, 0),
+        DEFINE_PROP_UINT64("ns_wr_bps", NVMEState, ns_qos.wr_bps, 0),
+        DEFINE_PROP_UINT64("ns_iops_burst", NVMEState, ns_qos.iops_burst, 0),
+        DEFINE_PROP_UINT64("ns_bps_burst", NVMEState, ns_qos.bps_burst, 0),
+        DEFINE_PROP_UINT64("sq_rd_iops", NVMEState, sq_qos.rd_iops, 0),
+        DEFINE_PROP_UINT64("sq_wr_iops", NVMEState, sq_qos.wr_iops, 0),
+        DEFINE_PROP_UINT64("sq_rd_bps", NVMEState, sq_qos.rd_bps, 0),
+        DEFINE_PROP_UINT64("sq_wr_bps", NVMEState, sq_qos.wr_bps, 0),
+        DEFINE_PROP_UINT64("sq_iops_burst", NVMEState, sq_qos.iops_burst, 0),
+        DEFINE_PROP_UINT64("sq_bps_burst", NVMEState, sq_qos.bps_burst, 0),
+        DEFINE_PROP_STRING("dataplane", NVMEState, dataplane),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
@@ -1171,6 +1458,303 @@ static inline void _nvme_check_size(void)
     BUILD_BUG_ON(sizeof(NVMEStatusField) != 2);
     BUILD_BUG_ON(sizeof(RangeDef) != 16);
     BUILD_BUG_ON(sizeof(CtxAttrib) != 4);
+    BUILD_BUG_ON(sizeof(NVMECtrlList) != 4096);
+}
+
+/*********************************************************************
+    Function     :    nvme_monitor_find
+    Description  :    Looks up a NVME device by its qdev id for the
+                      monitor commands
+    Return Type  :    NVMEState * (NULL if not found)
+    Arguments    :    const char * : qdev id or PCI address
+*********************************************************************/
+static NVMEState *nvme_monitor_find(const char *id)
+{
+    PCIDevice *pci_dev;
+
+    if (pci_qdev_find_device(id, &pci_dev) < 0 ||
+            strcmp(pci_dev->qdev.info->name, nvme_info.qdev.name)) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, id);
+        return NULL;
+    }
+    return DO_UPCAST(NVMEState, dev, pci_dev);
+}
+
+/*********************************************************************
+    Function     :    nvme_monitor_error
+    Description  :    Translates a failed namespace operation into a
+                      monitor error
+    Return Type  :    int : -1
+    Arguments    :    NVMEStatusField * : Status of the operation
+*********************************************************************/
+static int nvme_monitor_error(NVMEStatusField *sf)
+{
+    if (sf->sct == NVME_SCT_CMD_SPEC_ERR) {
+        switch (sf->sc) {
+        case NVME_NS_INSUFFICIENT_CAPACITY:
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "size",
+                "a size within the unallocated NVM capacity");
+            return -1;
+        case NVME_INVALID_FORMAT:
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "lbaf",
+                "a supported LBA format");
+            return -1;
+        case NVME_NS_ALREADY_ATTACHED:
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+                "a detached namespace");
+            return -1;
+        case NVME_NS_NOT_ATTACHED:
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+                "an attached namespace");
+            return -1;
+        }
+    } else if (sf->sc == NVME_SC_INVALID_NAMESPACE) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+            "an allocated namespace");
+        return -1;
+    } else if (sf->sc == NVME_SC_NS_NOT_READY) {
+        qerror_report(QERR_DEVICE_IN_USE, "nsid");
+        return -1;
+    } else if (sf->sc == NVME_SC_INVALID_FIELD) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "size",
+            "a non-zero number of blocks");
+        return -1;
+    }
+    qerror_report(QERR_UNDEFINED_ERROR);
+    return -1;
+}
+
+/*********************************************************************
+    Function     :    nvme_monitor_blocks
+    Description  :    Converts a size in bytes into logical blocks of
+                      the given LBA format
+    Return Type  :    int (0:-1 Success:Failure)
+    Arguments    :    uint32_t : Block size in bytes
+                      int64_t  : Size in bytes
+                      uint64_t * : Returns the number of blocks
+*********************************************************************/
+static int nvme_monitor_blocks(uint32_t blksize, int64_t size, uint64_t *blks)
+{
+    if (size <= 0 || size % blksize) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "size",
+            "a positive multiple of the LBA data size");
+        return -1;
+    }
+    *blks = size / blksize;
+    return 0;
+}
+
+int do_nvme_ns_create(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *id = qdict_get_str(qdict, "id");
+    const char *backing = qdict_get_try_str(qdict, "backing");
+    int64_t size = qdict_get_int(qdict, "size");
+    int64_t lbaf;
+    NVMECQE cqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe.status;
+    NVMEState *n;
+    uint64_t nsze;
+    uint32_t nsid;
+
+    n = nvme_monitor_find(id);
+    if (n == NULL) {
+        return -1;
+    }
+    lbaf = qdict_get_try_int(qdict, "lbaf", n->lba_format);
+    if (lbaf < 0 || lbaf > NO_LBA_FORMATS) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "lbaf",
+            "a supported LBA format");
+        return -1;
+    }
+    if (nvme_monitor_blocks(NVME_BLOCK_SIZE(LBA_SIZE + (lbaf / 4)), size,
+            &nsze) < 0) {
+        return -1;
+    }
+
+    memset(&cqe, 0, sizeof(cqe));
+    if (nvme_ns_create(n, nsze, nsze, lbaf, backing, &nsid, sf)) {
+        return nvme_monitor_error(sf);
+    }
+    if (qdict_get_try_bool(qdict, "attach", 0) && nvme_ns_attach(n, nsid, sf)) {
+        return nvme_monitor_error(sf);
+    }
+
+    *ret_data = qobject_from_jsonf("{ 'nsid': %d }", nsid);
+    return 0;
+}
+
+int do_nvme_ns_delete(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    NVMECQE cqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe.status;
+    NVMEState *n;
+
+    n = nvme_monitor_find(qdict_get_str(qdict, "id"));
+    if (n == NULL) {
+        return -1;
+    }
+
+    memset(&cqe, 0, sizeof(cqe));
+    if (nvme_ns_delete(n, qdict_get_int(qdict, "nsid"), sf)) {
+        return nvme_monitor_error(sf);
+    }
+    return 0;
+}
+
+int do_nvme_ns_resize(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    uint32_t nsid = qdict_get_int(qdict, "nsid");
+    NVMECQE cqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe.status;
+    NVMEState *n;
+    DiskInfo *disk;
+    uint64_t nsze;
+
+    n = nvme_monitor_find(qdict_get_str(qdict, "id"));
+    if (n == NULL) {
+        return -1;
+    }
+    if (nsid == 0 || nsid > NVME_MAX_NUM_NAMESPACES ||
+            !n->disk[nsid - 1].allocated) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+            "an allocated namespace");
+        return -1;
+    }
+    disk = &n->disk[nsid - 1];
+    if (nvme_monitor_blocks(NVME_BLOCK_SIZE(
+            disk->idtfy_ns.lbafx[disk->idtfy_ns.flbas & 0xf].lbads),
+            qdict_get_int(qdict, "size"), &nsze) < 0) {
+        return -1;
+    }
+
+    memset(&cqe, 0, sizeof(cqe));
+    if (nvme_ns_resize(n, nsid, nsze, sf)) {
+        return nvme_monitor_error(sf);
+    }
+    return 0;
+}
+
+int do_nvme_ns_attach(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    NVMECQE cqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe.status;
+    NVMEState *n;
+
+    n = nvme_monitor_find(qdict_get_str(qdict, "id"));
+    if (n == NULL) {
+        return -1;
+    }
+
+    memset(&cqe, 0, sizeof(cqe));
+    if (nvme_ns_attach(n, qdict_get_int(qdict, "nsid"), sf)) {
+        return nvme_monitor_error(sf);
+    }
+    return 0;
+}
+
+int do_nvme_ns_detach(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    NVMECQE cqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe.status;
+    NVMEState *n;
+
+    n = nvme_monitor_find(qdict_get_str(qdict, "id"));
+    if (n == NULL) {
+        return -1;
+    }
+
+    memset(&cqe, 0, sizeof(cqe));
+    if (nvme_ns_detach(n, qdict_get_int(qdict, "nsid"), sf)) {
+        return nvme_monitor_error(sf);
+    }
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_monitor_qos_arg
+    Description  :    Reads an optional QoS limit, keeping the
+                      current value when it is not given
+    Return Type  :    int : 0 on success, -1 on a negative value
+    Arguments    :    const QDict * : Command arguments
+                      const char * : Argument name
+                      uint64_t * : Limit to update
+*********************************************************************/
+static int nvme_monitor_qos_arg(const QDict *qdict, const char *name,
+    uint64_t *val)
+{
+    int64_t v;
+
+    if (!qdict_haskey(qdict, name)) {
+        return 0;
+    }
+    v = qdict_get_int(qdict, name);
+    if (v < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, name, "a positive value");
+        return -1;
+    }
+    *val = v;
+    return 0;
+}
+
+int do_nvme_set_qos(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    NVMEState *n;
+    NVMEQoS *q;
+    NVMEQoSConf conf;
+    int64_t id;
+
+    n = nvme_monitor_find(qdict_get_str(qdict, "id"));
+    if (n == NULL) {
+        return -1;
+    }
+
+    if (!qdict_haskey(qdict, "nsid") && !qdict_haskey(qdict, "sqid")) {
+        qerror_report(QERR_MISSING_PARAMETER, "nsid");
+        return -1;
+    }
+    if (qdict_haskey(qdict, "nsid") && qdict_haskey(qdict, "sqid")) {
+        qerror_report(QERR_INVALID_PARAMETER, "sqid");
+        return -1;
+    }
+    if (qdict_haskey(qdict, "nsid")) {
+        id = qdict_get_int(qdict, "nsid");
+        if (id <= 0 || id > NVME_MAX_NUM_NAMESPACES ||
+                !n->disk[id - 1].allocated) {
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+                "an allocated namespace");
+            return -1;
+        }
+        q = &n->ns_throttle[id - 1].qos;
+    } else {
+        id = qdict_get_int(qdict, "sqid");
+        if (id <= 0 || id > NVME_MAX_QID || n->sq[id].dma_addr == 0) {
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "sqid",
+                "an existing I/O submission queue");
+            return -1;
+        }
+        q = &n->sq[id].qos;
+    }
+    if (NVME_DP_ON(n)) {
+        /* The dataplane runs the I/O queues, QEMU can't throttle them */
+        qerror_report(QERR_UNSUPPORTED);
+        return -1;
+    }
+
+    conf = q->conf;
+    if (nvme_monitor_qos_arg(qdict, "rd_iops", &conf.rd_iops) ||
+        nvme_monitor_qos_arg(qdict, "wr_iops", &conf.wr_iops) ||
+        nvme_monitor_qos_arg(qdict, "rd_bps", &conf.rd_bps) ||
+        nvme_monitor_qos_arg(qdict, "wr_bps", &conf.wr_bps) ||
+        nvme_monitor_qos_arg(qdict, "iops_burst", &conf.iops_burst) ||
+        nvme_monitor_qos_arg(qdict, "bps_burst", &conf.bps_burst)) {
+        return -1;
+    }
+    nvme_qos_set(q, &conf);
+
+    /* Let parked commands and queues see the new limits right away */
+    qemu_mod_timer(n->qos_timer, qemu_get_clock_ns(vm_clock));
+    n->qos_timer_target = qemu_get_clock_ns(vm_clock);
+    return 0;
 }
 
 /*********************************************************************
@@ -8,6 +8,7 @@
 #include "loader.h"
 #include "sysemu.h"
 #include "msix.h"
+#include "dma.h"
 #include <pthread.h>
 #include <sched.h>
 
@@ -85,7 +86,7 @@
 
 /* Assume that block is 512 bytes */
 #define NVME_BUF_SIZE 4096
-#define NVME_BLOCK_SIZE(x) (1 << x)
+#define NVME_BLOCK_SIZE(x) (1 << (x))
 
 /* The value is reported in terms of a power of two (2^n).
  * LBA data size=2^9=512
@@ -107,6 +108,8 @@
 #define NVME_TEMPERATURE 0x143
 #define NVME_MAX_NAMESPACE_SIZE 8192
 #define NVME_MAX_NUM_NAMESPACES 256
+/* Entries in the Changed Namespace List log page */
+#define NVME_MAX_CHANGED_NAMESPACES 1024
 
 /* NVMe Controller Registers */
 enum {
@@ -119,7 +122,9 @@ enum {
     NVME_AQA       = 0x0024, /* Admin Queue Attributes, 32bit*/
     NVME_ASQ       = 0x0028, /* Admin Submission Queue Base Address, 64b.*/
     NVME_ACQ       = 0x0030, /* Admin Completion Queue Base Address, 64b.*/
-    NVME_RESERVED  = 0x0038, /* Reserved */
+    NVME_CMBLOC    = 0x0038, /* Controller Memory Buffer Location, 32bit */
+    NVME_CMBSZ     = 0x003c, /* Controller Memory Buffer Size, 32bit */
+    NVME_RESERVED  = 0x0040, /* Reserved */
     NVME_CMD_SS    = 0x0F00, /* Command Set Specific*/
     NVME_SQ0TDBL   = 0x1000, /* SQ 0 Tail Doorbell, 32bit (Admin) */
     NVME_CQ0HDBL   = 0x1004, /* CQ 0 Head Doorbell, 32bit (Admin)*/
@@ -135,6 +140,24 @@ enum {
 /* address for CQ ID. */
 #define NVME_CQyTDBL(id) (NVME_CQ0TDBL + 8*(id))
 
+/* Controller Memory Buffer, exposed through its own 64bit BAR */
+#define NVME_CMB_BIR 2
+#define NVME_MAX_CMB_SIZE 1024 /* MB */
+
+/* Max Data Transfer Size, a power of two in units of the 4KB minimum
+ * page size: 5 is 128KB and 11 is 8MB. 0 means no limit */
+#define NVME_DEFAULT_MDTS 5
+#define NVME_MAX_MDTS 11
+enum {
+    NVME_CMBSZ_SQS   = 1 << 0, /* Submission Queue Support */
+    NVME_CMBSZ_CQS   = 1 << 1, /* Completion Queue Support */
+    NVME_CMBSZ_LISTS = 1 << 2, /* PRP SGL List Support */
+    NVME_CMBSZ_RDS   = 1 << 3, /* Read Data Support */
+    NVME_CMBSZ_WDS   = 1 << 4, /* Write Data Support */
+    NVME_CMBSZ_SZU_1M = 2 << 8, /* Size Units: 1MB */
+};
+#define NVME_CMBSZ_SZ_SHIFT 12
+
 #define ASQ_ID 0    /* Admin submition queue ID == 0 */
 #define ACQ_ID 0    /* Admin complition queue ID == 0 */
 
@@ -206,11 +229,56 @@ typedef struct NVMEAQA {
     uint32_t res1:4;
 } NVMEAQA;
 
+/* Where a tracked command is waiting */
+enum {
+    NVME_CMD_PARKED = 1, /* fetched, held back by namespace QoS */
+    NVME_CMD_HELD   = 2, /* executed, completion held by the NAND model */
+};
+
+/* Buckets of the per SQ table of commands not completed yet */
+#define NVME_CMD_HASH_SIZE 64
+
+/* Command fetched from an I/O SQ whose completion is not posted yet,
+ * embedded in the structure holding it and found by Abort through the
+ * SQ command table */
 typedef struct CommandEntry {
     QTAILQ_ENTRY(CommandEntry) entry;
     uint16_t cid;
+    uint16_t sq_id;
+    uint8_t state;
 } CommandEntry;
 
+/* QoS token buckets, see nvme_qos.c */
+enum {
+    NVME_QOS_RD_IOPS = 0,
+    NVME_QOS_WR_IOPS,
+    NVME_QOS_RD_BPS,
+    NVME_QOS_WR_BPS,
+    NVME_QOS_BUCKETS,
+};
+
+/* User visible limits, 0 means unlimited */
+typedef struct NVMEQoSConf {
+    uint64_t rd_iops;
+    uint64_t wr_iops;
+    uint64_t rd_bps;
+    uint64_t wr_bps;
+    uint64_t iops_burst; /* Bucket size for the IOPS limits, 0: 1 second */
+    uint64_t bps_burst; /* Bucket size for the bytes/s limits, 0: 1 second */
+} NVMEQoSConf;
+
+typedef struct NVMEBucket {
+    uint64_t rate; /* Tokens per second, 0 is unlimited */
+    uint64_t size; /* Maximum number of tokens */
+    double level; /* Tokens left, negative when a command overdrew it */
+    int64_t last; /* vm_clock time of the last refill */
+} NVMEBucket;
+
+typedef struct NVMEQoS {
+    NVMEQoSConf conf;
+    NVMEBucket bucket[NVME_QOS_BUCKETS];
+} NVMEQoS;
+
 typedef struct NVMEIOSQueue {
     uint16_t id;
     uint16_t cq_id;
@@ -221,7 +289,8 @@ typedef struct NVMEIOSQueue {
     uint32_t size;
     uint64_t dma_addr; /* DMA Address */
     /*FIXME: Add support for PRP List. */
-    QTAILQ_HEAD(cmd_list, CommandEntry) cmd_list;
+    QTAILQ_HEAD(cmd_list, CommandEntry) cmd_list[NVME_CMD_HASH_SIZE];
+    NVMEQoS qos;
 } NVMEIOSQueue;
 
 typedef struct NVMEIOCQueue {
@@ -235,6 +304,7 @@ typedef struct NVMEIOCQueue {
     uint32_t size;
     uint64_t dma_addr; /* DMA Address */
     uint8_t phase_tag; /* check spec for Phase Tag details*/
+    uint32_t pending; /* completions held back by the NAND model */
 } NVMEIOCQueue;
 
 /* FIXME*/
@@ -315,7 +385,8 @@ typedef struct NVMEIdentifyController {
     uint8_t ieee[3];
     uint8_t mic;
     uint8_t mdts;
-    uint8_t rsvd255[178];
+    uint16_t cntlid;
+    uint8_t rsvd255[176];
     uint16_t oacs;
     uint8_t acl;
     uint8_t aerl;
@@ -323,7 +394,10 @@ typedef struct NVMEIdentifyController {
     uint8_t lpa;
     uint8_t elpe;
     uint8_t npss;
-    uint8_t rsvd511[248];
+    uint8_t rsvd279[16];
+    uint8_t tnvmcap[16];
+    uint8_t unvmcap[16];
+    uint8_t rsvd511[200];
     uint8_t sqes;
     uint8_t cqes;
     uint16_t rsvd515;
@@ -390,7 +464,8 @@ typedef struct NVMEIdentifyNamespace {
     uint8_t  mc;        /* [27] Metadata Capabilities */
     uint8_t  dpc;       /* [28] End2end Data Protection Capabilities */
     uint8_t  dps;       /* [29] End2end Data Protection Type Settings */
-    uint8_t  res0[98];  /* [30-127] Reserved */
+    uint8_t  nmic;      /* [30] Namespace Multi-path I/O Capabilities */
+    uint8_t  res0[97];  /* [31-127] Reserved */
     struct NVMELBAFormat lbafx[16]; /* [128-191] LBA Format 0-15 Support */
     uint8_t  res1[192]; /* [192-383] Reserved */
     uint8_t  vs[3712];  /* [384-4095] Vendor Specific */
@@ -455,20 +530,66 @@ enum {
     NVME_LOG_ERROR_INFORMATION   = 0x01,
     NVME_LOG_SMART_INFORMATION   = 0x02,
     NVME_LOG_FW_SLOT_INFORMATION = 0x03,
+    NVME_LOG_CHANGED_NS_LIST     = 0x04,
+};
+
+/* Namespace memory backend, see nvme_storage.c */
+enum {
+    NVME_MEM_PREALLOC = 0, /* bits in NVMEMemBackend.flags */
+    NVME_MEM_LOCK = 1,
 };
 
+#define NVME_MAX_HOST_NODES 1024
+
+typedef struct NVMEMemBackend {
+    char *path; /* hugetlbfs directory, NULL keeps image files */
+    uint32_t flags;
+    int32_t host_node; /* host NUMA node, -1 for no binding */
+} NVMEMemBackend;
+
+struct NVMEState;
+struct DiskInfo;
+struct NVMECmd;
+struct NVMECQE;
+
+/* Formatted LBA size of a namespace, cached from idtfy_ns whenever it
+ * changes so that I/O does not decode FLBAS for every command */
+typedef struct NVMEFormat {
+    uint8_t lbads; /* log2 of the block size */
+    uint8_t extended; /* metadata is transferred with the data */
+    uint16_t ms; /* metadata bytes per block */
+    uint32_t blk_sz;
+    /* Read/write handler picked for this format */
+    uint8_t (*rw)(struct NVMEState *n, struct DiskInfo *disk,
+        struct NVMECmd *sqe, struct NVMECQE *cqe);
+} NVMEFormat;
+
 typedef struct DiskInfo {
     int fd;
     int mfd;
     int nsid;
+    /* Namespace exists (Namespace Management) */
+    uint8_t allocated;
+    /* Controllers the namespace is attached to (Namespace Attachment),
+     * one bit per NVMEState.ctrl_idx */
+    uint32_t attached;
+    /* Held by a running admin command (Format), I/O fails as not ready */
+    uint8_t busy;
+    /* Optional user supplied backing file, NULL for the default image */
+    char *backing;
     size_t mapping_size;
     uint8_t *mapping_addr;
+    /* Memory backend of the data, NULL for an image file; points into the
+     * subsystem, which outlives the controllers */
+    NVMEMemBackend *mem;
+    size_t mem_page_size;
 
     size_t meta_mapping_size;
     uint8_t *meta_mapping_addr;
 
     /* Pointer to Identify Namespace Strucutre */
     NVMEIdentifyNamespace idtfy_ns;
+    NVMEFormat fmt;
     /* Namespace utilization bitmasks (rounded off) */
     uint8_t *ns_util;
     uint8_t thresh_warn_issued;
@@ -482,6 +603,60 @@ typedef struct DiskInfo {
     uint64_t host_write_commands[2];
 } DiskInfo;
 
+/* Controllers sharing a set of namespaces, see nvme_subsys.c */
+#define NVME_MAX_CTRLS 32
+
+typedef struct NVMESubsystem {
+    char *name; /* NULL for the private subsystem of a lone controller */
+    struct NVMEState *ctrl[NVME_MAX_CTRLS];
+    uint32_t nctrls;
+    DiskInfo *disk; /* NVME_MAX_NUM_NAMESPACES entries, indexed by nsid-1 */
+    /* Memory backend of the namespaces, copied from the first controller */
+    NVMEMemBackend mem;
+    QLIST_ENTRY(NVMESubsystem) entry;
+} NVMESubsystem;
+
+#define NVME_NS_ATTACHED(n, disk) ((disk)->attached & (1U << (n)->ctrl_idx))
+
+/* QoS state a controller keeps for each namespace */
+typedef struct NVMENsThrottle {
+    NVMEQoS qos;
+    /* Commands waiting for the namespace QoS limits */
+    QTAILQ_HEAD(throttled, NVMEThrottled) throttled;
+} NVMENsThrottle;
+
+/* NAND timing model, see nvme_nand.c */
+enum {
+    NVME_NAND_ENABLED = 0, /* bit in NVMENand.flags */
+};
+
+typedef struct NVMENand {
+    uint32_t flags;
+    uint32_t channels; /* Flash channels */
+    uint32_t dies; /* Dies per channel */
+    uint32_t planes; /* Planes per die */
+    uint32_t page_size; /* Flash page size, KB */
+    uint32_t pages_per_block;
+    uint32_t read_lat; /* Page read latency, us */
+    uint32_t prog_lat; /* Page program latency, us */
+    uint32_t erase_lat; /* Block erase latency, us */
+    uint32_t chan_bw; /* Channel bandwidth, MB/s */
+    uint32_t wbuf_size; /* Write buffer size, KB. 0 writes through */
+
+    uint32_t num_units; /* channels * dies * planes */
+    int64_t *unit_free; /* vm_clock time each plane becomes idle */
+    uint32_t *unit_progs; /* pages programmed since the last erase */
+    int64_t *chan_free; /* vm_clock time each channel becomes idle */
+    int64_t *wbuf; /* vm_clock time each buffer slot is drained */
+    uint32_t wbuf_slots;
+    uint32_t wbuf_next;
+
+    QEMUTimer *timer;
+    QTAILQ_HEAD(nand_pending, NVMENandCompletion) pending;
+} NVMENand;
+
+#define NVME_NAND_ON(n) ((n)->nand.flags & (1 << NVME_NAND_ENABLED))
+
 typedef struct NVMEState {
     PCIDevice dev;
     int mmio_index;
@@ -489,6 +664,20 @@ typedef struct NVMEState {
     int bar0_size;
     uint8_t nvectors;
 
+    /* LBA format of the namespaces created without an explicit one */
+    uint32_t lba_format;
+    uint32_t mdts;
+    /* Guest memory of the I/O command being transferred */
+    QEMUSGList sg;
+
+    /* Memory backend for namespaces without a backing file */
+    NVMEMemBackend mem;
+
+    /* Controller Memory Buffer, cmb_size is in MB and 0 disables it */
+    uint32_t cmb_size;
+    ram_addr_t cmb_offset;
+    uint8_t *cmb;
+
     unsigned int host_page_size; /* it is possible to set different page sizes through CC reg */
     /* Space for NVME Ctrl Space except doorbells */
     uint8_t *cntrl_reg;
@@ -503,10 +692,22 @@ typedef struct NVMEState {
     NVMEIOCQueue cq[NVME_MAX_QS_ALLOCATED];
     NVMEIOSQueue sq[NVME_MAX_QS_ALLOCATED];
 
-    DiskInfo *disk;
+    /* Namespaces, owned by the subsystem */
+    DiskInfo *disk; /* NVME_MAX_NUM_NAMESPACES entries, indexed by nsid-1 */
+    char *subsys_name;
+    NVMESubsystem *subsys;
+    uint32_t ctrl_idx; /* slot in the subsystem */
+    NVMENsThrottle ns_throttle[NVME_MAX_NUM_NAMESPACES];
     uint32_t ns_size;
     uint32_t num_namespaces;
     uint32_t instance;
+    /* Total NVM capacity in MB shared by all namespaces */
+    uint32_t nvm_capacity;
+
+    /* Changed Namespace List log page */
+    uint32_t changed_nsids[NVME_MAX_CHANGED_NAMESPACES];
+    uint16_t num_changed_nsids;
+    uint8_t ns_change_aen_pending;
 
     time_t start_time;
 
@@ -531,6 +732,11 @@ typedef struct NVMEState {
 
     QEMUTimer *sq_processing_timer;
     int64_t sq_processing_timer_target;
+    /* The admin SQ is processed apart from the I/O SQs */
+    QEMUBH *admin_bh;
+    /* Admin command running on a thread, the admin SQ waits for it */
+    struct NVMEAdmJob *adm_job;
+    int adm_job_fds[2];
     /* Used for PIN based and MSI interrupts */
     uint32_t intr_vect;
     /* Page Size used by the hardware */
@@ -549,8 +755,22 @@ typedef struct NVMEState {
     uint16_t outstanding_asyncs;
 
     QSIMPLEQ_HEAD(async_queue, AsyncEvent) async_queue;
+
+    NVMENand nand;
+
+    /* Default QoS limits of new namespaces and submission queues */
+    NVMEQoSConf ns_qos;
+    NVMEQoSConf sq_qos;
+    QEMUTimer *qos_timer;
+    int64_t qos_timer_target;
+
+    /* Socket of the out of process dataplane serving the I/O queues */
+    char *dataplane;
+    struct NVMEDataplane *dp;
 } NVMEState;
 
+#define NVME_DP_ON(n) ((n)->dp != NULL)
+
 /* Structure used for default initialization sequence (except doorbell) */
 struct NVMEReg {
     uint32_t offset; /* Offset in NVME space */
@@ -671,6 +891,25 @@ static const struct NVMEReg nvme_reg[] = {
     .rwc_mask = 0x00,
     .rws_mask = 0x00,
 },
+
+/* Filled in by nvme_cmb_set_registry() when a CMB is configured */
+{
+    .offset = NVME_CMBLOC,
+    .len = 0x04,
+    .reset = 0x00,
+    .rw_mask = 0x00,
+    .rwc_mask = 0x00,
+    .rws_mask = 0x00,
+},
+
+{
+    .offset = NVME_CMBSZ,
+    .len = 0x04,
+    .reset = 0x00,
+    .rw_mask = 0x00,
+    .rwc_mask = 0x00,
+    .rws_mask = 0x00,
+},
 };
 
 /*
@@ -690,8 +929,10 @@ enum {
     NVME_ADM_CMD_SET_FEATURES  = 0x09,
     NVME_ADM_CMD_GET_FEATURES  = 0x0a,
     NVME_ADM_CMD_ASYNC_EV_REQ  = 0x0c,
+    NVME_ADM_CMD_NS_MANAGEMENT = 0x0d,
     NVME_ADM_CMD_ACTIVATE_FW   = 0x10,
     NVME_ADM_CMD_DOWNLOAD_FW   = 0x11,
+    NVME_ADM_CMD_NS_ATTACHMENT = 0x15,
     NVME_ADM_CMD_FORMAT_NVM    = 0x80,
     NVME_ADM_CMD_SECURITY_SEND = 0x81,
     NVME_ADM_CMD_SECURITY_RECV = 0x82,
@@ -819,8 +1060,9 @@ typedef struct NVMEAdmCmdIdentify {
     uint64_t mptr;
     uint64_t prp1;
     uint64_t prp2;
-    uint32_t cns:1; /* CDW10[0] Controller or Namespace Structure  */
-    uint32_t res2:31; /* CDW10[1-31] Reserved */
+    uint32_t cns:8; /* CDW10[0-7] Controller or Namespace Structure  */
+    uint32_t res2:8; /* CDW10[8-15] Reserved */
+    uint32_t cntid:16; /* CDW10[16-31] Controller Identifier */
     uint32_t cdw11;
     uint32_t cdw12;
     uint32_t cdw13;
@@ -850,6 +1092,7 @@ typedef struct NVMEAdmCmdAbort {
 enum {
     event_type_error = 0,
     event_type_smart = 1,
+    event_type_notice = 2,
     event_info_err_invalid_sq = 0,
     event_info_err_invalid_db = 1,
     event_info_err_diag_fail  = 2,
@@ -858,9 +1101,28 @@ enum {
     event_info_err_fw_img_load_err = 5,
     event_info_smart_reliability = 0,
     event_info_smart_temp_thresh = 1,
-    event_info_smart_spare_thresh = 2
+    event_info_smart_spare_thresh = 2,
+    event_info_notice_ns_attr_changed = 0
 };
 
+/* Namespace Management - Select (CDW10[0-3]) */
+enum {
+    NVME_NS_MANAGEMENT_CREATE = 0,
+    NVME_NS_MANAGEMENT_DELETE = 1,
+};
+
+/* Namespace Attachment - Select (CDW10[0-3]) */
+enum {
+    NVME_NS_ATTACHMENT_ATTACH = 0,
+    NVME_NS_ATTACHMENT_DETACH = 1,
+};
+
+/* Controller List used by Namespace Attachment and Identify */
+typedef struct NVMECtrlList {
+    uint16_t num_ids;
+    uint16_t ids[2047];
+} NVMECtrlList;
+
 typedef struct NVMEAdmCmdAsyncEvRq {
     uint32_t opcode:8;
     uint32_t fuse:2;
@@ -995,6 +1257,7 @@ enum {
     NVME_SC_FUSED_FAIL        = 0x9,
     NVME_SC_FUSED_MISSING     = 0xa,
     NVME_SC_INVALID_NAMESPACE = 0xb,
+    NVME_SC_INVALID_PRP_OFFSET = 0x13,
     NVME_SC_LBA_RANGE         = 0x80,
     NVME_SC_CAP_EXCEEDED      = 0x81,
     NVME_SC_NS_NOT_READY      = 0x82,
@@ -1013,6 +1276,12 @@ enum {
     NVME_INVALID_INTERRUPT_VECTOR   = 0x08,
     NVME_INVALID_LOG_PAGE           = 0x09,
     NVME_INVALID_FORMAT             = 0x0a,
+    NVME_NS_INSUFFICIENT_CAPACITY   = 0x15,
+    NVME_NS_ID_UNAVAILABLE          = 0x16,
+    NVME_NS_ALREADY_ATTACHED        = 0x18,
+    NVME_NS_IS_PRIVATE              = 0x19,
+    NVME_NS_NOT_ATTACHED            = 0x1a,
+    NVME_CTRL_LIST_INVALID          = 0x1c,
 
     NVME_CMD_NVM_ERR_CONFLICT       = 0x80,
 };
@@ -1038,11 +1307,32 @@ typedef struct NVMECQE {
     NVMEStatusField status; /* DW3[16] Phase Tag & DW3[17-31] Status Field */
 } NVMECQE;
 
+/* Completion waiting for its NAND model deadline */
+typedef struct NVMENandCompletion {
+    int64_t time;
+    uint16_t cq_id;
+    NVMECQE cqe;
+    CommandEntry ce;
+    QTAILQ_ENTRY(NVMENandCompletion) entry;
+} NVMENandCompletion;
+
+/* I/O command fetched from its SQ but held back by namespace QoS */
+typedef struct NVMEThrottled {
+    NVMECmd sqe;
+    CommandEntry ce; /* ce.sq_id is the queue it was fetched from */
+    QTAILQ_ENTRY(NVMEThrottled) entry;
+} NVMEThrottled;
+
 
 /* CNS bit in Identify command */
 enum {
-    NVME_IDENTIFY_NAMESPACE  = 0,
-    NVME_IDENTIFY_CONTROLLER = 1,
+    NVME_IDENTIFY_NAMESPACE         = 0x00,
+    NVME_IDENTIFY_CONTROLLER        = 0x01,
+    NVME_IDENTIFY_ACTIVE_NS_LIST    = 0x02,
+    NVME_IDENTIFY_ALLOCATED_NS_LIST = 0x10,
+    NVME_IDENTIFY_ALLOCATED_NS      = 0x11,
+    NVME_IDENTIFY_NS_CTRL_LIST      = 0x12,
+    NVME_IDENTIFY_CTRL_LIST         = 0x13,
 };
 
 /* Config File Read Strucutre */
@@ -1084,6 +1374,10 @@ int nvme_init_io_thread(NVMEState *n);
 
 /* Admin command processing */
 uint8_t nvme_admin_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe);
+int nvme_adm_job_init(NVMEState *n);
+void nvme_adm_job_uninit(NVMEState *n);
+void nvme_adm_job_cancel(NVMEState *n);
+void nvme_adm_job_wake(NVMEState *n);
 
 /* IO command processing */
 uint8_t nvme_io_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe);
@@ -1104,9 +1398,71 @@ int nvme_del_storage_disks(NVMEState *n);
 int nvme_del_storage_disk(DiskInfo *disk);
 int nvme_create_storage_disk(uint32_t instance, uint32_t nsid, DiskInfo *disk,
     NVMEState *n);
-
-void nvme_dma_mem_read(target_phys_addr_t addr, uint8_t *buf, int len);
-void nvme_dma_mem_write(target_phys_addr_t addr, uint8_t *buf, int len);
+int nvme_resize_storage_disk(DiskInfo *disk, uint64_t nsze);
+
+/* Namespace management, shared by the admin commands and the monitor */
+void nvme_init_ns_identify(DiskInfo *disk, uint64_t nsze, uint8_t flbas);
+void nvme_ns_set_format(DiskInfo *disk);
+DiskInfo *nvme_get_active_ns(NVMEState *n, uint32_t nsid);
+uint64_t nvme_allocated_capacity(NVMEState *n);
+uint32_t nvme_ns_create(NVMEState *n, uint64_t nsze, uint64_t ncap,
+    uint8_t flbas, const char *backing, uint32_t *nsid, NVMEStatusField *sf);
+uint32_t nvme_ns_delete(NVMEState *n, uint32_t nsid, NVMEStatusField *sf);
+uint32_t nvme_ns_resize(NVMEState *n, uint32_t nsid, uint64_t nsze,
+    NVMEStatusField *sf);
+uint32_t nvme_ns_attach(NVMEState *n, uint32_t nsid, NVMEStatusField *sf);
+uint32_t nvme_ns_detach(NVMEState *n, uint32_t nsid, NVMEStatusField *sf);
+
+int nvme_subsys_join(NVMEState *n);
+void nvme_subsys_leave(NVMEState *n);
+NVMEState *nvme_subsys_find_ctrl(NVMESubsystem *s, uint16_t cntlid);
+void nvme_ns_changed(NVMEState *n, uint32_t nsid);
+
+/* NAND timing model */
+int nvme_nand_init(NVMEState *n);
+void nvme_nand_uninit(NVMEState *n);
+void nvme_nand_reset(NVMEState *n);
+void nvme_nand_cancel_sq(NVMEState *n, uint16_t sq_id);
+void nvme_nand_abort(NVMEState *n, CommandEntry *ce);
+void nvme_nand_complete(NVMEState *n, NVMECmd *sqe, uint16_t cq_id,
+    NVMECQE *cqe);
+
+/* QoS throttling */
+void nvme_qos_init(NVMEState *n);
+void nvme_qos_uninit(NVMEState *n);
+void nvme_qos_reset(NVMEState *n);
+void nvme_qos_set(NVMEQoS *q, const NVMEQoSConf *conf);
+int nvme_qos_limited(const NVMEQoSConf *conf);
+int nvme_qos_sq_throttled(NVMEState *n, uint16_t sq_id, NVMECmd *sqe);
+int nvme_qos_ns_throttled(NVMEState *n, uint16_t sq_id, NVMECmd *sqe);
+void nvme_qos_release_ns(NVMEState *n, DiskInfo *disk);
+void nvme_qos_set_ns(NVMEState *n, DiskInfo *disk);
+void nvme_qos_cancel_sq(NVMEState *n, uint16_t sq_id);
+void nvme_qos_abort(NVMEState *n, CommandEntry *ce);
+void nvme_io_dispatch(NVMEState *n, uint16_t sq_id, NVMECmd *sqe);
+void nvme_cmd_track(NVMEState *n, CommandEntry *ce, uint16_t sq_id,
+    uint16_t cid, uint8_t state);
+void nvme_cmd_untrack(NVMEState *n, CommandEntry *ce);
+CommandEntry *nvme_cmd_find(NVMEState *n, uint16_t sq_id, uint16_t cid);
+
+/* Out of process dataplane, nvme_dataplane.c */
+int nvme_dp_init(NVMEState *n);
+void nvme_dp_uninit(NVMEState *n);
+void nvme_dp_enable(NVMEState *n);
+void nvme_dp_reset(NVMEState *n);
+int nvme_dp_reset_pending(NVMEState *n);
+int nvme_dp_create_cq(NVMEState *n, uint16_t qid);
+int nvme_dp_create_sq(NVMEState *n, uint16_t qid);
+int nvme_dp_delete_sq(NVMEState *n, uint16_t qid);
+int nvme_dp_delete_cq(NVMEState *n, uint16_t qid);
+void nvme_dp_ns_changed(NVMEState *n, uint32_t nsid);
+void nvme_dp_sq_doorbell(NVMEState *n, uint16_t qid, uint16_t tail);
+void nvme_dp_cq_doorbell(NVMEState *n, uint16_t qid, uint16_t head);
+
+void nvme_dma_mem_read(NVMEState *n, target_phys_addr_t addr, uint8_t *buf,
+    int len);
+void nvme_dma_mem_write(NVMEState *n, target_phys_addr_t addr, uint8_t *buf,
+    int len);
 int  process_sq(NVMEState *n, uint16_t sq_id);
 void async_process_cb(void *);
 void incr_cq_tail(NVMEIOCQueue *q);
@@ -1130,5 +1486,6 @@ int random_chance(int chance);
 void post_cq_entry(NVMEState *n, NVMEIOCQueue *cq, NVMECQE* cqe);
 uint8_t is_cq_full(NVMEState *n, uint16_t qid);
 void isr_notify(NVMEState *n, NVMEIOCQueue *cq);
+void nvme_reset_complete(NVMEState *n);
 
 #endif /* NVME_H_ */
@@ -27,6 +27,37 @@
 #include "nvme_debug.h"
 #include <sys/mman.h>
 
+/*
+ * Admin commands that may block for long, Format NVM and the firmware
+ * commands, do their file work on a thread as a NVMEAdmJob. The admin
+ * SQ is not fetched from until the job completes, the I/O SQs go on
+ * meanwhile. The ACQ slot of its completion is reserved, asynchronous
+ * events can't take it. work() runs on the thread and must not touch guest
+ * memory or device state other than what the job owns, done() runs back in
+ * the main loop and fills in the completion.
+ *
+ * A waiting job has no thread, it holds back the completion of a command
+ * that is done on QEMU's side until nvme_adm_job_wake(), the dataplane
+ * acknowledging a queue deletion.
+ */
+typedef struct NVMEAdmJob NVMEAdmJob;
+
+struct NVMEAdmJob {
+    NVMEState *n;
+    NVMECmd sqe;
+    NVMECQE cqe;
+    pthread_t thread;
+    uint32_t (*work)(NVMEAdmJob *job);
+    void (*done)(NVMEAdmJob *job);
+    uint32_t res;
+    DiskInfo *disk;
+    uint8_t *buf;
+    uint32_t len;
+    uint64_t offset;
+    char fw_hash[9];
+    uint8_t waiting;
+};
+
 static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_del_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
@@ -40,6 +71,8 @@ static uint32_t adm_cmd_async_ev_req(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_act_fw(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_dl_fw(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_format_nvm(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
+static uint32_t adm_cmd_ns_mgmt(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
+static uint32_t adm_cmd_ns_attach(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 
 typedef uint32_t adm_command_func(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 
@@ -57,6 +90,8 @@ static adm_command_func * const adm_cmds_funcs[] = {
     [NVME_ADM_CMD_ACTIVATE_FW] = adm_cmd_act_fw,
     [NVME_ADM_CMD_DOWNLOAD_FW] = adm_cmd_dl_fw,
     [NVME_ADM_CMD_FORMAT_NVM] = adm_cmd_format_nvm,
+    [NVME_ADM_CMD_NS_MANAGEMENT] = adm_cmd_ns_mgmt,
+    [NVME_ADM_CMD_NS_ATTACHMENT] = adm_cmd_ns_attach,
     [NVME_ADM_CMD_LAST] = NULL,
 };
 
@@ -101,6 +136,219 @@ uint32_t adm_check_sqid(NVMEState *n, uint16_t sqid)
     }
 }
 
+static void *adm_job_thread(void *opaque)
+{
+    NVMEAdmJob *job = opaque;
+    char c = 0;
+
+    job->res = job->work(job);
+    while (write(job->n->adm_job_fds[1], &c, 1) < 0 && errno == EINTR) {
+        ;
+    }
+    return NULL;
+}
+
+/*********************************************************************
+    Function     :    adm_job_start
+    Description  :    Starts the work of a long admin command on a
+                      thread, or runs it in place if no thread can
+                      be created
+    Return Type  :    uint32_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd   * : Pointer to SQ cmd
+                      NVMECQE   * : Pointer to CQ completion entries
+                      NVMEAdmJob * : Job, freed once done
+*********************************************************************/
+static uint32_t adm_job_start(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe,
+    NVMEAdmJob *job)
+{
+    uint32_t res;
+
+    job->n = n;
+    job->sqe = *cmd;
+    job->cqe = *cqe;
+    if (n->adm_job_fds[0] >= 0 &&
+            pthread_create(&job->thread, NULL, adm_job_thread, job) == 0) {
+        /* process_sq() posts no completion while n->adm_job is set */
+        n->adm_job = job;
+        n->cq[ACQ_ID].pending++;
+        return 0;
+    }
+
+    LOG_ERR("%s(): no thread for opcode %x, running it in place", __func__,
+        cmd->opcode);
+    job->res = job->work(job);
+    job->done(job);
+    *cqe = job->cqe;
+    res = job->res;
+    qemu_free(job->buf);
+    qemu_free(job);
+    return res;
+}
+
+/*********************************************************************
+    Function     :    adm_job_wait
+    Description  :    Holds back the completion of an admin command
+                      until nvme_adm_job_wake()
+    Return Type  :    uint32_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd   * : Pointer to SQ cmd
+                      NVMECQE   * : Pointer to CQ completion entries
+*********************************************************************/
+static uint32_t adm_job_wait(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
+{
+    NVMEAdmJob *job = qemu_mallocz(sizeof(*job));
+
+    job->n = n;
+    job->sqe = *cmd;
+    job->cqe = *cqe;
+    job->waiting = 1;
+    n->adm_job = job;
+    n->cq[ACQ_ID].pending++;
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    adm_job_finish
+    Description  :    Waits for the running admin job and completes
+                      it, posting its completion entry if asked to
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      int         : Post the completion entry
+*********************************************************************/
+static void adm_job_finish(NVMEState *n, int post)
+{
+    NVMEAdmJob *job = n->adm_job;
+    NVMEStatusField *sf = (NVMEStatusField *)&job->cqe.status;
+
+    if (!job->waiting) {
+        pthread_join(job->thread, NULL);
+    }
+    n->adm_job = NULL;
+    n->cq[ACQ_ID].pending--;
+    if (job->done) {
+        job->done(job);
+    }
+
+    if (post) {
+        job->cqe.sq_id = ASQ_ID;
+        job->cqe.sq_head = n->sq[ASQ_ID].head;
+        job->cqe.command_id = job->sqe.cid;
+        sf->p = n->cq[ACQ_ID].phase_tag;
+        sf->m = 0;
+        sf->dnr = 0;
+        post_cq_entry(n, &n->cq[ACQ_ID], &job->cqe);
+    }
+    qemu_free(job->buf);
+    qemu_free(job);
+}
+
+static void adm_job_read(void *opaque)
+{
+    NVMEState *n = opaque;
+    char buf[16];
+
+    while (read(n->adm_job_fds[0], buf, sizeof(buf)) > 0) {
+        ;
+    }
+    if (n->adm_job && !n->adm_job->waiting) {
+        adm_job_finish(n, 1);
+        qemu_bh_schedule(n->admin_bh);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_adm_job_wake
+    Description  :    Posts the completion held back by a waiting
+                      admin job
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_adm_job_wake(NVMEState *n)
+{
+    if (n->adm_job && n->adm_job->waiting) {
+        adm_job_finish(n, 1);
+        qemu_bh_schedule(n->admin_bh);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_adm_job_init
+    Description  :    Sets up the notification of admin jobs
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_adm_job_init(NVMEState *n)
+{
+    if (qemu_pipe(n->adm_job_fds) < 0) {
+        LOG_ERR("%s(): pipe failed: %s", __func__, strerror(errno));
+        n->adm_job_fds[0] = n->adm_job_fds[1] = -1;
+        return FAIL;
+    }
+    fcntl(n->adm_job_fds[0], F_SETFL, O_NONBLOCK);
+    qemu_set_fd_handler(n->adm_job_fds[0], adm_job_read, NULL, n);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_adm_job_cancel
+    Description  :    Waits for a running admin job, for a controller
+                      reset. Its completion is dropped.
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_adm_job_cancel(NVMEState *n)
+{
+    if (n->adm_job) {
+        LOG_NORM("%s(): waiting for admin opcode %x", __func__,
+            n->adm_job->sqe.opcode);
+        adm_job_finish(n, 0);
+    }
+}
+
+void nvme_adm_job_uninit(NVMEState *n)
+{
+    nvme_adm_job_cancel(n);
+    if (n->adm_job_fds[0] < 0) {
+        return;
+    }
+    qemu_set_fd_handler(n->adm_job_fds[0], NULL, NULL, NULL);
+    close(n->adm_job_fds[0]);
+    close(n->adm_job_fds[1]);
+}
+
+/* Copies a controller to host data structure through PRP1 and PRP2 */
+static void adm_dma_write_prp(NVMEState *n, NVMECmd *cmd, uint8_t *buf,
+    uint32_t buf_len)
+{
+    uint32_t len;
+
+    len = min(n->host_page_size - (cmd->prp1 % n->host_page_size), buf_len);
+    nvme_dma_mem_write(n, cmd->prp1, buf, len);
+    if (len < buf_len) {
+        nvme_dma_mem_write(n, cmd->prp2, buf + len, buf_len - len);
+    }
+}
+
+/* Copies a host to controller data structure through PRP1 and PRP2 */
+static void adm_dma_read_prp(NVMEState *n, NVMECmd *cmd, uint8_t *buf,
+    uint32_t buf_len)
+{
+    uint32_t len;
+
+    len = min(n->host_page_size - (cmd->prp1 % n->host_page_size), buf_len);
+    nvme_dma_mem_read(n, cmd->prp1, buf, len);
+    if (len < buf_len) {
+        nvme_dma_mem_read(n, cmd->prp2, buf + len, buf_len - len);
+    }
+}
+
 static uint16_t adm_get_sq(NVMEState *n, uint16_t sqid)
 {
     if (sqid > NVME_MAX_QID) {
@@ -134,6 +382,7 @@ static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     NVMEIOSQueue *sq;
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     uint16_t i;
+    int wait;
     sf->sc = NVME_SC_SUCCESS;
 
     LOG_NORM("%s(): called with QID:%d", __func__, c->qid);
@@ -171,6 +420,10 @@ static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     if (sq->tail != sq->head) {
         /* Queue not empty */
     }
+    nvme_nand_cancel_sq(n, c->qid);
+    nvme_qos_cancel_sq(n, c->qid);
+    /* The completion waits until the dataplane let go of the queue */
+    wait = NVME_DP_ON(n) && nvme_dp_delete_sq(n, c->qid);
 
     if (sq->cq_id <= NVME_MAX_QID) {
         cq = &n->cq[sq->cq_id];
@@ -195,7 +448,7 @@ static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     sq->phys_contig = 0;
     sq->dma_addr = 0;
 
-    return 0;
+    return wait ? adm_job_wait(n, cmd, cqe) : 0;
 }
 
 static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
@@ -203,6 +456,7 @@ static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     NVMEAdmCmdCreateSQ *c = (NVMEAdmCmdCreateSQ *)cmd;
     NVMEIOSQueue *sq;
     uint16_t *mqes;
+    uint32_t i;
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     sf->sc = NVME_SC_SUCCESS;
 
@@ -292,8 +546,17 @@ static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     sq->cq_id = c->cqid;
     sq->prio = c->qprio;
     sq->dma_addr = c->prp1;
+    nvme_qos_set(&sq->qos, &n->sq_qos);
 
-    QTAILQ_INIT(&sq->cmd_list);
+    for (i = 0; i < NVME_CMD_HASH_SIZE; i++) {
+        QTAILQ_INIT(&sq->cmd_list[i]);
+    }
+
+    if (NVME_DP_ON(n) && nvme_dp_create_sq(n, c->qid)) {
+        sq->dma_addr = 0;
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
 
     LOG_DBG("sq->id %d, sq->dma_addr 0x%x, %lu",
         sq->id, (unsigned int)sq->dma_addr,
@@ -311,6 +574,7 @@ static uint32_t adm_cmd_del_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     NVMEIOCQueue *cq;
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     uint16_t i;
+    int wait;
     sf->sc = NVME_SC_SUCCESS;
 
     LOG_NORM("%s(): called", __func__);
@@ -360,6 +624,7 @@ static uint32_t adm_cmd_del_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         sf->sc = NVME_SC_INVALID_FIELD;
         return NVME_SC_INVALID_FIELD;
     }
+    wait = NVME_DP_ON(n) && nvme_dp_delete_cq(n, c->qid);
 
     cq->id = USHRT_MAX;
     cq->head = cq->tail = 0;
@@ -369,7 +634,7 @@ static uint32_t adm_cmd_del_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     cq->dma_addr = 0;
     cq->phys_contig = 0;
 
-    return 0;
+    return wait ? adm_job_wait(n, cmd, cqe) : 0;
 }
 
 static uint32_t adm_cmd_alloc_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
@@ -461,6 +726,12 @@ static uint32_t adm_cmd_alloc_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     cq->size = c->qsize + 1;
     cq->phys_contig = c->pc;
 
+    if (NVME_DP_ON(n) && nvme_dp_create_cq(n, c->qid)) {
+        cq->dma_addr = 0;
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+
     return 0;
 }
 
@@ -480,9 +751,9 @@ static uint32_t adm_cmd_fw_log_info(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     }
 
     len = min(n->host_page_size - (cmd->prp1 % n->host_page_size), trans_len);
-    nvme_dma_mem_write(cmd->prp1, (uint8_t *)fw_info, len);
+    nvme_dma_mem_write(n, cmd->prp1, (uint8_t *)fw_info, len);
     if (len < trans_len) {
-        nvme_dma_mem_write(cmd->prp2, (uint8_t *)((uint8_t *)fw_info + len),
+        nvme_dma_mem_write(n, cmd->prp2, (uint8_t *)((uint8_t *)fw_info + len),
             trans_len - len);
     }
     return 0;
@@ -515,10 +786,14 @@ static uint32_t adm_cmd_smart_info(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         uint64_t hwc[2] = {0, 0};
         uint64_t total_use = 0;
         uint64_t total_size = 0;
-        for (i = 0; i < n->num_namespaces; ++i) {
+        for (i = 0; i < NVME_MAX_NUM_NAMESPACES; ++i) {
             uint64_t tmp;
             DiskInfo *disk = &n->disk[i];
 
+            if (!NVME_NS_ATTACHED(n, disk)) {
+                continue;
+            }
+
             tmp = dur[0];
             dur[0] += disk->data_units_read[0];
             dur[1] += disk->data_units_read[1];
@@ -561,7 +836,7 @@ static uint32_t adm_cmd_smart_info(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         smart_log.host_write_commands[1] = hwc[1];
         smart_log.available_spare = 100 - (uint32_t)((((double)total_use) /
             total_size) * 100);
-    } else if (cmd->nsid > 0 && cmd->nsid <= n->num_namespaces &&
+    } else if (nvme_get_active_ns(n, cmd->nsid) != NULL &&
         (n->idtfy_ctrl->lpa & 0x1)) {
         LOG_NORM("getting smart log info for instance:%d nsid:%d",
             n->instance, cmd->nsid);
@@ -598,14 +873,38 @@ static uint32_t adm_cmd_smart_info(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     }
 
     len = min(n->host_page_size - (cmd->prp1 % n->host_page_size), trans_len);
-    nvme_dma_mem_write(cmd->prp1, (uint8_t *)&smart_log, len);
+    nvme_dma_mem_write(n, cmd->prp1, (uint8_t *)&smart_log, len);
     if (len < trans_len) {
-        nvme_dma_mem_write(cmd->prp2, (uint8_t *)((uint8_t *)&smart_log + len),
+        nvme_dma_mem_write(n, cmd->prp2,
+            (uint8_t *)((uint8_t *)&smart_log + len),
             trans_len - len);
     }
     return 0;
 }
 
+static uint32_t adm_cmd_changed_ns_list(NVMEState *n, NVMECmd *cmd,
+    NVMECQE *cqe)
+{
+    uint32_t buf_len, trans_len;
+    uint32_t list[NVME_MAX_CHANGED_NAMESPACES];
+
+    LOG_NORM("%s(): called, %d changed namespaces", __func__,
+        n->num_changed_nsids);
+
+    buf_len = (((cmd->cdw10 >> 16) & 0xfff) + 1) * 4;
+    trans_len = min(sizeof(list), buf_len);
+
+    memset(list, 0, sizeof(list));
+    memcpy(list, n->changed_nsids,
+        n->num_changed_nsids * sizeof(n->changed_nsids[0]));
+    adm_dma_write_prp(n, cmd, (uint8_t *)list, trans_len);
+
+    /* Reading the log page clears it and unmasks the event */
+    n->num_changed_nsids = 0;
+    n->ns_change_aen_pending = 0;
+    return 0;
+}
+
 static uint32_t adm_cmd_get_log_page(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
     NVMEAdmCmdGetLogPage *c = (NVMEAdmCmdGetLogPage *)cmd;
@@ -629,6 +928,9 @@ static uint32_t adm_cmd_get_log_page(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     case NVME_LOG_FW_SLOT_INFORMATION:
         return adm_cmd_fw_log_info(n, cmd, cqe);
         break;
+    case NVME_LOG_CHANGED_NS_LIST:
+        return adm_cmd_changed_ns_list(n, cmd, cqe);
+        break;
     default:
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_INVALID_LOG_PAGE;
@@ -640,13 +942,18 @@ static uint32_t adm_cmd_get_log_page(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 static uint32_t adm_cmd_id_ctrl(NVMEState *n, NVMECmd *cmd)
 {
     uint32_t len;
+    uint64_t unvmcap;
     LOG_NORM("%s(): copying %lu data into addr %lu",
         __func__, sizeof(*n->idtfy_ctrl), cmd->prp1);
 
+    unvmcap = cpu_to_le64(n->nvm_capacity * BYTES_PER_MB -
+        nvme_allocated_capacity(n));
+    memcpy(n->idtfy_ctrl->unvmcap, &unvmcap, sizeof(unvmcap));
+
     len = n->host_page_size - (cmd->prp1 % n->host_page_size);
-    nvme_dma_mem_write(cmd->prp1, (uint8_t *) n->idtfy_ctrl, len);
+    nvme_dma_mem_write(n, cmd->prp1, (uint8_t *) n->idtfy_ctrl, len);
     if (len != sizeof(*(n->idtfy_ctrl))) {
-        nvme_dma_mem_write(cmd->prp2,
+        nvme_dma_mem_write(n, cmd->prp2,
             (uint8_t *) ((uint8_t *) n->idtfy_ctrl + len),
                 (sizeof(*(n->idtfy_ctrl)) - len));
     }
@@ -659,20 +966,77 @@ static uint32_t adm_cmd_id_ns(NVMEState *n, NVMECmd *cmd)
     uint32_t len;
     LOG_NORM("%s(): called", __func__);
 
+    if (!n->disk[cmd->nsid - 1].allocated) {
+        /* Unallocated namespaces report a zero filled structure */
+        NVMEIdentifyNamespace zero_ns;
+
+        memset(&zero_ns, 0, sizeof(zero_ns));
+        adm_dma_write_prp(n, cmd, (uint8_t *)&zero_ns, sizeof(zero_ns));
+        return 0;
+    }
+
     LOG_DBG("Current Namespace utilization: %lu",
         n->disk[(cmd->nsid - 1)].idtfy_ns.nuse);
 
     len = n->host_page_size - (cmd->prp1 % n->host_page_size);
-    nvme_dma_mem_write(cmd->prp1,
+    nvme_dma_mem_write(n, cmd->prp1,
         (uint8_t *) &n->disk[(cmd->nsid - 1)].idtfy_ns, len);
     if (len != sizeof(n->disk[(cmd->nsid - 1)].idtfy_ns)) {
-        nvme_dma_mem_write(cmd->prp2,
+        nvme_dma_mem_write(n, cmd->prp2,
             (uint8_t *) ((uint8_t *)&n->disk[(cmd->nsid - 1)].idtfy_ns + len),
                 (sizeof(n->disk[(cmd->nsid - 1)].idtfy_ns)) - len);
     }
     return 0;
 }
 
+/* Active (attached) or allocated namespace ids greater than nsid */
+static uint32_t adm_cmd_id_ns_list(NVMEState *n, NVMECmd *cmd,
+    uint8_t attached_only)
+{
+    uint32_t list[1024];
+    uint32_t i, j = 0;
+
+    memset(list, 0, sizeof(list));
+    for (i = cmd->nsid; i < NVME_MAX_NUM_NAMESPACES && j < 1024; i++) {
+        if (n->disk[i].allocated &&
+                (NVME_NS_ATTACHED(n, &n->disk[i]) || !attached_only)) {
+            list[j++] = i + 1;
+        }
+    }
+    adm_dma_write_prp(n, cmd, (uint8_t *)list, sizeof(list));
+    return 0;
+}
+
+/* Subsystem controllers attached to nsid, or all of them for CNS 0x13,
+ * with an id of at least cntid, in increasing order */
+static uint32_t adm_cmd_id_ctrl_list(NVMEState *n, NVMECmd *cmd)
+{
+    NVMEAdmCmdIdentify *c = (NVMEAdmCmdIdentify *)cmd;
+    NVMESubsystem *s = n->subsys;
+    NVMECtrlList list;
+    uint16_t id;
+    uint32_t i, j;
+
+    memset(&list, 0, sizeof(list));
+    for (i = 0; i < NVME_MAX_CTRLS; i++) {
+        if (s->ctrl[i] == NULL) {
+            continue;
+        }
+        id = s->ctrl[i]->idtfy_ctrl->cntlid;
+        if (id < c->cntid || (c->cns == NVME_IDENTIFY_NS_CTRL_LIST &&
+                !NVME_NS_ATTACHED(s->ctrl[i], &n->disk[c->nsid - 1]))) {
+            continue;
+        }
+        for (j = list.num_ids; j > 0 && list.ids[j - 1] > id; j--) {
+            list.ids[j] = list.ids[j - 1];
+        }
+        list.ids[j] = id;
+        list.num_ids++;
+    }
+    adm_dma_write_prp(n, cmd, (uint8_t *)&list, sizeof(list));
+    return 0;
+}
+
 static uint32_t adm_cmd_identify(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
     NVMEAdmCmdIdentify *c = (NVMEAdmCmdIdentify *)cmd;
@@ -703,14 +1067,43 @@ static uint32_t adm_cmd_identify(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
             return FAIL;
         }
         ret = adm_cmd_id_ctrl(n, cmd);
-    } else {
+    } else if (c->cns == NVME_IDENTIFY_ACTIVE_NS_LIST ||
+            c->cns == NVME_IDENTIFY_ALLOCATED_NS_LIST) {
+        if (c->nsid >= 0xfffffffe) {
+            LOG_NORM("%s(): Invalid Namespace ID for list", __func__);
+            sf->sc = NVME_SC_INVALID_NAMESPACE;
+            return FAIL;
+        }
+        ret = adm_cmd_id_ns_list(n, cmd,
+            c->cns == NVME_IDENTIFY_ACTIVE_NS_LIST);
+    } else if (c->cns == NVME_IDENTIFY_CTRL_LIST) {
+        ret = adm_cmd_id_ctrl_list(n, cmd);
+    } else if (c->cns == NVME_IDENTIFY_NAMESPACE ||
+            c->cns == NVME_IDENTIFY_ALLOCATED_NS ||
+            c->cns == NVME_IDENTIFY_NS_CTRL_LIST) {
         /* Check for name space */
         if (c->nsid == 0 || (c->nsid > n->idtfy_ctrl->nn)) {
             LOG_NORM("%s(): Invalid Namespace ID", __func__);
             sf->sc = NVME_SC_INVALID_NAMESPACE;
             return FAIL;
         }
-        ret = adm_cmd_id_ns(n, cmd);
+        if (c->cns == NVME_IDENTIFY_NS_CTRL_LIST) {
+            ret = adm_cmd_id_ctrl_list(n, cmd);
+        } else if (c->cns == NVME_IDENTIFY_NAMESPACE &&
+                !NVME_NS_ATTACHED(n, &n->disk[c->nsid - 1])) {
+            /* Inactive namespaces look unallocated to the plain identify */
+            NVMEIdentifyNamespace zero_ns;
+
+            memset(&zero_ns, 0, sizeof(zero_ns));
+            adm_dma_write_prp(n, cmd, (uint8_t *)&zero_ns, sizeof(zero_ns));
+            ret = 0;
+        } else {
+            ret = adm_cmd_id_ns(n, cmd);
+        }
+    } else {
+        LOG_NORM("%s(): Invalid CNS:%x", __func__, c->cns);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
     }
     if (ret) {
         sf->sc = NVME_SC_INTERNAL;
@@ -730,14 +1123,22 @@ static uint32_t adm_cmd_identify(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
  * the command with an error (i.e., Requested Command to Abort Not Found)
  * when the command to abort is not found.
 */
+/* Aborts complete before the next admin command is fetched, so no more
+ * than one is ever outstanding and the ACL reported in Identify
+ * Controller cannot be exceeded. */
 static uint32_t adm_cmd_abort(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
     NVMEAdmCmdAbort *c = (NVMEAdmCmdAbort *)cmd;
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     NVMEIOSQueue *sq;
+    NVMEIOCQueue *cq;
+    CommandEntry *ce;
+    NVMECQE acqe;
+    NVMEStatusField *aborted_sf = (NVMEStatusField *) &acqe.status;
 
     sf->sc = NVME_SC_SUCCESS;
-    CommandEntry *ce;
+    /* Dword 0 bit 0 set: command not aborted */
+    cqe->cmd_specific = 1;
 
     if (cmd->opcode != NVME_ADM_CMD_ABORT) {
         LOG_NORM("%s(): Invalid opcode %d", __func__, cmd->opcode);
@@ -758,44 +1159,33 @@ static uint32_t adm_cmd_abort(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     LOG_NORM("%s(): called", __func__);
 
     sq = &n->sq[c->sqid];
-    QTAILQ_FOREACH(ce, &sq->cmd_list, entry) {
-        if (ce->cid == c->cmdid) {
-            uint16_t aborted_cq_id;
-            NVMECQE acqe;
-            NVMEIOCQueue *cq;
-            NVMEStatusField *aborted_sf = (NVMEStatusField *) &acqe.status;
-
-            aborted_cq_id = sq->cq_id;
-            if (adm_check_cqid(n, aborted_cq_id)) {
-                LOG_ERR("Abort, submission queue:%d has invalid cq:%d", sq->id,
-                    aborted_cq_id);
-                sf->sct = NVME_SCT_CMD_SPEC_ERR;
-                sf->sc = NVME_REQ_CMD_TO_ABORT_NOT_FOUND;
-                return FAIL;
-            }
-            cq = &n->cq[aborted_cq_id];
-
-            memset(&acqe, 0, sizeof(acqe));
-            aborted_sf->p = cq->phase_tag;
-            aborted_sf->sc = NVME_SC_ABORT_REQ;
-
-            acqe.sq_id = c->sqid;
-            acqe.sq_head = sq->head;
-            acqe.command_id = c->cmdid;
-
-            post_cq_entry(n, cq, &acqe);
+    ce = nvme_cmd_find(n, c->sqid, c->cmdid);
+    if (ce == NULL) {
+        /* Already completed, or still in the SQ ring */
+        LOG_NORM("Abort failed, could not find corresponding cmdid:%d on "
+            "sq:%d", c->cmdid, sq->id);
+        return FAIL;
+    }
 
-            QTAILQ_REMOVE(&sq->cmd_list, ce, entry);
-            qemu_free(ce);
+    /* Drop the command wherever it waits, its CQ slot is freed */
+    if (ce->state == NVME_CMD_PARKED) {
+        nvme_qos_abort(n, ce);
+    } else {
+        nvme_nand_abort(n, ce);
+    }
 
-            LOG_NORM("Abort cmdid:%d on sq:%d success", c->cmdid, sq->id);
+    cq = &n->cq[sq->cq_id];
+    memset(&acqe, 0, sizeof(acqe));
+    aborted_sf->p = cq->phase_tag;
+    aborted_sf->sc = NVME_SC_ABORT_REQ;
+    acqe.sq_id = c->sqid;
+    acqe.sq_head = sq->head;
+    acqe.command_id = c->cmdid;
+    post_cq_entry(n, cq, &acqe);
 
-            return 0;
-        }
-    }
-    LOG_NORM("Abort failed, could not find corresponding cmdid:%d on sq:%d",
-        c->cmdid, sq->id);
-    return FAIL;
+    cqe->cmd_specific = 0;
+    LOG_NORM("Abort cmdid:%d on sq:%d success", c->cmdid, sq->id);
+    return 0;
 }
 
 static uint32_t do_features(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
@@ -970,33 +1360,16 @@ static uint64_t DJBHash(uint8_t* str, uint32_t len)
     return hash;
 }
 
-static uint32_t adm_cmd_act_fw(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
+/* Hashes the downloaded image, on the job thread */
+static uint32_t adm_job_act_fw(NVMEAdmJob *job)
 {
     int fd;
     unsigned sz_fw_buf;
     struct stat sb;
     char fw_file_name[] = "nvme_firmware_disk.img";
     uint8_t *fw_buf;
-    char fw_hash[9];
-    uint8_t *target_frs;
-
-    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     uint32_t res = 0;
 
-    LOG_NORM("%s(): called", __func__);
-
-    if (cmd->opcode != NVME_ADM_CMD_ACTIVATE_FW) {
-        LOG_NORM("%s(): Invalid opcode %x", __func__, cmd->opcode);
-        sf->sc = NVME_SC_INVALID_OPCODE;
-        return FAIL;
-    }
-
-    if ((cmd->cdw10 & 0x7) > 7) {
-        LOG_NORM("%s(): Invalid Firmware Slot %d", __func__, cmd->cdw10 & 0x7);
-        sf->sc = NVME_SC_INVALID_FIELD;
-        return FAIL;
-    }
-
     fd = open(fw_file_name, O_RDWR, S_IRUSR | S_IWUSR);
     if (fd < 0) {
         LOG_ERR("Error while creating the storage");
@@ -1016,7 +1389,29 @@ static uint32_t adm_cmd_act_fw(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         goto close;
     }
 
-    snprintf(fw_hash, 9, "%lx", DJBHash(fw_buf, sz_fw_buf));
+    snprintf(job->fw_hash, 9, "%lx", DJBHash(fw_buf, sz_fw_buf));
+
+    munmap(fw_buf, sz_fw_buf);
+    if(ftruncate(fd, 0) < 0)
+        LOG_ERR("Error truncating backing firmware file");
+
+ close:
+    close(fd);
+    return res;
+}
+
+/* Puts the hashed image in a slot, in the main loop */
+static void adm_job_act_fw_done(NVMEAdmJob *job)
+{
+    NVMEState *n = job->n;
+    NVMECmd *cmd = &job->sqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&job->cqe.status;
+    uint8_t *target_frs;
+
+    if (job->res) {
+        sf->sc = NVME_SC_INTERNAL;
+        return;
+    }
 
     if ((cmd->cdw10 & 0x7) > 0)
         n->fw_slot_log.afi = cmd->cdw10 & 0x7;
@@ -1036,17 +1431,34 @@ static uint32_t adm_cmd_act_fw(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     }
     target_frs = (uint8_t *)&(n->fw_slot_log) + (n->fw_slot_log.afi * 8);
 
-    memcpy ((char *)target_frs, fw_hash, 8);
-    memcpy ((char *)n->idtfy_ctrl->fr, fw_hash, 8);
+    memcpy ((char *)target_frs, job->fw_hash, 8);
+    memcpy ((char *)n->idtfy_ctrl->fr, job->fw_hash, 8);
     n->last_fw_slot = n->fw_slot_log.afi;
+}
 
-    munmap(fw_buf, sz_fw_buf);
-    if(ftruncate(fd, 0) < 0)
-        LOG_ERR("Error truncating backing firmware file");
+static uint32_t adm_cmd_act_fw(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEAdmJob *job;
 
- close:
-    close(fd);
-    return res;
+    LOG_NORM("%s(): called", __func__);
+
+    if (cmd->opcode != NVME_ADM_CMD_ACTIVATE_FW) {
+        LOG_NORM("%s(): Invalid opcode %x", __func__, cmd->opcode);
+        sf->sc = NVME_SC_INVALID_OPCODE;
+        return FAIL;
+    }
+
+    if ((cmd->cdw10 & 0x7) > 7) {
+        LOG_NORM("%s(): Invalid Firmware Slot %d", __func__, cmd->cdw10 & 0x7);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+
+    job = qemu_mallocz(sizeof(*job));
+    job->work = adm_job_act_fw;
+    job->done = adm_job_act_fw_done;
+    return adm_job_start(n, cmd, cqe, job);
 }
 
 static uint8_t do_dlfw_prp(NVMEState *n, uint64_t mem_addr,
@@ -1066,7 +1478,7 @@ static uint8_t do_dlfw_prp(NVMEState *n, uint64_t mem_addr,
 
     LOG_DBG("Length of FW Img:%ld", data_len);
     LOG_DBG("Address for FW Img:%ld", mem_addr);
-    nvme_dma_mem_read(mem_addr, (buf + *buf_offset), data_len);
+    nvme_dma_mem_read(n, mem_addr, (buf + *buf_offset), data_len);
 
     *buf_offset = *buf_offset + data_len;
     *data_size_p = *data_size_p - data_len;
@@ -1084,7 +1496,7 @@ static uint8_t do_dlfw_prp_list(NVMEState *n, NVMECmd *cmd,
 
     /* Logic to find the number of PRP Entries */
     prp_entries = (uint64_t) ((*data_size_p + n->host_page_size - 1) / n->host_page_size);
-    nvme_dma_mem_read(cmd->prp2, (uint8_t *)prp_list,
+    nvme_dma_mem_read(n, cmd->prp2, (uint8_t *)prp_list,
         min(sizeof(prp_list), prp_entries * sizeof(uint64_t)));
 
     i = 0;
@@ -1094,7 +1506,7 @@ static uint8_t do_dlfw_prp_list(NVMEState *n, NVMECmd *cmd,
             /* Calculate the actual number of remaining entries */
             prp_entries = (uint64_t) ((*data_size_p + n->host_page_size - 1) /
                 n->host_page_size);
-            nvme_dma_mem_read(prp_list[511], (uint8_t *)prp_list,
+            nvme_dma_mem_read(n, prp_list[511], (uint8_t *)prp_list,
                 min(sizeof(prp_list), prp_entries * sizeof(uint64_t)));
             i = 0;
         }
@@ -1109,21 +1521,12 @@ static uint8_t do_dlfw_prp_list(NVMEState *n, NVMECmd *cmd,
     return res;
 }
 
-static uint32_t fw_get_img(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe,
-                                     uint8_t *buf, uint32_t sz_fw_buf)
+static uint32_t fw_get_img(NVMEState *n, NVMECmd *cmd, uint8_t *buf,
+    uint32_t sz_fw_buf)
 {
     uint32_t res = 0;
     uint64_t data_size = sz_fw_buf;
     uint64_t buf_offset = 0;
-    int fd;
-    uint64_t offset = 0;
-    uint64_t bytes_written = 0;
-
-    fd = open("nvme_firmware_disk.img", O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (fd < 0) {
-        LOG_ERR("Error while creating the storage");
-        return FAIL;
-    }
 
     /* Reading PRP1 and PRP2 */
     res = do_dlfw_prp(n, cmd->prp1, &data_size, &buf_offset, buf);
@@ -1136,39 +1539,51 @@ static uint32_t fw_get_img(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe,
         } else {
             res = do_dlfw_prp_list(n, cmd, &data_size, &buf_offset, buf);
         }
-        if (res == FAIL) {
-            return FAIL;
-        }
     }
+    return res;
+}
+
+/* Writes the fetched piece to the firmware image, on the job thread */
+static uint32_t adm_job_dl_fw(NVMEAdmJob *job)
+{
+    uint32_t res = 0;
+    uint64_t bytes_written;
+    int fd;
 
-    /* Writing to Firmware image file */
-    offset = cmd->cdw11 * 4;
-    if (lseek(fd, (off_t)offset, SEEK_SET) != offset) {
-        LOG_ERR("Error while seeking to offset %ld", offset);
+    fd = open("nvme_firmware_disk.img", O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        LOG_ERR("Error while creating the storage");
         return FAIL;
     }
 
-    LOG_NORM("Writing buffer: size = %d, offset = %ld", sz_fw_buf, offset);
-    bytes_written = write(fd, buf, sz_fw_buf);
-    if (bytes_written != sz_fw_buf) {
+    LOG_NORM("Writing buffer: size = %d, offset = %ld", job->len,
+        job->offset);
+    bytes_written = pwrite(fd, job->buf, job->len, job->offset);
+    if (bytes_written != job->len) {
         LOG_ERR("Error while writing: %ld written out of %d", bytes_written,
-                                                                sz_fw_buf);
-        return FAIL;
+            job->len);
+        res = FAIL;
     }
 
     if (close(fd) < 0) {
         LOG_ERR("Unable to close the nvme disk");
     }
-
     return res;
 }
 
+static void adm_job_dl_fw_done(NVMEAdmJob *job)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&job->cqe.status;
+
+    if (job->res) {
+        sf->sc = NVME_SC_INTERNAL;
+    }
+}
+
 static uint32_t adm_cmd_dl_fw(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
-    uint32_t res = 0;
-    uint8_t *fw_buf;
-    uint32_t sz_fw_buf = 0;
+    NVMEAdmJob *job;
 
     LOG_NORM("%s(): called", __func__);
 
@@ -1184,17 +1599,22 @@ static uint32_t adm_cmd_dl_fw(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
-    sz_fw_buf = (cmd->cdw10 + 1) * sizeof(uint8_t) * 4;
-    fw_buf = (uint8_t *) qemu_mallocz(sz_fw_buf);
-    if (fw_buf == NULL) {
+    job = qemu_mallocz(sizeof(*job));
+    job->len = (cmd->cdw10 + 1) * sizeof(uint8_t) * 4;
+    job->offset = (uint64_t)cmd->cdw11 * 4;
+    job->buf = qemu_mallocz(job->len);
+    LOG_DBG("sz_fw_buf = %d", job->len);
+
+    /* Guest memory is only read here, the thread does the file write */
+    if (fw_get_img(n, cmd, job->buf, job->len) == FAIL) {
+        qemu_free(job->buf);
+        qemu_free(job);
+        sf->sc = NVME_SC_DATA_XFER_ERROR;
         return FAIL;
     }
-    LOG_DBG("sz_fw_buf = %d", sz_fw_buf);
-    res = fw_get_img(n, cmd, cqe, fw_buf, sz_fw_buf);
-
-    qemu_free(fw_buf);
-
-    return res;
+    job->work = adm_job_dl_fw;
+    job->done = adm_job_dl_fw_done;
+    return adm_job_start(n, cmd, cqe, job);
 }
 
 void async_process_cb(void *param)
@@ -1205,6 +1625,7 @@ void async_process_cb(void *param)
     target_phys_addr_t addr;
     AsyncResult *result;
     AsyncEvent *event;
+    int posted = 0;
 
     if (n->outstanding_asyncs <= 0) {
         LOG_NORM("%s(): called without an outstanding async event", __func__);
@@ -1218,8 +1639,9 @@ void async_process_cb(void *param)
     LOG_NORM("%s(): called outstanding asyncs:%d", __func__,
         n->outstanding_asyncs);
 
+    /* Events left over when the ACQ is full wait for its head doorbell */
     while ((event = QSIMPLEQ_FIRST(&n->async_queue)) != NULL &&
-            n->outstanding_asyncs > 0) {
+            n->outstanding_asyncs > 0 && !is_cq_full(n, ACQ_ID)) {
         QSIMPLEQ_REMOVE_HEAD(&n->async_queue, entry);
 
         result = (AsyncResult *)&cqe.cmd_specific;
@@ -1241,10 +1663,13 @@ void async_process_cb(void *param)
         sf->dnr = 0;
 
         addr = n->cq[0].dma_addr + n->cq[0].tail * sizeof(cqe);
-        nvme_dma_mem_write(addr, (uint8_t *)&cqe, sizeof(cqe));
+        nvme_dma_mem_write(n, addr, (uint8_t *)&cqe, sizeof(cqe));
         incr_cq_tail(&n->cq[0]);
+        posted = 1;
+    }
+    if (posted) {
+        msix_notify(&(n->dev), 0);
     }
-    msix_notify(&(n->dev), 0);
 }
 
 static uint32_t adm_cmd_async_ev_req(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
@@ -1274,9 +1699,37 @@ static uint32_t adm_cmd_async_ev_req(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     return 0;
 }
 
+/* Recreates the namespace image, on the job thread. The namespace is
+ * busy, nothing else touches it meanwhile */
+static uint32_t adm_job_format_nvm(NVMEAdmJob *job)
+{
+    DiskInfo *disk = job->disk;
+
+    if (nvme_close_storage_disk(disk)) {
+        return FAIL;
+    }
+    if (disk->backing && truncate(disk->backing, 0) < 0) {
+        LOG_ERR("Error while erasing the backing file %s", disk->backing);
+    }
+    return nvme_create_storage_disk(job->n->instance, disk->nsid, disk,
+        job->n);
+}
+
+static void adm_job_format_nvm_done(NVMEAdmJob *job)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&job->cqe.status;
+
+    nvme_ns_set_format(job->disk);
+    job->disk->busy = 0;
+    if (job->res) {
+        sf->sc = NVME_SC_INTERNAL;
+    }
+}
+
 static uint32_t adm_cmd_format_nvm(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEAdmJob *job;
     DiskInfo *disk;
     uint64_t old_size;
     uint32_t dw10 = cmd->cdw10;
@@ -1294,13 +1747,18 @@ static uint32_t adm_cmd_format_nvm(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     }
 
     nsid = cmd->nsid;
-    if (nsid > n->num_namespaces || nsid == 0) {
+    if (nvme_get_active_ns(n, nsid) == NULL) {
         LOG_NORM("%s(): bad nsid:%d", __func__, nsid);
         sf->sc = NVME_SC_INVALID_NAMESPACE;
         return FAIL;
     }
 
     disk = &n->disk[nsid - 1];
+    if (disk->busy) {
+        LOG_NORM("%s(): nsid:%d is being formatted", __func__, nsid);
+        sf->sc = NVME_SC_NS_NOT_READY;
+        return FAIL;
+    }
     if ((lba_idx) > disk->idtfy_ns.nlbaf) {
         LOG_NORM("%s(): Invalid format %x, lbaf out of range", __func__, dw10);
         sf->sc = NVME_INVALID_FORMAT;
@@ -1341,10 +1799,6 @@ static uint32_t adm_cmd_format_nvm(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
-    if (nvme_close_storage_disk(disk)) {
-        return FAIL;
-    }
-
     old_size = disk->idtfy_ns.nsze * (1 << disk->idtfy_ns.lbafx[
         disk->idtfy_ns.flbas & 0xf].lbads);
     block_size = 1 << disk->idtfy_ns.lbafx[lba_idx].lbads;
@@ -1364,10 +1818,134 @@ static uint32_t adm_cmd_format_nvm(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     disk->idtfy_ns.ncap = disk->idtfy_ns.nsze;
     disk->idtfy_ns.dps = pil | pi;
 
-    if (nvme_create_storage_disk(n->instance, nsid, disk, n)) {
+    /* I/O to the namespace fails as not ready until the job is done */
+    disk->busy = 1;
+    job = qemu_mallocz(sizeof(*job));
+    job->disk = disk;
+    job->work = adm_job_format_nvm;
+    job->done = adm_job_format_nvm_done;
+    return adm_job_start(n, cmd, cqe, job);
+}
+
+/*********************************************************************
+    Function     :    adm_cmd_ns_mgmt
+    Description  :    Namespace Management command, creates or
+                      deletes namespaces. A created namespace is not
+                      attached to any controller.
+    Return Type  :    uint32_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd   * : Pointer to SQ cmd
+                      NVMECQE   * : Pointer to CQ completion entries
+*********************************************************************/
+static uint32_t adm_cmd_ns_mgmt(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEIdentifyNamespace id_ns;
+    uint32_t nsid;
+
+    sf->sc = NVME_SC_SUCCESS;
+    if (cmd->opcode != NVME_ADM_CMD_NS_MANAGEMENT) {
+        LOG_NORM("%s(): Invalid opcode %d", __func__, cmd->opcode);
+        sf->sc = NVME_SC_INVALID_OPCODE;
         return FAIL;
     }
 
-    return 0;
+    switch (cmd->cdw10 & 0xf) {
+    case NVME_NS_MANAGEMENT_CREATE:
+        if (cmd->prp1 == 0) {
+            LOG_NORM("%s(): prp1 absent", __func__);
+            sf->sc = NVME_SC_INVALID_FIELD;
+            return FAIL;
+        }
+        adm_dma_read_prp(n, cmd, (uint8_t *)&id_ns, sizeof(id_ns));
+        LOG_NORM("%s(): create nsze:%lu ncap:%lu flbas:%x", __func__,
+            id_ns.nsze, id_ns.ncap, id_ns.flbas);
+        if (nvme_ns_create(n, id_ns.nsze, id_ns.ncap, id_ns.flbas, NULL,
+                &nsid, sf)) {
+            return FAIL;
+        }
+        cqe->cmd_specific = nsid;
+        return 0;
+    case NVME_NS_MANAGEMENT_DELETE:
+        LOG_NORM("%s(): delete nsid:%x", __func__, cmd->nsid);
+        return nvme_ns_delete(n, cmd->nsid, sf);
+    default:
+        LOG_NORM("%s(): Invalid select:%x", __func__, cmd->cdw10 & 0xf);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
 }
 
+/*********************************************************************
+    Function     :    adm_cmd_ns_attach
+    Description  :    Namespace Attachment command, attaches or
+                      detaches a namespace from the controllers in
+                      the controller list
+    Return Type  :    uint32_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd   * : Pointer to SQ cmd
+                      NVMECQE   * : Pointer to CQ completion entries
+*********************************************************************/
+static uint32_t adm_cmd_ns_attach(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEState *ctrl[NVME_MAX_CTRLS];
+    NVMECtrlList list;
+    uint32_t sel = cmd->cdw10 & 0xf;
+    uint16_t i, j;
+
+    sf->sc = NVME_SC_SUCCESS;
+    if (cmd->opcode != NVME_ADM_CMD_NS_ATTACHMENT) {
+        LOG_NORM("%s(): Invalid opcode %d", __func__, cmd->opcode);
+        sf->sc = NVME_SC_INVALID_OPCODE;
+        return FAIL;
+    }
+    if (cmd->prp1 == 0) {
+        LOG_NORM("%s(): prp1 absent", __func__);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+
+    if (sel != NVME_NS_ATTACHMENT_ATTACH && sel != NVME_NS_ATTACHMENT_DETACH) {
+        LOG_NORM("%s(): Invalid select:%x", __func__, sel);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+
+    adm_dma_read_prp(n, cmd, (uint8_t *)&list, sizeof(list));
+    if (list.num_ids == 0 || list.num_ids > NVME_MAX_CTRLS) {
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_CTRL_LIST_INVALID;
+        return FAIL;
+    }
+    /* Resolve the whole list before changing anything */
+    for (i = 0; i < list.num_ids; i++) {
+        ctrl[i] = nvme_subsys_find_ctrl(n->subsys, list.ids[i]);
+        for (j = 0; ctrl[i] && j < i; j++) {
+            if (ctrl[j] == ctrl[i]) {
+                ctrl[i] = NULL;
+            }
+        }
+        if (ctrl[i] == NULL) {
+            LOG_NORM("%s(): unknown or repeated controller id:%d", __func__,
+                list.ids[i]);
+            sf->sct = NVME_SCT_CMD_SPEC_ERR;
+            sf->sc = NVME_CTRL_LIST_INVALID;
+            return FAIL;
+        }
+    }
+
+    for (i = 0; i < list.num_ids; i++) {
+        LOG_NORM("%s(): %s nsid:%d controller:%d", __func__,
+            sel == NVME_NS_ATTACHMENT_ATTACH ? "attach" : "detach",
+            cmd->nsid, list.ids[i]);
+        if (sel == NVME_NS_ATTACHMENT_ATTACH ?
+                nvme_ns_attach(ctrl[i], cmd->nsid, sf) :
+                nvme_ns_detach(ctrl[i], cmd->nsid, sf)) {
+            return FAIL;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,925 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Out of process dataplane.
+ *
+ * With the 'dataplane' property set, I/O queues are served by a separate
+ * process instead of sq_processing_timer_cb. See nvme_dataplane.h for the
+ * protocol. Guest memory is handed over as the file descriptors backing
+ * the RAM blocks, so guest RAM has to come from -mem-path and be shared
+ * with -mem-prealloc. This file is built per target as it needs the RAM
+ * block list and the target page size.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+#include "nvme_dataplane.h"
+#include "event_notifier.h"
+#include "qemu_socket.h"
+#include "cpu-all.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Delay between attempts to reach a restarted dataplane */
+#define NVME_DP_RECONNECT_MS 1000
+/* Time the dataplane gets to acknowledge a queue teardown */
+#define NVME_DP_ACK_TIMEOUT_MS 5000
+
+typedef struct NVMEDataplane NVMEDataplane;
+
+typedef struct NVMEDpQueue {
+    NVMEDataplane *dp;
+    uint16_t qid;
+    uint8_t live;
+    EventNotifier notifier;
+} NVMEDpQueue;
+
+typedef struct NVMEDpRange {
+    target_phys_addr_t gpa;
+    ram_addr_t size;
+    ram_addr_t ram_addr;
+} NVMEDpRange;
+
+struct NVMEDataplane {
+    NVMEState *n;
+    int sock; /* -1 while the dataplane is not connected */
+    QEMUTimer *reconnect_timer;
+    uint8_t enabled; /* controller enabled, its state is mirrored */
+
+    int db_fd;
+    NVMEDpDoorbells *db;
+
+    NVMEDpQueue sq[NVME_MAX_QID + 1]; /* kick eventfds */
+    NVMEDpQueue cq[NVME_MAX_QID + 1]; /* irq eventfds */
+
+    CPUPhysMemoryClient client;
+    int nranges;
+    NVMEDpRange ranges[NVME_DP_MAX_REGIONS];
+
+    /*
+     * Messages that need an ACK are numbered as they are sent, the
+     * dataplane acknowledges them in order. The admin command and the
+     * reset remember the number they wait for, 0 if they don't.
+     */
+    uint32_t acks_sent;
+    uint32_t acks_received;
+    uint32_t adm_ack;
+    uint32_t reset_ack;
+    QEMUTimer *ack_timer;
+
+    /* ACK being received, the only message the dataplane sends */
+    uint8_t rx[sizeof(NVMEDpMsgHdr) + sizeof(NVMEDpAck)];
+    uint32_t rx_len;
+};
+
+static void nvme_dp_sync(NVMEDataplane *dp);
+static void nvme_dp_ack_done(NVMEDataplane *dp);
+
+/*********************************************************************
+    Function     :    nvme_dp_disconnect
+    Description  :    Drops the connection and starts trying to
+                      reach the dataplane again
+    Return Type  :    void
+    Arguments    :    NVMEDataplane * : Dataplane state
+*********************************************************************/
+static void nvme_dp_disconnect(NVMEDataplane *dp)
+{
+    if (dp->sock < 0) {
+        return;
+    }
+    LOG_ERR("nvme dataplane disconnected");
+    qemu_set_fd_handler(dp->sock, NULL, NULL, NULL);
+    closesocket(dp->sock);
+    dp->sock = -1;
+    dp->rx_len = 0;
+    qemu_mod_timer(dp->reconnect_timer,
+        qemu_get_clock_ms(rt_clock) + NVME_DP_RECONNECT_MS);
+
+    /* A dataplane that lost the connection lets go of all queues */
+    dp->acks_received = dp->acks_sent;
+    nvme_dp_ack_done(dp);
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_send
+    Description  :    Sends one message with its file descriptors
+    Return Type  :    int : 0 on success, -1 if the connection broke
+    Arguments    :    NVMEDataplane * : Dataplane state
+                      uint32_t : Message type
+                      const void * : Payload
+                      uint32_t : Payload size
+                      const int * : File descriptors to pass
+                      int : Number of file descriptors
+*********************************************************************/
+static int nvme_dp_send(NVMEDataplane *dp, uint32_t type,
+    const void *payload, uint32_t size, const int *fds, int nfds)
+{
+    NVMEDpMsgHdr hdr;
+    struct msghdr msg;
+    struct iovec iov[2];
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * NVME_DP_MAX_FDS)];
+    ssize_t ret;
+
+    if (dp->sock < 0) {
+        return -1;
+    }
+    assert(nfds <= NVME_DP_MAX_FDS);
+
+    hdr.type = type;
+    hdr.size = size;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = size;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = size ? 2 : 1;
+    if (nfds) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    do {
+        ret = sendmsg(dp->sock, &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != sizeof(hdr) + size) {
+        LOG_ERR("nvme dataplane: failed to send message %u", type);
+        nvme_dp_disconnect(dp);
+        return -1;
+    }
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_send_acked
+    Description  :    Sends a message the dataplane has to
+                      acknowledge and starts waiting for the ACK
+    Return Type  :    uint32_t : number of the ACK to wait for, 0 if
+                      there is none as the dataplane is away
+    Arguments    :    NVMEDataplane * : Dataplane state
+                      uint32_t : Message type
+                      const void * : Payload
+                      uint32_t : Payload size
+*********************************************************************/
+static uint32_t nvme_dp_send_acked(NVMEDataplane *dp, uint32_t type,
+    const void *payload, uint32_t size)
+{
+    if (nvme_dp_send(dp, type, payload, size, NULL, 0)) {
+        return 0;
+    }
+    if (!qemu_timer_pending(dp->ack_timer)) {
+        qemu_mod_timer(dp->ack_timer,
+            qemu_get_clock_ms(rt_clock) + NVME_DP_ACK_TIMEOUT_MS);
+    }
+    return ++dp->acks_sent;
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_ack_done
+    Description  :    Completes what waited for the ACKs received
+                      so far
+    Return Type  :    void
+    Arguments    :    NVMEDataplane * : Dataplane state
+*********************************************************************/
+static void nvme_dp_ack_done(NVMEDataplane *dp)
+{
+    if (dp->adm_ack && (int32_t)(dp->acks_received - dp->adm_ack) >= 0) {
+        dp->adm_ack = 0;
+        nvme_adm_job_wake(dp->n);
+    }
+    if (dp->reset_ack &&
+        (int32_t)(dp->acks_received - dp->reset_ack) >= 0) {
+        dp->reset_ack = 0;
+        nvme_reset_complete(dp->n);
+    }
+
+    if (dp->acks_received == dp->acks_sent) {
+        qemu_del_timer(dp->ack_timer);
+    } else {
+        qemu_mod_timer(dp->ack_timer,
+            qemu_get_clock_ms(rt_clock) + NVME_DP_ACK_TIMEOUT_MS);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_ack_timeout_cb
+    Description  :    Gives up on a dataplane that doesn't answer,
+                      dropping the connection lets go of the queues
+    Return Type  :    void
+    Arguments    :    void * : Dataplane state
+*********************************************************************/
+static void nvme_dp_ack_timeout_cb(void *opaque)
+{
+    NVMEDataplane *dp = opaque;
+
+    LOG_ERR("nvme dataplane: no acknowledgement within %d ms",
+        NVME_DP_ACK_TIMEOUT_MS);
+    nvme_dp_disconnect(dp);
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_read
+    Description  :    Socket read handler, receives the ACKs. Any
+                      other message breaks the protocol and drops
+                      the connection.
+    Return Type  :    void
+    Arguments    :    void * : Dataplane state
+*********************************************************************/
+static void nvme_dp_read(void *opaque)
+{
+    NVMEDataplane *dp = opaque;
+    NVMEDpMsgHdr *hdr = (NVMEDpMsgHdr *)dp->rx;
+    NVMEDpAck *ack = (NVMEDpAck *)(dp->rx + sizeof(*hdr));
+    ssize_t ret;
+
+    while (dp->sock >= 0) {
+        ret = recv(dp->sock, dp->rx + dp->rx_len, sizeof(dp->rx) - dp->rx_len,
+            MSG_DONTWAIT);
+        if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (ret <= 0) {
+            nvme_dp_disconnect(dp);
+            return;
+        }
+        dp->rx_len += ret;
+        if (dp->rx_len >= sizeof(*hdr) &&
+            (hdr->type != NVME_DP_MSG_ACK || hdr->size != sizeof(*ack))) {
+            LOG_ERR("nvme dataplane: unexpected message %u of %u bytes",
+                hdr->type, hdr->size);
+            nvme_dp_disconnect(dp);
+            return;
+        }
+        if (dp->rx_len < sizeof(dp->rx)) {
+            continue;
+        }
+
+        dp->rx_len = 0;
+        if (dp->acks_received == dp->acks_sent ||
+            (ack->type != NVME_DP_MSG_DELETE_SQ &&
+             ack->type != NVME_DP_MSG_DELETE_CQ &&
+             ack->type != NVME_DP_MSG_RESET)) {
+            LOG_ERR("nvme dataplane: unexpected ACK of message %u",
+                ack->type);
+            nvme_dp_disconnect(dp);
+            return;
+        }
+        dp->acks_received++;
+        nvme_dp_ack_done(dp);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_connect
+    Description  :    Connects to the dataplane socket
+    Return Type  :    int : 0 on success, -1 on failure
+    Arguments    :    NVMEDataplane * : Dataplane state
+*********************************************************************/
+static int nvme_dp_connect(NVMEDataplane *dp)
+{
+    struct sockaddr_un un;
+    int sock;
+
+    sock = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s", dp->n->dataplane);
+    if (connect(sock, (struct sockaddr *)&un, sizeof(un)) < 0) {
+        closesocket(sock);
+        return -1;
+    }
+    dp->sock = sock;
+    qemu_set_fd_handler(sock, nvme_dp_read, NULL, dp);
+    LOG_NORM("nvme dataplane connected on %s", dp->n->dataplane);
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_reconnect_cb
+    Description  :    Tries to reach a restarted dataplane and
+                      replays the controller state to it
+    Return Type  :    void
+    Arguments    :    void * : Dataplane state
+*********************************************************************/
+static void nvme_dp_reconnect_cb(void *opaque)
+{
+    NVMEDataplane *dp = opaque;
+
+    if (nvme_dp_connect(dp)) {
+        qemu_mod_timer(dp->reconnect_timer,
+            qemu_get_clock_ms(rt_clock) + NVME_DP_RECONNECT_MS);
+        return;
+    }
+    nvme_dp_sync(dp);
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_unassign
+    Description  :    Removes a guest physical range from the
+                      tracked RAM ranges, splitting them as needed
+    Return Type  :    void
+    Arguments    :    NVMEDataplane * : Dataplane state
+                      target_phys_addr_t : Start of the range
+                      ram_addr_t : Size of the range
+*********************************************************************/
+static void nvme_dp_unassign(NVMEDataplane *dp, target_phys_addr_t start,
+    ram_addr_t size)
+{
+    target_phys_addr_t end = start + size;
+    NVMEDpRange *r, tail;
+    int i;
+
+    for (i = 0; i < dp->nranges; i++) {
+        r = &dp->ranges[i];
+        if (r->gpa >= end || r->gpa + r->size <= start) {
+            continue;
+        }
+        if (r->gpa < start && r->gpa + r->size > end) {
+            /* Punch a hole, the tail becomes a range of its own */
+            tail.gpa = end;
+            tail.size = r->gpa + r->size - end;
+            tail.ram_addr = r->ram_addr + (end - r->gpa);
+            r->size = start - r->gpa;
+            if (dp->nranges < NVME_DP_MAX_REGIONS) {
+                dp->ranges[dp->nranges++] = tail;
+            }
+        } else if (r->gpa < start) {
+            r->size = start - r->gpa;
+        } else if (r->gpa + r->size > end) {
+            r->ram_addr += end - r->gpa;
+            r->size -= end - r->gpa;
+            r->gpa = end;
+        } else {
+            dp->ranges[i--] = dp->ranges[--dp->nranges];
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_set_memory
+    Description  :    Physical memory client hook keeping track of
+                      the guest RAM ranges
+    Return Type  :    void
+    Arguments    :    CPUPhysMemoryClient * : Client
+                      target_phys_addr_t : Start address
+                      ram_addr_t : Size
+                      ram_addr_t : Physical offset and memory type
+                      bool : Dirty logging enabled
+*********************************************************************/
+static void nvme_dp_set_memory(CPUPhysMemoryClient *client,
+    target_phys_addr_t start_addr, ram_addr_t size, ram_addr_t phys_offset,
+    bool log_dirty)
+{
+    NVMEDataplane *dp = container_of(client, NVMEDataplane, client);
+    NVMEDpRange *r;
+    int i;
+
+    nvme_dp_unassign(dp, start_addr, size);
+    if ((phys_offset & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
+        /* Extend an adjacent range rather than adding one */
+        for (i = 0; i < dp->nranges; i++) {
+            r = &dp->ranges[i];
+            if (r->gpa + r->size == start_addr &&
+                r->ram_addr + r->size == phys_offset) {
+                r->size += size;
+                break;
+            }
+        }
+        if (i == dp->nranges) {
+            if (dp->nranges == NVME_DP_MAX_REGIONS) {
+                LOG_ERR("nvme dataplane: too many guest memory regions");
+                return;
+            }
+            r = &dp->ranges[dp->nranges++];
+            r->gpa = start_addr;
+            r->size = size;
+            r->ram_addr = phys_offset;
+        }
+    }
+}
+
+static int nvme_dp_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+    target_phys_addr_t start_addr, target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int nvme_dp_migration_log(CPUPhysMemoryClient *client, int enable)
+{
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_send_mem_table
+    Description  :    Sends the guest RAM ranges along with the
+                      files backing them
+    Return Type  :    int : 0 on success, -1 on failure
+    Arguments    :    NVMEDataplane * : Dataplane state
+*********************************************************************/
+static int nvme_dp_send_mem_table(NVMEDataplane *dp)
+{
+    NVMEDpMemTable table;
+    NVMEDpMemRegion *reg;
+    RAMBlock *block;
+    int fds[NVME_DP_MAX_FDS];
+    int nfds = 0, i, j;
+
+    memset(&table, 0, sizeof(table));
+    for (i = 0; i < dp->nranges; i++) {
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (dp->ranges[i].ram_addr >= block->offset &&
+                dp->ranges[i].ram_addr < block->offset + block->length) {
+                break;
+            }
+        }
+        /* Blocks that are not file backed are left with a zero fd */
+        if (block == NULL || block->fd <= 0) {
+            continue;
+        }
+        for (j = 0; j < nfds && fds[j] != block->fd; j++) {
+        }
+        if (j == nfds) {
+            fds[nfds++] = block->fd;
+        }
+        reg = &table.regions[table.nregions++];
+        reg->gpa = dp->ranges[i].gpa;
+        reg->size = dp->ranges[i].size;
+        reg->fd_offset = dp->ranges[i].ram_addr - block->offset;
+        reg->fd_index = j;
+    }
+    return nvme_dp_send(dp, NVME_DP_MSG_MEM_TABLE, &table, sizeof(table),
+        fds, nfds);
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_send_ns
+    Description  :    Describes one namespace and passes its images
+    Return Type  :    int : 0 on success, -1 on failure
+    Arguments    :    NVMEDataplane * : Dataplane state
+                      DiskInfo * : Namespace
+*********************************************************************/
+static int nvme_dp_send_ns(NVMEDataplane *dp, DiskInfo *disk)
+{
+    NVMEDpNs ns;
+    int fds[2], nfds = 0;
+    uint8_t lba_idx = disk->idtfy_ns.flbas & 0xf;
+
+    memset(&ns, 0, sizeof(ns));
+    ns.nsid = disk->nsid;
+    ns.attached = disk->allocated && NVME_NS_ATTACHED(dp->n, disk);
+    if (disk->allocated) {
+        ns.nsze = disk->idtfy_ns.nsze;
+        ns.lbads = disk->idtfy_ns.lbafx[lba_idx].lbads;
+        fds[nfds++] = disk->fd;
+        if (disk->meta_mapping_addr) {
+            ns.ms = disk->idtfy_ns.lbafx[lba_idx].ms;
+            fds[nfds++] = disk->mfd;
+        }
+    }
+    return nvme_dp_send(dp, NVME_DP_MSG_NS, &ns, sizeof(ns), fds, nfds);
+}
+
+static int nvme_dp_send_cq(NVMEDataplane *dp, uint16_t qid)
+{
+    NVMEIOCQueue *cq = &dp->n->cq[qid];
+    int fd = event_notifier_get_fd(&dp->cq[qid].notifier);
+    NVMEDpCQ m;
+
+    memset(&m, 0, sizeof(m));
+    m.qid = qid;
+    m.irq_enabled = cq->irq_enabled;
+    m.phys_contig = cq->phys_contig;
+    m.vector = cq->vector;
+    m.size = cq->size;
+    m.dma_addr = cq->dma_addr;
+    return nvme_dp_send(dp, NVME_DP_MSG_CREATE_CQ, &m, sizeof(m), &fd, 1);
+}
+
+static int nvme_dp_send_sq(NVMEDataplane *dp, uint16_t qid)
+{
+    NVMEIOSQueue *sq = &dp->n->sq[qid];
+    int fd = event_notifier_get_fd(&dp->sq[qid].notifier);
+    NVMEDpSQ m;
+
+    memset(&m, 0, sizeof(m));
+    m.qid = qid;
+    m.cqid = sq->cq_id;
+    m.prio = sq->prio;
+    m.phys_contig = sq->phys_contig;
+    m.size = sq->size;
+    m.dma_addr = sq->dma_addr;
+    return nvme_dp_send(dp, NVME_DP_MSG_CREATE_SQ, &m, sizeof(m), &fd, 1);
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_sync
+    Description  :    Replays the whole controller state to a newly
+                      connected dataplane
+    Return Type  :    void
+    Arguments    :    NVMEDataplane * : Dataplane state
+*********************************************************************/
+static void nvme_dp_sync(NVMEDataplane *dp)
+{
+    NVMEState *n = dp->n;
+    NVMEDpHello hello;
+    uint32_t i;
+
+    if (dp->sock < 0 || !dp->enabled) {
+        return;
+    }
+
+    memset(&hello, 0, sizeof(hello));
+    hello.version = NVME_DP_VERSION;
+    hello.instance = n->instance;
+    hello.page_size = n->page_size;
+    hello.host_page_size = n->host_page_size;
+    hello.max_qid = NVME_MAX_QID;
+    if (nvme_dp_send(dp, NVME_DP_MSG_HELLO, &hello, sizeof(hello),
+            &dp->db_fd, 1) || nvme_dp_send_mem_table(dp)) {
+        return;
+    }
+    for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+        if (n->disk[i].allocated && nvme_dp_send_ns(dp, &n->disk[i])) {
+            return;
+        }
+    }
+    for (i = 1; i <= NVME_MAX_QID; i++) {
+        if (dp->cq[i].live && nvme_dp_send_cq(dp, i)) {
+            return;
+        }
+    }
+    for (i = 1; i <= NVME_MAX_QID; i++) {
+        if (dp->sq[i].live && nvme_dp_send_sq(dp, i)) {
+            return;
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_cq_irq
+    Description  :    Raises the interrupt of a CQ the dataplane
+                      posted completions to
+    Return Type  :    void
+    Arguments    :    void * : Dataplane queue
+*********************************************************************/
+static void nvme_dp_cq_irq(void *opaque)
+{
+    NVMEDpQueue *q = opaque;
+    NVMEIOCQueue *cq = &q->dp->n->cq[q->qid];
+
+    if (event_notifier_test_and_clear(&q->notifier)) {
+        isr_notify(q->dp->n, cq);
+    }
+}
+
+static int nvme_dp_queue_init(NVMEDpQueue *q)
+{
+    if (q->live) {
+        return 0;
+    }
+    if (event_notifier_init(&q->notifier, 0) < 0) {
+        LOG_ERR("nvme dataplane: cannot create eventfd for queue %d", q->qid);
+        return -1;
+    }
+    q->live = 1;
+    return 0;
+}
+
+static void nvme_dp_queue_cleanup(NVMEDpQueue *q)
+{
+    if (q->live) {
+        event_notifier_cleanup(&q->notifier);
+        q->live = 0;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_init
+    Description  :    Sets up the dataplane mode if requested
+    Return Type  :    int : 0 on success, -1 on failure
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_dp_init(NVMEState *n)
+{
+    NVMEDataplane *dp;
+    char path[] = "/dev/shm/qemu-nvme-XXXXXX";
+    int i;
+
+    if (n->dataplane == NULL) {
+        return 0;
+    }
+#ifndef CONFIG_EVENTFD
+    LOG_ERR("nvme dataplane needs eventfd support");
+    return -1;
+#endif
+    if (mem_path == NULL || !mem_prealloc) {
+        LOG_ERR("nvme dataplane needs guest memory shared through "
+            "-mem-path and -mem-prealloc");
+        return -1;
+    }
+    if (n->cmb_size || NVME_NAND_ON(n)) {
+        LOG_ERR("nvme dataplane cannot be combined with the CMB or the NAND "
+            "model");
+        return -1;
+    }
+    /* Namespaces shared within a subsystem are not mirrored */
+    if (n->subsys_name) {
+        LOG_ERR("nvme dataplane cannot be combined with subsystem %s",
+            n->subsys_name);
+        return -1;
+    }
+    /* QEMU doesn't see the I/O commands, so it can't throttle them */
+    if (nvme_qos_limited(&n->ns_qos) || nvme_qos_limited(&n->sq_qos)) {
+        LOG_ERR("nvme dataplane cannot be combined with QoS limits");
+        return -1;
+    }
+
+    dp = qemu_mallocz(sizeof(*dp));
+    dp->n = n;
+    dp->sock = -1;
+    for (i = 0; i <= NVME_MAX_QID; i++) {
+        dp->sq[i].dp = dp->cq[i].dp = dp;
+        dp->sq[i].qid = dp->cq[i].qid = i;
+    }
+
+    dp->db_fd = mkstemp(path);
+    if (dp->db_fd < 0) {
+        LOG_ERR("nvme dataplane: cannot create the doorbell page");
+        qemu_free(dp);
+        return -1;
+    }
+    unlink(path);
+    if (ftruncate(dp->db_fd, TARGET_PAGE_SIZE) < 0 ||
+        (dp->db = mmap(NULL, TARGET_PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_SHARED, dp->db_fd, 0)) == MAP_FAILED) {
+        LOG_ERR("nvme dataplane: cannot map the doorbell page");
+        close(dp->db_fd);
+        qemu_free(dp);
+        return -1;
+    }
+
+    if (nvme_dp_connect(dp)) {
+        LOG_ERR("nvme dataplane: cannot connect to %s", n->dataplane);
+        munmap(dp->db, TARGET_PAGE_SIZE);
+        close(dp->db_fd);
+        qemu_free(dp);
+        return -1;
+    }
+    dp->reconnect_timer = qemu_new_timer_ms(rt_clock, nvme_dp_reconnect_cb,
+        dp);
+    dp->ack_timer = qemu_new_timer_ms(rt_clock, nvme_dp_ack_timeout_cb, dp);
+
+    dp->client.set_memory = nvme_dp_set_memory;
+    dp->client.sync_dirty_bitmap = nvme_dp_sync_dirty_bitmap;
+    dp->client.migration_log = nvme_dp_migration_log;
+    cpu_register_phys_memory_client(&dp->client);
+
+    n->dp = dp;
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_uninit
+    Description  :    Tears the dataplane mode down
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_dp_uninit(NVMEState *n)
+{
+    NVMEDataplane *dp = n->dp;
+
+    if (dp == NULL) {
+        return;
+    }
+    /* Closing the connection makes the dataplane let go, no ACK needed */
+    nvme_dp_reset(n);
+    cpu_unregister_phys_memory_client(&dp->client);
+    if (dp->sock >= 0) {
+        qemu_set_fd_handler(dp->sock, NULL, NULL, NULL);
+        closesocket(dp->sock);
+    }
+    qemu_del_timer(dp->reconnect_timer);
+    qemu_free_timer(dp->reconnect_timer);
+    qemu_del_timer(dp->ack_timer);
+    qemu_free_timer(dp->ack_timer);
+    munmap(dp->db, TARGET_PAGE_SIZE);
+    close(dp->db_fd);
+    qemu_free(dp);
+    n->dp = NULL;
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_enable
+    Description  :    Controller enabled, start mirroring its state
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_dp_enable(NVMEState *n)
+{
+    n->dp->enabled = 1;
+    nvme_dp_sync(n->dp);
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_reset
+    Description  :    Controller reset, the dataplane drops all
+                      queues. Until it acknowledged that,
+                      nvme_dp_reset_pending() is true, and
+                      nvme_reset_complete() is called once it did.
+                      A pending admin command is dropped.
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_dp_reset(NVMEState *n)
+{
+    NVMEDataplane *dp = n->dp;
+    int i;
+
+    dp->adm_ack = 0;
+    if (dp->enabled) {
+        dp->reset_ack = nvme_dp_send_acked(dp, NVME_DP_MSG_RESET, NULL, 0);
+    }
+    dp->enabled = 0;
+    for (i = 1; i <= NVME_MAX_QID; i++) {
+        nvme_dp_queue_cleanup(&dp->sq[i]);
+        if (dp->cq[i].live) {
+            qemu_set_fd_handler(event_notifier_get_fd(&dp->cq[i].notifier),
+                NULL, NULL, NULL);
+        }
+        nvme_dp_queue_cleanup(&dp->cq[i]);
+    }
+    memset(dp->db, 0, sizeof(*dp->db));
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_create_cq
+    Description  :    Hands a newly created I/O CQ to the dataplane
+    Return Type  :    int : 0 on success, -1 on failure
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Queue id
+*********************************************************************/
+int nvme_dp_create_cq(NVMEState *n, uint16_t qid)
+{
+    NVMEDataplane *dp = n->dp;
+
+    if (nvme_dp_queue_init(&dp->cq[qid])) {
+        return -1;
+    }
+    qemu_set_fd_handler(event_notifier_get_fd(&dp->cq[qid].notifier),
+        nvme_dp_cq_irq, NULL, &dp->cq[qid]);
+    dp->db->cq_head[qid] = 0;
+    /* A dataplane that is away gets the queue on reconnection */
+    nvme_dp_send_cq(dp, qid);
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_create_sq
+    Description  :    Hands a newly created I/O SQ to the dataplane
+    Return Type  :    int : 0 on success, -1 on failure
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Queue id
+*********************************************************************/
+int nvme_dp_create_sq(NVMEState *n, uint16_t qid)
+{
+    NVMEDataplane *dp = n->dp;
+
+    if (nvme_dp_queue_init(&dp->sq[qid])) {
+        return -1;
+    }
+    dp->db->sq_tail[qid] = 0;
+    nvme_dp_send_sq(dp, qid);
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_reset_pending
+    Description  :    Tells whether the dataplane still has to
+                      acknowledge a controller reset
+    Return Type  :    int
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_dp_reset_pending(NVMEState *n)
+{
+    return n->dp->reset_ack != 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_delete_sq
+    Description  :    Takes an I/O SQ back from the dataplane
+    Return Type  :    int : 1 if the admin command has to wait for
+                      the ACK, nvme_adm_job_wake() is called then
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Queue id
+*********************************************************************/
+int nvme_dp_delete_sq(NVMEState *n, uint16_t qid)
+{
+    NVMEDataplane *dp = n->dp;
+    NVMEDpQid m = { .qid = qid };
+
+    nvme_dp_queue_cleanup(&dp->sq[qid]);
+    dp->adm_ack = nvme_dp_send_acked(dp, NVME_DP_MSG_DELETE_SQ, &m,
+        sizeof(m));
+    return dp->adm_ack != 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_delete_cq
+    Description  :    Takes an I/O CQ back from the dataplane
+    Return Type  :    int : 1 if the admin command has to wait for
+                      the ACK, nvme_adm_job_wake() is called then
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Queue id
+*********************************************************************/
+int nvme_dp_delete_cq(NVMEState *n, uint16_t qid)
+{
+    NVMEDataplane *dp = n->dp;
+    NVMEDpQid m = { .qid = qid };
+
+    if (dp->cq[qid].live) {
+        qemu_set_fd_handler(event_notifier_get_fd(&dp->cq[qid].notifier),
+            NULL, NULL, NULL);
+    }
+    nvme_dp_queue_cleanup(&dp->cq[qid]);
+    dp->adm_ack = nvme_dp_send_acked(dp, NVME_DP_MSG_DELETE_CQ, &m,
+        sizeof(m));
+    return dp->adm_ack != 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_ns_changed
+    Description  :    Sends the new state of a namespace
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t : Namespace id
+*********************************************************************/
+void nvme_dp_ns_changed(NVMEState *n, uint32_t nsid)
+{
+    NVMEDataplane *dp = n->dp;
+
+    if (!dp->enabled || nsid == 0 || nsid > NVME_MAX_NUM_NAMESPACES) {
+        return;
+    }
+    n->disk[nsid - 1].nsid = nsid;
+    nvme_dp_send_ns(dp, &n->disk[nsid - 1]);
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_sq_doorbell
+    Description  :    Publishes a SQ tail and kicks the dataplane
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Queue id
+                      uint16_t : New tail
+*********************************************************************/
+void nvme_dp_sq_doorbell(NVMEState *n, uint16_t qid, uint16_t tail)
+{
+    NVMEDataplane *dp = n->dp;
+    uint64_t one = 1;
+
+    dp->db->sq_tail[qid] = tail;
+    if (dp->sq[qid].live &&
+        write(event_notifier_get_fd(&dp->sq[qid].notifier), &one,
+            sizeof(one)) != sizeof(one)) {
+        LOG_DBG("nvme dataplane: kick of SQ %d failed", qid);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_dp_cq_doorbell
+    Description  :    Publishes a CQ head, the dataplane polls it
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Queue id
+                      uint16_t : New head
+*********************************************************************/
+void nvme_dp_cq_doorbell(NVMEState *n, uint16_t qid, uint16_t head)
+{
+    n->dp->db->cq_head[qid] = head;
+}
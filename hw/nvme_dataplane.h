@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef NVME_DATAPLANE_H
+#define NVME_DATAPLANE_H
+
+/*
+ * Protocol between the nvme device and an out of process dataplane.
+ *
+ * The device connects to the dataplane's UNIX socket. Every message is a
+ * NVMEDpMsgHdr followed by 'size' bytes of payload, file descriptors are
+ * passed alongside as SCM_RIGHTS. All fields are in host byte order.
+ *
+ * QEMU keeps handling the admin queue and the register space. Once the
+ * controller is enabled it mirrors its state to the dataplane: HELLO,
+ * MEM_TABLE, one NS per allocated namespace, then CREATE_CQ and
+ * CREATE_SQ for every existing I/O queue. The same sequence is replayed
+ * when the dataplane reconnects after a restart. Later changes are sent
+ * as they happen.
+ *
+ * The dataplane fetches I/O commands, moves data and posts completions
+ * directly in guest memory. I/O doorbell writes are stored in the shared
+ * NVMEDpDoorbells page, and a SQ tail write also signals the kick
+ * eventfd of that queue. The dataplane signals the irq eventfd of a CQ to
+ * have QEMU raise its interrupt vector.
+ *
+ * DELETE_SQ, DELETE_CQ and RESET must be answered with an ACK once the
+ * dataplane stopped touching the queues concerned, in the order they
+ * were received. ACK is the only message the dataplane sends. Until the
+ * ACK arrives QEMU holds back the completion of the Delete I/O Queue
+ * command, or keeps CSTS.RDY set after a reset, so the guest doesn't
+ * reuse the queue memory. A dataplane that doesn't answer within 5
+ * seconds, or sends anything else, is disconnected. Whenever the
+ * connection is lost the dataplane must stop touching all queues, QEMU
+ * replays the state once it reconnects.
+ *
+ * qemu-nvme-dataplane is a minimal implementation of this protocol.
+ */
+
+#include <stdint.h>
+
+#define NVME_DP_VERSION 1
+#define NVME_DP_MAX_QID 63 /* Same as NVME_MAX_QID */
+#define NVME_DP_MAX_REGIONS 32
+#define NVME_DP_MAX_FDS NVME_DP_MAX_REGIONS
+
+enum {
+    NVME_DP_MSG_HELLO     = 1, /* NVMEDpHello, fd: doorbell page */
+    NVME_DP_MSG_MEM_TABLE = 2, /* NVMEDpMemTable, fds: guest memory */
+    NVME_DP_MSG_NS        = 3, /* NVMEDpNs, fds: data, metadata images */
+    NVME_DP_MSG_CREATE_CQ = 4, /* NVMEDpCQ, fd: irq eventfd */
+    NVME_DP_MSG_CREATE_SQ = 5, /* NVMEDpSQ, fd: kick eventfd */
+    NVME_DP_MSG_DELETE_SQ = 6, /* NVMEDpQid */
+    NVME_DP_MSG_DELETE_CQ = 7, /* NVMEDpQid */
+    NVME_DP_MSG_RESET     = 8, /* no payload, drop all queues */
+    NVME_DP_MSG_ACK       = 9, /* NVMEDpAck, dataplane to QEMU */
+};
+
+typedef struct NVMEDpMsgHdr {
+    uint32_t type;
+    uint32_t size;
+} NVMEDpMsgHdr;
+
+typedef struct NVMEDpHello {
+    uint32_t version;
+    uint32_t instance;
+    uint32_t page_size; /* CC.MPS, used for non contiguous queues */
+    uint32_t host_page_size; /* used for PRPs */
+    uint32_t max_qid;
+    uint32_t rsvd;
+} NVMEDpHello;
+
+/* Guest physical range backed by fds[fd_index] starting at fd_offset */
+typedef struct NVMEDpMemRegion {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t fd_offset;
+    uint32_t fd_index;
+    uint32_t rsvd;
+} NVMEDpMemRegion;
+
+typedef struct NVMEDpMemTable {
+    uint32_t nregions;
+    uint32_t rsvd;
+    NVMEDpMemRegion regions[NVME_DP_MAX_REGIONS];
+} NVMEDpMemTable;
+
+typedef struct NVMEDpNs {
+    uint32_t nsid;
+    uint32_t attached; /* 0: commands must fail with Invalid Namespace */
+    uint64_t nsze; /* blocks */
+    uint32_t lbads; /* log2 of the block size */
+    uint32_t ms; /* metadata bytes per block, 0 if there is no image */
+} NVMEDpNs;
+
+typedef struct NVMEDpCQ {
+    uint16_t qid;
+    uint16_t irq_enabled;
+    uint16_t phys_contig;
+    uint16_t vector;
+    uint32_t size;
+    uint32_t rsvd;
+    uint64_t dma_addr;
+} NVMEDpCQ;
+
+typedef struct NVMEDpSQ {
+    uint16_t qid;
+    uint16_t cqid;
+    uint16_t prio;
+    uint16_t phys_contig;
+    uint32_t size;
+    uint32_t rsvd;
+    uint64_t dma_addr;
+} NVMEDpSQ;
+
+typedef struct NVMEDpQid {
+    uint32_t qid;
+} NVMEDpQid;
+
+typedef struct NVMEDpAck {
+    uint32_t type; /* message acknowledged */
+} NVMEDpAck;
+
+/* Shared doorbell page, written by QEMU on every I/O doorbell write */
+typedef struct NVMEDpDoorbells {
+    uint32_t sq_tail[NVME_DP_MAX_QID + 1];
+    uint32_t cq_head[NVME_DP_MAX_QID + 1];
+} NVMEDpDoorbells;
+
+#endif /* NVME_DATAPLANE_H */
@@ -29,7 +29,11 @@
 
 uint8_t is_cq_full(NVMEState *n, uint16_t qid)
 {
-    return (((n->cq[qid].tail + 1) % n->cq[qid].size) == n->cq[qid].head);
+    NVMEIOCQueue *cq = &n->cq[qid];
+
+    /* Completions held back by the NAND model already own their slot */
+    return ((cq->tail + cq->size - cq->head) % cq->size) + cq->pending + 1
+        >= cq->size;
 }
 
 static void incr_sq_head(NVMEIOSQueue *q)
@@ -51,8 +55,8 @@ void incr_cq_tail(NVMEIOCQueue *q)
 /* Used to get the required Queue entry for discontig SQ and CQ
  * Returns- dma address
  */
-static uint64_t find_discontig_queue_entry(uint32_t pg_size, uint16_t queue_ptr,
-    uint32_t cmd_size, uint64_t st_dma_addr) {
+static uint64_t find_discontig_queue_entry(NVMEState *n, uint32_t pg_size,
+    uint16_t queue_ptr, uint32_t cmd_size, uint64_t st_dma_addr) {
     uint32_t index = 0;
     uint32_t pg_no, prp_pg_no, entr_per_pg, prps_per_pg, prp_entry, pg_entry;
     uint64_t dma_addr, entry_addr;
@@ -70,7 +74,8 @@ static uint64_t find_discontig_queue_entry(uint32_t pg_size, uint16_t queue_ptr,
 
     /* Get to the correct page */
     for (index = 1; index <= prp_pg_no; index++) {
-        nvme_dma_mem_read((st_dma_addr + ((prps_per_pg - 1) * PRP_ENTRY_SIZE)),
+        nvme_dma_mem_read(n,
+            (st_dma_addr + ((prps_per_pg - 1) * PRP_ENTRY_SIZE)),
             (uint8_t *)&dma_addr, PRP_ENTRY_SIZE);
         st_dma_addr = dma_addr;
     }
@@ -78,7 +83,7 @@ static uint64_t find_discontig_queue_entry(uint32_t pg_size, uint16_t queue_ptr,
     /* Correct offset within the prp list page */
     dma_addr = st_dma_addr + (prp_entry * PRP_ENTRY_SIZE);
     /* Reading the PRP List at required offset */
-    nvme_dma_mem_read(dma_addr, (uint8_t *)&entry_addr, PRP_ENTRY_SIZE);
+    nvme_dma_mem_read(n, dma_addr, (uint8_t *)&entry_addr, PRP_ENTRY_SIZE);
 
     /* Correct offset within the page */
     dma_addr = entry_addr + (pg_entry * cmd_size);
@@ -91,10 +96,10 @@ void post_cq_entry(NVMEState *n, NVMEIOCQueue *cq, NVMECQE* cqe)
     if (cq->phys_contig) {
         addr = cq->dma_addr + cq->tail * sizeof(*cqe);
     } else {
-        addr = find_discontig_queue_entry(n->page_size, cq->tail,
+        addr = find_discontig_queue_entry(n, n->page_size, cq->tail,
             sizeof(*cqe), cq->dma_addr);
     }
-    nvme_dma_mem_write(addr, (uint8_t *)cqe, sizeof(*cqe));
+    nvme_dma_mem_write(n, addr, (uint8_t *)cqe, sizeof(*cqe));
 
     incr_cq_tail(cq);
     if (cq->irq_enabled) {
@@ -117,6 +122,10 @@ int process_sq(NVMEState *n, uint16_t sq_id)
         return -1;
     }
     cq_id = n->sq[sq_id].cq_id;
+    if (sq_id == ASQ_ID && n->adm_job) {
+        LOG_DBG("admin job running");
+        return -1;
+    }
     if (is_cq_full(n, cq_id)) {
         LOG_DBG("CQ %d is full", cq_id);
         return -1;
@@ -130,23 +139,30 @@ int process_sq(NVMEState *n, uint16_t sq_id)
         addr = n->sq[sq_id].dma_addr + n->sq[sq_id].head * sizeof(sqe);
     } else {
         /* PRP implementation */
-        addr = find_discontig_queue_entry(n->page_size, n->sq[sq_id].head,
+        addr = find_discontig_queue_entry(n, n->page_size, n->sq[sq_id].head,
             sizeof(sqe), n->sq[sq_id].dma_addr);
     }
-    nvme_dma_mem_read(addr, (uint8_t *)&sqe, sizeof(sqe));
+    nvme_dma_mem_read(n, addr, (uint8_t *)&sqe, sizeof(sqe));
+
+    if (sq_id != ASQ_ID) {
+        /* The entry stays in the ring while the queue is throttled */
+        if (nvme_qos_sq_throttled(n, sq_id, &sqe)) {
+            return -1;
+        }
+        incr_sq_head(&n->sq[sq_id]);
+        if (!nvme_qos_ns_throttled(n, sq_id, &sqe)) {
+            nvme_io_dispatch(n, sq_id, &sqe);
+        }
+        return 0;
+    }
 
     incr_sq_head(&n->sq[sq_id]);
 
-    if (sq_id == ASQ_ID) {
-        nvme_admin_command(n, &sqe, &cqe);
-        if (sqe.opcode == NVME_ADM_CMD_ASYNC_EV_REQ &&
-            sf->sc == NVME_SC_SUCCESS) {
-            /* completion entry is done separately */
-            return 0;
-        }
-    } else {
-       /* TODO add support for IO commands with different sizes of Q elements */
-       nvme_command_set(n, &sqe, &cqe);
+    nvme_admin_command(n, &sqe, &cqe);
+    if ((sqe.opcode == NVME_ADM_CMD_ASYNC_EV_REQ &&
+        sf->sc == NVME_SC_SUCCESS) || n->adm_job) {
+        /* completion entry is done separately */
+        return 0;
     }
 
     /* Filling up the CQ entry */
@@ -162,3 +178,97 @@ int process_sq(NVMEState *n, uint16_t sq_id)
 
     return 0;
 }
+
+/*********************************************************************
+    Function     :    nvme_cmd_track
+    Description  :    Records a command whose completion is not
+                      posted yet in the command table of its SQ
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      CommandEntry * : Entry embedded in the holder
+                      uint16_t : Submission queue id
+                      uint16_t : Command id
+                      uint8_t : NVME_CMD_PARKED or NVME_CMD_HELD
+*********************************************************************/
+void nvme_cmd_track(NVMEState *n, CommandEntry *ce, uint16_t sq_id,
+    uint16_t cid, uint8_t state)
+{
+    ce->cid = cid;
+    ce->sq_id = sq_id;
+    ce->state = state;
+    QTAILQ_INSERT_TAIL(&n->sq[sq_id].cmd_list[cid % NVME_CMD_HASH_SIZE], ce,
+        entry);
+}
+
+/*********************************************************************
+    Function     :    nvme_cmd_untrack
+    Description  :    Removes a command from the command table of
+                      its SQ
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      CommandEntry * : Entry embedded in the holder
+*********************************************************************/
+void nvme_cmd_untrack(NVMEState *n, CommandEntry *ce)
+{
+    QTAILQ_REMOVE(&n->sq[ce->sq_id].cmd_list[ce->cid % NVME_CMD_HASH_SIZE],
+        ce, entry);
+}
+
+/*********************************************************************
+    Function     :    nvme_cmd_find
+    Description  :    Looks a command up by its CID
+    Return Type  :    CommandEntry * : NULL if the command is not
+                                       waiting anywhere
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Submission queue id
+                      uint16_t : Command id
+*********************************************************************/
+CommandEntry *nvme_cmd_find(NVMEState *n, uint16_t sq_id, uint16_t cid)
+{
+    CommandEntry *ce;
+
+    QTAILQ_FOREACH(ce, &n->sq[sq_id].cmd_list[cid % NVME_CMD_HASH_SIZE],
+        entry) {
+        if (ce->cid == cid) {
+            return ce;
+        }
+    }
+    return NULL;
+}
+
+/*********************************************************************
+    Function     :    nvme_io_dispatch
+    Description  :    Executes an I/O command and posts its
+                      completion, or hands it to the NAND model
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Submission queue the command came from
+                      NVMECmd * : NVME I/O command
+*********************************************************************/
+void nvme_io_dispatch(NVMEState *n, uint16_t sq_id, NVMECmd *sqe)
+{
+    uint16_t cq_id = n->sq[sq_id].cq_id;
+    NVMECQE cqe;
+    NVMEStatusField *sf = (NVMEStatusField *) &cqe.status;
+
+    memset(&cqe, 0, sizeof(cqe));
+
+    /* TODO add support for IO commands with different sizes of Q elements */
+    nvme_command_set(n, sqe, &cqe);
+
+    /* Filling up the CQ entry */
+    cqe.sq_id = sq_id;
+    cqe.sq_head = n->sq[sq_id].head;
+    cqe.command_id = sqe->cid;
+
+    sf->m = 0;
+    sf->dnr = 0; /* TODO add support for dnr */
+
+    if (NVME_NAND_ON(n)) {
+        nvme_nand_complete(n, sqe, cq_id, &cqe);
+        return;
+    }
+
+    sf->p = n->cq[cq_id].phase_tag;
+    post_cq_entry(n, &n->cq[cq_id], &cqe);
+}
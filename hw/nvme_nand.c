@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * NAND timing model.
+ *
+ * The backing store completes every command as fast as memcpy allows.
+ * When the model is enabled the data is still moved synchronously, but
+ * the completion entry of each I/O command is held back until the time
+ * a real flash array would have needed to serve it.
+ *
+ * Flash pages are striped over channels first, then dies, then planes.
+ * Every plane is an independent unit that is busy for the array time of
+ * a read or program, while the channel it hangs off is busy for the
+ * transfer of the data. A plane that has programmed a block worth of
+ * pages additionally pays for one erase. Writes are absorbed by a write
+ * buffer of flash page sized slots and complete once they hold a slot;
+ * a slot is released when the program of its page is done.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+#define NVME_NAND_MAX_UNITS 4096
+
+static void nvme_nand_timer_cb(void *opaque);
+
+/*********************************************************************
+    Function     :    nvme_nand_init
+    Description  :    Validates the model geometry and allocates
+                      its state
+    Return Type  :    int : 0 on success, -1 on a bad configuration
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_nand_init(NVMEState *n)
+{
+    NVMENand *m = &n->nand;
+
+    QTAILQ_INIT(&m->pending);
+    if (!NVME_NAND_ON(n)) {
+        return 0;
+    }
+
+    if (m->channels == 0 || m->dies == 0 || m->planes == 0 ||
+        (uint64_t)m->channels * m->dies * m->planes > NVME_NAND_MAX_UNITS) {
+        LOG_ERR("bad nand geometry %u channels, %u dies, %u planes, must "
+            "have at most %d planes in total", m->channels, m->dies,
+            m->planes, NVME_NAND_MAX_UNITS);
+        return -1;
+    }
+    if (m->page_size == 0 || m->pages_per_block == 0 || m->chan_bw == 0) {
+        LOG_ERR("nand page size, pages per block and channel bandwidth "
+            "must not be 0");
+        return -1;
+    }
+
+    m->num_units = m->channels * m->dies * m->planes;
+    m->unit_free = qemu_mallocz(sizeof(*m->unit_free) * m->num_units);
+    m->unit_progs = qemu_mallocz(sizeof(*m->unit_progs) * m->num_units);
+    m->chan_free = qemu_mallocz(sizeof(*m->chan_free) * m->channels);
+    m->wbuf_slots = m->wbuf_size / m->page_size;
+    if (m->wbuf_slots) {
+        m->wbuf = qemu_mallocz(sizeof(*m->wbuf) * m->wbuf_slots);
+    }
+    m->wbuf_next = 0;
+    m->timer = qemu_new_timer_ns(vm_clock, nvme_nand_timer_cb, n);
+
+    LOG_NORM("NAND model: %u channels, %u dies, %u planes, %u KB pages, "
+        "%u KB write buffer", m->channels, m->dies, m->planes,
+        m->page_size, m->wbuf_slots * m->page_size);
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_nand_uninit
+    Description  :    Frees the model state
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_nand_uninit(NVMEState *n)
+{
+    NVMENand *m = &n->nand;
+
+    nvme_nand_reset(n);
+    if (m->timer) {
+        qemu_free_timer(m->timer);
+        m->timer = NULL;
+    }
+    qemu_free(m->unit_free);
+    qemu_free(m->unit_progs);
+    qemu_free(m->chan_free);
+    qemu_free(m->wbuf);
+    m->unit_free = m->chan_free = m->wbuf = NULL;
+    m->unit_progs = NULL;
+}
+
+/*********************************************************************
+    Function     :    nvme_nand_reset
+    Description  :    Drops every held back completion, the flash
+                      array itself is left busy
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_nand_reset(NVMEState *n)
+{
+    NVMENand *m = &n->nand;
+    NVMENandCompletion *c;
+
+    while ((c = QTAILQ_FIRST(&m->pending)) != NULL) {
+        QTAILQ_REMOVE(&m->pending, c, entry);
+        nvme_cmd_untrack(n, &c->ce);
+        n->cq[c->cq_id].pending--;
+        qemu_free(c);
+    }
+    if (m->timer) {
+        qemu_del_timer(m->timer);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_nand_cancel_sq
+    Description  :    Drops the held back completions of commands
+                      fetched from a submission queue being deleted
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Submission queue id
+*********************************************************************/
+void nvme_nand_cancel_sq(NVMEState *n, uint16_t sq_id)
+{
+    NVMENand *m = &n->nand;
+    NVMENandCompletion *c, *next;
+
+    QTAILQ_FOREACH_SAFE(c, &m->pending, entry, next) {
+        if (c->cqe.sq_id == sq_id) {
+            QTAILQ_REMOVE(&m->pending, c, entry);
+            nvme_cmd_untrack(n, &c->ce);
+            n->cq[c->cq_id].pending--;
+            qemu_free(c);
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_nand_abort
+    Description  :    Drops the held back completion of an executed
+                      command, the caller posts Command Abort Requested
+                      instead
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      CommandEntry * : Tracking entry of the command
+*********************************************************************/
+void nvme_nand_abort(NVMEState *n, CommandEntry *ce)
+{
+    NVMENandCompletion *c = container_of(ce, NVMENandCompletion, ce);
+
+    /* The timer may fire early now, it just rearms itself */
+    QTAILQ_REMOVE(&n->nand.pending, c, entry);
+    nvme_cmd_untrack(n, ce);
+    n->cq[c->cq_id].pending--;
+    qemu_free(c);
+}
+
+/* Time the channel needs to move len bytes, in ns */
+static int64_t nvme_nand_xfer_time(NVMENand *m, uint64_t len)
+{
+    return len * 1000 / m->chan_bw;
+}
+
+/* Array time of a program, including the erase it may trigger, in ns */
+static int64_t nvme_nand_prog_time(NVMENand *m, uint32_t unit)
+{
+    int64_t t = (int64_t)m->prog_lat * 1000;
+
+    if (++m->unit_progs[unit] >= m->pages_per_block) {
+        m->unit_progs[unit] = 0;
+        t += (int64_t)m->erase_lat * 1000;
+    }
+    return t;
+}
+
+/*********************************************************************
+    Function     :    nvme_nand_page
+    Description  :    Schedules one flash page worth of a command
+                      on its plane and channel
+    Return Type  :    int64_t : vm_clock time the page is done, for a
+                                buffered write the time its buffer
+                                slot was available
+    Arguments    :    NVMENand * : Pointer to the model
+                      uint64_t : Flash page index
+                      uint64_t : Bytes of the page touched
+                      uint8_t : Read or Write opcode
+                      int64_t : Current vm_clock time
+*********************************************************************/
+static int64_t nvme_nand_page(NVMENand *m, uint64_t page, uint64_t len,
+    uint8_t opcode, int64_t now)
+{
+    uint32_t chan = page % m->channels;
+    uint32_t unit = page % m->num_units;
+    int64_t start, done, ready = now;
+
+    if (opcode == NVME_CMD_READ) {
+        /* Sense the page into the plane register, then move it out */
+        start = MAX(now, m->unit_free[unit]) + (int64_t)m->read_lat * 1000;
+        done = MAX(start, m->chan_free[chan]) + nvme_nand_xfer_time(m, len);
+        m->chan_free[chan] = done;
+        m->unit_free[unit] = done;
+        return done;
+    }
+
+    if (m->wbuf_slots) {
+        /* The data can only be accepted once a slot has drained */
+        ready = MAX(now, m->wbuf[m->wbuf_next]);
+    }
+    /* Move the page in over the channel, then program it */
+    start = MAX(ready, m->chan_free[chan]) + nvme_nand_xfer_time(m, len);
+    m->chan_free[chan] = start;
+    done = MAX(start, m->unit_free[unit]) + nvme_nand_prog_time(m, unit);
+    m->unit_free[unit] = done;
+
+    if (m->wbuf_slots) {
+        m->wbuf[m->wbuf_next] = done;
+        m->wbuf_next = (m->wbuf_next + 1) % m->wbuf_slots;
+        return ready;
+    }
+    return done;
+}
+
+/*********************************************************************
+    Function     :    nvme_nand_cmd_time
+    Description  :    Computes when an I/O command would complete
+                      on the modelled flash
+    Return Type  :    int64_t : vm_clock completion time
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd * : NVME I/O command
+                      int64_t : Current vm_clock time
+*********************************************************************/
+static int64_t nvme_nand_cmd_time(NVMEState *n, NVMECmd *sqe, int64_t now)
+{
+    NVMENand *m = &n->nand;
+    NVME_rw *e = (NVME_rw *)sqe;
+    DiskInfo *disk;
+    uint64_t page_bytes = (uint64_t)m->page_size * 1024;
+    uint64_t off, end, len;
+    int64_t done = now;
+    uint32_t i;
+    uint8_t lbads;
+
+    switch (sqe->opcode) {
+    case NVME_CMD_READ:
+    case NVME_CMD_WRITE:
+        disk = nvme_get_active_ns(n, sqe->nsid);
+        if (disk == NULL) {
+            return now;
+        }
+        lbads = disk->fmt.lbads;
+        off = e->slba << lbads;
+        end = (e->slba + e->nlb + 1) << lbads;
+        while (off < end) {
+            len = MIN(end, (off / page_bytes + 1) * page_bytes) - off;
+            done = MAX(done, nvme_nand_page(m, off / page_bytes, len,
+                sqe->opcode, now));
+            off += len;
+        }
+        return done;
+    case NVME_CMD_FLUSH:
+        /* Everything sitting in the write buffer has to be programmed */
+        for (i = 0; i < m->wbuf_slots; i++) {
+            done = MAX(done, m->wbuf[i]);
+        }
+        return done;
+    default:
+        return now;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_nand_complete
+    Description  :    Holds back the completion entry of an I/O
+                      command until the model says it is done
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd * : NVME I/O command
+                      uint16_t : Completion queue id
+                      NVMECQE * : Completion entry, phase tag is set
+                                  when it is posted
+*********************************************************************/
+void nvme_nand_complete(NVMEState *n, NVMECmd *sqe, uint16_t cq_id,
+    NVMECQE *cqe)
+{
+    NVMENand *m = &n->nand;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMENandCompletion *c, *pos;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+
+    c = qemu_malloc(sizeof(*c));
+    /* Failed commands never reached the flash */
+    c->time = (sf->sc == NVME_SC_SUCCESS) ? nvme_nand_cmd_time(n, sqe, now)
+        : now;
+    c->cq_id = cq_id;
+    c->cqe = *cqe;
+    nvme_cmd_track(n, &c->ce, cqe->sq_id, cqe->command_id, NVME_CMD_HELD);
+
+    /* Keep the list sorted by completion time */
+    QTAILQ_FOREACH_REVERSE(pos, &m->pending, nand_pending, entry) {
+        if (pos->time <= c->time) {
+            break;
+        }
+    }
+    if (pos) {
+        QTAILQ_INSERT_AFTER(&m->pending, pos, c, entry);
+    } else {
+        QTAILQ_INSERT_HEAD(&m->pending, c, entry);
+        qemu_mod_timer(m->timer, c->time);
+    }
+    n->cq[cq_id].pending++;
+}
+
+/*********************************************************************
+    Function     :    nvme_nand_timer_cb
+    Description  :    Posts every held back completion that is due
+    Return Type  :    void
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_nand_timer_cb(void *opaque)
+{
+    NVMEState *n = (NVMEState *)opaque;
+    NVMENand *m = &n->nand;
+    NVMENandCompletion *c;
+    NVMEIOCQueue *cq;
+    NVMEStatusField *sf;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+
+    while ((c = QTAILQ_FIRST(&m->pending)) != NULL && c->time <= now) {
+        QTAILQ_REMOVE(&m->pending, c, entry);
+        nvme_cmd_untrack(n, &c->ce);
+        cq = &n->cq[c->cq_id];
+        cq->pending--;
+        if (cq->dma_addr) {
+            sf = (NVMEStatusField *)&c->cqe.status;
+            sf->p = cq->phase_tag;
+            post_cq_entry(n, cq, &c->cqe);
+        }
+        qemu_free(c);
+    }
+    if (c) {
+        qemu_mod_timer(m->timer, c->time);
+    }
+}
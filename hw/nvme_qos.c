@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * QoS throttling.
+ *
+ * Namespaces and I/O submission queues carry token buckets for read and
+ * write IOPS and bytes/s. A command may start whenever the buckets it is
+ * charged to are not empty, and may overdraw them; the debt delays the
+ * next command.
+ *
+ * A submission queue that ran out of tokens is simply not fetched from,
+ * its ring holds the waiting commands. Commands to a throttled namespace
+ * are fetched and parked on the namespace, so they do not hold up other
+ * namespaces sharing the queue. Both are picked up again by qos_timer.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+static void nvme_qos_timer_cb(void *opaque);
+
+/*********************************************************************
+    Function     :    nvme_qos_set
+    Description  :    Applies new limits to a set of buckets and
+                      fills them up
+    Return Type  :    void
+    Arguments    :    NVMEQoS * : Buckets to configure
+                      const NVMEQoSConf * : New limits
+*********************************************************************/
+void nvme_qos_set(NVMEQoS *q, const NVMEQoSConf *conf)
+{
+    uint64_t rate[NVME_QOS_BUCKETS], burst[NVME_QOS_BUCKETS];
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int i;
+
+    rate[NVME_QOS_RD_IOPS] = conf->rd_iops;
+    rate[NVME_QOS_WR_IOPS] = conf->wr_iops;
+    rate[NVME_QOS_RD_BPS] = conf->rd_bps;
+    rate[NVME_QOS_WR_BPS] = conf->wr_bps;
+    burst[NVME_QOS_RD_IOPS] = burst[NVME_QOS_WR_IOPS] = conf->iops_burst;
+    burst[NVME_QOS_RD_BPS] = burst[NVME_QOS_WR_BPS] = conf->bps_burst;
+
+    q->conf = *conf;
+    for (i = 0; i < NVME_QOS_BUCKETS; i++) {
+        q->bucket[i].rate = rate[i];
+        q->bucket[i].size = burst[i] ? burst[i] : rate[i];
+        q->bucket[i].level = q->bucket[i].size;
+        q->bucket[i].last = now;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_limited
+    Description  :    Tells whether any limit is set
+    Return Type  :    int
+    Arguments    :    const NVMEQoSConf * : Limits
+*********************************************************************/
+int nvme_qos_limited(const NVMEQoSConf *conf)
+{
+    return conf->rd_iops || conf->wr_iops || conf->rd_bps || conf->wr_bps;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_init
+    Description  :    Sets up the QoS timer and the default limits
+                      of every namespace slot
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_qos_init(NVMEState *n)
+{
+    uint32_t i;
+
+    for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+        nvme_qos_set(&n->ns_throttle[i].qos, &n->ns_qos);
+        QTAILQ_INIT(&n->ns_throttle[i].throttled);
+    }
+    n->qos_timer = qemu_new_timer_ns(vm_clock, nvme_qos_timer_cb, n);
+    n->qos_timer_target = 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_uninit
+    Description  :    Frees the QoS timer and parked commands
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_qos_uninit(NVMEState *n)
+{
+    nvme_qos_reset(n);
+    if (n->qos_timer) {
+        qemu_free_timer(n->qos_timer);
+        n->qos_timer = NULL;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_reset
+    Description  :    Drops every parked command on controller reset
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_qos_reset(NVMEState *n)
+{
+    NVMEThrottled *t;
+    uint32_t i;
+
+    for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+        while ((t = QTAILQ_FIRST(&n->ns_throttle[i].throttled)) != NULL) {
+            QTAILQ_REMOVE(&n->ns_throttle[i].throttled, t, entry);
+            nvme_cmd_untrack(n, &t->ce);
+            n->cq[n->sq[t->ce.sq_id].cq_id].pending--;
+            qemu_free(t);
+        }
+    }
+    if (n->qos_timer) {
+        qemu_del_timer(n->qos_timer);
+    }
+    n->qos_timer_target = 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_cancel_sq
+    Description  :    Drops the parked commands of a submission
+                      queue being deleted
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Submission queue id
+*********************************************************************/
+void nvme_qos_cancel_sq(NVMEState *n, uint16_t sq_id)
+{
+    NVMEThrottled *t, *next;
+    uint32_t i;
+
+    for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+        QTAILQ_FOREACH_SAFE(t, &n->ns_throttle[i].throttled, entry, next) {
+            if (t->ce.sq_id == sq_id) {
+                QTAILQ_REMOVE(&n->ns_throttle[i].throttled, t, entry);
+                nvme_cmd_untrack(n, &t->ce);
+                n->cq[n->sq[sq_id].cq_id].pending--;
+                qemu_free(t);
+            }
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_abort
+    Description  :    Drops a parked command, the caller posts its
+                      Command Abort Requested completion
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      CommandEntry * : Tracking entry of the command
+*********************************************************************/
+void nvme_qos_abort(NVMEState *n, CommandEntry *ce)
+{
+    NVMEThrottled *t = container_of(ce, NVMEThrottled, ce);
+
+    /* Only commands for an active namespace are ever parked */
+    QTAILQ_REMOVE(&n->ns_throttle[t->sqe.nsid - 1].throttled, t, entry);
+    nvme_cmd_untrack(n, ce);
+    n->cq[n->sq[ce->sq_id].cq_id].pending--;
+    qemu_free(t);
+}
+
+/* Arms the QoS timer unless it already fires earlier */
+static void nvme_qos_arm(NVMEState *n, int64_t when)
+{
+    if (n->qos_timer_target == 0 || when < n->qos_timer_target) {
+        n->qos_timer_target = when;
+        qemu_mod_timer(n->qos_timer, when);
+    }
+}
+
+/* Bytes moved by a read or write, 0 for other commands */
+static uint64_t nvme_qos_bytes(NVMEState *n, NVMECmd *sqe)
+{
+    NVME_rw *e = (NVME_rw *)sqe;
+    DiskInfo *disk = nvme_get_active_ns(n, sqe->nsid);
+
+    if (disk == NULL) {
+        return 0;
+    }
+    return (uint64_t)(e->nlb + 1) << disk->fmt.lbads;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_wait
+    Description  :    Refills the buckets a command is charged to
+                      and checks whether it may start
+    Return Type  :    int64_t : 0 if the command may start, otherwise
+                                the ns it has to wait
+    Arguments    :    NVMEQoS * : Buckets to check
+                      NVMECmd * : NVME I/O command
+                      int64_t : Current vm_clock time
+*********************************************************************/
+static int64_t nvme_qos_wait(NVMEQoS *q, NVMECmd *sqe, int64_t now)
+{
+    int idx[2], i;
+    int64_t wait = 0, w;
+    NVMEBucket *b;
+
+    if (sqe->opcode == NVME_CMD_READ) {
+        idx[0] = NVME_QOS_RD_IOPS;
+        idx[1] = NVME_QOS_RD_BPS;
+    } else if (sqe->opcode == NVME_CMD_WRITE) {
+        idx[0] = NVME_QOS_WR_IOPS;
+        idx[1] = NVME_QOS_WR_BPS;
+    } else {
+        return 0;
+    }
+
+    for (i = 0; i < 2; i++) {
+        b = &q->bucket[idx[i]];
+        if (b->rate == 0) {
+            continue;
+        }
+        b->level += (double)b->rate * (now - b->last) / 1000000000;
+        if (b->level > b->size) {
+            b->level = b->size;
+        }
+        b->last = now;
+        if (b->level <= 0) {
+            w = (int64_t)((1 - b->level) * 1000000000 / b->rate) + 1;
+            wait = MAX(wait, w);
+        }
+    }
+    return wait;
+}
+
+/* Takes the tokens of a command that is allowed to start */
+static void nvme_qos_charge(NVMEQoS *q, NVMECmd *sqe, uint64_t bytes)
+{
+    int write = (sqe->opcode == NVME_CMD_WRITE);
+
+    if (sqe->opcode != NVME_CMD_READ && !write) {
+        return;
+    }
+    q->bucket[write ? NVME_QOS_WR_IOPS : NVME_QOS_RD_IOPS].level -= 1;
+    q->bucket[write ? NVME_QOS_WR_BPS : NVME_QOS_RD_BPS].level -= bytes;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_sq_throttled
+    Description  :    Checks the submission queue limits before the
+                      command at its head is consumed
+    Return Type  :    int : 1 if the queue has to wait, 0 if the
+                            command was charged and may be fetched
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Submission queue id
+                      NVMECmd * : Command at the head of the queue
+*********************************************************************/
+int nvme_qos_sq_throttled(NVMEState *n, uint16_t sq_id, NVMECmd *sqe)
+{
+    NVMEQoS *q = &n->sq[sq_id].qos;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int64_t wait = nvme_qos_wait(q, sqe, now);
+
+    if (wait) {
+        LOG_DBG("SQ %d throttled for %ld ns", sq_id, wait);
+        nvme_qos_arm(n, now + wait);
+        return 1;
+    }
+    nvme_qos_charge(q, sqe, nvme_qos_bytes(n, sqe));
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_ns_throttled
+    Description  :    Checks the namespace limits of a fetched
+                      command and parks it if they are exceeded
+    Return Type  :    int : 1 if the command was parked, 0 if it was
+                            charged and may be executed now
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Submission queue id
+                      NVMECmd * : NVME I/O command
+*********************************************************************/
+int nvme_qos_ns_throttled(NVMEState *n, uint16_t sq_id, NVMECmd *sqe)
+{
+    NVMENsThrottle *nt;
+    NVMEThrottled *t;
+    int64_t now, wait;
+
+    if (nvme_get_active_ns(n, sqe->nsid) == NULL) {
+        return 0;
+    }
+    nt = &n->ns_throttle[sqe->nsid - 1];
+
+    now = qemu_get_clock_ns(vm_clock);
+    /* Keep the order of commands already waiting on the namespace */
+    wait = QTAILQ_EMPTY(&nt->throttled) ?
+        nvme_qos_wait(&nt->qos, sqe, now) : 0;
+    if (QTAILQ_EMPTY(&nt->throttled) && wait == 0) {
+        nvme_qos_charge(&nt->qos, sqe, nvme_qos_bytes(n, sqe));
+        return 0;
+    }
+
+    t = qemu_malloc(sizeof(*t));
+    t->sqe = *sqe;
+    nvme_cmd_track(n, &t->ce, sq_id, sqe->cid, NVME_CMD_PARKED);
+    QTAILQ_INSERT_TAIL(&nt->throttled, t, entry);
+    /* Its completion slot is taken now */
+    n->cq[n->sq[sq_id].cq_id].pending++;
+    if (wait) {
+        LOG_DBG("nsid %d throttled for %ld ns", sqe->nsid, wait);
+        nvme_qos_arm(n, now + wait);
+    }
+    return 1;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_dispatch_ns
+    Description  :    Executes the parked commands of a namespace
+                      as far as its limits allow
+    Return Type  :    int64_t : 0 if nothing is left parked, otherwise
+                                the vm_clock time to retry at
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMENsThrottle * : QoS state of the namespace
+                      int : Ignore the limits, used once the namespace
+                            went away and the commands have to fail
+*********************************************************************/
+static int64_t nvme_qos_dispatch_ns(NVMEState *n, NVMENsThrottle *nt,
+    int force)
+{
+    NVMEThrottled *t;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int64_t wait;
+
+    while ((t = QTAILQ_FIRST(&nt->throttled)) != NULL) {
+        if (!force) {
+            wait = nvme_qos_wait(&nt->qos, &t->sqe, now);
+            if (wait) {
+                return now + wait;
+            }
+            nvme_qos_charge(&nt->qos, &t->sqe, nvme_qos_bytes(n, &t->sqe));
+        }
+        QTAILQ_REMOVE(&nt->throttled, t, entry);
+        nvme_cmd_untrack(n, &t->ce);
+        n->cq[n->sq[t->ce.sq_id].cq_id].pending--;
+        nvme_io_dispatch(n, t->ce.sq_id, &t->sqe);
+        qemu_free(t);
+    }
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_release_ns
+    Description  :    Completes the parked commands of a namespace
+                      that was detached or deleted
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo * : Namespace
+*********************************************************************/
+void nvme_qos_release_ns(NVMEState *n, DiskInfo *disk)
+{
+    nvme_qos_dispatch_ns(n, &n->ns_throttle[disk - n->disk], 1);
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_set_ns
+    Description  :    Applies the default limits of the controller to
+                      a newly created namespace
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo * : Namespace
+*********************************************************************/
+void nvme_qos_set_ns(NVMEState *n, DiskInfo *disk)
+{
+    nvme_qos_set(&n->ns_throttle[disk - n->disk].qos, &n->ns_qos);
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_timer_cb
+    Description  :    Restarts parked commands and submission queues
+                      whose limits allow it again
+    Return Type  :    void
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_qos_timer_cb(void *opaque)
+{
+    NVMEState *n = (NVMEState *)opaque;
+    int64_t next = 0, when;
+    uint32_t i;
+
+    n->qos_timer_target = 0;
+    for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+        when = nvme_qos_dispatch_ns(n, &n->ns_throttle[i], 0);
+        if (when && (next == 0 || when < next)) {
+            next = when;
+        }
+    }
+    if (next) {
+        nvme_qos_arm(n, next);
+    }
+
+    /* Throttled submission queues are rechecked by the SQ processing */
+    if (n->sq_processing_timer_target == 0) {
+        n->sq_processing_timer_target = qemu_get_clock_ns(vm_clock);
+        qemu_mod_timer(n->sq_processing_timer, n->sq_processing_timer_target);
+    }
+}
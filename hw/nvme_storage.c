@@ -24,9 +24,15 @@
 
 #include "nvme.h"
 #include "nvme_debug.h"
+#include "host-utils.h"
 #include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
 #include <assert.h>
 
+#define HUGETLBFS_MAGIC 0x958458f6
+#define MPOL_BIND 2
+
 #define MASK_AD         0x4
 #define MASK_IDW        0x2
 #define MASK_IDR        0x1
@@ -36,88 +42,194 @@ static uint8_t read_dsm_ranges(NVMEState *n, uint64_t range_prp1, uint64_t range
 static void dsm_dealloc(DiskInfo *disk, uint64_t slba, uint64_t nlb);
 
 
-void nvme_dma_mem_read(target_phys_addr_t addr, uint8_t *buf, int len)
+/*********************************************************************
+    Function     :    nvme_cmb_ptr
+    Description  :    Translates a bus address falling entirely within
+                      the Controller Memory Buffer into a host pointer
+    Return Type  :    uint8_t * : Host pointer, NULL if the range is
+                                  not in the CMB
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      target_phys_addr_t : Bus address
+                      int : Length of the access
+*********************************************************************/
+static inline uint8_t *nvme_cmb_ptr(NVMEState *n, target_phys_addr_t addr,
+    int len)
 {
-    cpu_physical_memory_rw(addr, buf, len, 0);
-}
+    pcibus_t base = n->dev.io_regions[NVME_CMB_BIR].addr;
+    uint64_t size = (uint64_t)n->cmb_size * 1024 * 1024;
 
-void nvme_dma_mem_write(target_phys_addr_t addr, uint8_t *buf, int len)
-{
-    cpu_physical_memory_rw(addr, buf, len, 1);
+    if (!n->cmb || base == PCI_BAR_UNMAPPED || addr < base ||
+        addr - base > size || len > size - (addr - base)) {
+        return NULL;
+    }
+    return n->cmb + (addr - base);
 }
 
-static uint8_t do_rw_prp(NVMEState *n, uint64_t mem_addr, uint64_t *data_size_p,
-    uint64_t *file_offset_p, uint8_t *mapping_addr, uint8_t rw)
+void nvme_dma_mem_read(NVMEState *n, target_phys_addr_t addr, uint8_t *buf,
+    int len)
 {
-    uint64_t data_len;
+    uint8_t *cmb = nvme_cmb_ptr(n, addr, len);
 
-    if (*data_size_p == 0) {
-        return FAIL;
+    if (cmb) {
+        memcpy(buf, cmb, len);
+    } else {
+        cpu_physical_memory_rw(addr, buf, len, 0);
     }
+}
 
-    /* Data Len to be written per page basis */
-    data_len = n->host_page_size - (mem_addr % n->host_page_size);
-    if (data_len > *data_size_p) {
-        data_len = *data_size_p;
-    }
+void nvme_dma_mem_write(NVMEState *n, target_phys_addr_t addr, uint8_t *buf,
+    int len)
+{
+    uint8_t *cmb = nvme_cmb_ptr(n, addr, len);
 
-    LOG_DBG("File offset for read/write:%ld", *file_offset_p);
-    LOG_DBG("Length for read/write:%ld", data_len);
-    LOG_DBG("Address for read/write:%ld", mem_addr);
+    if (cmb) {
+        memcpy(cmb, buf, len);
+    } else {
+        cpu_physical_memory_rw(addr, buf, len, 1);
+    }
+}
 
-    switch (rw) {
-    case NVME_CMD_READ:
-        LOG_DBG("Read cmd called");
-        nvme_dma_mem_write(mem_addr, (mapping_addr + *file_offset_p), data_len);
-        break;
-    case NVME_CMD_WRITE:
-        LOG_DBG("Write cmd called");
-        nvme_dma_mem_read(mem_addr, (mapping_addr + *file_offset_p), data_len);
-        break;
-    default:
-        LOG_ERR("Error- wrong opcode: %d", rw);
-        return FAIL;
+/* Appends a guest range, merging it with the previous one when the
+ * pages are contiguous */
+static inline void nvme_sg_add(QEMUSGList *qsg, target_phys_addr_t addr,
+    target_phys_addr_t len)
+{
+    if (qsg->nsg && qsg->sg[qsg->nsg - 1].base +
+            qsg->sg[qsg->nsg - 1].len == addr) {
+        qsg->sg[qsg->nsg - 1].len += len;
+        qsg->size += len;
+    } else {
+        qemu_sglist_add(qsg, addr, len);
     }
-    *file_offset_p = *file_offset_p + data_len;
-    *data_size_p = *data_size_p - data_len;
-    return NVME_SC_SUCCESS;
 }
 
-static uint8_t do_rw_prp_list(NVMEState *n, NVMECmd *command,
-    uint64_t *data_size_p, uint64_t *file_offset_p, uint8_t *mapping_addr)
+/*********************************************************************
+    Function     :    nvme_prp_map
+    Description  :    Walks PRP1, PRP2 and the PRP lists of a command
+                      and collects the guest memory it points to
+    Return Type  :    uint8_t : NVMe status code
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVME_rw *   : NVME IO command
+                      uint64_t    : Bytes to transfer
+                      QEMUSGList * : Filled with the guest ranges
+*********************************************************************/
+static uint8_t nvme_prp_map(NVMEState *n, NVME_rw *e, uint64_t data_size,
+    QEMUSGList *qsg)
 {
-    uint64_t prp_list[512], prp_entries;
-    uint16_t i = 0;
-    uint8_t res = FAIL;
-    NVME_rw *cmd = (NVME_rw *)command;
+    uint64_t page = n->host_page_size;
+    uint64_t prp_list[512], list_addr, len, lists;
+    uint32_t i, nents, in_page;
 
-    LOG_DBG("Data Size remaining for read/write:%ld", *data_size_p);
+    qsg->nsg = 0;
+    qsg->size = 0;
 
-    /* Logic to find the number of PRP Entries */
-    prp_entries = (uint64_t) ((*data_size_p + n->host_page_size - 1) / n->host_page_size);
-    nvme_dma_mem_read(cmd->prp2, (uint8_t *)prp_list,
-        min(sizeof(prp_list), prp_entries * sizeof(uint64_t)));
+    len = min(page - (e->prp1 % page), data_size);
+    nvme_sg_add(qsg, e->prp1, len);
+    data_size -= len;
+    if (data_size == 0) {
+        return NVME_SC_SUCCESS;
+    }
+    if (data_size <= page) {
+        if (e->prp2 % page) {
+            LOG_ERR("%s(): misaligned prp2:%lx", __func__, e->prp2);
+            return NVME_SC_INVALID_PRP_OFFSET;
+        }
+        nvme_sg_add(qsg, e->prp2, data_size);
+        return NVME_SC_SUCCESS;
+    }
 
-    /* Read/Write on PRPList */
-    while (*data_size_p != 0) {
-        if (i == 511 && *data_size_p > n->host_page_size) {
-            /* Calculate the actual number of remaining entries */
-            prp_entries = (uint64_t) ((*data_size_p + n->host_page_size - 1) /
-                n->host_page_size);
-            nvme_dma_mem_read(prp_list[511], (uint8_t *)prp_list,
-                min(sizeof(prp_list), prp_entries * sizeof(uint64_t)));
-            i = 0;
+    /*
+     * The last entry of a list page chains to the next list page. Every
+     * list page has to hold at least one data entry, so a command never
+     * walks more list pages than it has data pages.
+     */
+    list_addr = e->prp2;
+    lists = (data_size + page - 1) / page;
+    while (data_size) {
+        if (list_addr % sizeof(uint64_t)) {
+            LOG_ERR("%s(): misaligned prp list:%lx", __func__, list_addr);
+            return NVME_SC_INVALID_PRP_OFFSET;
+        }
+        in_page = (page - (list_addr % page)) / sizeof(uint64_t);
+        nents = min((data_size + page - 1) / page, in_page);
+        if (nents == in_page && (uint64_t)nents * page < data_size) {
+            nents--;
+        }
+        if (nents == 0 || lists-- == 0) {
+            LOG_ERR("%s(): prp list:%lx holds no entry", __func__, list_addr);
+            return NVME_SC_INVALID_PRP_OFFSET;
         }
+        for (i = 0; i < nents; ) {
+            uint32_t j, batch = min(nents - i, ARRAY_SIZE(prp_list));
+
+            nvme_dma_mem_read(n, list_addr + i * sizeof(uint64_t),
+                (uint8_t *)prp_list, batch * sizeof(uint64_t));
+            for (j = 0; j < batch; j++) {
+                if (prp_list[j] % page) {
+                    LOG_ERR("%s(): misaligned prp entry:%lx", __func__,
+                        prp_list[j]);
+                    return NVME_SC_INVALID_PRP_OFFSET;
+                }
+                len = min(page, data_size);
+                nvme_sg_add(qsg, prp_list[j], len);
+                data_size -= len;
+            }
+            i += batch;
+        }
+        if (data_size) {
+            nvme_dma_mem_read(n, list_addr + nents * sizeof(uint64_t),
+                (uint8_t *)&list_addr, sizeof(list_addr));
+        }
+    }
+    return NVME_SC_SUCCESS;
+}
 
-        res = do_rw_prp(n, prp_list[i], data_size_p,
-            file_offset_p, mapping_addr, cmd->opcode);
-        LOG_DBG("Data Size remaining for read/write:%ld", *data_size_p);
-        if (res == FAIL) {
-            break;
+/*********************************************************************
+    Function     :    nvme_sg_copy
+    Description  :    Copies between the guest ranges of a command and
+                      the namespace image, one memcpy per contiguous
+                      range of guest RAM
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      QEMUSGList * : Guest ranges
+                      uint8_t *   : Namespace image at the start LBA
+                      int         : 1 to write guest memory (Read cmd)
+*********************************************************************/
+static void nvme_sg_copy(NVMEState *n, QEMUSGList *qsg, uint8_t *buf,
+    int to_guest)
+{
+    target_phys_addr_t addr, len, plen;
+    uint8_t *ptr;
+    int i;
+
+    for (i = 0; i < qsg->nsg; i++) {
+        addr = qsg->sg[i].base;
+        len = qsg->sg[i].len;
+
+        ptr = nvme_cmb_ptr(n, addr, len);
+        if (ptr) {
+            memcpy(to_guest ? ptr : buf, to_guest ? buf : ptr, len);
+            buf += len;
+            continue;
+        }
+        while (len) {
+            plen = len;
+            ptr = cpu_physical_memory_map(addr, &plen, to_guest);
+            if (ptr == NULL) {
+                /* Not RAM or the bounce buffer is busy, go the slow way */
+                cpu_physical_memory_rw(addr, buf, len, to_guest);
+                buf += len;
+                break;
+            }
+            memcpy(to_guest ? ptr : buf, to_guest ? buf : ptr, plen);
+            cpu_physical_memory_unmap(ptr, plen, to_guest, plen);
+            addr += plen;
+            buf += plen;
+            len -= plen;
         }
-        i++;
     }
-    return res;
 }
 
 /*********************************************************************
@@ -157,7 +269,9 @@ static void update_ns_util(DiskInfo *disk, uint64_t slba, uint64_t nlb)
 static void nvme_update_stats(NVMEState *n, DiskInfo *disk, uint8_t opcode,
     uint64_t slba, uint64_t nlb)
 {
+    NVMESubsystem *s = n->subsys;
     uint64_t tmp;
+    uint32_t i;
     if (opcode == NVME_CMD_WRITE) {
         uint64_t old_use = disk->idtfy_ns.nuse;
 
@@ -170,8 +284,14 @@ static void nvme_update_stats(NVMEState *n, DiskInfo *disk, uint8_t opcode,
             LOG_NORM("Device:%d nsid:%d, setting threshold warning",
                 n->instance, disk->nsid);
             disk->thresh_warn_issued = 1;
-            enqueue_async_event(n, event_type_smart,
-                event_info_smart_spare_thresh, NVME_LOG_SMART_INFORMATION);
+            /* The counters are shared, warn every controller using them */
+            for (i = 0; i < NVME_MAX_CTRLS; i++) {
+                if (s->ctrl[i] && NVME_NS_ATTACHED(s->ctrl[i], disk)) {
+                    enqueue_async_event(s->ctrl[i], event_type_smart,
+                        event_info_smart_spare_thresh,
+                        NVME_LOG_SMART_INFORMATION);
+                }
+            }
         }
 
         if (++disk->host_write_commands[0] == 0) {
@@ -199,120 +319,199 @@ static void nvme_update_stats(NVMEState *n, DiskInfo *disk, uint8_t opcode,
 }
 
 /*********************************************************************
-    Function     :    nvme_io_command
-    Description  :    NVME Read or write cmd processing.
-
+    Function     :    nvme_rw_xfer
+    Description  :    Moves the data of a read or write between the
+                      PRPs and the namespace image
     Return Type  :    uint8_t
 
     Arguments    :    NVMEState * : Pointer to NVME device State
-                      NVMECmd  *  : Pointer to SQ entries
-                      NVMECQE *   : Pointer to CQ entries
+                      DiskInfo *  : Namespace
+                      NVME_rw *   : NVME IO command
+                      NVMEStatusField * : Status field of the completion
+                      uint64_t    : Bytes to transfer
+                      uint64_t    : Offset in the namespace image
 *********************************************************************/
-uint8_t nvme_io_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
+static inline uint8_t nvme_rw_xfer(NVMEState *n, DiskInfo *disk, NVME_rw *e,
+    NVMEStatusField *sf, uint64_t data_size, uint64_t file_offset)
 {
-    NVME_rw *e = (NVME_rw *)sqe;
-    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
-    uint8_t res = FAIL;
-    uint64_t data_size, file_offset;
-    uint8_t *mapping_addr;
-    uint32_t nvme_blk_sz;
-    DiskInfo *disk;
-    uint8_t lba_idx;
-
-    sf->sc = NVME_SC_SUCCESS;
-    LOG_DBG("%s(): called", __func__);
-
-    disk = &n->disk[e->nsid - 1];
-    if ((e->slba + e->nlb) >= disk->idtfy_ns.nsze) {
-        LOG_NORM("%s(): LBA out of range", __func__);
-        sf->sc = NVME_SC_LBA_RANGE;
+    if (n->mdts && data_size > (4096ULL << n->mdts)) {
+        LOG_ERR("%s(): data size:%ld exceeds max:%lld", __func__,
+            data_size, 4096ULL << n->mdts);
+        sf->sc = NVME_SC_INVALID_FIELD;
         return FAIL;
-    } else if ((e->slba + e->nlb) >= disk->idtfy_ns.ncap) {
-        LOG_NORM("%s():Capacity Exceeded", __func__);
-        sf->sc = NVME_SC_CAP_EXCEEDED;
+    }
+    if (e->opcode != NVME_CMD_READ && e->opcode != NVME_CMD_WRITE) {
+        LOG_ERR("Error- wrong opcode: %d", e->opcode);
         return FAIL;
     }
 
-    lba_idx = disk->idtfy_ns.flbas & 0xf;
-    if ((e->mptr == 0) &&            /* if NOT supplying separate meta buffer */
-        (disk->idtfy_ns.lbafx[lba_idx].ms != 0) &&       /* if using metadata */
-        ((disk->idtfy_ns.flbas & 0x10) == 0)) {   /* if using separate buffer */
-
-        LOG_ERR("%s(): invalid meta-data for extended lba", __func__);
-        sf->sc = NVME_SC_INVALID_FIELD;
+    sf->sc = nvme_prp_map(n, e, data_size, &n->sg);
+    if (sf->sc != NVME_SC_SUCCESS) {
         return FAIL;
     }
+    nvme_sg_copy(n, &n->sg, disk->mapping_addr + file_offset,
+        e->opcode == NVME_CMD_READ);
+    return NVME_SC_SUCCESS;
+}
 
-    /* Read in the command */
-    nvme_blk_sz = NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
-    LOG_DBG("NVME Block size: %u", nvme_blk_sz);
-    data_size = (e->nlb + 1) * nvme_blk_sz;
+/*********************************************************************
+    Function     :    nvme_rw_generic
+    Description  :    Read or write for any LBA format, with metadata
+                      either extended or in a separate buffer
 
-    if (disk->idtfy_ns.flbas & 0x10) {
-        data_size += (disk->idtfy_ns.lbafx[lba_idx].ms * (e->nlb + 1));
-    }
+    Return Type  :    uint8_t
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : Namespace
+                      NVMECmd  *  : Pointer to SQ entries
+                      NVMECQE *   : Pointer to CQ entries
+*********************************************************************/
+static uint8_t nvme_rw_generic(NVMEState *n, DiskInfo *disk, NVMECmd *sqe,
+    NVMECQE *cqe)
+{
+    NVME_rw *e = (NVME_rw *)sqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEFormat *fmt = &disk->fmt;
+    uint64_t data_size;
 
-    if (n->idtfy_ctrl->mdts && data_size > n->host_page_size *
-                (1 << (n->idtfy_ctrl->mdts))) {
-        LOG_ERR("%s(): data size:%ld exceeds max:%ld", __func__,
-            data_size, ((uint64_t)n->host_page_size) * (1 << (n->idtfy_ctrl->mdts)));
+    if ((e->mptr == 0) &&            /* if NOT supplying separate meta buffer */
+        (fmt->ms != 0) &&                                /* if using metadata */
+        !fmt->extended) {                         /* if using separate buffer */
+
+        LOG_ERR("%s(): invalid meta-data for extended lba", __func__);
         sf->sc = NVME_SC_INVALID_FIELD;
         return FAIL;
     }
 
-    file_offset = e->slba * nvme_blk_sz;
-    mapping_addr = disk->mapping_addr;
-
-    /* Namespace not ready */
-    if (mapping_addr == NULL) {
-        LOG_NORM("%s():Namespace not ready", __func__);
-        sf->sc = NVME_SC_NS_NOT_READY;
-        return FAIL;
+    LOG_DBG("NVME Block size: %u", fmt->blk_sz);
+    data_size = (e->nlb + 1) * fmt->blk_sz;
+    if (fmt->extended) {
+        data_size += (fmt->ms * (e->nlb + 1));
     }
 
-    /* Writing/Reading PRP1 */
-    res = do_rw_prp(n, e->prp1, &data_size, &file_offset, mapping_addr,
-        e->opcode);
-    if (res == FAIL) {
+    if (nvme_rw_xfer(n, disk, e, sf, data_size, e->slba * fmt->blk_sz)
+            == FAIL) {
         return FAIL;
     }
-    if (data_size > 0) {
-        if (data_size <= n->host_page_size) {
-            res = do_rw_prp(n, e->prp2, &data_size, &file_offset, mapping_addr,
-                e->opcode);
-        } else {
-            res = do_rw_prp_list(n, sqe, &data_size, &file_offset,
-                mapping_addr);
-        }
-        if (res == FAIL) {
-            return FAIL;
-        }
-    }
 
     /* Spec states that non-zero meta data buffers shall be ignored, i.e. no
      * error reported, when the DW4&5 (MPTR) field is not in use */
     if ((e->mptr != 0) &&                /* if supplying separate meta buffer */
-        (disk->idtfy_ns.lbafx[lba_idx].ms != 0) &&       /* if using metadata */
-        ((disk->idtfy_ns.flbas & 0x10) == 0)) {   /* if using separate buffer */
+        (fmt->ms != 0) &&                                /* if using metadata */
+        !fmt->extended) {                         /* if using separate buffer */
 
         /* Then go ahead and use the separate meta data buffer */
-        unsigned int ms, meta_offset, meta_size;
+        unsigned int meta_offset, meta_size;
         uint8_t *meta_mapping_addr;
 
-        ms = disk->idtfy_ns.lbafx[lba_idx].ms;
-        meta_offset = e->slba * ms;
-        meta_size = (e->nlb + 1) * ms;
+        meta_offset = e->slba * fmt->ms;
+        meta_size = (e->nlb + 1) * fmt->ms;
         meta_mapping_addr = disk->meta_mapping_addr + meta_offset;
 
         if (e->opcode == NVME_CMD_READ) {
-            nvme_dma_mem_write(e->mptr, meta_mapping_addr, meta_size);
+            nvme_dma_mem_write(n, e->mptr, meta_mapping_addr, meta_size);
         } else if (e->opcode == NVME_CMD_WRITE) {
-            nvme_dma_mem_read(e->mptr, meta_mapping_addr, meta_size);
+            nvme_dma_mem_read(n, e->mptr, meta_mapping_addr, meta_size);
         }
     }
+    return NVME_SC_SUCCESS;
+}
+
+/* Read or write without metadata, the block size is a constant so that
+ * offsets are plain shifts */
+static inline uint8_t nvme_rw_shift(NVMEState *n, DiskInfo *disk,
+    NVMECmd *sqe, NVMECQE *cqe, const unsigned lbads)
+{
+    NVME_rw *e = (NVME_rw *)sqe;
+
+    return nvme_rw_xfer(n, disk, e, (NVMEStatusField *)&cqe->status,
+        (uint64_t)(e->nlb + 1) << lbads, e->slba << lbads);
+}
+
+static uint8_t nvme_rw_512(NVMEState *n, DiskInfo *disk, NVMECmd *sqe,
+    NVMECQE *cqe)
+{
+    return nvme_rw_shift(n, disk, sqe, cqe, 9);
+}
+
+static uint8_t nvme_rw_4k(NVMEState *n, DiskInfo *disk, NVMECmd *sqe,
+    NVMECQE *cqe)
+{
+    return nvme_rw_shift(n, disk, sqe, cqe, 12);
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_set_format
+    Description  :    Caches the formatted LBA size of a namespace and
+                      picks its read/write handler, to be called
+                      whenever FLBAS changes
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : Pointer to NVME disk
+*********************************************************************/
+void nvme_ns_set_format(DiskInfo *disk)
+{
+    NVMEFormat *fmt = &disk->fmt;
+    uint8_t lba_idx = disk->idtfy_ns.flbas & 0xf;
+
+    fmt->lbads = disk->idtfy_ns.lbafx[lba_idx].lbads;
+    fmt->ms = disk->idtfy_ns.lbafx[lba_idx].ms;
+    fmt->extended = (disk->idtfy_ns.flbas & 0x10) != 0;
+    fmt->blk_sz = NVME_BLOCK_SIZE(fmt->lbads);
+
+    if (fmt->ms == 0 && fmt->lbads == 9) {
+        fmt->rw = nvme_rw_512;
+    } else if (fmt->ms == 0 && fmt->lbads == 12) {
+        fmt->rw = nvme_rw_4k;
+    } else {
+        fmt->rw = nvme_rw_generic;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_io_command
+    Description  :    NVME Read or write cmd processing.
+
+    Return Type  :    uint8_t
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd  *  : Pointer to SQ entries
+                      NVMECQE *   : Pointer to CQ entries
+*********************************************************************/
+uint8_t nvme_io_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
+{
+    NVME_rw *e = (NVME_rw *)sqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    DiskInfo *disk;
+
+    sf->sc = NVME_SC_SUCCESS;
+    LOG_DBG("%s(): called", __func__);
+
+    disk = &n->disk[e->nsid - 1];
+    if ((e->slba + e->nlb) >= disk->idtfy_ns.nsze) {
+        LOG_NORM("%s(): LBA out of range", __func__);
+        sf->sc = NVME_SC_LBA_RANGE;
+        return FAIL;
+    } else if ((e->slba + e->nlb) >= disk->idtfy_ns.ncap) {
+        LOG_NORM("%s():Capacity Exceeded", __func__);
+        sf->sc = NVME_SC_CAP_EXCEEDED;
+        return FAIL;
+    }
+
+    /* Namespace not ready, busy goes first as a Format job may be
+     * setting up the mapping on its thread */
+    if (disk->busy || disk->mapping_addr == NULL) {
+        LOG_NORM("%s():Namespace not ready", __func__);
+        sf->sc = NVME_SC_NS_NOT_READY;
+        return FAIL;
+    }
+
+    if (disk->fmt.rw(n, disk, sqe, cqe) == FAIL) {
+        return FAIL;
+    }
 
     nvme_update_stats(n, disk, e->opcode, e->slba, e->nlb);
-    return res;
+    return NVME_SC_SUCCESS;
 }
 
 /*********************************************************************
@@ -339,11 +538,11 @@ static uint8_t read_dsm_ranges(NVMEState *n, uint64_t range_prp1, uint64_t range
         data_len = *data_size_p;
     }
 
-    nvme_dma_mem_read(range_prp1, buffer_addr, data_len);
+    nvme_dma_mem_read(n, range_prp1, buffer_addr, data_len);
     *data_size_p = *data_size_p - data_len;
     if (*data_size_p) {
         buffer_addr = buffer_addr + data_len;
-        nvme_dma_mem_read(range_prp2, buffer_addr, *data_size_p);
+        nvme_dma_mem_read(n, range_prp2, buffer_addr, *data_size_p);
     }
 
     return NVME_SC_SUCCESS;
@@ -439,7 +638,7 @@ uint8_t nvme_command_set(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
 
     /* As of NVMe spec rev 1.0b "All NVM cmds use the CMD.DW1 (NSID) field".
      * Thus all NVM cmd set cmds must check for illegal namespaces up front */
-    if (sqe->nsid == 0 || (sqe->nsid > n->idtfy_ctrl->nn)) {
+    if (nvme_get_active_ns(n, sqe->nsid) == NULL) {
         LOG_NORM("%s(): Invalid nsid:%u", __func__, sqe->nsid);
         sf->sc = NVME_SC_INVALID_NAMESPACE;
         return FAIL;
@@ -472,7 +671,7 @@ static int nvme_create_meta_disk(uint32_t instance, uint32_t nsid,
 {
     uint32_t ms;
 
-    ms = disk->idtfy_ns.lbafx[disk->idtfy_ns.flbas].ms;
+    ms = disk->idtfy_ns.lbafx[disk->idtfy_ns.flbas & 0xf].ms;
     if (ms != 0 && !(disk->idtfy_ns.flbas & 0x10)) {
         char str[64];
         uint64_t blks, msize;
@@ -505,6 +704,103 @@ static int nvme_create_meta_disk(uint32_t instance, uint32_t nsid,
     return SUCCESS;
 }
 
+/*********************************************************************
+    Function     :    nvme_mem_open
+    Description  :    Creates an anonymous file for a namespace in the
+                      memory backend directory
+    Return Type  :    int : File descriptor, -1 on failure
+
+    Arguments    :    NVMEMemBackend * : Memory backend
+                      size_t *   : Returns the page size of the backend
+*********************************************************************/
+static int nvme_mem_open(NVMEMemBackend *mem, size_t *page_size)
+{
+    struct statfs fs;
+    char *path;
+    int fd, ret;
+
+    do {
+        ret = statfs(mem->path, &fs);
+    } while (ret != 0 && errno == EINTR);
+    if (ret != 0) {
+        LOG_ERR("Cannot access the memory backend %s", mem->path);
+        return -1;
+    }
+    if (fs.f_type != HUGETLBFS_MAGIC) {
+        LOG_NORM("Memory backend %s is not on hugetlbfs", mem->path);
+    }
+    *page_size = fs.f_bsize;
+
+    if (asprintf(&path, "%s/qemu_nvme.XXXXXX", mem->path) < 0) {
+        return -1;
+    }
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        /* The memory goes away with the last reference to it */
+        unlink(path);
+    }
+    free(path);
+    return fd;
+}
+
+/*********************************************************************
+    Function     :    nvme_mem_map
+    Description  :    Sizes and maps the memory backing a namespace,
+                      binding it to the host NUMA node and faulting it
+                      in up front when requested
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    DiskInfo * : NVME disk, its mapping is replaced
+                      uint64_t   : Size of the data in bytes
+*********************************************************************/
+static int nvme_mem_map(DiskInfo *disk, uint64_t size)
+{
+    NVMEMemBackend *mem = disk->mem;
+    uint8_t *addr;
+    size_t off;
+
+    size = (size + disk->mem_page_size - 1) & ~(disk->mem_page_size - 1);
+    if (ftruncate(disk->fd, size) < 0) {
+        LOG_ERR("Error while sizing the memory of namespace %d", disk->nsid);
+        return FAIL;
+    }
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (addr == MAP_FAILED) {
+        LOG_ERR("Error while mapping the memory of namespace %d", disk->nsid);
+        return FAIL;
+    }
+
+    if (mem->host_node >= 0) {
+#ifdef __NR_mbind
+        unsigned long nodes[NVME_MAX_HOST_NODES / (sizeof(long) * 8)];
+
+        /* Has to happen before the pages are faulted in */
+        memset(nodes, 0, sizeof(nodes));
+        nodes[mem->host_node / (sizeof(long) * 8)] =
+            1UL << (mem->host_node % (sizeof(long) * 8));
+        if (syscall(__NR_mbind, addr, size, MPOL_BIND, nodes,
+                NVME_MAX_HOST_NODES, 0) < 0) {
+            LOG_ERR("Cannot bind namespace %d to host node %d", disk->nsid,
+                mem->host_node);
+        }
+#else
+        LOG_ERR("Host NUMA binding is not supported");
+#endif
+    }
+    if (mem->flags & (1 << NVME_MEM_PREALLOC)) {
+        for (off = 0; off < size; off += disk->mem_page_size) {
+            addr[off] = *(volatile uint8_t *)(addr + off);
+        }
+    }
+    if ((mem->flags & (1 << NVME_MEM_LOCK)) && mlock(addr, size) < 0) {
+        LOG_ERR("Cannot lock the memory of namespace %d", disk->nsid);
+    }
+
+    disk->mapping_addr = addr;
+    disk->mapping_size = size;
+    return SUCCESS;
+}
+
 /*********************************************************************
     Function     :    nvme_create_storage_disk
     Description  :    Creates a NVME Storage Disk and the
@@ -521,11 +817,25 @@ int nvme_create_storage_disk(uint32_t instance, uint32_t nsid, DiskInfo *disk,
     uint32_t blksize, lba_idx;
     uint64_t size, blks;
     char str[64];
+    const char *path = str;
+    int flags = O_RDWR | O_CREAT | O_TRUNC;
 
     snprintf(str, sizeof(str), "nvme_disk%d_n%d.img", instance, nsid);
     disk->nsid = nsid;
 
-    disk->fd = open(str, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (disk->backing) {
+        /* User supplied backing files keep their contents */
+        path = disk->backing;
+        flags &= ~O_TRUNC;
+    }
+
+    disk->mem = NULL;
+    if (disk->backing == NULL && n->subsys->mem.path) {
+        disk->mem = &n->subsys->mem;
+        disk->fd = nvme_mem_open(disk->mem, &disk->mem_page_size);
+    } else {
+        disk->fd = open(path, flags, S_IRUSR | S_IWUSR);
+    }
     if (disk->fd < 0) {
         LOG_ERR("Error while creating the storage");
         return FAIL;
@@ -544,18 +854,24 @@ int nvme_create_storage_disk(uint32_t instance, uint32_t nsid, DiskInfo *disk,
         return SUCCESS;
     }
 
-    if (posix_fallocate(disk->fd, 0, size) != 0) {
-        LOG_ERR("Error while allocating space for namespace");
-        return FAIL;
-    }
+    if (disk->mem) {
+        if (nvme_mem_map(disk, size) != SUCCESS) {
+            return FAIL;
+        }
+    } else {
+        if (posix_fallocate(disk->fd, 0, size) != 0) {
+            LOG_ERR("Error while allocating space for namespace");
+            return FAIL;
+        }
 
-    disk->mapping_addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
-        MAP_SHARED, disk->fd, 0);
-    if (disk->mapping_addr == NULL) {
-        LOG_ERR("Error while opening namespace: %d", disk->nsid);
-        return FAIL;
+        disk->mapping_addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, disk->fd, 0);
+        if (disk->mapping_addr == NULL) {
+            LOG_ERR("Error while opening namespace: %d", disk->nsid);
+            return FAIL;
+        }
+        disk->mapping_size = size;
     }
-    disk->mapping_size = size;
 
     if (nvme_create_meta_disk(instance, nsid, disk) != SUCCESS) {
         return FAIL;
@@ -587,7 +903,10 @@ int nvme_create_storage_disks(NVMEState *n)
     uint32_t i;
     int ret = SUCCESS;
 
-    for (i = 0; i < n->num_namespaces; i++) {
+    for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+        if (!n->disk[i].allocated) {
+            continue;
+        }
         ret = nvme_create_storage_disk(n->instance, i + 1, &n->disk[i], n);
     }
 
@@ -667,9 +986,515 @@ int nvme_close_storage_disks(NVMEState *n)
     uint32_t i;
     int ret = SUCCESS;
 
-    for (i = 0; i < n->num_namespaces; i++) {
+    for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+        if (!n->disk[i].allocated) {
+            continue;
+        }
         ret = nvme_close_storage_disk(&n->disk[i]);
     }
     return ret;
 }
 
+/*********************************************************************
+    Function     :    nvme_resize_file_mapping
+    Description  :    Grows or shrinks a mmaped backing file. The old
+                      mapping is only replaced once the new one is in
+                      place, so it is left untouched on failure.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    int        : file descriptor of the backing file
+                      uint8_t ** : current mapping, updated on success
+                      size_t *   : current mapping size, updated on success
+                      size_t     : new mapping size
+*********************************************************************/
+static int nvme_resize_file_mapping(int fd, uint8_t **addr, size_t *size,
+    size_t new_size)
+{
+    uint8_t *new_addr;
+
+    if (new_size > *size && posix_fallocate(fd, 0, new_size) != 0) {
+        return FAIL;
+    }
+    new_addr = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (new_addr == MAP_FAILED) {
+        if (new_size > *size && ftruncate(fd, *size) < 0) {
+            LOG_ERR("Error while restoring the size of a backing file");
+        }
+        return FAIL;
+    }
+
+    if (*addr != NULL) {
+        munmap(*addr, *size);
+    }
+    /* Shrink only now that nothing maps the dropped tail any more */
+    if (new_size < *size && ftruncate(fd, new_size) < 0) {
+        LOG_ERR("Error while shrinking a backing file");
+    }
+    *addr = new_addr;
+    *size = new_size;
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_resize_data_mapping
+    Description  :    Resizes the data of a NVME Storage Disk, keeping
+                      the old mapping on failure
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    DiskInfo * : Pointer to NVME disk
+                      size_t     : New size of the data in bytes
+*********************************************************************/
+static int nvme_resize_data_mapping(DiskInfo *disk, size_t size)
+{
+    uint8_t *old_addr = disk->mapping_addr;
+    size_t old_size = disk->mapping_size;
+
+    if (!disk->mem) {
+        return nvme_resize_file_mapping(disk->fd, &disk->mapping_addr,
+            &disk->mapping_size, size);
+    }
+
+    /* nvme_mem_map() only replaces the mapping when it succeeds */
+    if (nvme_mem_map(disk, size) != SUCCESS) {
+        if (ftruncate(disk->fd, old_size) < 0) {
+            LOG_ERR("Error while restoring the memory of namespace %d",
+                disk->nsid);
+        }
+        return FAIL;
+    }
+    if (old_addr != NULL) {
+        munmap(old_addr, old_size);
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_resize_storage_disk
+    Description  :    Changes the size of a NVME Storage Disk, its
+                      meta-data and utilization bitmap. The disk is
+                      left as it was on failure.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    DiskInfo * : Pointer to NVME disk
+                      uint64_t   : New namespace size in blocks
+*********************************************************************/
+int nvme_resize_storage_disk(DiskInfo *disk, uint64_t nsze)
+{
+    uint32_t lba_idx, blksize, ms;
+    uint64_t size, old_nsze, index;
+    size_t old_bytes, new_bytes, old_size;
+
+    lba_idx = disk->idtfy_ns.flbas & 0xf;
+    blksize = NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
+    ms = disk->idtfy_ns.lbafx[lba_idx].ms;
+    size = nsze * blksize;
+    if (disk->idtfy_ns.flbas & 0x10) {
+        /* extended lba */
+        size += nsze * ms;
+    }
+
+    old_size = disk->mapping_size;
+    if (nvme_resize_data_mapping(disk, size) != SUCCESS) {
+        LOG_ERR("Error while resizing namespace: %d", disk->nsid);
+        return FAIL;
+    }
+
+    if (disk->meta_mapping_addr != NULL) {
+        size_t old_msize = disk->meta_mapping_size;
+
+        if (nvme_resize_file_mapping(disk->mfd, &disk->meta_mapping_addr,
+                &disk->meta_mapping_size, nsze * ms) != SUCCESS) {
+            LOG_ERR("Error while resizing namespace meta-data: %d",
+                disk->nsid);
+            /* The data must still cover the unchanged namespace size */
+            if (nvme_resize_data_mapping(disk, old_size) != SUCCESS &&
+                    disk->mapping_size < old_size) {
+                LOG_ERR("Cannot restore namespace %d, detaching its data",
+                    disk->nsid);
+                munmap(disk->mapping_addr, disk->mapping_size);
+                disk->mapping_addr = NULL;
+                disk->mapping_size = 0;
+            }
+            return FAIL;
+        }
+        if (disk->meta_mapping_size > old_msize) {
+            memset(disk->meta_mapping_addr + old_msize, 0xff,
+                disk->meta_mapping_size - old_msize);
+        }
+    }
+
+    old_nsze = disk->idtfy_ns.nsze;
+    old_bytes = (old_nsze + 7) / 8;
+    new_bytes = (nsze + 7) / 8;
+    disk->ns_util = qemu_realloc(disk->ns_util, new_bytes);
+    if (new_bytes > old_bytes) {
+        memset(disk->ns_util + old_bytes, 0, new_bytes - old_bytes);
+    }
+    if (nsze < old_nsze) {
+        /* Drop blocks beyond the new end and recount utilization */
+        if (nsze % 8) {
+            disk->ns_util[new_bytes - 1] &= (1 << (nsze % 8)) - 1;
+        }
+        disk->idtfy_ns.nuse = 0;
+        for (index = 0; index < new_bytes; index++) {
+            disk->idtfy_ns.nuse += ctpop8(disk->ns_util[index]);
+        }
+    }
+
+    disk->idtfy_ns.nsze = nsze;
+    disk->idtfy_ns.ncap = nsze;
+
+    LOG_NORM("resized namespace %d to %lu blocks", disk->nsid, nsze);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_init_ns_identify
+    Description  :    Fills in the Identify Namespace structure of a
+                      newly allocated namespace
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : Pointer to NVME disk
+                      uint64_t   : Namespace size in blocks
+                      uint8_t    : Formatted LBA size
+*********************************************************************/
+void nvme_init_ns_identify(DiskInfo *disk, uint64_t nsze, uint8_t flbas)
+{
+    int ms_arr[4] = {0, 8, 64, 128};
+    int i;
+
+    memset(&disk->idtfy_ns, 0, sizeof(disk->idtfy_ns));
+    disk->idtfy_ns.nsze = nsze;
+    disk->idtfy_ns.ncap = nsze;
+    disk->idtfy_ns.nuse = 0;
+    disk->idtfy_ns.nlbaf = NO_LBA_FORMATS;
+    disk->idtfy_ns.flbas = flbas;
+
+    /* meta data capabilities */
+    disk->idtfy_ns.mc = 1 << 1 | 1 << 0;
+    disk->idtfy_ns.dpc = 1 << 4 | 1 << 3 | 1 << 0;
+    disk->idtfy_ns.dps = 0;
+
+    /* Filling in the LBA Format structure */
+    for (i = 0 ; i <= NO_LBA_FORMATS; i++) {
+        disk->idtfy_ns.lbafx[i].lbads = LBA_SIZE + (i / 4);
+        disk->idtfy_ns.lbafx[i].ms = ms_arr[i % 4];
+    }
+    nvme_ns_set_format(disk);
+}
+
+/*********************************************************************
+    Function     :    nvme_get_active_ns
+    Description  :    Looks up a namespace attached to the controller
+    Return Type  :    DiskInfo * (NULL if nsid is not active)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+*********************************************************************/
+DiskInfo *nvme_get_active_ns(NVMEState *n, uint32_t nsid)
+{
+    if (nsid == 0 || nsid > NVME_MAX_NUM_NAMESPACES) {
+        return NULL;
+    }
+    if (!n->disk[nsid - 1].allocated ||
+            !NVME_NS_ATTACHED(n, &n->disk[nsid - 1])) {
+        return NULL;
+    }
+    return &n->disk[nsid - 1];
+}
+
+static DiskInfo *nvme_get_allocated_ns(NVMEState *n, uint32_t nsid)
+{
+    if (nsid == 0 || nsid > NVME_MAX_NUM_NAMESPACES) {
+        return NULL;
+    }
+    if (!n->disk[nsid - 1].allocated) {
+        return NULL;
+    }
+    return &n->disk[nsid - 1];
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_notify
+    Description  :    Reports a namespace change to every controller
+                      of the subsystem the namespace is attached to
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : Namespace
+*********************************************************************/
+static void nvme_ns_notify(NVMEState *n, DiskInfo *disk)
+{
+    NVMESubsystem *s = n->subsys;
+    uint32_t i;
+
+    for (i = 0; i < NVME_MAX_CTRLS; i++) {
+        if (s->ctrl[i] && NVME_NS_ATTACHED(s->ctrl[i], disk)) {
+            nvme_ns_changed(s->ctrl[i], disk - n->disk + 1);
+        }
+    }
+}
+
+static uint64_t nvme_ns_bytes(DiskInfo *disk, uint64_t blks)
+{
+    return blks * NVME_BLOCK_SIZE(
+        disk->idtfy_ns.lbafx[disk->idtfy_ns.flbas & 0xf].lbads);
+}
+
+/*********************************************************************
+    Function     :    nvme_allocated_capacity
+    Description  :    Sums up the NVM capacity used by all namespaces
+    Return Type  :    uint64_t : Capacity in bytes
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+uint64_t nvme_allocated_capacity(NVMEState *n)
+{
+    uint64_t total = 0;
+    uint32_t i;
+
+    for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+        if (n->disk[i].allocated) {
+            total += nvme_ns_bytes(&n->disk[i], n->disk[i].idtfy_ns.ncap);
+        }
+    }
+    return total;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_create
+    Description  :    Allocates a new, detached namespace with its
+                      own size and backing file
+    Return Type  :    uint32_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint64_t    : Namespace size in blocks
+                      uint64_t    : Namespace capacity in blocks
+                      uint8_t     : Formatted LBA size
+                      const char *: Backing file, NULL for default
+                      uint32_t *  : Returns the allocated nsid
+                      NVMEStatusField * : Status on failure
+*********************************************************************/
+uint32_t nvme_ns_create(NVMEState *n, uint64_t nsze, uint64_t ncap,
+    uint8_t flbas, const char *backing, uint32_t *nsid, NVMEStatusField *sf)
+{
+    NVMESubsystem *s = n->subsys;
+    DiskInfo *disk = NULL;
+    uint32_t i, c;
+
+    for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+        if (!n->disk[i].allocated) {
+            disk = &n->disk[i];
+            break;
+        }
+    }
+    if (disk == NULL) {
+        LOG_NORM("%s(): no namespace id available", __func__);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_NS_ID_UNAVAILABLE;
+        return FAIL;
+    }
+    if ((flbas & 0xf) > NO_LBA_FORMATS) {
+        LOG_NORM("%s(): invalid lba format:%x", __func__, flbas);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_INVALID_FORMAT;
+        return FAIL;
+    }
+    if (nsze == 0 || ncap == 0 || ncap > nsze) {
+        LOG_NORM("%s(): invalid nsze:%lu ncap:%lu", __func__, nsze, ncap);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+
+    memset(disk, 0, sizeof(*disk));
+    nvme_init_ns_identify(disk, nsze, flbas);
+    disk->idtfy_ns.nmic = s->name != NULL;
+    disk->idtfy_ns.ncap = ncap;
+    if (nvme_allocated_capacity(n) + nvme_ns_bytes(disk, ncap) >
+            n->nvm_capacity * BYTES_PER_MB) {
+        LOG_NORM("%s(): insufficient capacity for %lu blocks", __func__, ncap);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_NS_INSUFFICIENT_CAPACITY;
+        return FAIL;
+    }
+    if (backing) {
+        disk->backing = qemu_strdup(backing);
+    }
+
+    if (nvme_create_storage_disk(n->instance, i + 1, disk, n) != SUCCESS) {
+        nvme_close_storage_disk(disk);
+        qemu_free(disk->backing);
+        disk->backing = NULL;
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+    for (c = 0; c < NVME_MAX_CTRLS; c++) {
+        if (s->ctrl[c]) {
+            nvme_qos_set_ns(s->ctrl[c], disk);
+        }
+    }
+    disk->allocated = 1;
+    *nsid = i + 1;
+
+    LOG_NORM("Device:%d created nsid:%d, nsze:%lu", n->instance, *nsid, nsze);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_delete
+    Description  :    Deletes one or, for nsid 0xffffffff, all
+                      namespaces, detaching them first
+    Return Type  :    uint32_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+                      NVMEStatusField * : Status on failure
+*********************************************************************/
+uint32_t nvme_ns_delete(NVMEState *n, uint32_t nsid, NVMEStatusField *sf)
+{
+    DiskInfo *disk;
+    uint32_t i;
+
+    if (nsid == 0xffffffff) {
+        for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+            if (n->disk[i].allocated && nvme_ns_delete(n, i + 1, sf)) {
+                return FAIL;
+            }
+        }
+        return SUCCESS;
+    }
+
+    disk = nvme_get_allocated_ns(n, nsid);
+    if (disk == NULL) {
+        LOG_NORM("%s(): bad nsid:%d", __func__, nsid);
+        sf->sc = NVME_SC_INVALID_NAMESPACE;
+        return FAIL;
+    }
+    if (disk->busy) {
+        sf->sc = NVME_SC_NS_NOT_READY;
+        return FAIL;
+    }
+    /* Deleting a shared namespace removes it from every controller */
+    for (i = 0; i < NVME_MAX_CTRLS; i++) {
+        NVMEState *c = n->subsys->ctrl[i];
+
+        if (c && NVME_NS_ATTACHED(c, disk)) {
+            disk->attached &= ~(1U << c->ctrl_idx);
+            nvme_qos_release_ns(c, disk);
+            nvme_ns_changed(c, nsid);
+        }
+    }
+    if (nvme_close_storage_disk(disk) != SUCCESS) {
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+    qemu_free(disk->backing);
+    disk->backing = NULL;
+    disk->allocated = 0;
+
+    LOG_NORM("Device:%d deleted nsid:%d", n->instance, nsid);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_resize
+    Description  :    Changes the size of an existing namespace
+    Return Type  :    uint32_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+                      uint64_t    : New namespace size in blocks
+                      NVMEStatusField * : Status on failure
+*********************************************************************/
+uint32_t nvme_ns_resize(NVMEState *n, uint32_t nsid, uint64_t nsze,
+    NVMEStatusField *sf)
+{
+    DiskInfo *disk = nvme_get_allocated_ns(n, nsid);
+
+    if (disk == NULL) {
+        LOG_NORM("%s(): bad nsid:%d", __func__, nsid);
+        sf->sc = NVME_SC_INVALID_NAMESPACE;
+        return FAIL;
+    }
+    if (nsze == 0) {
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    if (disk->busy) {
+        sf->sc = NVME_SC_NS_NOT_READY;
+        return FAIL;
+    }
+    if (nvme_allocated_capacity(n) - nvme_ns_bytes(disk, disk->idtfy_ns.ncap)
+            + nvme_ns_bytes(disk, nsze) > n->nvm_capacity * BYTES_PER_MB) {
+        LOG_NORM("%s(): insufficient capacity for %lu blocks", __func__, nsze);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_NS_INSUFFICIENT_CAPACITY;
+        return FAIL;
+    }
+    if (nvme_resize_storage_disk(disk, nsze) != SUCCESS) {
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+    nvme_ns_notify(n, disk);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_attach
+    Description  :    Makes an allocated namespace active on the
+                      controller
+    Return Type  :    uint32_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+                      NVMEStatusField * : Status on failure
+*********************************************************************/
+uint32_t nvme_ns_attach(NVMEState *n, uint32_t nsid, NVMEStatusField *sf)
+{
+    DiskInfo *disk = nvme_get_allocated_ns(n, nsid);
+
+    if (disk == NULL) {
+        LOG_NORM("%s(): bad nsid:%d", __func__, nsid);
+        sf->sc = NVME_SC_INVALID_NAMESPACE;
+        return FAIL;
+    }
+    if (NVME_NS_ATTACHED(n, disk)) {
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_NS_ALREADY_ATTACHED;
+        return FAIL;
+    }
+    disk->attached |= 1U << n->ctrl_idx;
+    nvme_ns_changed(n, nsid);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_detach
+    Description  :    Makes an attached namespace inactive on the
+                      controller
+    Return Type  :    uint32_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+                      NVMEStatusField * : Status on failure
+*********************************************************************/
+uint32_t nvme_ns_detach(NVMEState *n, uint32_t nsid, NVMEStatusField *sf)
+{
+    DiskInfo *disk = nvme_get_allocated_ns(n, nsid);
+
+    if (disk == NULL) {
+        LOG_NORM("%s(): bad nsid:%d", __func__, nsid);
+        sf->sc = NVME_SC_INVALID_NAMESPACE;
+        return FAIL;
+    }
+    if (!NVME_NS_ATTACHED(n, disk)) {
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_NS_NOT_ATTACHED;
+        return FAIL;
+    }
+    disk->attached &= ~(1U << n->ctrl_idx);
+    nvme_qos_release_ns(n, disk);
+    nvme_ns_changed(n, nsid);
+    return SUCCESS;
+}
+
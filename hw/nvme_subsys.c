@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * NVM subsystems.
+ *
+ * Controllers created with the same "subsys" name share one set of
+ * namespaces: the DiskInfo array, its backing images, the memory backend
+ * and the utilization and SMART counters. The memory backend properties
+ * of a controller that joins must match those of the subsystem. Each controller keeps its own queues, its own
+ * cntlid and its own QoS state, and sees a namespace once the bit of its
+ * ctrl_idx is set in DiskInfo.attached.
+ *
+ * A controller without a subsystem name gets a private subsystem, so the
+ * rest of the device never has to tell the two cases apart.
+ *
+ * Commands of all controllers run under the global QEMU mutex, which
+ * serializes writes to a shared namespace.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+static QLIST_HEAD(, NVMESubsystem) nvme_subsystems =
+    QLIST_HEAD_INITIALIZER(nvme_subsystems);
+
+static NVMESubsystem *nvme_subsys_find(const char *name)
+{
+    NVMESubsystem *s;
+
+    QLIST_FOREACH(s, &nvme_subsystems, entry) {
+        if (!strcmp(s->name, name)) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static int nvme_mem_equal(const NVMEMemBackend *a, const NVMEMemBackend *b)
+{
+    if ((a->path == NULL) != (b->path == NULL) ||
+        (a->path && strcmp(a->path, b->path))) {
+        return 0;
+    }
+    return a->flags == b->flags && a->host_node == b->host_node;
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_join
+    Description  :    Adds the controller to the subsystem named by
+                      its "subsys" property, creating it if needed
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_subsys_join(NVMEState *n)
+{
+    NVMESubsystem *s = NULL;
+    NVMEState *first = NULL;
+    uint32_t i, slot = NVME_MAX_CTRLS;
+
+    if (n->subsys_name) {
+        s = nvme_subsys_find(n->subsys_name);
+    }
+    if (s == NULL) {
+        s = qemu_mallocz(sizeof(*s));
+        s->disk = qemu_mallocz(sizeof(DiskInfo) * NVME_MAX_NUM_NAMESPACES);
+        s->mem = n->mem;
+        s->mem.path = n->mem.path ? qemu_strdup(n->mem.path) : NULL;
+        if (n->subsys_name) {
+            s->name = qemu_strdup(n->subsys_name);
+            QLIST_INSERT_HEAD(&nvme_subsystems, s, entry);
+        }
+    } else if (s->nctrls == NVME_MAX_CTRLS) {
+        LOG_ERR("subsystem %s already has %d controllers", s->name,
+            NVME_MAX_CTRLS);
+        return FAIL;
+    } else if (!nvme_mem_equal(&n->mem, &s->mem)) {
+        /* The namespaces, and so their memory, are shared */
+        LOG_ERR("mem_path, mem_prealloc, mem_lock and host_node must match "
+            "those of subsystem %s", s->name);
+        return FAIL;
+    }
+
+    for (i = 0; i < NVME_MAX_CTRLS; i++) {
+        if (s->ctrl[i] != NULL && first == NULL) {
+            first = s->ctrl[i];
+        }
+        if (s->ctrl[i] == NULL && slot == NVME_MAX_CTRLS) {
+            slot = i;
+        }
+    }
+    /* The capacity is a property of the shared namespaces */
+    if (first && n->nvm_capacity != first->nvm_capacity) {
+        LOG_NORM("%s(): using the capacity of subsystem %s: %u MB",
+            __func__, s->name, first->nvm_capacity);
+        n->nvm_capacity = first->nvm_capacity;
+    }
+    s->ctrl[slot] = n;
+    s->nctrls++;
+    n->ctrl_idx = slot;
+    n->subsys = s;
+    n->disk = s->disk;
+
+    LOG_NORM("%s(): device:%d joined subsystem %s as controller %d",
+        __func__, n->instance, s->name ? s->name : "(private)", slot);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_leave
+    Description  :    Removes the controller from its subsystem, the
+                      last one out closes and frees the namespaces
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_subsys_leave(NVMEState *n)
+{
+    NVMESubsystem *s = n->subsys;
+    uint32_t i;
+
+    if (s == NULL) {
+        return;
+    }
+    for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+        s->disk[i].attached &= ~(1U << n->ctrl_idx);
+    }
+    s->ctrl[n->ctrl_idx] = NULL;
+    n->subsys = NULL;
+    n->disk = NULL;
+    if (--s->nctrls) {
+        return;
+    }
+
+    for (i = 0; i < NVME_MAX_NUM_NAMESPACES; i++) {
+        if (s->disk[i].allocated) {
+            nvme_close_storage_disk(&s->disk[i]);
+        }
+        qemu_free(s->disk[i].backing);
+    }
+    if (s->name) {
+        QLIST_REMOVE(s, entry);
+        qemu_free(s->name);
+    }
+    qemu_free(s->mem.path);
+    qemu_free(s->disk);
+    qemu_free(s);
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_find_ctrl
+    Description  :    Looks up a controller of the subsystem by its
+                      controller id
+    Return Type  :    NVMEState * (NULL if there is no such controller)
+
+    Arguments    :    NVMESubsystem * : Subsystem
+                      uint16_t : Controller id
+*********************************************************************/
+NVMEState *nvme_subsys_find_ctrl(NVMESubsystem *s, uint16_t cntlid)
+{
+    uint32_t i;
+
+    for (i = 0; i < NVME_MAX_CTRLS; i++) {
+        if (s->ctrl[i] && s->ctrl[i]->idtfy_ctrl->cntlid == cntlid) {
+            return s->ctrl[i];
+        }
+    }
+    return NULL;
+}
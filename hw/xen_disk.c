@@ -551,6 +551,7 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
 
     if (use_aio) {
         blk_send_response_all(blkdev);
+        bdrv_io_plug(blkdev->bs);
     }
     while (rc != rp) {
         /* pull request from ring */
@@ -582,7 +583,9 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
             ioreq_runio_qemu_sync(ioreq);
         }
     }
-    if (!use_aio) {
+    if (use_aio) {
+        bdrv_io_unplug(blkdev->bs);
+    } else {
         blk_send_response_all(blkdev);
     }
 
@@ -18,12 +18,33 @@
 /*
  * Queue size (per-device).
  *
- * XXX: eventually we need to communicate this to the guest and/or make it
- *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ * The context is set up with as many events as the host allows, between
+ * MIN_EVENTS and MAX_EVENTS (io_setup fails with EAGAIN once the system
+ * wide fs.aio-max-nr is used up). Requests beyond that, or requests that
+ * io_submit rejects with EAGAIN, wait in a queue and are submitted as
+ * earlier ones complete.
  */
-#define MAX_EVENTS 128
+#define MIN_EVENTS 128
+#define MAX_EVENTS 1024
+
+/*
+ * Layout of the completion ring that the kernel maps at the address of the
+ * io_context_t. Reading completions from it directly saves the
+ * io_getevents() system call; the ring is only used if its header matches.
+ */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
 
 struct qemu_laiocb {
     BlockDriverAIOCB common;
@@ -32,16 +53,28 @@ struct qemu_laiocb {
     ssize_t ret;
     size_t nbytes;
     int async_context_id;
+    bool queued;
+    QEMUBH *bh;
     QLIST_ENTRY(qemu_laiocb) node;
+    QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
 struct qemu_laio_state {
     io_context_t ctx;
     int efd;
-    int count;
+    int count;          /* all requests that haven't completed yet */
+    int in_flight;      /* requests that were handed to the kernel */
+    int max_events;
+    int plugged;
+    bool use_ring;
+    struct io_event *events;
+    struct iocb **iocbs;
+    QSIMPLEQ_HEAD(, qemu_laiocb) pending;
     QLIST_HEAD(, qemu_laiocb) completed_reqs;
 };
 
+static void laio_submit_pending(struct qemu_laio_state *s);
+
 static inline ssize_t io_event_ret(struct io_event *ev)
 {
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
@@ -110,15 +143,57 @@ static void qemu_laio_enqueue_completed(struct qemu_laio_state *s,
     }
 }
 
+/*
+ * Copies up to max completions from the ring that the kernel shares with us
+ * and returns their number.
+ */
+static int laio_reap_ring(struct qemu_laio_state *s, struct io_event *events,
+    int max)
+{
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+    unsigned head, tail;
+    int n = 0;
+
+    head = ring->head;
+    tail = ring->tail;
+    /* read the events only after the tail that covers them */
+    __sync_synchronize();
+
+    while (head != tail && n < max) {
+        events[n++] = ring->io_events[head];
+        head = (head + 1) % ring->nr;
+    }
+
+    /* the kernel may reuse the slots once it sees the new head */
+    __sync_synchronize();
+    ring->head = head;
+
+    return n;
+}
+
+static int laio_get_events(struct qemu_laio_state *s, long min_nr)
+{
+    struct timespec ts = { 0 };
+    int nevents;
+
+    if (s->use_ring) {
+        return laio_reap_ring(s, s->events, s->max_events);
+    }
+
+    do {
+        nevents = io_getevents(s->ctx, min_nr, s->max_events, s->events, &ts);
+    } while (nevents == -EINTR);
+
+    return nevents;
+}
+
 static void qemu_laio_completion_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
     while (1) {
-        struct io_event events[MAX_EVENTS];
         uint64_t val;
         ssize_t ret;
-        struct timespec ts = { 0 };
         int nevents, i;
 
         do {
@@ -131,17 +206,86 @@ static void qemu_laio_completion_cb(void *opaque)
         if (ret != 8)
             break;
 
+        /* The eventfd counts completions, the ring may hold more than one
+         * read of it announced */
         do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+            nevents = laio_get_events(s, val);
+            if (nevents <= 0) {
+                break;
+            }
+            s->in_flight -= nevents;
+
+            for (i = 0; i < nevents; i++) {
+                struct iocb *iocb = s->events[i].obj;
+                struct qemu_laiocb *laiocb =
+                        container_of(iocb, struct qemu_laiocb, iocb);
+
+                laiocb->ret = io_event_ret(&s->events[i]);
+                qemu_laio_enqueue_completed(s, laiocb);
+            }
+        } while (s->use_ring);
+
+        /* Completions made room in the context for queued requests */
+        if (!s->plugged) {
+            laio_submit_pending(s);
+        }
+    }
+}
+
+/* Completes a request that failed in io_submit after laio_submit returned */
+static void qemu_laio_error_bh(void *opaque)
+{
+    struct qemu_laiocb *laiocb = opaque;
+
+    qemu_bh_delete(laiocb->bh);
+    laiocb->bh = NULL;
+    qemu_laio_enqueue_completed(laiocb->ctx, laiocb);
+}
+
+/*
+ * Hands the queued requests to the kernel, as many per io_submit call as
+ * the context has room for. Requests that the kernel can't take right now
+ * stay queued until earlier requests complete.
+ */
+static void laio_submit_pending(struct qemu_laio_state *s)
+{
+    struct qemu_laiocb *laiocb;
+    int n, ret;
+
+    while (!QSIMPLEQ_EMPTY(&s->pending) && s->in_flight < s->max_events) {
+        n = 0;
+        QSIMPLEQ_FOREACH(laiocb, &s->pending, next) {
+            if (n == s->max_events - s->in_flight) {
+                break;
+            }
+            s->iocbs[n++] = &laiocb->iocb;
+        }
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+        ret = io_submit(s->ctx, n, s->iocbs);
+        if (ret == -EAGAIN) {
+            /* Retried when the next request completes */
+            if (s->in_flight > 0) {
+                break;
+            }
+            ret = -EIO;
+        }
+
+        if (ret < 0) {
+            /* Fail the first request, the others are retried */
+            laiocb = QSIMPLEQ_FIRST(&s->pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+            laiocb->queued = false;
+            laiocb->ret = ret;
+            laiocb->bh = qemu_bh_new(qemu_laio_error_bh, laiocb);
+            qemu_bh_schedule(laiocb->bh);
+            continue;
+        }
 
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_enqueue_completed(s, laiocb);
+        s->in_flight += ret;
+        while (ret--) {
+            laiocb = QSIMPLEQ_FIRST(&s->pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+            laiocb->queued = false;
         }
     }
 }
@@ -150,6 +294,10 @@ static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /* Somebody waits for requests to complete, which the ones held back by
+     * plugging never would (e.g. synchronous I/O of a format driver) */
+    laio_submit_pending(s);
+
     return (s->count > 0) ? 1 : 0;
 }
 
@@ -162,6 +310,14 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    if (laiocb->queued) {
+        /* The kernel has never seen this one */
+        QSIMPLEQ_REMOVE(&laiocb->ctx->pending, laiocb, qemu_laiocb, next);
+        laiocb->ctx->count--;
+        qemu_aio_release(laiocb);
+        return;
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -223,31 +379,88 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_dec_count;
+    laiocb->queued = true;
+    QSIMPLEQ_INSERT_TAIL(&s->pending, laiocb, next);
+    if (s->plugged) {
+        return &laiocb->common;
+    }
+
+    /* Unbatched requests that io_submit rejects fail right away, like they
+     * always did */
+    if (s->in_flight < s->max_events && QSIMPLEQ_FIRST(&s->pending) == laiocb) {
+        int ret = io_submit(s->ctx, 1, &iocbs);
+        if (ret == 1) {
+            QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+            laiocb->queued = false;
+            s->in_flight++;
+        } else if (ret != -EAGAIN || s->in_flight == 0) {
+            QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+            s->count--;
+            goto out_free_aiocb;
+        }
+    }
     return &laiocb->common;
 
 out_free_aiocb:
     qemu_aio_release(laiocb);
-out_dec_count:
-    s->count--;
     return NULL;
 }
 
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0) {
+        laio_submit_pending(s);
+    }
+}
+
+/* Submits the requests held back by plugging, e.g. ahead of a flush */
+void laio_io_kick(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    laio_submit_pending(s);
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
+    struct aio_ring *ring;
+    int nr;
 
     s = qemu_mallocz(sizeof(*s));
     QLIST_INIT(&s->completed_reqs);
+    QSIMPLEQ_INIT(&s->pending);
     s->efd = eventfd(0, 0);
     if (s->efd == -1)
         goto out_free_state;
     fcntl(s->efd, F_SETFL, O_NONBLOCK);
 
-    if (io_setup(MAX_EVENTS, &s->ctx) != 0)
+    for (nr = MAX_EVENTS; nr >= MIN_EVENTS; nr /= 2) {
+        if (io_setup(nr, &s->ctx) == 0) {
+            break;
+        }
+    }
+    if (nr < MIN_EVENTS)
         goto out_close_efd;
 
+    s->max_events = nr;
+    s->events = qemu_malloc(nr * sizeof(*s->events));
+    s->iocbs = qemu_malloc(nr * sizeof(*s->iocbs));
+
+    ring = (struct aio_ring *)s->ctx;
+    s->use_ring = ring->magic == AIO_RING_MAGIC &&
+                  ring->incompat_features == 0;
+
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
         qemu_laio_flush_cb, qemu_laio_process_requests, s);
 
@@ -40,6 +40,7 @@
 #include "readline.h"
 #include "console.h"
 #include "blockdev.h"
+#include "blockjob.h"
 #include "audio/audio.h"
 #include "disas.h"
 #include "balloon.h"
@@ -468,6 +469,15 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_SPICE_DISCONNECTED:
             event_name = "SPICE_DISCONNECTED";
             break;
+        case QEVENT_BLOCK_JOB_COMPLETED:
+            event_name = "BLOCK_JOB_COMPLETED";
+            break;
+        case QEVENT_BLOCK_JOB_CANCELLED:
+            event_name = "BLOCK_JOB_CANCELLED";
+            break;
+        case QEVENT_BLOCK_JOB_READY:
+            event_name = "BLOCK_JOB_READY";
+            break;
         default:
             abort();
             break;
@@ -2857,6 +2867,14 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of ongoing block device operations",
+        .user_print = block_job_info_print,
+        .mhandler.info_new = block_job_info,
+    },
     {
         .name       = "registers",
         .args_type  = "",
@@ -3156,6 +3174,14 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of ongoing block device operations",
+        .user_print = block_job_info_print,
+        .mhandler.info_new = block_job_info,
+    },
     {
         .name       = "cpus",
         .args_type  = "",
@@ -31,6 +31,28 @@
 #include "block/raw-posix-aio.h"
 
 
+/*
+ * Requests are spread over PAIO_SHARDS submission queues by file
+ * descriptor, each with its own lock and its own worker threads, so that
+ * busy drives don't contend for a single lock. The shards share one budget
+ * of max_threads workers. A shard that finds the budget spent while it has
+ * no worker at all is marked starving, and a worker of another shard that
+ * can be spared moves over to it.
+ *
+ * Workers hand finished requests back through a lock-free list and wake up
+ * the I/O thread with an eventfd (a pipe where eventfd is unavailable).
+ * Without the I/O thread, a signal additionally kicks the vCPU loop, which
+ * wouldn't look at the file descriptor otherwise.
+ *
+ * A worker that picks up a read or write also takes the requests queued
+ * for the same file that continue it, up to PAIO_MAX_MERGE of them, and
+ * issues a single preadv/pwritev for all of them.
+ */
+#define PAIO_SHARDS     4
+#define PAIO_MAX_MERGE  32
+
+typedef struct PaioShard PaioShard;
+
 struct qemu_paiocb {
     BlockDriverAIOCB common;
     int aio_fildes;
@@ -41,32 +63,46 @@ struct qemu_paiocb {
     int aio_niov;
     size_t aio_nbytes;
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
-    int ev_signo;
     off_t aio_offset;
 
     QTAILQ_ENTRY(qemu_paiocb) node;
     int aio_type;
     ssize_t ret;
     int active;
-    struct qemu_paiocb *next;
+    bool cancelled;
+    PaioShard *shard;
+
+    /* completion list of the workers, then of the I/O thread */
+    struct qemu_paiocb *next_done;
+    QTAILQ_ENTRY(qemu_paiocb) done_node;
 
     int async_context_id;
 };
 
 typedef struct PosixAioState {
     int rfd, wfd;
-    struct qemu_paiocb *first_aio;
+    int count;
+    struct qemu_paiocb *done;   /* pushed to by the workers */
+    QTAILQ_HEAD(, qemu_paiocb) completed;
 } PosixAioState;
 
+struct PaioShard {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int cur_threads;
+    int idle_threads;
+    bool starving;      /* waits for a worker, protected by threads_lock */
+    QTAILQ_HEAD(, qemu_paiocb) request_list;
+};
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static PaioShard shards[PAIO_SHARDS];
 static pthread_t thread_id;
 static pthread_attr_t attr;
 static int max_threads = 64;
-static int cur_threads = 0;
-static int idle_threads = 0;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static int nb_threads;      /* workers of all shards */
+static int nb_starving;     /* shards marked starving */
+static PosixAioState *posix_aio_state;
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -111,6 +147,24 @@ static void cond_signal(pthread_cond_t *cond)
     if (ret) die2(ret, "pthread_cond_signal");
 }
 
+static void cond_broadcast(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_broadcast(cond);
+    if (ret) die2(ret, "pthread_cond_broadcast");
+}
+
+static void mutex_init(pthread_mutex_t *mutex)
+{
+    int ret = pthread_mutex_init(mutex, NULL);
+    if (ret) die2(ret, "pthread_mutex_init");
+}
+
+static void cond_init(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_init(cond, NULL);
+    if (ret) die2(ret, "pthread_cond_init");
+}
+
 static void thread_create(pthread_t *thread, pthread_attr_t *attr,
                           void *(*start_routine)(void*), void *arg)
 {
@@ -301,171 +355,358 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
     return nbytes;
 }
 
-static void *aio_thread(void *unused)
+/*
+ * Takes the requests from the queue that continue the read or write in
+ * batch[0] and returns the size of the batch. Called with the shard lock
+ * held.
+ */
+static int paio_collect_merge(PaioShard *shard, struct qemu_paiocb **batch)
+{
+    struct qemu_paiocb *first = batch[0], *aiocb;
+    off_t end = first->aio_offset + first->aio_nbytes;
+    int niov = first->aio_niov;
+    int n = 1;
+    bool found;
+
+    if (!preadv_present || (first->aio_type & QEMU_AIO_MISALIGNED) ||
+        !(first->aio_type & (QEMU_AIO_READ | QEMU_AIO_WRITE))) {
+        return 1;
+    }
+
+    do {
+        found = false;
+        QTAILQ_FOREACH(aiocb, &shard->request_list, node) {
+            if (aiocb->aio_fildes == first->aio_fildes &&
+                aiocb->aio_type == first->aio_type &&
+                aiocb->aio_offset == end &&
+                niov + aiocb->aio_niov <= IOV_MAX) {
+                QTAILQ_REMOVE(&shard->request_list, aiocb, node);
+                aiocb->active = 1;
+                batch[n++] = aiocb;
+                end += aiocb->aio_nbytes;
+                niov += aiocb->aio_niov;
+                found = true;
+                break;
+            }
+        }
+    } while (found && n < PAIO_MAX_MERGE);
+
+    return n;
+}
+
+/*
+ * Runs a merged batch with one preadv/pwritev. Returns false if that
+ * didn't transfer everything, the requests are then run one by one.
+ */
+static bool handle_aiocb_merged(struct qemu_paiocb **batch, int n)
 {
-    pid_t pid;
+    struct qemu_paiocb merged = *batch[0];
+    struct iovec *iov;
+    ssize_t ret;
+    int i, niov = 0;
 
-    pid = getpid();
+    for (i = 0; i < n; i++) {
+        niov += batch[i]->aio_niov;
+    }
+    iov = qemu_malloc(niov * sizeof(*iov));
+
+    niov = 0;
+    merged.aio_nbytes = 0;
+    for (i = 0; i < n; i++) {
+        memcpy(iov + niov, batch[i]->aio_iov,
+               batch[i]->aio_niov * sizeof(*iov));
+        niov += batch[i]->aio_niov;
+        merged.aio_nbytes += batch[i]->aio_nbytes;
+    }
+    merged.aio_iov = iov;
+    merged.aio_niov = niov;
+
+    ret = handle_aiocb_rw_vector(&merged);
+    qemu_free(iov);
+
+    if (ret != merged.aio_nbytes) {
+        return false;
+    }
+    for (i = 0; i < n; i++) {
+        batch[i]->ret = batch[i]->aio_nbytes;
+    }
+    return true;
+}
+
+static ssize_t handle_aiocb(struct qemu_paiocb *aiocb)
+{
+    switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
+    case QEMU_AIO_READ:
+    case QEMU_AIO_WRITE:
+        return handle_aiocb_rw(aiocb);
+    case QEMU_AIO_FLUSH:
+        return handle_aiocb_flush(aiocb);
+    case QEMU_AIO_IOCTL:
+        return handle_aiocb_ioctl(aiocb);
+    default:
+        fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
+        return -EINVAL;
+    }
+}
+
+/* Hands a finished request back to the I/O thread */
+static void paio_complete(struct qemu_paiocb *aiocb)
+{
+    PosixAioState *s = posix_aio_state;
+    struct qemu_paiocb *old;
+    uint64_t val = 1;
+    ssize_t ret;
+
+    /* The compare-and-swap is a full barrier, so aiocb->ret is visible
+     * before the request is */
+    do {
+        old = s->done;
+        aiocb->next_done = old;
+    } while (!__sync_bool_compare_and_swap(&s->done, old, aiocb));
+
+    /* The I/O thread takes the whole list at once, only the first request
+     * on an empty list needs to wake it up */
+    if (old != NULL) {
+        return;
+    }
+
+    do {
+        ret = write(s->wfd, &val, sizeof(val));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && errno != EAGAIN)
+        die("write()");
+
+#ifndef CONFIG_IOTHREAD
+    if (kill(getpid(), SIGUSR2)) die("kill failed");
+#endif
+}
+
+/*
+ * Returns a starving shard for a worker of shard to move to, or NULL if
+ * there is none or the worker is the last one left for queued requests.
+ * Called with shard->lock held.
+ */
+static PaioShard *paio_find_starving(PaioShard *shard)
+{
+    PaioShard *target = NULL;
+    int i;
+
+    if (!nb_starving ||
+        (shard->cur_threads == 1 && !QTAILQ_EMPTY(&shard->request_list))) {
+        return NULL;
+    }
+
+    mutex_lock(&threads_lock);
+    for (i = 0; i < PAIO_SHARDS; i++) {
+        if (shards[i].starving) {
+            shards[i].starving = false;
+            nb_starving--;
+            if (&shards[i] != shard) {
+                target = &shards[i];
+                break;
+            }
+        }
+    }
+    mutex_unlock(&threads_lock);
+
+    return target;
+}
+
+static void *aio_thread(void *opaque)
+{
+    PaioShard *shard = opaque;
+    PaioShard *target;
 
     while (1) {
-        struct qemu_paiocb *aiocb;
+        struct qemu_paiocb *batch[PAIO_MAX_MERGE];
         ssize_t ret = 0;
         qemu_timeval tv;
         struct timespec ts;
+        int i, n;
 
         qemu_gettimeofday(&tv);
         ts.tv_sec = tv.tv_sec + 10;
         ts.tv_nsec = 0;
 
-        mutex_lock(&lock);
+        mutex_lock(&shard->lock);
 
-        while (QTAILQ_EMPTY(&request_list) &&
-               !(ret == ETIMEDOUT)) {
-            idle_threads++;
-            ret = cond_timedwait(&cond, &lock, &ts);
-            idle_threads--;
+        while ((target = paio_find_starving(shard)) != NULL) {
+            shard->cur_threads--;
+            mutex_unlock(&shard->lock);
+            shard = target;
+            mutex_lock(&shard->lock);
+            shard->cur_threads++;
         }
 
-        if (QTAILQ_EMPTY(&request_list))
-            break;
-
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
-        aiocb->active = 1;
-        mutex_unlock(&lock);
+        while (QTAILQ_EMPTY(&shard->request_list) &&
+               !(ret == ETIMEDOUT) && !nb_starving) {
+            shard->idle_threads++;
+            ret = cond_timedwait(&shard->cond, &shard->lock, &ts);
+            shard->idle_threads--;
+        }
 
-        switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
-        case QEMU_AIO_READ:
-        case QEMU_AIO_WRITE:
-            ret = handle_aiocb_rw(aiocb);
-            break;
-        case QEMU_AIO_FLUSH:
-            ret = handle_aiocb_flush(aiocb);
-            break;
-        case QEMU_AIO_IOCTL:
-            ret = handle_aiocb_ioctl(aiocb);
-            break;
-        default:
-            fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
-            ret = -EINVAL;
+        if (QTAILQ_EMPTY(&shard->request_list)) {
+            /* Hand the thread to a starving shard rather than exiting */
+            mutex_lock(&threads_lock);
+            if (nb_starving) {
+                mutex_unlock(&threads_lock);
+                mutex_unlock(&shard->lock);
+                continue;
+            }
+            nb_threads--;
+            mutex_unlock(&threads_lock);
             break;
         }
 
-        mutex_lock(&lock);
-        aiocb->ret = ret;
-        mutex_unlock(&lock);
+        batch[0] = QTAILQ_FIRST(&shard->request_list);
+        QTAILQ_REMOVE(&shard->request_list, batch[0], node);
+        batch[0]->active = 1;
+        n = paio_collect_merge(shard, batch);
+        mutex_unlock(&shard->lock);
+
+        if (n == 1 || !handle_aiocb_merged(batch, n)) {
+            for (i = 0; i < n; i++) {
+                batch[i]->ret = handle_aiocb(batch[i]);
+            }
+        }
 
-        if (kill(pid, aiocb->ev_signo)) die("kill failed");
+        for (i = 0; i < n; i++) {
+            paio_complete(batch[i]);
+        }
     }
 
-    cur_threads--;
-    mutex_unlock(&lock);
+    shard->cur_threads--;
+    mutex_unlock(&shard->lock);
 
     return NULL;
 }
 
-static void spawn_thread(void)
+static void spawn_thread(PaioShard *shard)
 {
     sigset_t set, oldset;
 
-    cur_threads++;
+    shard->cur_threads++;
 
     /* block all signals */
     if (sigfillset(&set)) die("sigfillset");
     if (sigprocmask(SIG_SETMASK, &set, &oldset)) die("sigprocmask");
 
-    thread_create(&thread_id, &attr, aio_thread, NULL);
+    thread_create(&thread_id, &attr, aio_thread, shard);
 
     if (sigprocmask(SIG_SETMASK, &oldset, NULL)) die("sigprocmask restore");
 }
 
-static void qemu_paio_submit(struct qemu_paiocb *aiocb)
+/*
+ * Starts a worker for shard if the budget allows, or marks the shard
+ * starving if it has none. Returns true if the workers of the other shards
+ * must be woken up to hand one over. Called with shard->lock held.
+ */
+static bool paio_add_thread(PaioShard *shard)
 {
-    aiocb->ret = -EINPROGRESS;
-    aiocb->active = 0;
-    mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads)
-        spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
-    mutex_unlock(&lock);
-    cond_signal(&cond);
+    bool wake = false;
+
+    mutex_lock(&threads_lock);
+    if (nb_threads < max_threads) {
+        nb_threads++;
+        spawn_thread(shard);
+    } else if (shard->cur_threads == 0 && !shard->starving) {
+        shard->starving = true;
+        nb_starving++;
+        wake = true;
+    }
+    mutex_unlock(&threads_lock);
+
+    return wake;
 }
 
-static ssize_t qemu_paio_return(struct qemu_paiocb *aiocb)
+static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
-    ssize_t ret;
-
-    mutex_lock(&lock);
-    ret = aiocb->ret;
-    mutex_unlock(&lock);
+    PaioShard *shard = &shards[aiocb->aio_fildes % PAIO_SHARDS];
+    bool wake = false;
+    int i;
 
-    return ret;
+    aiocb->ret = -EINPROGRESS;
+    aiocb->active = 0;
+    aiocb->cancelled = false;
+    aiocb->shard = shard;
+    posix_aio_state->count++;
+
+    mutex_lock(&shard->lock);
+    if (shard->idle_threads == 0)
+        wake = paio_add_thread(shard);
+    QTAILQ_INSERT_TAIL(&shard->request_list, aiocb, node);
+    mutex_unlock(&shard->lock);
+    cond_signal(&shard->cond);
+
+    /* Idle workers check for starving shards under their shard's lock */
+    for (i = 0; wake && i < PAIO_SHARDS; i++) {
+        if (&shards[i] != shard) {
+            mutex_lock(&shards[i].lock);
+            cond_broadcast(&shards[i].cond);
+            mutex_unlock(&shards[i].lock);
+        }
+    }
 }
 
-static int qemu_paio_error(struct qemu_paiocb *aiocb)
+/* Moves the requests the workers finished to s->completed, in order */
+static void paio_take_done(PosixAioState *s)
 {
-    ssize_t ret = qemu_paio_return(aiocb);
-
-    if (ret < 0)
-        ret = -ret;
-    else
-        ret = 0;
-
-    return ret;
+    struct qemu_paiocb *acb, *next, *list = NULL;
+
+    acb = __sync_lock_test_and_set(&s->done, NULL);
+    while (acb) {
+        next = acb->next_done;
+        acb->next_done = list;
+        list = acb;
+        acb = next;
+    }
+    for (acb = list; acb; acb = acb->next_done) {
+        QTAILQ_INSERT_TAIL(&s->completed, acb, done_node);
+    }
 }
 
 static int posix_aio_process_queue(void *opaque)
 {
     PosixAioState *s = opaque;
-    struct qemu_paiocb *acb, **pacb;
+    struct qemu_paiocb *acb;
     int ret;
     int result = 0;
     int async_context_id = get_async_context_id();
 
-    for(;;) {
-        pacb = &s->first_aio;
-        for(;;) {
-            acb = *pacb;
-            if (!acb)
-                return result;
+    paio_take_done(s);
 
+    for(;;) {
+        /* A callback may complete other requests, so start over after each
+         * one */
+        QTAILQ_FOREACH(acb, &s->completed, done_node) {
             /* we're only interested in requests in the right context */
-            if (acb->async_context_id != async_context_id) {
-                pacb = &acb->next;
-                continue;
-            }
-
-            ret = qemu_paio_error(acb);
-            if (ret == ECANCELED) {
-                /* remove the request */
-                *pacb = acb->next;
-                qemu_aio_release(acb);
-                result = 1;
-            } else if (ret != EINPROGRESS) {
-                /* end of aio */
-                if (ret == 0) {
-                    ret = qemu_paio_return(acb);
-                    if (ret == acb->aio_nbytes)
-                        ret = 0;
-                    else
-                        ret = -EINVAL;
-                } else {
-                    ret = -ret;
-                }
-
-                trace_paio_complete(acb, acb->common.opaque, ret);
-
-                /* remove the request */
-                *pacb = acb->next;
-                /* call the callback */
-                acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
-                result = 1;
+            if (acb->async_context_id == async_context_id) {
                 break;
-            } else {
-                pacb = &acb->next;
             }
         }
+        if (!acb)
+            return result;
+
+        QTAILQ_REMOVE(&s->completed, acb, done_node);
+        s->count--;
+        result = 1;
+
+        if (acb->cancelled) {
+            qemu_aio_release(acb);
+            continue;
+        }
+
+        ret = acb->ret;
+        if (ret == acb->aio_nbytes)
+            ret = 0;
+        else if (ret >= 0)
+            ret = -EINVAL;
+
+        trace_paio_complete(acb, acb->common.opaque, ret);
+
+        /* call the callback */
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
     }
 
     return result;
@@ -476,7 +717,7 @@ static void posix_aio_read(void *opaque)
     PosixAioState *s = opaque;
     ssize_t len;
 
-    /* read all bytes from signal pipe */
+    /* read all bytes from the eventfd or pipe */
     for (;;) {
         char bytes[16];
 
@@ -494,68 +735,42 @@ static void posix_aio_read(void *opaque)
 static int posix_aio_flush(void *opaque)
 {
     PosixAioState *s = opaque;
-    return !!s->first_aio;
+    return s->count > 0;
 }
 
-static PosixAioState *posix_aio_state;
-
+#ifndef CONFIG_IOTHREAD
 static void aio_signal_handler(int signum)
 {
-    if (posix_aio_state) {
-        char byte = 0;
-        ssize_t ret;
-
-        ret = write(posix_aio_state->wfd, &byte, sizeof(byte));
-        if (ret < 0 && errno != EAGAIN)
-            die("write()");
-    }
-
     qemu_service_io();
 }
-
-static void paio_remove(struct qemu_paiocb *acb)
-{
-    struct qemu_paiocb **pacb;
-
-    /* remove the callback from the queue */
-    pacb = &posix_aio_state->first_aio;
-    for(;;) {
-        if (*pacb == NULL) {
-            fprintf(stderr, "paio_remove: aio request not found!\n");
-            break;
-        } else if (*pacb == acb) {
-            *pacb = acb->next;
-            qemu_aio_release(acb);
-            break;
-        }
-        pacb = &(*pacb)->next;
-    }
-}
+#endif
 
 static void paio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_paiocb *acb = (struct qemu_paiocb *)blockacb;
-    int active = 0;
+    PaioShard *shard = acb->shard;
+    int active;
 
     trace_paio_cancel(acb, acb->common.opaque);
 
-    mutex_lock(&lock);
-    if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
-        acb->ret = -ECANCELED;
-    } else if (acb->ret == -EINPROGRESS) {
-        active = 1;
+    mutex_lock(&shard->lock);
+    active = acb->active;
+    if (!active) {
+        QTAILQ_REMOVE(&shard->request_list, acb, node);
     }
-    mutex_unlock(&lock);
+    mutex_unlock(&shard->lock);
 
-    if (active) {
-        /* fail safe: if the aio could not be canceled, we wait for
-           it */
-        while (qemu_paio_error(acb) == EINPROGRESS)
-            ;
+    if (!active) {
+        posix_aio_state->count--;
+        qemu_aio_release(acb);
+        return;
     }
 
-    paio_remove(acb);
+    /* fail safe: if the aio could not be canceled, we wait for it. It
+       is released once it shows up in the completion list. */
+    while (__sync_fetch_and_add(&acb->ret, 0) == -EINPROGRESS)
+        ;
+    acb->cancelled = true;
 }
 
 static AIOPool raw_aio_pool = {
@@ -574,19 +789,18 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         return NULL;
     acb->aio_type = type;
     acb->aio_fildes = fd;
-    acb->ev_signo = SIGUSR2;
     acb->async_context_id = get_async_context_id();
 
     if (qiov) {
         acb->aio_iov = qiov->iov;
         acb->aio_niov = qiov->niov;
+    } else {
+        acb->aio_iov = NULL;
+        acb->aio_niov = 0;
     }
     acb->aio_nbytes = nb_sectors * 512;
     acb->aio_offset = sector_num * 512;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
-
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
     qemu_paio_submit(acb);
     return &acb->common;
@@ -603,39 +817,48 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
         return NULL;
     acb->aio_type = QEMU_AIO_IOCTL;
     acb->aio_fildes = fd;
-    acb->ev_signo = SIGUSR2;
     acb->async_context_id = get_async_context_id();
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
-
     qemu_paio_submit(acb);
     return &acb->common;
 }
 
+/*
+ * Sets the maximum number of worker threads of all submission queues
+ * together. Threads that exist already are not stopped.
+ */
+void paio_set_max_threads(int n)
+{
+    max_threads = MAX(n, 1);
+}
+
 int paio_init(void)
 {
+#ifndef CONFIG_IOTHREAD
     struct sigaction act;
+#endif
     PosixAioState *s;
     int fds[2];
-    int ret;
+    int ret, i;
 
     if (posix_aio_state)
         return 0;
 
-    s = qemu_malloc(sizeof(PosixAioState));
+    s = qemu_mallocz(sizeof(PosixAioState));
+    QTAILQ_INIT(&s->completed);
 
+#ifndef CONFIG_IOTHREAD
     sigfillset(&act.sa_mask);
     act.sa_flags = 0; /* do not restart syscalls to interrupt select() */
     act.sa_handler = aio_signal_handler;
     sigaction(SIGUSR2, &act, NULL);
+#endif
 
-    s->first_aio = NULL;
-    if (qemu_pipe(fds) == -1) {
-        fprintf(stderr, "failed to create pipe\n");
+    if (qemu_eventfd(fds) == -1) {
+        fprintf(stderr, "failed to create eventfd\n");
         return -1;
     }
 
@@ -656,7 +879,11 @@ int paio_init(void)
     if (ret)
         die2(ret, "pthread_attr_setdetachstate");
 
-    QTAILQ_INIT(&request_list);
+    for (i = 0; i < PAIO_SHARDS; i++) {
+        mutex_init(&shards[i].lock);
+        cond_init(&shards[i].cond);
+        QTAILQ_INIT(&shards[i].request_list);
+    }
 
     posix_aio_state = s;
     return 0;
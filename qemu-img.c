@@ -588,6 +588,40 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/* Clusters that convert -c keeps in flight, so that they are compressed in
+   parallel */
+#define COMPRESS_SLOTS 16
+
+typedef struct CompressSlot {
+    uint8_t *buf;
+    int64_t sector_num;
+    int busy;
+    int ret;
+} CompressSlot;
+
+static void compress_write_cb(void *opaque, int ret)
+{
+    CompressSlot *slot = opaque;
+
+    slot->ret = ret;
+    slot->busy = 0;
+}
+
+/* Waits until a slot is free and returns it */
+static CompressSlot *compress_get_slot(CompressSlot *slots)
+{
+    int i;
+
+    for (;;) {
+        for (i = 0; i < COMPRESS_SLOTS; i++) {
+            if (!slots[i].busy) {
+                return &slots[i];
+            }
+        }
+        qemu_aio_wait();
+    }
+}
+
 static int img_convert(int argc, char **argv)
 {
     int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
@@ -599,6 +633,7 @@ static int img_convert(int argc, char **argv)
     uint64_t bs_sectors;
     uint8_t * buf = NULL;
     const uint8_t *buf1;
+    CompressSlot *slots = NULL;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -806,6 +841,11 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = cluster_size >> 9;
         sector_num = 0;
 
+        slots = qemu_mallocz(COMPRESS_SLOTS * sizeof(*slots));
+        for (n = 0; n < COMPRESS_SLOTS; n++) {
+            slots[n].buf = qemu_blockalign(out_bs, cluster_size);
+        }
+
         nb_sectors = total_sectors;
         local_progress = (float)100 /
             (nb_sectors / MIN(nb_sectors, cluster_sectors));
@@ -814,6 +854,7 @@ static int img_convert(int argc, char **argv)
             int64_t bs_num;
             int remainder;
             uint8_t *buf2;
+            CompressSlot *slot;
 
             nb_sectors = total_sectors - sector_num;
             if (nb_sectors <= 0)
@@ -823,10 +864,15 @@ static int img_convert(int argc, char **argv)
             else
                 n = nb_sectors;
 
+            slot = compress_get_slot(slots);
+            if (slot->ret < 0) {
+                break;
+            }
+
             bs_num = sector_num - bs_offset;
             assert (bs_num >= 0);
             remainder = n;
-            buf2 = buf;
+            buf2 = slot->buf;
             while (remainder > 0) {
                 int nlow;
                 while (bs_num == bs_sectors) {
@@ -857,20 +903,34 @@ static int img_convert(int argc, char **argv)
             assert (remainder == 0);
 
             if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
+                memset(slot->buf + n * 512, 0, cluster_size - n * 512);
             }
-            if (is_not_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64,
-                          sector_num);
-                    goto out;
+            if (is_not_zero(slot->buf, cluster_size)) {
+                slot->sector_num = sector_num;
+                slot->busy = 1;
+                if (!bdrv_aio_write_compressed(out_bs, sector_num, slot->buf,
+                                               cluster_sectors,
+                                               compress_write_cb, slot)) {
+                    slot->busy = 0;
+                    slot->ret = bdrv_write_compressed(out_bs, sector_num,
+                                                      slot->buf,
+                                                      cluster_sectors);
                 }
             }
             sector_num += n;
             qemu_progress_print(local_progress, 100);
         }
+
+        qemu_aio_flush();
+        for (n = 0; n < COMPRESS_SLOTS; n++) {
+            if (slots[n].ret < 0) {
+                error_report("error while compressing sector %" PRId64,
+                             slots[n].sector_num);
+                ret = slots[n].ret;
+                goto out;
+            }
+        }
+
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
@@ -962,6 +1022,13 @@ out:
     free_option_parameters(create_options);
     free_option_parameters(param);
     qemu_free(buf);
+    if (slots) {
+        qemu_aio_flush();
+        for (n = 0; n < COMPRESS_SLOTS; n++) {
+            qemu_vfree(slots[n].buf);
+        }
+        qemu_free(slots);
+    }
     if (out_bs) {
         bdrv_delete(out_bs);
     }
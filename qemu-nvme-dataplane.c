@@ -0,0 +1,748 @@
+/*
+ * Minimal NVMe dataplane
+ *
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Reference implementation of the protocol in hw/nvme_dataplane.h. It
+ * serves the I/O queues of one nvme device started with
+ * 'dataplane=SOCKET' from a single thread: Read, Write and Flush, any
+ * other opcode fails with Invalid Opcode.
+ *
+ * The dataplane doesn't keep the queue positions across a restart, the
+ * queues replayed on reconnection start over at entry 0. Only restart it
+ * while the guest doesn't use the device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hw/nvme_dataplane.h"
+
+#define MAX_NS 1024
+
+#define SC_SUCCESS          0x00
+#define SC_INVALID_OPCODE   0x01
+#define SC_DATA_XFER_ERROR  0x04
+#define SC_INVALID_NS       0x0b
+#define SC_LBA_RANGE        0x80
+#define SC_PRP_OFFSET       0x13
+
+#define CMD_FLUSH 0x00
+#define CMD_WRITE 0x01
+#define CMD_READ  0x02
+
+typedef struct Sqe {
+    uint8_t opcode;
+    uint8_t fuse;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t res1;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} Sqe;
+
+typedef struct Cqe {
+    uint32_t cmd_specific;
+    uint32_t rsvd;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t command_id;
+    uint16_t status; /* phase:1, sc:8, sct:3, rsvd:2, m:1, dnr:1 */
+} Cqe;
+
+typedef struct Region {
+    uint64_t gpa;
+    uint64_t size;
+    uint8_t *ptr;
+} Region;
+
+typedef struct Ns {
+    int attached;
+    uint64_t nsze;
+    uint32_t lbads;
+    uint32_t ms;
+    int fd;
+    int mfd;
+    uint8_t *data;
+    uint8_t *meta;
+} Ns;
+
+typedef struct Queue {
+    int live;
+    int fd; /* kick eventfd of a SQ, irq eventfd of a CQ */
+    uint16_t cqid;
+    uint16_t phys_contig;
+    uint32_t size;
+    uint64_t dma_addr;
+    uint32_t pos; /* SQ head, CQ tail */
+    int phase;
+} Queue;
+
+static int verbose;
+static int sock = -1;
+static NVMEDpDoorbells *db;
+static NVMEDpHello hello;
+static Region regions[NVME_DP_MAX_REGIONS];
+static int nregions;
+static Ns ns[MAX_NS + 1];
+static Queue sq[NVME_DP_MAX_QID + 1];
+static Queue cq[NVME_DP_MAX_QID + 1];
+
+static void close_fds(int *fds, int nfds)
+{
+    while (nfds--) {
+        close(fds[nfds]);
+    }
+}
+
+/* Guest memory access, -1 if the range isn't guest RAM */
+static int dma(uint64_t gpa, void *buf, uint64_t len, int to_guest)
+{
+    uint8_t *p = buf;
+    uint64_t n;
+    int i;
+
+    while (len) {
+        for (i = 0; i < nregions; i++) {
+            if (gpa >= regions[i].gpa &&
+                gpa - regions[i].gpa < regions[i].size) {
+                break;
+            }
+        }
+        if (i == nregions) {
+            return -1;
+        }
+        n = regions[i].size - (gpa - regions[i].gpa);
+        if (n > len) {
+            n = len;
+        }
+        if (to_guest) {
+            memcpy(regions[i].ptr + (gpa - regions[i].gpa), p, n);
+        } else {
+            memcpy(p, regions[i].ptr + (gpa - regions[i].gpa), n);
+        }
+        gpa += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Address of a queue entry, the same walk as find_discontig_queue_entry */
+static int queue_entry(Queue *q, uint32_t esz, uint64_t *addr)
+{
+    uint32_t per_pg = hello.page_size / esz;
+    uint32_t prps_per_pg = hello.page_size / 8;
+    uint32_t pg = q->pos / per_pg;
+    uint64_t list = q->dma_addr, page;
+
+    if (q->phys_contig) {
+        *addr = q->dma_addr + (uint64_t)q->pos * esz;
+        return 0;
+    }
+    while (pg >= prps_per_pg - 1) {
+        if (dma(list + (prps_per_pg - 1) * 8, &list, 8, 0)) {
+            return -1;
+        }
+        pg -= prps_per_pg - 1;
+    }
+    if (dma(list + pg * 8, &page, 8, 0)) {
+        return -1;
+    }
+    *addr = page + (q->pos % per_pg) * esz;
+    return 0;
+}
+
+/*
+ * Moves len bytes between buf and the PRPs of a command. Returns a status
+ * code. List pages are chained through their last entry, at most as many
+ * as the transfer could need.
+ */
+static int prp_xfer(Sqe *sqe, uint8_t *buf, uint64_t len, int to_guest)
+{
+    uint64_t ps = hello.host_page_size;
+    uint64_t n, list, ent;
+    uint64_t chains = len / ps + 1;
+
+    n = ps - (sqe->prp1 & (ps - 1));
+    if (n > len) {
+        n = len;
+    }
+    if (dma(sqe->prp1, buf, n, to_guest)) {
+        return SC_DATA_XFER_ERROR;
+    }
+    buf += n;
+    len -= n;
+    if (len == 0) {
+        return SC_SUCCESS;
+    }
+    if (len <= ps) {
+        if (sqe->prp2 & (ps - 1)) {
+            return SC_PRP_OFFSET;
+        }
+        return dma(sqe->prp2, buf, len, to_guest) ? SC_DATA_XFER_ERROR :
+            SC_SUCCESS;
+    }
+
+    list = sqe->prp2;
+    if (list & 7) {
+        return SC_PRP_OFFSET;
+    }
+    while (len) {
+        if (dma(list, &ent, 8, 0)) {
+            return SC_DATA_XFER_ERROR;
+        }
+        if (((list + 8) & (ps - 1)) == 0 && len > ps) {
+            /* Last entry of a list page, points to the next one */
+            if ((ent & 7) || chains-- == 0) {
+                return SC_PRP_OFFSET;
+            }
+            list = ent;
+            continue;
+        }
+        if (ent & (ps - 1)) {
+            return SC_PRP_OFFSET;
+        }
+        n = len < ps ? len : ps;
+        if (dma(ent, buf, n, to_guest)) {
+            return SC_DATA_XFER_ERROR;
+        }
+        buf += n;
+        len -= n;
+        list += 8;
+    }
+    return SC_SUCCESS;
+}
+
+static int do_rw(Sqe *sqe, Ns *d)
+{
+    uint64_t slba = sqe->cdw10 | ((uint64_t)sqe->cdw11 << 32);
+    uint64_t nlb = (sqe->cdw12 & 0xffff) + 1;
+    int to_guest = sqe->opcode == CMD_READ;
+    int sc;
+
+    if (slba + nlb > d->nsze || slba + nlb < slba) {
+        return SC_LBA_RANGE;
+    }
+    sc = prp_xfer(sqe, d->data + (slba << d->lbads), nlb << d->lbads,
+        to_guest);
+    if (sc == SC_SUCCESS && d->meta && sqe->mptr) {
+        if (dma(sqe->mptr, d->meta + slba * d->ms, nlb * d->ms, to_guest)) {
+            sc = SC_DATA_XFER_ERROR;
+        }
+    }
+    return sc;
+}
+
+static int do_cmd(Sqe *sqe)
+{
+    Ns *d;
+
+    if (sqe->opcode != CMD_FLUSH && sqe->opcode != CMD_WRITE &&
+        sqe->opcode != CMD_READ) {
+        return SC_INVALID_OPCODE;
+    }
+    if (sqe->nsid == 0 || sqe->nsid > MAX_NS || !ns[sqe->nsid].attached) {
+        return SC_INVALID_NS;
+    }
+    d = &ns[sqe->nsid];
+    if (sqe->opcode == CMD_FLUSH) {
+        if (fdatasync(d->fd) || (d->mfd >= 0 && fdatasync(d->mfd))) {
+            return SC_DATA_XFER_ERROR;
+        }
+        return SC_SUCCESS;
+    }
+    return do_rw(sqe, d);
+}
+
+static int cq_full(Queue *q, uint16_t qid)
+{
+    return (q->pos + 1) % q->size == db->cq_head[qid];
+}
+
+/* Runs the commands of one SQ, stops early if its CQ is full */
+static void process_sq(uint16_t qid)
+{
+    Queue *q = &sq[qid];
+    Queue *c = &cq[q->cqid];
+    uint64_t addr;
+    Sqe sqe;
+    Cqe cqe;
+    int sc, posted = 0;
+    uint64_t one = 1;
+
+    while (q->live && c->live && q->pos != db->sq_tail[qid] % q->size &&
+           !cq_full(c, q->cqid)) {
+        if (queue_entry(q, sizeof(sqe), &addr) ||
+            dma(addr, &sqe, sizeof(sqe), 0)) {
+            fprintf(stderr, "SQ %u: entry %u is not in guest memory\n",
+                qid, q->pos);
+            q->live = 0;
+            break;
+        }
+        q->pos = (q->pos + 1) % q->size;
+        sc = do_cmd(&sqe);
+        if (verbose) {
+            fprintf(stderr, "SQ %u: cid %u opcode %x nsid %u: status %x\n",
+                qid, sqe.cid, sqe.opcode, sqe.nsid, sc);
+        }
+
+        memset(&cqe, 0, sizeof(cqe));
+        cqe.sq_head = q->pos;
+        cqe.sq_id = qid;
+        cqe.command_id = sqe.cid;
+        cqe.status = c->phase | (sc << 1);
+        if (queue_entry(c, sizeof(cqe), &addr) ||
+            dma(addr, &cqe, sizeof(cqe), 1)) {
+            fprintf(stderr, "CQ %u: entry %u is not in guest memory\n",
+                q->cqid, c->pos);
+            c->live = 0;
+            break;
+        }
+        c->pos = (c->pos + 1) % c->size;
+        if (c->pos == 0) {
+            c->phase = !c->phase;
+        }
+        posted = 1;
+    }
+    if (posted && write(c->fd, &one, sizeof(one)) < 0) {
+        perror("irq eventfd");
+    }
+}
+
+static void queue_drop(Queue *q)
+{
+    if (q->live) {
+        close(q->fd);
+    }
+    memset(q, 0, sizeof(*q));
+}
+
+static void ns_drop(Ns *d)
+{
+    if (d->data) {
+        munmap(d->data, d->nsze << d->lbads);
+    }
+    if (d->meta) {
+        munmap(d->meta, d->nsze * d->ms);
+    }
+    if (d->fd >= 0) {
+        close(d->fd);
+    }
+    if (d->mfd >= 0) {
+        close(d->mfd);
+    }
+    memset(d, 0, sizeof(*d));
+    d->fd = d->mfd = -1;
+}
+
+static void mem_drop(void)
+{
+    while (nregions) {
+        nregions--;
+        munmap(regions[nregions].ptr, regions[nregions].size);
+    }
+}
+
+static void reset(void)
+{
+    int i;
+
+    for (i = 0; i <= NVME_DP_MAX_QID; i++) {
+        queue_drop(&sq[i]);
+        queue_drop(&cq[i]);
+    }
+}
+
+static int send_ack(uint32_t type)
+{
+    struct {
+        NVMEDpMsgHdr hdr;
+        NVMEDpAck ack;
+    } m;
+
+    m.hdr.type = NVME_DP_MSG_ACK;
+    m.hdr.size = sizeof(m.ack);
+    m.ack.type = type;
+    if (send(sock, &m, sizeof(m), MSG_NOSIGNAL) != sizeof(m)) {
+        perror("ack");
+        return -1;
+    }
+    return 0;
+}
+
+static int set_mem_table(NVMEDpMemTable *t, int *fds, int nfds)
+{
+    NVMEDpMemRegion *r;
+    uint32_t i;
+
+    mem_drop();
+    for (i = 0; i < t->nregions && i < NVME_DP_MAX_REGIONS; i++) {
+        r = &t->regions[i];
+        if (r->fd_index >= (uint32_t)nfds) {
+            fprintf(stderr, "memory region %u without file\n", i);
+            return -1;
+        }
+        regions[nregions].ptr = mmap(NULL, r->size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fds[r->fd_index], r->fd_offset);
+        if (regions[nregions].ptr == MAP_FAILED) {
+            perror("mmap guest memory");
+            return -1;
+        }
+        regions[nregions].gpa = r->gpa;
+        regions[nregions].size = r->size;
+        nregions++;
+    }
+    return 0;
+}
+
+static int set_ns(NVMEDpNs *m, int *fds, int nfds)
+{
+    Ns *d;
+
+    if (m->nsid == 0 || m->nsid > MAX_NS) {
+        fprintf(stderr, "namespace %u out of range\n", m->nsid);
+        close_fds(fds, nfds);
+        return -1;
+    }
+    d = &ns[m->nsid];
+    ns_drop(d);
+    if (nfds == 0) {
+        return 0;
+    }
+    d->nsze = m->nsze;
+    d->lbads = m->lbads;
+    d->fd = fds[0];
+    d->mfd = nfds > 1 ? fds[1] : -1;
+    d->data = mmap(NULL, d->nsze << d->lbads, PROT_READ | PROT_WRITE,
+        MAP_SHARED, d->fd, 0);
+    if (d->data == MAP_FAILED) {
+        d->data = NULL;
+        goto fail;
+    }
+    if (nfds > 1) {
+        d->ms = m->ms;
+        d->meta = mmap(NULL, d->nsze * d->ms, PROT_READ | PROT_WRITE,
+            MAP_SHARED, d->mfd, 0);
+        if (d->meta == MAP_FAILED) {
+            d->meta = NULL;
+            goto fail;
+        }
+    }
+    d->attached = m->attached;
+    return 0;
+
+fail:
+    perror("mmap namespace");
+    ns_drop(d);
+    return -1;
+}
+
+static Queue *create_queue(Queue *queues, uint32_t qid, uint32_t size,
+    uint16_t phys_contig, uint64_t dma_addr, int fd)
+{
+    Queue *q;
+
+    if (qid == 0 || qid > NVME_DP_MAX_QID || size < 2) {
+        fprintf(stderr, "invalid queue %u of %u entries\n", qid, size);
+        close(fd);
+        return NULL;
+    }
+    q = &queues[qid];
+    queue_drop(q);
+    q->live = 1;
+    q->fd = fd;
+    q->size = size;
+    q->phys_contig = phys_contig;
+    q->dma_addr = dma_addr;
+    q->phase = 1;
+    return q;
+}
+
+/* Receives and handles one message, -1 once the connection is gone */
+static int handle_msg(void)
+{
+    union {
+        NVMEDpHello hello;
+        NVMEDpMemTable table;
+        NVMEDpNs ns;
+        NVMEDpCQ cq;
+        NVMEDpSQ sq;
+        NVMEDpQid qid;
+    } u;
+    NVMEDpMsgHdr hdr;
+    Queue *q;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * NVME_DP_MAX_FDS)];
+    int fds[NVME_DP_MAX_FDS], nfds = 0;
+    ssize_t ret;
+    size_t got;
+
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    do {
+        ret = recvmsg(sock, &msg, MSG_WAITALL);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != sizeof(hdr)) {
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+    }
+
+    if (hdr.size > sizeof(u)) {
+        fprintf(stderr, "message %u too long\n", hdr.type);
+        close_fds(fds, nfds);
+        return -1;
+    }
+    for (got = 0; got < hdr.size; got += ret) {
+        ret = read(sock, (uint8_t *)&u + got, hdr.size - got);
+        if (ret <= 0 && !(ret < 0 && errno == EINTR)) {
+            close_fds(fds, nfds);
+            return -1;
+        }
+        ret = ret < 0 ? 0 : ret;
+    }
+    if (verbose) {
+        fprintf(stderr, "message %u, %u bytes, %d fds\n", hdr.type, hdr.size,
+            nfds);
+    }
+
+    switch (hdr.type) {
+    case NVME_DP_MSG_HELLO:
+        if (nfds != 1 || u.hello.version != NVME_DP_VERSION) {
+            fprintf(stderr, "unsupported HELLO\n");
+            close_fds(fds, nfds);
+            return -1;
+        }
+        hello = u.hello;
+        if (db) {
+            munmap(db, sizeof(*db));
+        }
+        db = mmap(NULL, sizeof(*db), PROT_READ | PROT_WRITE, MAP_SHARED,
+            fds[0], 0);
+        close(fds[0]);
+        if (db == MAP_FAILED) {
+            perror("mmap doorbells");
+            db = NULL;
+            return -1;
+        }
+        return 0;
+    case NVME_DP_MSG_MEM_TABLE:
+        ret = set_mem_table(&u.table, fds, nfds);
+        close_fds(fds, nfds);
+        return ret;
+    case NVME_DP_MSG_NS:
+        set_ns(&u.ns, fds, nfds);
+        return 0;
+    case NVME_DP_MSG_CREATE_CQ:
+        if (nfds != 1) {
+            close_fds(fds, nfds);
+            return -1;
+        }
+        create_queue(cq, u.cq.qid, u.cq.size, u.cq.phys_contig,
+            u.cq.dma_addr, fds[0]);
+        return 0;
+    case NVME_DP_MSG_CREATE_SQ:
+        if (nfds != 1) {
+            close_fds(fds, nfds);
+            return -1;
+        }
+        q = create_queue(sq, u.sq.qid, u.sq.size, u.sq.phys_contig,
+            u.sq.dma_addr, fds[0]);
+        if (q) {
+            q->cqid = u.sq.cqid <= NVME_DP_MAX_QID ? u.sq.cqid : 0;
+        }
+        return 0;
+    case NVME_DP_MSG_DELETE_SQ:
+    case NVME_DP_MSG_DELETE_CQ:
+        if (u.qid.qid <= NVME_DP_MAX_QID) {
+            queue_drop(hdr.type == NVME_DP_MSG_DELETE_SQ ? &sq[u.qid.qid] :
+                &cq[u.qid.qid]);
+        }
+        return send_ack(hdr.type);
+    case NVME_DP_MSG_RESET:
+        reset();
+        return send_ack(hdr.type);
+    default:
+        fprintf(stderr, "unknown message %u\n", hdr.type);
+        close_fds(fds, nfds);
+        return -1;
+    }
+}
+
+static void serve(void)
+{
+    struct pollfd pfd[NVME_DP_MAX_QID + 1];
+    uint16_t qids[NVME_DP_MAX_QID + 1];
+    uint64_t cnt;
+    int i, n, stalled;
+
+    for (;;) {
+        /* A SQ waiting for CQ space is retried, CQ head writes don't kick */
+        stalled = 0;
+        pfd[0].fd = sock;
+        pfd[0].events = POLLIN;
+        n = 1;
+        for (i = 1; i <= NVME_DP_MAX_QID; i++) {
+            if (!sq[i].live) {
+                continue;
+            }
+            pfd[n].fd = sq[i].fd;
+            pfd[n].events = POLLIN;
+            qids[n++] = i;
+            if (db && cq[sq[i].cqid].live &&
+                sq[i].pos != db->sq_tail[i] % sq[i].size) {
+                stalled = 1;
+            }
+        }
+        if (poll(pfd, n, stalled ? 1 : -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return;
+        }
+        if (pfd[0].revents) {
+            if (handle_msg()) {
+                return;
+            }
+            continue;
+        }
+        for (i = 1; i < n; i++) {
+            if (pfd[i].revents && read(pfd[i].fd, &cnt, sizeof(cnt)) < 0) {
+                perror("kick eventfd");
+            }
+        }
+        for (i = 1; i < n && db; i++) {
+            process_sq(qids[i]);
+        }
+    }
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-v] SOCKET\n"
+        "\n"
+        "Serves the I/O queues of the nvme device started with\n"
+        "'-device nvme,dataplane=SOCKET'. Guest memory has to come from\n"
+        "-mem-path with -mem-prealloc.\n"
+        "\n"
+        "  -v, --verbose  log every message and command\n"
+        "  -h, --help     display this help and exit\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    struct option lopt[] = {
+        { "verbose", 0, NULL, 'v' },
+        { "help", 0, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct sockaddr_un un;
+    int lsock, c, i;
+
+    while ((c = getopt_long(argc, argv, "vh", lopt, NULL)) != -1) {
+        switch (c) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    lsock = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (lsock < 0) {
+        perror("socket");
+        return 1;
+    }
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s", argv[optind]);
+    unlink(un.sun_path);
+    if (bind(lsock, (struct sockaddr *)&un, sizeof(un)) < 0 ||
+        listen(lsock, 1) < 0) {
+        perror(un.sun_path);
+        return 1;
+    }
+    for (i = 0; i <= MAX_NS; i++) {
+        ns[i].fd = ns[i].mfd = -1;
+    }
+
+    /* QEMU reconnects after a restart of either side */
+    for (;;) {
+        sock = accept(lsock, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            return 1;
+        }
+        if (verbose) {
+            fprintf(stderr, "connected\n");
+        }
+        serve();
+        close(sock);
+        sock = -1;
+        /* Losing the connection drops every queue */
+        reset();
+        mem_drop();
+        for (i = 0; i <= MAX_NS; i++) {
+            ns_drop(&ns[i]);
+        }
+        if (verbose) {
+            fprintf(stderr, "disconnected\n");
+        }
+    }
+    return 0;
+}
@@ -120,7 +120,11 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off]\n"
+    "       [,readonly=on|off][,l2-cache-size=bytes]\n"
+    "       [,refcount-cache-size=bytes][,merge-max-size=bytes]\n"
+    "       [,copy-on-read=on|off]\n"
+    "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][,bps_max=bm]\n"
+    "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]][,iops_max=im]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -160,6 +164,29 @@ an untrusted format header.
 This option specifies the serial number to assign to the device.
 @item addr=@var{addr}
 Specify the controller's PCI address (if=virtio only).
+@item l2-cache-size=@var{bytes},refcount-cache-size=@var{bytes}
+Size of the qcow2 L2 table and refcount block caches. By default the L2 cache
+maps the whole image, up to 32 MB, and the refcount cache is a quarter of it.
+Hits and misses are shown by @code{info blockstats}.
+@item merge-max-size=@var{bytes}
+Requests that a device model submits as one batch are sorted and adjacent
+reads or writes are merged into requests of up to @var{bytes}. The default
+is 1 MB, 0 disables merging.
+@item copy-on-read=@var{copy-on-read}
+@var{copy-on-read} is "on" or "off" and enables whether to copy data read from
+the backing file into the image, so that it is read from the image next time.
+See also the @code{block_stream} monitor command.
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the throughput of the drive to @var{b} bytes per second in total, or
+to @var{r} and @var{w} bytes per second for reads and writes.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the drive to @var{i} requests per second in total, or to @var{r} and
+@var{w} requests per second for reads and writes.
+@item bps_max=@var{bm},iops_max=@var{im}
+Bytes and requests that may be submitted at once before the limits apply.
+By default a tenth of a second of each limit. Requests over a limit are
+delayed; the limits can be changed with the @code{block_set_io_throttle}
+monitor command.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -317,6 +344,16 @@ the raw disk image you use is not written back. You can however force
 the write back by pressing @key{C-a s} (@pxref{disk_images}).
 ETEXI
 
+DEF("aio-threads", HAS_ARG, QEMU_OPTION_aio_threads,
+    "-aio-threads n  use up to n threads for aio=threads I/O [default=64]\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -aio-threads @var{n}
+@findex -aio-threads
+Use up to @var{n} worker threads for the I/O of drives with @option{aio=threads},
+between 1 and 1024. All such drives share the threads.
+ETEXI
+
 DEF("m", HAS_ARG, QEMU_OPTION_m,
     "-m megs         set virtual RAM size to megs MB [default="
     stringify(DEFAULT_RAM_SIZE) "]\n", QEMU_ARCH_ALL)
@@ -691,6 +691,191 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "nvme_ns_create",
+        .args_type  = "id:s,size:o,lbaf:i?,backing:F?,attach:b?",
+        .params     = "id size [lbaf] [backing] [attach]",
+        .help       = "create a namespace on a nvme device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_create,
+    },
+
+SQMP
+nvme_ns_create
+--------------
+
+Create a namespace on a running nvme device. The namespace is detached
+unless "attach" is true.
+
+Arguments:
+
+- "id": the nvme device's ID, must be unique (json-string)
+- "size": namespace size in bytes, a multiple of the LBA data size (json-int)
+- "lbaf": LBA format index, defaults to the lba_format property of the
+          device (json-int, optional)
+- "backing": backing file, a new image is created if omitted (json-string, optional)
+- "attach": attach the namespace to the controller (json-bool, optional)
+
+Returns the namespace id.
+
+Example:
+
+-> { "execute": "nvme_ns_create", "arguments": { "id": "nvme0", "size": 1073741824, "attach": true } }
+<- { "return": { "nsid": 2 } }
+
+EQMP
+
+    {
+        .name       = "nvme_ns_delete",
+        .args_type  = "id:s,nsid:i",
+        .params     = "id nsid",
+        .help       = "delete a namespace of a nvme device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_delete,
+    },
+
+SQMP
+nvme_ns_delete
+--------------
+
+Delete a namespace, detaching it first if necessary.
+
+Arguments:
+
+- "id": the nvme device's ID, must be unique (json-string)
+- "nsid": namespace id, 0xffffffff deletes all namespaces (json-int)
+
+Example:
+
+-> { "execute": "nvme_ns_delete", "arguments": { "id": "nvme0", "nsid": 2 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "nvme_ns_resize",
+        .args_type  = "id:s,nsid:i,size:o",
+        .params     = "id nsid size",
+        .help       = "resize a namespace of a nvme device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_resize,
+    },
+
+SQMP
+nvme_ns_resize
+--------------
+
+Resize a namespace while the guest is running.
+
+Arguments:
+
+- "id": the nvme device's ID, must be unique (json-string)
+- "nsid": namespace id (json-int)
+- "size": new size in bytes, a multiple of the LBA data size (json-int)
+
+Example:
+
+-> { "execute": "nvme_ns_resize", "arguments": { "id": "nvme0", "nsid": 2, "size": 2147483648 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "nvme_ns_attach",
+        .args_type  = "id:s,nsid:i",
+        .params     = "id nsid",
+        .help       = "attach a namespace to a nvme controller",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_attach,
+    },
+
+SQMP
+nvme_ns_attach
+--------------
+
+Attach a namespace to the controller and notify the guest.
+
+Arguments:
+
+- "id": the nvme device's ID, must be unique (json-string)
+- "nsid": namespace id (json-int)
+
+Example:
+
+-> { "execute": "nvme_ns_attach", "arguments": { "id": "nvme0", "nsid": 2 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "nvme_ns_detach",
+        .args_type  = "id:s,nsid:i",
+        .params     = "id nsid",
+        .help       = "detach a namespace from a nvme controller",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_detach,
+    },
+
+SQMP
+nvme_ns_detach
+--------------
+
+Detach a namespace from the controller and notify the guest.
+
+Arguments:
+
+- "id": the nvme device's ID, must be unique (json-string)
+- "nsid": namespace id (json-int)
+
+Example:
+
+-> { "execute": "nvme_ns_detach", "arguments": { "id": "nvme0", "nsid": 2 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "nvme_set_qos",
+        .args_type  = "id:s,nsid:i?,sqid:i?,rd_iops:l?,wr_iops:l?,rd_bps:l?,"
+                      "wr_bps:l?,iops_burst:l?,bps_burst:l?",
+        .params     = "id [nsid] [sqid] [rd_iops] [wr_iops] [rd_bps] [wr_bps] "
+                      "[iops_burst] [bps_burst]",
+        .help       = "change the QoS limits of a nvme namespace or queue",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_set_qos,
+    },
+
+SQMP
+nvme_set_qos
+------------
+
+Change the token bucket limits of a namespace or of an I/O submission queue.
+Limits that are not given keep their current value, 0 removes a limit.
+Devices whose I/O queues are served by a dataplane can't be throttled.
+
+Arguments:
+
+- "id": the nvme device's ID, must be unique (json-string)
+- "nsid": namespace id, exclusive with "sqid" (json-int, optional)
+- "sqid": I/O submission queue id, exclusive with "nsid" (json-int, optional)
+- "rd_iops": read commands per second (json-int, optional)
+- "wr_iops": write commands per second (json-int, optional)
+- "rd_bps": bytes read per second (json-int, optional)
+- "wr_bps": bytes written per second (json-int, optional)
+- "iops_burst": commands that may be issued at once, defaults to one
+                second worth (json-int, optional)
+- "bps_burst": bytes that may be issued at once, defaults to one second
+               worth (json-int, optional)
+
+Example:
+
+-> { "execute": "nvme_set_qos", "arguments": { "id": "nvme0", "nsid": 1,
+                                                "rd_iops": 1000,
+                                                "wr_bps": 10485760 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -825,6 +1010,372 @@ Example:
                                                "password": "12345" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,iops_max:l?",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr [bps_max] [iops_max]",
+        .help       = "change the I/O throttling limits of a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+SQMP
+block_set_io_throttle
+---------------------
+
+Change the I/O throttling limits of a block device. All limits are per second
+and 0 means unlimited. Requests that exceed a limit are delayed, not failed.
+
+Arguments:
+
+- "device": device name (json-string)
+- "bps": total throughput limit in bytes (json-int)
+- "bps_rd": read throughput limit in bytes (json-int)
+- "bps_wr": write throughput limit in bytes (json-int)
+- "iops": total requests limit (json-int)
+- "iops_rd": read requests limit (json-int)
+- "iops_wr": write requests limit (json-int)
+- "bps_max": burst in bytes, a tenth of a second of the limit by default
+             (json-int, optional)
+- "iops_max": burst in requests, a tenth of a second of the limit by default
+              (json-int, optional)
+
+"bps" and "iops" can't be combined with their read or write counterparts.
+
+Example:
+
+-> { "execute": "block_set_io_throttle", "arguments": { "device": "virtio0",
+                                                        "bps": 1000000,
+                                                        "bps_rd": 0,
+                                                        "bps_wr": 0,
+                                                        "iops": 0,
+                                                        "iops_rd": 0,
+                                                        "iops_wr": 0 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?,base:s?",
+        .params     = "device [speed [base]]",
+        .help       = "copy data from a backing file into a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+SQMP
+block_stream
+------------
+
+Copy data from the backing file chain into a block device in the background,
+while the guest keeps running. Guest reads of the device populate it as well
+while the job runs. When done, the device uses "base" as its backing file, or
+no backing file at all if "base" is not given.
+
+The job's progress is shown by query-block-jobs. Its end is reported by a
+BLOCK_JOB_COMPLETED or BLOCK_JOB_CANCELLED event.
+
+Arguments:
+
+- "device": device name (json-string)
+- "speed": maximum speed in bytes per second, 0 for unlimited
+           (json-int, optional)
+- "base": file name of the backing file to stop at, it stays the backing file
+          of the device (json-string, optional)
+
+Errors:
+
+- DeviceInUse: the device already has a job or is being migrated
+- BaseNotFound: "base" is not in the backing file chain of the device
+- Unsupported: the image format can't change its backing file
+
+Example:
+
+-> { "execute": "block_stream", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .help       = "set maximum speed for a background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+SQMP
+block_job_set_speed
+-------------------
+
+Set the maximum speed of a background block operation.
+
+Arguments:
+
+- "device": device name (json-string)
+- "value": maximum speed in bytes per second, 0 for unlimited (json-int)
+
+Errors:
+
+- DeviceNotActive: the device has no active job
+
+Example:
+
+-> { "execute": "block_job_set_speed",
+     "arguments": { "device": "virtio0", "value": 1048576 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "drive-mirror",
+        .args_type  = "device:B,target:s,format:s?,sync:s?,mode:s?,speed:o?",
+        .params     = "device target [format [sync [mode [speed]]]]",
+        .help       = "start mirroring a block device to a new image",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_drive_mirror,
+    },
+
+SQMP
+drive-mirror
+------------
+
+Start copying a block device to a target image in the background, while the
+guest keeps running. Writes of the guest are tracked and copied again until
+the target is in sync, which is reported by a BLOCK_JOB_READY event. From
+then on the target is kept in sync until block_job_complete switches the
+device over to it, or block_job_cancel stops mirroring.
+
+Arguments:
+
+- "device": device name (json-string)
+- "target": file name of the target image (json-string)
+- "format": format of the target image, by default the format of the device
+            for new images, probed for existing ones (json-string, optional)
+- "sync": "full" to copy the whole backing chain, "top" to copy only the
+          topmost image; new targets then get the same backing file
+          (json-string, optional, default "full")
+- "mode": "absolute-paths" to create a new target image, "existing" to use
+          an existing one (json-string, optional, default "absolute-paths")
+- "speed": maximum speed in bytes per second, 0 for unlimited
+           (json-int, optional)
+
+Errors:
+
+- DeviceInUse: the device already has a job or is being migrated
+- OpenFileFailed: the target image can't be created or opened
+
+Example:
+
+-> { "execute": "drive-mirror", "arguments": { "device": "virtio0",
+                                               "target": "/mnt/new.qcow2" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "drive-backup",
+        .args_type  = "device:B,target:s,format:s?,sync:s?,bitmap:s?,mode:s?,speed:o?",
+        .params     = "device target [format [sync [bitmap [mode [speed]]]]]",
+        .help       = "start backing a block device up to an image",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_drive_backup,
+    },
+
+SQMP
+drive-backup
+------------
+
+Start copying a block device to a target image in the background, while the
+guest keeps running. Writes of the guest are copied again until the target
+has caught up. The job then ends by itself, which is reported by a
+BLOCK_JOB_COMPLETED event, and the target holds the contents of the device at
+that point. The device keeps using its own image.
+
+An incremental backup copies only the chunks that are dirty in a dirty bitmap
+(see block_dirty_bitmap_add) onto an earlier backup. The bitmap is cleared
+when the backup completes, so that the next incremental backup copies what
+was written since. It is left alone if the job is cancelled or fails.
+
+Arguments:
+
+- "device": device name (json-string)
+- "target": file name of the target image (json-string)
+- "format": format of the target image, by default the format of the device
+            for new images, probed for existing ones (json-string, optional)
+- "sync": "full" to copy everything, "incremental" to copy only what is dirty
+          in "bitmap" (json-string, optional, default "full")
+- "bitmap": name of a dirty bitmap of the device, which is cleared when the
+            backup completes (json-string, optional)
+- "mode": "absolute-paths" to create a new target image, "existing" to use
+          an existing one (json-string, optional, default "absolute-paths")
+- "speed": maximum speed in bytes per second, 0 for unlimited
+           (json-int, optional)
+
+Errors:
+
+- DeviceInUse: the device already has a job or is being migrated
+- DirtyBitmapNotFound: the device has no such dirty bitmap
+- MissingParameter: an incremental backup needs a bitmap
+- OpenFileFailed: the target image can't be created or opened
+
+Example:
+
+-> { "execute": "drive-backup", "arguments": { "device": "virtio0",
+                                               "target": "/mnt/backup.qcow2",
+                                               "sync": "incremental",
+                                               "bitmap": "backup0",
+                                               "mode": "existing" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_dirty_bitmap_add",
+        .args_type  = "device:B,name:s,granularity:i?,persistent:b?",
+        .params     = "device name [granularity [persistent]]",
+        .help       = "start tracking writes to a block device in a dirty bitmap",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_dirty_bitmap_add,
+    },
+
+SQMP
+block_dirty_bitmap_add
+----------------------
+
+Create a named dirty bitmap on a block device, which tracks which chunks of
+the device were written. A persistent bitmap is stored in the image when it
+is closed and comes back when it is opened again; writes to the image that
+happen meanwhile without QEMU are not tracked. A bitmap starts out clean.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the bitmap, unique per device (json-string)
+- "granularity": size of a chunk in bytes, a power of two
+                 (json-int, optional, default 65536)
+- "persistent": whether to store the bitmap in the image
+                (json-bool, optional, default false)
+
+Errors:
+
+- DuplicateId: the device already has a bitmap of that name
+- BlockFormatFeatureNotSupported: the image can't store bitmaps, e.g. a qcow2
+  image that wasn't created with compat=1.1
+- DeviceIsReadOnly: a persistent bitmap can't be stored in the image
+
+Example:
+
+-> { "execute": "block_dirty_bitmap_add",
+     "arguments": { "device": "virtio0", "name": "backup0",
+                    "persistent": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_dirty_bitmap_remove",
+        .args_type  = "device:B,name:s",
+        .params     = "device name",
+        .help       = "remove a dirty bitmap from a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block_dirty_bitmap_remove
+-------------------------
+
+Remove a named dirty bitmap from a block device, and from its image if the
+bitmap is persistent.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the bitmap (json-string)
+
+Errors:
+
+- DirtyBitmapNotFound: the device has no such dirty bitmap
+- DeviceInUse: the device has a job that may use the bitmap
+
+Example:
+
+-> { "execute": "block_dirty_bitmap_remove",
+     "arguments": { "device": "virtio0", "name": "backup0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_complete",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "complete an active background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_complete,
+    },
+
+SQMP
+block_job_complete
+------------------
+
+Complete a background block operation that runs until told so, once it has
+sent its BLOCK_JOB_READY event. A mirror copies what is left with the
+guest's I/O stopped and then switches the device over to the target image.
+The end of the job is reported by a BLOCK_JOB_COMPLETED event.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Errors:
+
+- DeviceNotActive: the device has no active job
+- BlockJobNotReady: the job can't be completed yet
+- Unsupported: the job ends by itself
+
+Example:
+
+-> { "execute": "block_job_complete", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop an active background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+SQMP
+block_job_cancel
+----------------
+
+Stop an active background block operation. The job ends once its current I/O
+has completed, which is reported by a BLOCK_JOB_CANCELLED event. Data that was
+copied so far stays in the image.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Errors:
+
+- DeviceNotActive: the device has no active job
+
+Example:
+
+-> { "execute": "block_job_cancel", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1082,6 +1633,12 @@ Each json-object contain the following:
                                 "tftp", "vdi", "vmdk", "vpc", "vvfat"
          - "backing_file": backing file name (json-string, optional)
          - "encrypted": true if encrypted, false otherwise (json-bool)
+         - "dirty-bitmaps": named dirty bitmaps, only present if there are
+           any (json-array of json-object)
+             - "name": bitmap name (json-string)
+             - "granularity": chunk size in bytes (json-int)
+             - "count": dirty bytes, in whole chunks (json-int)
+             - "persistent": true if stored in the image (json-bool)
 
 Example:
 
@@ -1142,6 +1699,22 @@ Each json-object contain the following:
     - "wr_operations": write operations (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "l2_cache_hits": qcow2 L2 table lookups served from the cache
+                       (json-int, qcow2 only)
+    - "l2_cache_misses": qcow2 L2 tables read from the image
+                         (json-int, qcow2 only)
+    - "refcount_cache_hits": qcow2 refcount block lookups served from the
+                             cache (json-int, qcow2 only)
+    - "refcount_cache_misses": qcow2 refcount blocks read from the image
+                               (json-int, qcow2 only)
+      The qcow2 cache counters start with the first query, which returns
+      zeroes.
+    - "throttled_rd_operations": read operations delayed by I/O throttling
+                                 (json-int, only with I/O limits)
+    - "throttled_wr_operations": write operations delayed by I/O throttling
+                                 (json-int, only with I/O limits)
+    - "throttled_total_time_ns": total time requests were delayed by I/O
+                                 throttling (json-int, only with I/O limits)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1206,6 +1779,35 @@ Example:
 
 EQMP
 
+SQMP
+query-block-jobs
+----------------
+
+Show the progress of ongoing background block operations.
+
+Return a json-array of all jobs. Each job is represented by a json-object,
+which contains:
+
+- "type": job type, "stream" or "mirror" (json-string)
+- "device": device name (json-string)
+- "len": amount of work to do in total, in bytes (json-int)
+- "offset": amount of work done so far, in bytes (json-int)
+- "speed": maximum speed in bytes per second, 0 for unlimited (json-int)
+- "ready": whether the job can be completed with block_job_complete
+           (json-bool)
+
+Example:
+
+-> { "execute": "query-block-jobs" }
+<- { "return":[
+        { "type": "stream", "device": "virtio0",
+          "len": 10737418240, "offset": 709632,
+          "speed": 0, "ready": false }
+     ]
+   }
+
+EQMP
+
 SQMP
 query-cpus
 ----------
@@ -152,6 +152,14 @@ void pcie_aer_inject_error_print(Monitor *mon, const QObject *data);
 int do_pcie_aer_inejct_error(Monitor *mon,
                              const QDict *qdict, QObject **ret_data);
 
+/* nvme namespace management */
+int do_nvme_ns_create(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_nvme_ns_delete(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_nvme_ns_resize(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_nvme_ns_attach(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_nvme_ns_detach(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_nvme_set_qos(Monitor *mon, const QDict *qdict, QObject **ret_data);
+
 /* serial ports */
 
 #define MAX_SERIAL_PORTS 4
@@ -135,6 +135,9 @@ int main(int argc, char **argv)
 #include "qemu-char.h"
 #include "cache-utils.h"
 #include "block.h"
+#ifndef _WIN32
+#include "block/raw-posix-aio.h"
+#endif
 #include "blockdev.h"
 #include "block-migration.h"
 #include "dma.h"
@@ -170,6 +173,8 @@ int main(int argc, char **argv)
 
 #define MAX_VIRTIO_CONSOLES 1
 
+#define MAX_AIO_THREADS 1024
+
 static const char *data_dir;
 const char *bios_name = NULL;
 enum vga_retrace_method vga_retrace_method = VGA_RETRACE_DUMB;
@@ -2229,6 +2234,22 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_snapshot:
                 snapshot = 1;
                 break;
+            case QEMU_OPTION_aio_threads:
+                {
+                    char *end;
+                    long aio_threads = strtol(optarg, &end, 0);
+
+                    if (end == optarg || *end != '\0' || aio_threads < 1 ||
+                        aio_threads > MAX_AIO_THREADS) {
+                        fprintf(stderr, "qemu: invalid number of aio threads:"
+                                " %s\n", optarg);
+                        exit(1);
+                    }
+#ifndef _WIN32
+                    paio_set_max_threads(aio_threads);
+#endif
+                }
+                break;
             case QEMU_OPTION_hdachs:
                 {
                     const char *p;